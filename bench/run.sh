@@ -0,0 +1,212 @@
+#!/bin/sh
+#
+# Benchmark tfs on a loop device. Every workload gets a freshly made
+# image and mount. Results are written one JSON object per line.
+#
+#   run.sh [options] [workload...]            run with the loaded (or -m) module
+#   run.sh [options] -c old.ko new.ko         run both builds and compare them
+#   run.sh [-T pct] -C old.json new.json      compare two result files
+#
+# Options:
+#   -m tfs.ko    insmod this module first (rmmod-ing any loaded tfs)
+#   -O opts      mount options, e.g. 'nobh'
+#   -b bytes     block size of the image (default 1024)
+#   -B blocks    image size in blocks (default 262144)
+#   -s size      file size for the data workloads (default 32M)
+#   -n ops       operations for the random, metadata and fsync workloads (default 10000)
+#   -t threads   writers for 'parallel' and 'pwrite' (default 4)
+#   -r runs      repeat every workload (default 3)
+#   -o file      results file (default results.json)
+#   -T pct       regression threshold in percent (default 5)
+#
+# Needs root for losetup, insmod and mount.
+
+set -e
+
+BENCH_DIR=$(cd "$(dirname "$0")" && pwd)
+MKFS=$BENCH_DIR/../mkfs/mkfs.tfs
+BENCH=$BENCH_DIR/tfs-bench
+
+WORKLOADS="seqwrite seqread randwrite randread create stat unlink readdir dirpages fsync parallel pwrite"
+
+module=
+mount_opts=
+block_size=1024
+blocks=262144
+file_size=32M
+ops=10000
+threads=4
+runs=3
+out=results.json
+threshold=5
+compare_modules=
+compare_files=
+module_sum=loaded
+
+usage()
+{
+    sed -n '3,22s/^# \{0,1\}//p' "$0" >&2
+    exit 1
+}
+
+while getopts "m:O:b:B:s:n:t:r:o:T:cC" opt; do
+    case $opt in
+	m) module=$OPTARG ;;
+	O) mount_opts=$OPTARG ;;
+	b) block_size=$OPTARG ;;
+	B) blocks=$OPTARG ;;
+	s) file_size=$OPTARG ;;
+	n) ops=$OPTARG ;;
+	t) threads=$OPTARG ;;
+	r) runs=$OPTARG ;;
+	o) out=$OPTARG ;;
+	T) threshold=$OPTARG ;;
+	c) compare_modules=1 ;;
+	C) compare_files=1 ;;
+	*) usage ;;
+    esac
+done
+shift $((OPTIND - 1))
+
+# compare OLD NEW: print the change per workload, fail on regressions.
+# Throughput is MB/s, or ops/s for workloads that move no data; latency
+# is p99. Both are averaged over the runs.
+compare()
+{
+    awk -v threshold="$threshold" '
+	function field(line, key,    v) {
+	    if (!match(line, "\"" key "\":[^,}]*"))
+		return ""
+	    v = substr(line, RSTART + length(key) + 3, RLENGTH - length(key) - 3)
+	    gsub(/"/, "", v)
+	    return v
+	}
+	function throughput(line) {
+	    return field(line, "bytes") > 0 ? field(line, "mb_per_s") : field(line, "ops_per_s")
+	}
+	/"workload"/ {
+	    w = field($0, "workload")
+	    if (field($0, "error") != "")
+		next
+	    if (FNR == NR) {
+		old_n[w]++; old_thr[w] += throughput($0); old_p99[w] += field($0, "p99_us")
+		if (!(w in order)) { order[w] = ++nw; names[nw] = w }
+	    } else {
+		new_n[w]++; new_thr[w] += throughput($0); new_p99[w] += field($0, "p99_us")
+	    }
+	}
+	END {
+	    printf "%-10s %12s %12s %8s %10s %10s %8s\n", "workload", "old", "new", "thr", "old p99", "new p99", "p99"
+	    for (i = 1; i <= nw; i++) {
+		w = names[i]
+		if (!(w in new_n))
+		    continue
+		ot = old_thr[w] / old_n[w]; nt = new_thr[w] / new_n[w]
+		op = old_p99[w] / old_n[w]; np = new_p99[w] / new_n[w]
+		dt = ot > 0 ? (nt - ot) * 100 / ot : 0
+		dp = op > 0 ? (np - op) * 100 / op : 0
+		flag = ""
+		if (dt < -threshold || dp > threshold) {
+		    flag = "  REGRESSION"
+		    bad = 1
+		}
+		printf "%-10s %12.1f %12.1f %+7.1f%% %10.1f %10.1f %+7.1f%%%s\n", w, ot, nt, dt, op, np, dp, flag
+	    }
+	    exit bad
+	}' "$1" "$2"
+}
+
+if [ -n "$compare_files" ]; then
+    [ $# -eq 2 ] || usage
+    compare "$1" "$2"
+    exit $?
+fi
+
+[ -x "$MKFS" ] || { echo "run.sh: build $MKFS first" >&2; exit 1; }
+[ -x "$BENCH" ] || { echo "run.sh: build $BENCH first ('make' in bench)" >&2; exit 1; }
+
+work=$(mktemp -d /tmp/tfs-bench.XXXXXX)
+mnt=$work/mnt
+mkdir "$mnt"
+loop=
+
+cleanup()
+{
+    mountpoint -q "$mnt" && umount "$mnt"
+    [ -n "$loop" ] && losetup -d "$loop"
+    rm -rf "$work"
+}
+trap cleanup EXIT
+
+load_module()
+{
+    module_sum=$(md5sum "$1" | cut -c1-12)
+    if lsmod | grep -q '^tfs '; then
+	rmmod tfs
+    fi
+    insmod "$1"
+}
+
+# reads, sectors read, writes, sectors written of the loop device
+diskstats()
+{
+    awk -v dev="${loop#/dev/}" '$3 == dev { print $4, $6, $8, $10 }' /proc/diskstats
+}
+
+# run_suite RESULTS [workload...]
+run_suite()
+{
+    results=$1
+    shift
+    [ $# -gt 0 ] || set -- $WORKLOADS
+
+    kernel=$(uname -r)
+    : > "$results"
+
+    for w in "$@"; do
+	run=1
+	while [ $run -le "$runs" ]; do
+	    rm -f "$work/tfs.img"
+	    truncate -s $((blocks * block_size)) "$work/tfs.img"
+	    "$MKFS" -q -b "$block_size" "$work/tfs.img" "$blocks"
+	    loop=$(losetup -f --show "$work/tfs.img")
+	    mount -t tfs ${mount_opts:+-o "$mount_opts"} "$loop" "$mnt"
+	    sync
+	    echo 3 > /proc/sys/vm/drop_caches
+
+	    set -- $(diskstats)
+	    r0=$1 rs0=$2 w0=$3 ws0=$4
+
+	    status=0
+	    line=$("$BENCH" -w "$w" -s "$file_size" -n "$ops" -t "$threads" "$mnt") || status=$?
+
+	    # unmounting writes back what the workload left dirty
+	    umount "$mnt"
+	    set -- $(diskstats)
+	    losetup -d "$loop"
+	    loop=
+
+	    if [ -z "$line" ]; then
+		line="{\"workload\":\"$w\",\"error\":\"tfs-bench exited with $status\"}"
+	    fi
+
+	    echo "${line%\}},\"run\":$run,\"block_size\":$block_size,\"kernel\":\"$kernel\",\"module\":\"$module_sum\",\"mount_opts\":\"$mount_opts\",\"disk_reads\":$(($1 - r0)),\"disk_read_kb\":$((($2 - rs0) / 2)),\"disk_writes\":$(($3 - w0)),\"disk_write_kb\":$((($4 - ws0) / 2))}" | tee -a "$results"
+	    run=$((run + 1))
+	done
+    done
+}
+
+if [ -n "$compare_modules" ]; then
+    [ $# -eq 2 ] || usage
+    old=$1 new=$2
+    load_module "$old"
+    run_suite "${out%.json}.old.json"
+    load_module "$new"
+    run_suite "${out%.json}.new.json"
+    rmmod tfs
+    compare "${out%.json}.old.json" "${out%.json}.new.json"
+    exit $?
+fi
+
+[ -z "$module" ] || load_module "$module"
+run_suite "$out" "$@"
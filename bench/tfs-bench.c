@@ -0,0 +1,634 @@
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+/* the size of struct tfs_dentry in driver/tfs.h */
+#define TFS_DENTRY_SIZE 32
+
+/*
+ * One benchmark workload against a mounted file system. Setup (creating
+ * the files a read workload needs) is not timed. The result is printed
+ * as a single line of JSON on stdout.
+ */
+
+struct bench_options
+{
+  const char *workload;
+  const char *dir;
+  unsigned long long file_size;
+  unsigned int io_size;
+  unsigned long ops;
+  unsigned int threads;
+  unsigned int seed;
+};
+
+struct bench_result
+{
+  unsigned long long ops;
+  unsigned long long bytes;
+  unsigned long long errors;
+  unsigned long long *lat_ns;
+  unsigned long long nr_lat;
+  unsigned long long start_ns, end_ns;	/* timed part, setup excluded */
+};
+
+struct bench_thread
+{
+  struct bench_options *opt;
+  unsigned int id;
+  struct bench_result res;
+  pthread_t tid;
+};
+
+static void usage(const char *prog)
+{
+  fprintf(stderr,
+	  "usage: %s -w workload [-s file-size] [-b io-size] [-n ops] [-t threads] [-S seed] dir\n"
+	  "  workloads: seqwrite seqread randwrite randread create stat unlink readdir dirpages fsync parallel pwrite\n"
+	  "  -s  file size for the data workloads (default 32M)\n"
+	  "  -b  size of each read or write (default 4096)\n"
+	  "  -n  operations for the random, metadata and fsync workloads (default 10000)\n"
+	  "  -t  writer threads for 'parallel' and 'pwrite' (default 4)\n"
+	  "  -S  random seed (default 1)\n",
+	  prog);
+  exit(1);
+}
+
+static unsigned long long parse_size(const char *s)
+{
+  char *end;
+  unsigned long long n = strtoull(s, &end, 0);
+
+  switch (*end)
+    {
+    case 'k': case 'K': return n << 10;
+    case 'm': case 'M': return n << 20;
+    case 'g': case 'G': return n << 30;
+    }
+  return n;
+}
+
+static unsigned long long now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void die(const char *what, const char *path)
+{
+  fprintf(stderr, "tfs-bench: %s %s: %s\n", what, path, strerror(errno));
+  exit(2);
+}
+
+static void record(struct bench_result *res, unsigned long long start, size_t bytes)
+{
+  res->lat_ns[res->nr_lat++] = now_ns() - start;
+  res->bytes += bytes;
+  ++res->ops;
+}
+
+static int cmp_ull(const void *a, const void *b)
+{
+  unsigned long long x = *(const unsigned long long *) a, y = *(const unsigned long long *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+static double percentile(struct bench_result *res, double p)
+{
+  unsigned long long i;
+
+  if (!res->nr_lat)
+    return 0;
+  i = (unsigned long long) (p / 100.0 * (res->nr_lat - 1) + 0.5);
+  return res->lat_ns[i] / 1000.0;
+}
+
+static void alloc_lat(struct bench_result *res, unsigned long long n)
+{
+  res->lat_ns = malloc((n ? n : 1) * sizeof(*res->lat_ns));
+  if (!res->lat_ns)
+    {
+      fprintf(stderr, "tfs-bench: out of memory\n");
+      exit(2);
+    }
+}
+
+/* drop this file's pages so reads go to the device */
+static void drop_cache(int fd)
+{
+  int dc;
+
+  fsync(fd);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+
+  dc = open("/proc/sys/vm/drop_caches", O_WRONLY);
+  if (dc >= 0)
+    {
+      sync();
+      if (write(dc, "3\n", 2) < 0)
+	{
+	  /* without root only the fadvise above applies */
+	}
+      close(dc);
+    }
+}
+
+static char *data_buf(unsigned int size, unsigned int seed)
+{
+  char *buf;
+  unsigned int i;
+
+  if (posix_memalign((void **) &buf, 4096, size))
+    {
+      fprintf(stderr, "tfs-bench: out of memory\n");
+      exit(2);
+    }
+  for (i = 0; i < size; ++i)
+    buf[i] = rand_r(&seed);
+  return buf;
+}
+
+static void fill_file(const char *path, struct bench_options *opt, char *buf)
+{
+  unsigned long long off;
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+  if (fd < 0)
+    die("open", path);
+
+  for (off = 0; off < opt->file_size; off += opt->io_size)
+    if (write(fd, buf, opt->io_size) != (ssize_t) opt->io_size)
+      die("write", path);
+
+  drop_cache(fd);
+  close(fd);
+}
+
+static void seq_io(struct bench_options *opt, struct bench_result *res, const char *path, int write_mode)
+{
+  char *buf = data_buf(opt->io_size, opt->seed);
+  unsigned long long off, t;
+  int fd;
+
+  if (!write_mode)
+    fill_file(path, opt, buf);
+
+  fd = write_mode ? open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644) : open(path, O_RDONLY);
+  if (fd < 0)
+    die("open", path);
+
+  alloc_lat(res, opt->file_size / opt->io_size + 1);
+  res->start_ns = now_ns();
+  for (off = 0; off < opt->file_size; off += opt->io_size)
+    {
+      ssize_t n;
+
+      t = now_ns();
+      n = write_mode ? write(fd, buf, opt->io_size) : read(fd, buf, opt->io_size);
+      if (n != (ssize_t) opt->io_size)
+	{
+	  ++res->errors;
+	  break;
+	}
+      record(res, t, n);
+    }
+
+  if (write_mode)
+    fsync(fd);
+  res->end_ns = now_ns();
+  close(fd);
+  free(buf);
+}
+
+static void rand_io(struct bench_options *opt, struct bench_result *res, const char *path, int write_mode)
+{
+  char *buf = data_buf(opt->io_size, opt->seed);
+  unsigned long long slots = opt->file_size / opt->io_size, t;
+  unsigned int seed = opt->seed;
+  unsigned long i;
+  int fd;
+
+  fill_file(path, opt, buf);
+  fd = open(path, write_mode ? O_WRONLY : O_RDONLY);
+  if (fd < 0)
+    die("open", path);
+
+  alloc_lat(res, opt->ops);
+  res->start_ns = now_ns();
+  for (i = 0; i < opt->ops; ++i)
+    {
+      off_t off = (off_t) (((unsigned long long) rand_r(&seed) * RAND_MAX + rand_r(&seed)) % slots) * opt->io_size;
+      ssize_t n;
+
+      t = now_ns();
+      n = write_mode ? pwrite(fd, buf, opt->io_size, off) : pread(fd, buf, opt->io_size, off);
+      if (n != (ssize_t) opt->io_size)
+	{
+	  ++res->errors;
+	  continue;
+	}
+      record(res, t, n);
+    }
+
+  if (write_mode)
+    fsync(fd);
+  res->end_ns = now_ns();
+  close(fd);
+  free(buf);
+}
+
+/* names stay within the 20 byte dentry name */
+static void file_name(char *name, size_t size, const char *dir, unsigned long i)
+{
+  snprintf(name, size, "%.4000s/f%lu", dir, i);
+}
+
+static void create_files(struct bench_options *opt, const char *dir, struct bench_result *res)
+{
+  char name[4096];
+  unsigned long long t = 0;
+  unsigned long i;
+  int fd;
+
+  for (i = 0; i < opt->ops; ++i)
+    {
+      file_name(name, sizeof(name), dir, i);
+      if (res)
+	t = now_ns();
+      fd = open(name, O_WRONLY | O_CREAT | O_EXCL, 0644);
+      if (fd < 0)
+	{
+	  if (!res)
+	    die("create", name);
+	  ++res->errors;
+	  continue;
+	}
+      close(fd);
+      if (res)
+	record(res, t, 0);
+    }
+}
+
+static void make_dir(char *path, size_t size, struct bench_options *opt, const char *name)
+{
+  snprintf(path, size, "%s/%s", opt->dir, name);
+  if (mkdir(path, 0755) < 0 && errno != EEXIST)
+    die("mkdir", path);
+}
+
+static void meta(struct bench_options *opt, struct bench_result *res)
+{
+  char dir[4096], name[4096];
+  struct stat st;
+  unsigned long long t;
+  unsigned long i;
+
+  make_dir(dir, sizeof(dir), opt, opt->workload);
+  alloc_lat(res, opt->ops);
+
+  if (!strcmp(opt->workload, "create"))
+    {
+      res->start_ns = now_ns();
+      create_files(opt, dir, res);
+      res->end_ns = now_ns();
+      return;
+    }
+
+  create_files(opt, dir, NULL);
+  sync();
+
+  res->start_ns = now_ns();
+  for (i = 0; i < opt->ops; ++i)
+    {
+      int ret;
+
+      file_name(name, sizeof(name), dir, i);
+      t = now_ns();
+      ret = !strcmp(opt->workload, "stat") ? stat(name, &st) : unlink(name);
+      if (ret < 0)
+	{
+	  ++res->errors;
+	  continue;
+	}
+      record(res, t, 0);
+    }
+  res->end_ns = now_ns();
+}
+
+/* each op lists the whole directory of 'ops' entries; 10 passes */
+static void list_dir(struct bench_options *opt, struct bench_result *res)
+{
+  char dir[4096];
+  unsigned long long t;
+  unsigned long entries;
+  struct dirent *de;
+  DIR *d;
+  int pass;
+
+  make_dir(dir, sizeof(dir), opt, "readdir");
+  create_files(opt, dir, NULL);
+  sync();
+
+  alloc_lat(res, 10);
+  res->start_ns = now_ns();
+  for (pass = 0; pass < 10; ++pass)
+    {
+      t = now_ns();
+      if (!(d = opendir(dir)))
+	die("opendir", dir);
+      for (entries = 0; (de = readdir(d)); ++entries)
+	;
+      closedir(d);
+      if (entries < opt->ops)
+	++res->errors;
+      record(res, t, 0);
+    }
+  res->end_ns = now_ns();
+}
+
+/*
+ * Fill a directory to exactly two pages, then look up, unlink and
+ * re-create the entries of the last page, checking each result: lookups
+ * used to miss the last page of a directory whose size is a multiple of
+ * the page size. Every wrong answer counts as an error.
+ */
+static void dir_pages(struct bench_options *opt, struct bench_result *res)
+{
+  char dir[4096], name[4096];
+  long page = sysconf(_SC_PAGESIZE);
+  unsigned long entries = 2 * page / TFS_DENTRY_SIZE - 2;	/* "." and ".." take two slots */
+  unsigned long first = page / TFS_DENTRY_SIZE - 2, i;
+  unsigned long long t;
+  struct stat st;
+  int fd;
+
+  make_dir(dir, sizeof(dir), opt, "dirpages");
+  opt->ops = entries;
+  create_files(opt, dir, NULL);
+  sync();
+  if (stat(dir, &st) < 0)
+    die("stat", dir);
+  if (st.st_size != 2 * page)
+    ++res->errors;
+
+  alloc_lat(res, 4 * (entries - first));
+  res->start_ns = now_ns();
+  for (i = first; i < entries; ++i)
+    {
+      file_name(name, sizeof(name), dir, i);
+
+      t = now_ns();
+      if (stat(name, &st) < 0)
+	++res->errors;
+      record(res, t, 0);
+
+      t = now_ns();
+      fd = open(name, O_WRONLY | O_CREAT | O_EXCL, 0644);
+      if (fd >= 0 || errno != EEXIST)
+	++res->errors;
+      if (fd >= 0)
+	close(fd);
+      record(res, t, 0);
+
+      t = now_ns();
+      if (unlink(name) < 0 || stat(name, &st) == 0)
+	++res->errors;
+      record(res, t, 0);
+
+      t = now_ns();
+      fd = open(name, O_WRONLY | O_CREAT | O_EXCL, 0644);
+      if (fd < 0)
+	++res->errors;
+      else
+	close(fd);
+      record(res, t, 0);
+    }
+  res->end_ns = now_ns();
+
+  if (stat(dir, &st) < 0 || st.st_size != 2 * page)
+    ++res->errors;
+}
+
+/* small appends, each followed by fsync */
+static void fsync_append(struct bench_options *opt, struct bench_result *res)
+{
+  char path[4096];
+  char *buf = data_buf(opt->io_size, opt->seed);
+  unsigned long long t;
+  unsigned long i;
+  int fd;
+
+  snprintf(path, sizeof(path), "%s/fsync", opt->dir);
+  fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+  if (fd < 0)
+    die("open", path);
+
+  alloc_lat(res, opt->ops);
+  res->start_ns = now_ns();
+  for (i = 0; i < opt->ops && (i + 1) * opt->io_size <= opt->file_size; ++i)
+    {
+      t = now_ns();
+      if (write(fd, buf, opt->io_size) != (ssize_t) opt->io_size || fsync(fd) < 0)
+	{
+	  ++res->errors;
+	  break;
+	}
+      record(res, t, opt->io_size);
+    }
+  res->end_ns = now_ns();
+
+  close(fd);
+  free(buf);
+}
+
+static void *parallel_writer(void *arg)
+{
+  struct bench_thread *bt = arg;
+  char path[4096];
+
+  snprintf(path, sizeof(path), "%s/par%u", bt->opt->dir, bt->id);
+  seq_io(bt->opt, &bt->res, path, 1);
+
+  return NULL;
+}
+
+/*
+ * Each thread pwrite()s its own slice of one shared file, which is
+ * truncated up to its full size first so that no write extends it.
+ */
+static void *shared_writer(void *arg)
+{
+  struct bench_thread *bt = arg;
+  struct bench_options *opt = bt->opt;
+  unsigned long long slice = opt->file_size / opt->threads / opt->io_size * opt->io_size;
+  unsigned long long off, t;
+  char path[4096];
+  char *buf = data_buf(opt->io_size, opt->seed + bt->id);
+  int fd;
+
+  snprintf(path, sizeof(path), "%s/pwrite", opt->dir);
+  if ((fd = open(path, O_WRONLY)) < 0)
+    die("open", path);
+
+  alloc_lat(&bt->res, slice / opt->io_size + 1);
+  for (off = bt->id * slice; off < (bt->id + 1) * slice; off += opt->io_size)
+    {
+      t = now_ns();
+      if (pwrite(fd, buf, opt->io_size, off) != (ssize_t) opt->io_size)
+	{
+	  ++bt->res.errors;
+	  break;
+	}
+      record(&bt->res, t, opt->io_size);
+    }
+
+  close(fd);
+  free(buf);
+  return NULL;
+}
+
+static void parallel(struct bench_options *opt, struct bench_result *res, void *(*writer)(void *))
+{
+  struct bench_thread *bt = calloc(opt->threads, sizeof(*bt));
+  unsigned int i;
+
+  if (!bt)
+    {
+      fprintf(stderr, "tfs-bench: out of memory\n");
+      exit(2);
+    }
+
+  res->start_ns = now_ns();
+  for (i = 0; i < opt->threads; ++i)
+    {
+      bt[i].opt = opt;
+      bt[i].id = i;
+      if (pthread_create(&bt[i].tid, NULL, writer, &bt[i]))
+	die("pthread_create", "");
+    }
+
+  /* merge the per-thread latencies */
+  alloc_lat(res, opt->threads * (opt->file_size / opt->io_size + 1));
+  for (i = 0; i < opt->threads; ++i)
+    {
+      pthread_join(bt[i].tid, NULL);
+      memcpy(res->lat_ns + res->nr_lat, bt[i].res.lat_ns, bt[i].res.nr_lat * sizeof(*res->lat_ns));
+      res->nr_lat += bt[i].res.nr_lat;
+      res->ops += bt[i].res.ops;
+      res->bytes += bt[i].res.bytes;
+      res->errors += bt[i].res.errors;
+      free(bt[i].res.lat_ns);
+    }
+  res->end_ns = now_ns();
+  free(bt);
+}
+
+int main(int argc, char *argv[])
+{
+  struct bench_options opt;
+  struct bench_result res;
+  char path[4096];
+  double secs;
+  int c;
+
+  memset(&opt, 0, sizeof(opt));
+  memset(&res, 0, sizeof(res));
+  opt.file_size = 32 << 20;
+  opt.io_size = 4096;
+  opt.ops = 10000;
+  opt.threads = 4;
+  opt.seed = 1;
+
+  while ((c = getopt(argc, argv, "w:s:b:n:t:S:")) != -1)
+    {
+      switch (c)
+	{
+	case 'w':
+	  opt.workload = optarg;
+	  break;
+	case 's':
+	  opt.file_size = parse_size(optarg);
+	  break;
+	case 'b':
+	  opt.io_size = parse_size(optarg);
+	  break;
+	case 'n':
+	  opt.ops = strtoul(optarg, NULL, 0);
+	  break;
+	case 't':
+	  opt.threads = strtoul(optarg, NULL, 0);
+	  break;
+	case 'S':
+	  opt.seed = strtoul(optarg, NULL, 0);
+	  break;
+	default:
+	  usage(argv[0]);
+	}
+    }
+
+  if (!opt.workload || optind != argc - 1 || !opt.io_size || !opt.threads || opt.file_size < opt.io_size)
+    usage(argv[0]);
+  opt.dir = argv[optind];
+
+  snprintf(path, sizeof(path), "%s/%s", opt.dir, opt.workload);
+
+  if (!strcmp(opt.workload, "seqwrite"))
+    seq_io(&opt, &res, path, 1);
+  else if (!strcmp(opt.workload, "seqread"))
+    seq_io(&opt, &res, path, 0);
+  else if (!strcmp(opt.workload, "randwrite"))
+    rand_io(&opt, &res, path, 1);
+  else if (!strcmp(opt.workload, "randread"))
+    rand_io(&opt, &res, path, 0);
+  else if (!strcmp(opt.workload, "create") || !strcmp(opt.workload, "stat") || !strcmp(opt.workload, "unlink"))
+    meta(&opt, &res);
+  else if (!strcmp(opt.workload, "readdir"))
+    list_dir(&opt, &res);
+  else if (!strcmp(opt.workload, "dirpages"))
+    dir_pages(&opt, &res);
+  else if (!strcmp(opt.workload, "fsync"))
+    fsync_append(&opt, &res);
+  else if (!strcmp(opt.workload, "parallel"))
+    parallel(&opt, &res, parallel_writer);
+  else if (!strcmp(opt.workload, "pwrite"))
+    {
+      int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+      if (fd < 0 || ftruncate(fd, opt.file_size))
+	die("create", path);
+      close(fd);
+      parallel(&opt, &res, shared_writer);
+    }
+  else
+    usage(argv[0]);
+
+  secs = (res.end_ns - res.start_ns) / 1e9;
+
+  qsort(res.lat_ns, res.nr_lat, sizeof(*res.lat_ns), cmp_ull);
+
+  printf("{\"workload\":\"%s\",\"threads\":%u,\"io_size\":%u,\"ops\":%llu,\"errors\":%llu,"
+	 "\"bytes\":%llu,\"seconds\":%.6f,\"mb_per_s\":%.3f,\"ops_per_s\":%.1f,"
+	 "\"p50_us\":%.1f,\"p90_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f,\"max_us\":%.1f}\n",
+	 opt.workload, !strcmp(opt.workload, "parallel") || !strcmp(opt.workload, "pwrite") ? opt.threads : 1, opt.io_size,
+	 res.ops, res.errors, res.bytes, secs,
+	 secs > 0 ? res.bytes / secs / (1 << 20) : 0.0,
+	 secs > 0 ? res.ops / secs : 0.0,
+	 percentile(&res, 50), percentile(&res, 90), percentile(&res, 99), percentile(&res, 99.9),
+	 percentile(&res, 100));
+
+  free(res.lat_ns);
+  return res.errors ? 3 : 0;
+}
@@ -0,0 +1,190 @@
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+#include <linux/fs.h>
+
+#include "../driver/tfs.h"
+
+#define READ_BUF_SIZE (1 << 20)
+
+struct defrag_options
+{
+  int dry_run;
+  int no_timing;
+};
+
+static void usage(const char *prog)
+{
+  fprintf(stderr,
+	  "usage: %s [-n] [-T] file...\n"
+	  "  -n  only report fragmentation\n"
+	  "  -T  do not time reading the file before and after\n"
+	  "Needs root to map blocks with FIBMAP.\n",
+	  prog);
+  exit(1);
+}
+
+static double now(void)
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* number of runs of physically contiguous blocks, -1 on error */
+static long long count_extents(int fd, unsigned long long blocks)
+{
+  unsigned long long i;
+  long long extents = 0;
+  int block, prev = 0;
+
+  for (i = 0; i < blocks; ++i)
+    {
+      block = i;
+      if (ioctl(fd, FIBMAP, &block) < 0)
+	return -1;
+      if (block && (!prev || block != prev + 1))
+	++extents;
+      prev = block;
+    }
+
+  return extents;
+}
+
+/* read the whole file from disk, MB/s or -1 on error */
+static double read_throughput(int fd, unsigned long long size, char *buf)
+{
+  unsigned long long done = 0;
+  double start;
+  ssize_t n;
+
+  if (fdatasync(fd) < 0 || posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED))
+    return -1;
+
+  start = now();
+  while ((n = pread(fd, buf, READ_BUF_SIZE, done)) > 0)
+    done += n;
+  if (n < 0 || done != size)
+    return -1;
+
+  return size / (1024.0 * 1024.0) / (now() - start);
+}
+
+static int defrag_file(const char *path, struct defrag_options *opt, char *buf)
+{
+  struct tfs_defrag_range range;
+  struct stat st;
+  unsigned long long blocks;
+  long long before, after;
+  double mbps_before = 0, mbps_after = 0;
+  int fd, bs;
+
+  fd = open(path, opt->dry_run ? O_RDONLY : O_RDWR);
+  if (fd < 0 || fstat(fd, &st) < 0)
+    {
+      fprintf(stderr, "tfs-defrag: %s: %s\n", path, strerror(errno));
+      return 1;
+    }
+  if (!S_ISREG(st.st_mode))
+    {
+      fprintf(stderr, "tfs-defrag: %s: not a regular file\n", path);
+      close(fd);
+      return 1;
+    }
+  if (ioctl(fd, FIGETBSZ, &bs) < 0)
+    {
+      fprintf(stderr, "tfs-defrag: %s: cannot get block size: %s\n", path, strerror(errno));
+      close(fd);
+      return 1;
+    }
+
+  blocks = (st.st_size + bs - 1) / bs;
+  if ((before = count_extents(fd, blocks)) < 0)
+    {
+      fprintf(stderr, "tfs-defrag: %s: FIBMAP: %s\n", path, strerror(errno));
+      close(fd);
+      return 1;
+    }
+
+  if (opt->dry_run)
+    {
+      printf("%s: %llu blocks in %lld extents\n", path, blocks, before);
+      close(fd);
+      return 0;
+    }
+
+  if (!opt->no_timing)
+    mbps_before = read_throughput(fd, st.st_size, buf);
+
+  memset(&range, 0, sizeof(range));
+  range.len = blocks;
+  if (ioctl(fd, TFS_IOC_DEFRAG, &range) < 0)
+    {
+      fprintf(stderr, "tfs-defrag: %s: %s\n", path, strerror(errno));
+      close(fd);
+      return 1;
+    }
+
+  after = count_extents(fd, blocks);
+  if (!opt->no_timing)
+    mbps_after = read_throughput(fd, st.st_size, buf);
+
+  printf("%s: %llu blocks, %lld -> %lld extents, %llu blocks moved",
+	 path, blocks, before, after, (unsigned long long) range.moved);
+  if (!opt->no_timing && mbps_before > 0 && mbps_after > 0)
+    printf(", read %.1f -> %.1f MB/s (%+.0f%%)", mbps_before, mbps_after,
+	   (mbps_after - mbps_before) * 100 / mbps_before);
+  printf("\n");
+
+  close(fd);
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  struct defrag_options opt;
+  char *buf;
+  int c, i, ret = 0;
+
+  memset(&opt, 0, sizeof(opt));
+
+  while ((c = getopt(argc, argv, "nT")) != -1)
+    {
+      switch (c)
+	{
+	case 'n':
+	  opt.dry_run = 1;
+	  break;
+	case 'T':
+	  opt.no_timing = 1;
+	  break;
+	default:
+	  usage(argv[0]);
+	}
+    }
+
+  if (optind >= argc)
+    usage(argv[0]);
+
+  if (!(buf = malloc(READ_BUF_SIZE)))
+    {
+      fprintf(stderr, "tfs-defrag: out of memory\n");
+      return 1;
+    }
+
+  for (i = optind; i < argc; ++i)
+    ret |= defrag_file(argv[i], &opt, buf);
+
+  free(buf);
+  return ret;
+}
@@ -1,163 +1,574 @@
+#include <linux/percpu.h>
+#include <linux/random.h>
+
 #include "alloc.h"
 
 void tfs_release_inode_info_blocks(struct tfs_alloc_inode_info *tainfo)
 {
-  if (tainfo->inode_bitmap_bh)
-    brelse(tainfo->inode_bitmap_bh);
   if (tainfo->data_bitmap_bh)
     brelse(tainfo->data_bitmap_bh);
   if (tainfo->inode_table_bh)
     brelse(tainfo->inode_table_bh);
 }
 
+/* clear an inode's bit in the inode bitmap; called with inode_bitmap_mutex held */
+static void tfs_put_inode_bit(struct super_block *sb, u32 ino)
+{
+  struct tfs_sb_info *si = sb->s_fs_info;
+  struct buffer_head *bh;
+  sector_t block;
+
+  block = si->super_block->inode_bitmap_block_start + ino / si->bits_per_block;
+  if (!(bh = sb_bread(sb, block)))
+    {
+      printk("TFS: error reading bitmap block: %u\n", (unsigned) block);
+      return;
+    }
+
+  if (__test_and_clear_bit(ino % si->bits_per_block, (unsigned long *) bh->b_data))
+    {
+      si->groups[tfs_group_of_inode(si, ino)].free_inodes++;
+      si->free_inodes++;
+    }
+  else
+    printk("TFS: freeing free inode: %u\n", ino);
+
+  mark_buffer_dirty(bh);
+  brelse(bh);
+}
+
 void tfs_error_inode_info(struct tfs_alloc_inode_info *tainfo)
 {
-  if (tainfo->inode_bitmap_data)
-    *tainfo->inode_bitmap_data &= ~(1 << tainfo->inode_index);
+  struct tfs_sb_info *si = tainfo->si;
+
+  if (tainfo->ino)
+    {
+      mutex_lock(&si->inode_bitmap_mutex);
+      tfs_put_inode_bit(si->sb, tainfo->ino);
+      mutex_unlock(&si->inode_bitmap_mutex);
+    }
 
   if (tainfo->datablock_bitmap_data)
-    *tainfo->datablock_bitmap_data &= ~(1 << tainfo->datablock_index);
+    {
+      mutex_lock(&si->data_bitmap_mutex);
+      *tainfo->datablock_bitmap_data &= ~(1UL << tainfo->datablock_index);
+      si->groups[tfs_group_of_block(si, tainfo->data_block)].free_blocks += si->alloc_blocks;
+      si->free_blocks += si->alloc_blocks;
+      mutex_unlock(&si->data_bitmap_mutex);
+    }
 
   tfs_release_inode_info_blocks(tainfo);
 }
 
-int alloc_inode_bitmap(struct super_block *sb, struct tfs_alloc_inode_info *tainfo)
+unsigned int tfs_group_of_inode(struct tfs_sb_info *si, unsigned int ino)
 {
-  struct tfs_sb_info *si = sb->s_fs_info; 
-  struct tfs_super_block *tsb = si->super_block;
-  unsigned long *inode_bitmap_data = NULL;
-  int ret = 0;
-  unsigned int i, j, k;
+  return min_t(unsigned int, ino / si->inodes_per_group, si->groups_count - 1);
+}
 
-  mutex_lock(&si->inode_bitmap_mutex);
-  for (i = 0; i < tsb->inode_bitmap_blocks; ++i)
+unsigned int tfs_group_of_block(struct tfs_sb_info *si, sector_t block)
+{
+  sector_t start = si->super_block->inode_table_block_start;
+
+  if (block < start)
+    return 0;
+
+  return min_t(sector_t, (block - start) / si->blocks_per_group, si->groups_count - 1);
+}
+
+/* first block after the group's slice of the inode table */
+sector_t tfs_group_data_start(struct tfs_sb_info *si, unsigned int group)
+{
+  return si->super_block->inode_table_block_start + (sector_t) group * si->blocks_per_group +
+    si->itable_blocks_per_group;
+}
+
+/* where to look for a new block of 'inode' that follows 'prev' (0 if none) */
+sector_t tfs_find_goal(struct inode *inode, sector_t prev)
+{
+  struct tfs_sb_info *si = inode->i_sb->s_fs_info;
+
+  if (prev && prev + 1 < si->blocks_count)
+    return prev + 1;
+
+  return tfs_group_data_start(si, tfs_group_of_inode(si, inode->i_ino));
+}
+
+/*
+ * Free inode and block counts per group, taken from the bitmaps at mount
+ * and kept up to date under the bitmap mutexes. They only steer the
+ * allocator, so readers do not lock. Block counts are in blocks, even
+ * though a data bitmap bit may stand for a whole allocation cluster.
+ */
+static int tfs_count_free_bits(struct super_block *sb, sector_t start, u32 nbits, int inodes)
+{
+  struct tfs_sb_info *si = sb->s_fs_info;
+  struct buffer_head *bh;
+  unsigned long *p;
+  u32 bit = 0, j, k;
+
+  while (bit < nbits)
     {
-      tainfo->inode_bitmap_bh = sb_bread(sb, tsb->inode_bitmap_block_start + i);
-      if (!tainfo->inode_bitmap_bh)
+      if (!(bh = sb_bread(sb, start + bit / si->bits_per_block)))
 	{
-	  ret = -EIO;
-	  printk("TFS: error !tainfo->inode_bitmap_bh\n");
-	  goto inode_unlock;
+	  printk("TFS: error reading bitmap block: %u\n", (unsigned) (start + bit / si->bits_per_block));
+	  return -EIO;
 	}
-      inode_bitmap_data = (unsigned long *) tainfo->inode_bitmap_bh->b_data;
 
-      for (j = 0; j < TFS_BLOCK_SIZE; ++j, ++inode_bitmap_data)
+      p = (unsigned long *) bh->b_data;
+      for (j = 0; j < sb->s_blocksize / sizeof(unsigned long) && bit < nbits; ++j)
 	{
-	  if (*inode_bitmap_data == (unsigned long) -1)
-	    continue;
+	  if (p[j] == ~0UL)
+	    {
+	      bit += BITS_PER_LONG;
+	      continue;
+	    }
 
-	  for (k = 0; k < BITS_PER_LONG; ++k)
+	  for (k = 0; k < BITS_PER_LONG && bit < nbits; ++k, ++bit)
 	    {
-	      if ((1 << k) & *inode_bitmap_data)
+	      if (p[j] & (1UL << k))
 		continue;
 
-	      tainfo->inode_index = k;
-	      tainfo->ino = (i * TFS_BLOCK_SIZE) + (j * BITS_PER_LONG) + k;
-	      *inode_bitmap_data |= (1 << k);
-	      tainfo->inode_bitmap_data = inode_bitmap_data;
-	      goto inode_unlock;
+	      if (inodes)
+		{
+		  si->groups[tfs_group_of_inode(si, bit)].free_inodes++;
+		  si->free_inodes++;
+		}
+	      else
+		{
+		  si->groups[tfs_group_of_block(si, (sector_t) bit << si->alloc_bits)].free_blocks += si->alloc_blocks;
+		  si->free_blocks += si->alloc_blocks;
+		}
 	    }
 	}
-      brelse(tainfo->inode_bitmap_bh);
-      tainfo->inode_bitmap_bh = NULL;
-      inode_bitmap_data = NULL;
+      brelse(bh);
     }
-inode_unlock:
-  mutex_unlock(&si->inode_bitmap_mutex);
 
-  if (!ret && !tainfo->ino)
+  return 0;
+}
+
+int tfs_init_groups(struct super_block *sb)
+{
+  struct tfs_sb_info *si = sb->s_fs_info;
+  struct tfs_super_block *tsb = si->super_block;
+  int err;
+
+  si->blocks_count = min_t(sector_t, i_size_read(sb->s_bdev->bd_inode) >> sb->s_blocksize_bits,
+			   (sector_t) tsb->data_bitmap_blocks * si->bits_per_block << si->alloc_bits);
+  si->itable_blocks_per_group = tfs_itable_blocks_per_group(tsb);
+
+  if (tsb->blocks_per_group)
     {
-      printk("TFS: no more space for inode\n");
-      ret = -ENOSPC;
+      if (!tsb->inodes_per_group || tsb->inodes_per_group % si->inodes_per_block ||
+	  si->itable_blocks_per_group >= tsb->blocks_per_group ||
+	  tsb->inode_table_entries % tsb->inodes_per_group)
+	{
+	  printk("TFS: invalid block group geometry\n");
+	  return -EINVAL;
+	}
+      si->blocks_per_group = tsb->blocks_per_group;
+      si->inodes_per_group = tsb->inodes_per_group;
+      si->groups_count = tsb->inode_table_entries / tsb->inodes_per_group;
+    }
+  else
+    {
+      si->blocks_per_group = si->blocks_count;
+      si->inodes_per_group = tsb->inode_table_entries;
+      si->groups_count = 1;
     }
 
-  return ret;
+  si->groups = kcalloc(si->groups_count, sizeof(struct tfs_group_info), GFP_KERNEL);
+  if (!si->groups)
+    return -ENOMEM;
+
+  if ((err = tfs_count_free_bits(sb, tsb->inode_bitmap_block_start, tsb->inode_table_entries, 1)) ||
+      (err = tfs_count_free_bits(sb, tsb->data_bitmap_block_start, si->blocks_count >> si->alloc_bits, 0)))
+    {
+      kfree(si->groups);
+      si->groups = NULL;
+      return err;
+    }
+
+  printk("TFS: %u groups, %u free inodes, %u free blocks\n", si->groups_count, si->free_inodes, si->free_blocks);
+
+  return 0;
 }
 
-int alloc_datablock_bitmap(struct super_block *sb, struct tfs_alloc_inode_info *tainfo)
+/*
+ * Orlov: directories under the root are spread over groups with at least
+ * the average number of free inodes and blocks, starting from a random
+ * one; deeper directories stay in or near the parent's group while it is
+ * not much fuller than average.
+ */
+static unsigned int tfs_find_group_dir(struct super_block *sb, struct inode *parent)
 {
-  struct tfs_sb_info *si = sb->s_fs_info; 
-  struct tfs_super_block *tsb = si->super_block;
-  unsigned long *datablock_bitmap_data = NULL;
-  int ret = 0;
-  unsigned int i, j, k;
+  struct tfs_sb_info *si = sb->s_fs_info;
+  unsigned int ngroups = si->groups_count;
+  unsigned int avefreei = si->free_inodes / ngroups;
+  unsigned int avefreeb = si->free_blocks / ngroups;
+  unsigned int min_inodes, min_blocks, start, group, i;
 
-  mutex_lock(&si->data_bitmap_mutex);
-  for (i = 0; i < tsb->data_bitmap_blocks; ++i)
+  if (parent->i_ino == TFS_ROOT_DIR_INODE)
     {
-      tainfo->data_bitmap_bh = sb_bread(sb, tsb->data_bitmap_block_start + i);
-      if (!tainfo->data_bitmap_bh)
+      start = random32() % ngroups;
+      for (i = 0; i < ngroups; ++i)
 	{
-	  ret = -EIO;
-	  printk("TFS: error !tainfo->data_bitmap_bh\n");
-	  goto data_unlock;
+	  group = (start + i) % ngroups;
+	  if (si->groups[group].free_inodes && si->groups[group].free_inodes >= avefreei &&
+	      si->groups[group].free_blocks >= avefreeb)
+	    return group;
 	}
-      datablock_bitmap_data = (unsigned long *) tainfo->data_bitmap_bh->b_data;
+    }
+  else
+    {
+      min_inodes = max_t(unsigned int, avefreei - avefreei / 4, 1);
+      min_blocks = avefreeb - avefreeb / 4;
+      start = tfs_group_of_inode(si, parent->i_ino);
+      for (i = 0; i < ngroups; ++i)
+	{
+	  group = (start + i) % ngroups;
+	  if (si->groups[group].free_inodes >= min_inodes && si->groups[group].free_blocks >= min_blocks)
+	    return group;
+	}
+    }
+
+  start = tfs_group_of_inode(si, parent->i_ino);
+  for (i = 0; i < ngroups; ++i)
+    {
+      group = (start + i) % ngroups;
+      if (si->groups[group].free_inodes)
+	return group;
+    }
 
-      for (j = 0; j < TFS_BLOCK_SIZE; ++j, ++datablock_bitmap_data)
+  return start;
+}
+
+/* files: the parent's group, else a quadratic then linear search */
+static unsigned int tfs_find_group_other(struct super_block *sb, struct inode *parent)
+{
+  struct tfs_sb_info *si = sb->s_fs_info;
+  unsigned int ngroups = si->groups_count;
+  unsigned int parent_group = tfs_group_of_inode(si, parent->i_ino);
+  unsigned int group = parent_group, i;
+
+  if (si->groups[group].free_inodes && si->groups[group].free_blocks)
+    return group;
+
+  for (i = 1; i < ngroups; i <<= 1)
+    {
+      group = (group + i) % ngroups;
+      if (si->groups[group].free_inodes && si->groups[group].free_blocks)
+	return group;
+    }
+
+  for (i = 0, group = parent_group; i < ngroups; ++i, group = (group + 1) % ngroups)
+    if (si->groups[group].free_inodes)
+      return group;
+
+  return parent_group;
+}
+
+/*
+ * Set the first clear bit at or after 'goal' in the bitmap at 'start'
+ * of 'nbits' bits, wrapping around to bit 0. On success the bitmap
+ * block is left referenced in *bhp. Called with the bitmap mutex held.
+ */
+static int tfs_alloc_bit(struct super_block *sb, sector_t start, u32 nbits, u32 goal,
+			 struct buffer_head **bhp, unsigned long **wordp, unsigned int *indexp, u32 *bitp)
+{
+  struct tfs_sb_info *si = sb->s_fs_info;
+  unsigned int words = sb->s_blocksize / sizeof(unsigned long);
+  u64 scanned = 0;
+  u32 bit = goal < nbits ? goal : 0;
+
+  while (scanned < (u64) nbits + si->bits_per_block)
+    {
+      u32 block = bit / si->bits_per_block;
+      unsigned int j = (bit % si->bits_per_block) / BITS_PER_LONG;
+      unsigned int k = bit % BITS_PER_LONG;
+      unsigned long *p;
+      struct buffer_head *bh;
+
+      if (!(bh = sb_bread(sb, start + block)))
+	{
+	  printk("TFS: error reading bitmap block: %u\n", (unsigned) (start + block));
+	  return -EIO;
+	}
+
+      p = (unsigned long *) bh->b_data;
+      for ( ; j < words; ++j, k = 0)
 	{
-	  if (*datablock_bitmap_data == (unsigned long) -1)
+	  /* bits below the goal in its word count as used on the first pass */
+	  unsigned long w = p[j] | ((1UL << k) - 1);
+	  u32 found;
+
+	  if (w == ~0UL)
 	    continue;
 
-	  for (k = 0; k < BITS_PER_LONG; ++k)
-	    {
-	      if ((1 << k) & *datablock_bitmap_data)
-		continue;
+	  found = block * si->bits_per_block + j * BITS_PER_LONG + ffz(w);
+	  if (found >= nbits)
+	    break;
 
-	      tainfo->datablock_index = k;
-	      tainfo->data_block = (i * TFS_BLOCK_SIZE) + (j * BITS_PER_LONG) + k;
-	      *datablock_bitmap_data |= (1 << k);
-	      tainfo->datablock_bitmap_data = datablock_bitmap_data;
+	  p[j] |= 1UL << ffz(w);
+	  *indexp = ffz(w);
+	  *wordp = &p[j];
+	  *bhp = bh;
+	  *bitp = found;
+	  return 0;
+	}
+      brelse(bh);
 
-	      printk("TFS: datablock: %u\n", tainfo->data_block);
-	      goto data_unlock;
-	    }
+      scanned += (u64) (block + 1) * si->bits_per_block - bit;
+      bit = (block + 1) * si->bits_per_block;
+      if (bit >= nbits)
+	bit = 0;
+    }
+
+  return -ENOSPC;
+}
+
+/*
+ * Creates take their inode numbers from a batch of up to
+ * TFS_INODE_BATCH bits that the CPU they run on has already set in the
+ * inode bitmap, so inode_bitmap_mutex and the bitmap scan are paid once
+ * per batch. A batch is refilled when it runs out or the create wants
+ * another group; what is left of the batches goes back to the bitmap on
+ * sync and unmount. Bitmap writeback in between can put the reserved
+ * bits on disk, so a crash leaves them set with no inode behind them;
+ * fsck leaves such bits alone and clears them when repairing.
+ */
+int tfs_init_inode_batches(struct super_block *sb)
+{
+  struct tfs_sb_info *si = sb->s_fs_info;
+  int cpu;
+
+  si->inode_batches = alloc_percpu(struct tfs_inode_batch);
+  if (!si->inode_batches)
+    return -ENOMEM;
+
+  for_each_possible_cpu(cpu)
+    mutex_init(&per_cpu_ptr(si->inode_batches, cpu)->mutex);
+
+  return 0;
+}
+
+/* give back the unused part of a batch; called with its mutex and inode_bitmap_mutex held */
+static void tfs_drain_inode_batch(struct super_block *sb, struct tfs_inode_batch *b)
+{
+  while (b->next < b->count)
+    tfs_put_inode_bit(sb, b->inos[b->next++]);
+  b->next = b->count = 0;
+}
+
+void tfs_return_inode_batches(struct super_block *sb)
+{
+  struct tfs_sb_info *si = sb->s_fs_info;
+  struct tfs_inode_batch *b;
+  int cpu;
+
+  for_each_possible_cpu(cpu)
+    {
+      b = per_cpu_ptr(si->inode_batches, cpu);
+      mutex_lock(&b->mutex);
+      if (b->next < b->count)
+	{
+	  mutex_lock(&si->inode_bitmap_mutex);
+	  tfs_drain_inode_batch(sb, b);
+	  mutex_unlock(&si->inode_bitmap_mutex);
 	}
-      brelse(tainfo->data_bitmap_bh);
-      tainfo->data_bitmap_bh = NULL;
-      datablock_bitmap_data = NULL;
+      mutex_unlock(&b->mutex);
     }
-data_unlock:
-  mutex_unlock(&si->data_bitmap_mutex);
+}
 
-  if (!ret && !tainfo->data_block)
+/*
+ * Set the first free inode bit at or after goal, growing a dynamic
+ * inode table to hold it and zeroing its table block if that was never
+ * done. Called with inode_bitmap_mutex held.
+ */
+static int tfs_take_inode_bit(struct super_block *sb, u32 goal, u32 *ino)
+{
+  struct tfs_sb_info *si = sb->s_fs_info;
+  struct tfs_super_block *tsb = si->super_block;
+  struct buffer_head *bh;
+  unsigned long *word;
+  unsigned int index;
+  int ret;
+
+  ret = tfs_alloc_bit(sb, tsb->inode_bitmap_block_start, tsb->inode_table_entries, goal,
+		      &bh, &word, &index, ino);
+  if (ret)
+    return ret;
+
+  if ((ret = tfs_grow_inode_table(sb, *ino)) ||
+      (ret = tfs_init_itable_block(sb, *ino / si->inodes_per_block)))
     {
-      printk("TFS: no more space for data block\n");
-      ret = -ENOSPC;
+      *word &= ~(1UL << index);
+      brelse(bh);
+      return ret;
     }
 
+  mark_buffer_dirty(bh);
+  brelse(bh);
+  si->groups[tfs_group_of_inode(si, *ino)].free_inodes--;
+  si->free_inodes--;
+
+  return 0;
+}
+
+/* called with the batch's mutex held */
+static int tfs_refill_inode_batch(struct super_block *sb, struct tfs_inode_batch *b, unsigned int group)
+{
+  struct tfs_sb_info *si = sb->s_fs_info;
+  u32 goal = group * si->inodes_per_group, ino;
+  int ret = 0;
+
+  mutex_lock(&si->inode_bitmap_mutex);
+  tfs_drain_inode_batch(sb, b);
+  b->group = group;
+  while (b->count < TFS_INODE_BATCH && !(ret = tfs_take_inode_bit(sb, goal, &ino)))
+    {
+      b->inos[b->count++] = ino;
+      goal = ino + 1;
+    }
+  mutex_unlock(&si->inode_bitmap_mutex);
+
+  return b->count ? 0 : ret;
+}
+
+/*
+ * Directories are spread over the groups one at a time, so they take
+ * their inode straight from the bitmap rather than trade in a batch.
+ */
+int alloc_inode_bitmap(struct super_block *sb, struct tfs_alloc_inode_info *tainfo, unsigned int group, int batch)
+{
+  struct tfs_sb_info *si = sb->s_fs_info; 
+  struct tfs_inode_batch *b;
+  u32 ino;
+  int ret, retried = 0;
+
+  tainfo->si = si;
+
+  for (;;)
+    {
+      if (batch)
+	{
+	  b = per_cpu_ptr(si->inode_batches, raw_smp_processor_id());
+	  mutex_lock(&b->mutex);
+	  ret = 0;
+	  if (b->next == b->count || b->group != group)
+	    ret = tfs_refill_inode_batch(sb, b, group);
+	  if (!ret)
+	    tainfo->ino = b->inos[b->next++];
+	  mutex_unlock(&b->mutex);
+	}
+      else
+	{
+	  mutex_lock(&si->inode_bitmap_mutex);
+	  if (!(ret = tfs_take_inode_bit(sb, group * si->inodes_per_group, &ino)))
+	    tainfo->ino = ino;
+	  mutex_unlock(&si->inode_bitmap_mutex);
+	}
+
+      /* the last free inodes may sit in other CPUs' batches */
+      if (ret != -ENOSPC || retried++)
+	break;
+      tfs_return_inode_batches(sb);
+    }
+
+  if (ret == -ENOSPC)
+    printk("TFS: no more space for inode\n");
+
   return ret;
 }
 
+/* with bigalloc, the block returned is the first of a whole cluster */
+int alloc_datablock_bitmap(struct super_block *sb, struct tfs_alloc_inode_info *tainfo, sector_t goal)
+{
+  struct tfs_sb_info *si = sb->s_fs_info; 
+  struct tfs_super_block *tsb = si->super_block;
+  u32 bit;
+  int ret;
+
+  tainfo->si = si;
+
+  mutex_lock(&si->data_bitmap_mutex);
+  ret = tfs_alloc_bit(sb, tsb->data_bitmap_block_start, si->blocks_count >> si->alloc_bits, goal >> si->alloc_bits,
+		      &tainfo->data_bitmap_bh, &tainfo->datablock_bitmap_data, &tainfo->datablock_index, &bit);
+  if (!ret)
+    {
+      tainfo->data_block = bit << si->alloc_bits;
+      mark_buffer_dirty(tainfo->data_bitmap_bh);
+      si->groups[tfs_group_of_block(si, tainfo->data_block)].free_blocks -= si->alloc_blocks;
+      si->free_blocks -= si->alloc_blocks;
+      printk("TFS: datablock: %u\n", tainfo->data_block);
+    }
+  mutex_unlock(&si->data_bitmap_mutex);
+
+  if (ret == -ENOSPC)
+    printk("TFS: no more space for data block\n");
+
+  return ret;
+}
+
+/*
+ * Allocate the block for entry 'index' of the block map 'e' of 'n'
+ * entries. With bigalloc it goes into the cluster of another entry of
+ * its aligned run if one is mapped, so that only the first block of a
+ * run touches the bitmap; tainfo is then left without a bitmap bit to
+ * undo.
+ */
+int tfs_alloc_mapped_block(struct super_block *sb, struct tfs_alloc_inode_info *tainfo,
+			   const u32 *e, u32 n, u32 index, sector_t goal)
+{
+  struct tfs_sb_info *si = sb->s_fs_info;
+  u32 first = index - index % si->alloc_blocks, i;
+  int err;
+
+  for (i = first; si->alloc_bits && i < first + si->alloc_blocks && i < n; ++i)
+    {
+      /* a cluster shared some other way would not line up */
+      if (e[i] && (e[i] & (si->alloc_blocks - 1)) == i - first)
+	{
+	  tainfo->si = si;
+	  tainfo->data_block = e[i] - (i - first) + (index - first);
+	  return 0;
+	}
+    }
+
+  if (!(err = alloc_datablock_bitmap(sb, tainfo, goal)))
+    tainfo->data_block += index - first;
+
+  return err;
+}
+
 struct inode *tfs_new_inode(struct inode *dir, struct tfs_alloc_inode_info *tainfo, int mode)
 {
   struct inode *inode_new;
   struct super_block *sb = dir->i_sb;
   struct tfs_sb_info *si = sb->s_fs_info;
-  struct tfs_super_block *tsb = si->super_block;
   struct tfs_inode *ti;
-  unsigned int block, offset, shift;
+  unsigned int offset, group;
+  sector_t block;
   int err, i;
 
-  err = alloc_inode_bitmap(sb, tainfo);
+  group = S_ISDIR(mode) ? tfs_find_group_dir(sb, dir) : tfs_find_group_other(sb, dir);
+
+  err = alloc_inode_bitmap(sb, tainfo, group, !S_ISDIR(mode));
   if (err)
       goto err;
 
-  if (mode & S_IFDIR)
+  if (S_ISDIR(mode))
     {
-      err = alloc_datablock_bitmap(sb, tainfo);
+      err = alloc_datablock_bitmap(sb, tainfo, tfs_group_data_start(si, tfs_group_of_inode(si, tainfo->ino)));
       if (err)
 	goto err;
     }
 
-  shift = (tainfo->ino << TFS_INODE_SIZE_BITS);
-  block = tsb->inode_table_block_start + (shift >> TFS_BLOCK_SIZE_BITS);
-  offset = shift % TFS_BLOCK_SIZE;
+  block = tfs_inode_block(sb, tainfo->ino, &offset);
 
-  tainfo->inode_table_bh = sb_bread(sb, block);
+  tainfo->inode_table_bh = tfs_bread_itable(sb, block);
   if (!tainfo->inode_table_bh)
     {
-      printk("TFS: error reading inode table block: %u\n", block);
+      printk("TFS: error reading inode table block: %u\n", (unsigned) block);
       err = -EIO;
       goto err;
     }
@@ -171,10 +582,13 @@ struct inode *tfs_new_inode(struct inode *dir, struct tfs_alloc_inode_info *tain
 
   for (i = 0; i < TFS_DATA_BLOCKS_PER_INODE; ++i)
     ti->data_blocks[i] = 0;
+  ti->root_indirect_data_block = 0;
+  ti->size_hi = 0;
+  ti->flags = S_ISREG(mode) && (si->mount_opts & TFS_MOUNT_COMPRESS) && si->cluster_blocks ? TFS_INODE_COMPRESS : 0;
 
-  if (mode & S_IFDIR)
+  if (S_ISDIR(mode))
     {
-      ti->size = TFS_BLOCK_SIZE;
+      ti->size = sb->s_blocksize;
       ti->blocks = 1;
       ti->data_blocks[0] = tainfo->data_block;
       mark_buffer_dirty(tainfo->data_bitmap_bh);
@@ -186,7 +600,6 @@ struct inode *tfs_new_inode(struct inode *dir, struct tfs_alloc_inode_info *tain
     }
 
   mark_buffer_dirty(tainfo->inode_table_bh);
-  mark_buffer_dirty(tainfo->inode_bitmap_bh);
 
   inode_new = tfs_inode_get(sb, tainfo->ino);
   if (IS_ERR(inode_new))
@@ -206,3 +619,200 @@ err:
 
   return NULL;
 }
+
+/*
+ * Allocate 'count' contiguous blocks, at or after 'goal' if there is such
+ * a run, wrapping around otherwise. Runs do not cross bitmap blocks, so
+ * count is at most bits_per_block.
+ */
+int tfs_alloc_block_run(struct super_block *sb, sector_t goal, u32 count, sector_t *start)
+{
+  struct tfs_sb_info *si = sb->s_fs_info;
+  struct tfs_super_block *tsb = si->super_block;
+  u32 nmaps = (si->blocks_count + si->bits_per_block - 1) / si->bits_per_block;
+  u32 first, n, map, lo, hi, run, end, i;
+  struct buffer_head *bh;
+  unsigned long *p;
+
+  /* callers free the blocks of a run one by one, which bigalloc cannot do */
+  if (si->alloc_bits)
+    return -EOPNOTSUPP;
+  if (!count || count > si->bits_per_block)
+    return -EINVAL;
+  if (goal >= si->blocks_count)
+    goal = 0;
+  first = goal / si->bits_per_block;
+
+  mutex_lock(&si->data_bitmap_mutex);
+  for (n = 0; n <= nmaps; ++n)
+    {
+      map = (first + n) % nmaps;
+      lo = n ? 0 : goal % si->bits_per_block;
+      hi = min_t(sector_t, si->bits_per_block, si->blocks_count - (sector_t) map * si->bits_per_block);
+
+      if (!(bh = sb_bread(sb, tsb->data_bitmap_block_start + map)))
+	{
+	  printk("TFS: error reading bitmap block: %u\n", tsb->data_bitmap_block_start + map);
+	  continue;
+	}
+      p = (unsigned long *) bh->b_data;
+
+      while (lo < hi)
+	{
+	  run = find_next_zero_bit(p, hi, lo);
+	  if (run >= hi)
+	    break;
+	  end = find_next_bit(p, hi, run);
+	  if (end - run < count)
+	    {
+	      lo = end;
+	      continue;
+	    }
+
+	  *start = (sector_t) map * si->bits_per_block + run;
+	  for (i = run; i < run + count; ++i)
+	    {
+	      __set_bit(i, p);
+	      si->groups[tfs_group_of_block(si, *start + i - run)].free_blocks--;
+	    }
+	  si->free_blocks -= count;
+	  mark_buffer_dirty(bh);
+	  brelse(bh);
+	  mutex_unlock(&si->data_bitmap_mutex);
+
+	  return 0;
+	}
+      brelse(bh);
+    }
+  mutex_unlock(&si->data_bitmap_mutex);
+
+  return -ENOSPC;
+}
+
+int tfs_data_block_valid(struct tfs_sb_info *si, sector_t block)
+{
+  struct tfs_super_block *tsb = si->super_block;
+
+  return block >= tsb->inode_table_block_start && block < si->blocks_count &&
+    tfs_itable_index(tsb, block) == TFS_NOT_ITABLE;
+}
+
+/*
+ * Clear the data bitmap bits of 'count' blocks, taken from 'blocks' or,
+ * if that is NULL, the run starting at 'start'. Consecutive blocks
+ * covered by the same bitmap block share one read, so callers should
+ * pass them in roughly ascending order. With bigalloc any block of a
+ * cluster frees the whole cluster, and consecutive blocks of one
+ * cluster free it once.
+ */
+static void tfs_clear_block_bits(struct super_block *sb, sector_t *blocks, sector_t start, u32 count)
+{
+  struct tfs_sb_info *si = sb->s_fs_info;
+  struct tfs_super_block *tsb = si->super_block;
+  struct buffer_head *bh = NULL;
+  sector_t bitmap_block = 0, bit, last = ~(sector_t) 0;
+  u32 i;
+
+  mutex_lock(&si->data_bitmap_mutex);
+  for (i = 0; i < count; ++i)
+    {
+      sector_t block = blocks ? blocks[i] : start + i;
+
+      if (!tfs_data_block_valid(si, block))
+	{
+	  printk("TFS: freeing invalid block: %u\n", (unsigned) block);
+	  continue;
+	}
+
+      bit = block >> si->alloc_bits;
+      if (bit == last)
+	continue;
+      last = bit;
+
+      if (!bh || tsb->data_bitmap_block_start + bit / si->bits_per_block != bitmap_block)
+	{
+	  if (bh)
+	    {
+	      mark_buffer_dirty(bh);
+	      brelse(bh);
+	    }
+
+	  bitmap_block = tsb->data_bitmap_block_start + bit / si->bits_per_block;
+	  if (!(bh = sb_bread(sb, bitmap_block)))
+	    {
+	      printk("TFS: error reading bitmap block: %u\n", (unsigned) bitmap_block);
+	      continue;
+	    }
+	}
+
+      if (!__test_and_clear_bit(bit % si->bits_per_block, (unsigned long *) bh->b_data))
+	{
+	  printk("TFS: freeing free block: %u\n", (unsigned) block);
+	  continue;
+	}
+
+      si->groups[tfs_group_of_block(si, block)].free_blocks += si->alloc_blocks;
+      si->free_blocks += si->alloc_blocks;
+    }
+
+  if (bh)
+    {
+      mark_buffer_dirty(bh);
+      brelse(bh);
+    }
+  mutex_unlock(&si->data_bitmap_mutex);
+}
+
+/*
+ * Free 'count' blocks. A shared block only loses a reference, and is
+ * dropped from the array. With the discard mount option they stay
+ * allocated until the discard worker has discarded them, so they cannot
+ * be reused while the discard is in flight.
+ */
+void tfs_free_blocks(struct super_block *sb, sector_t *blocks, int count)
+{
+  struct tfs_sb_info *si = sb->s_fs_info;
+
+  if (!(count = tfs_unref_blocks(sb, blocks, count)))
+    return;
+
+  if ((si->mount_opts & TFS_MOUNT_DISCARD) && !tfs_queue_discard(sb, blocks, count))
+    return;
+
+  tfs_clear_block_bits(sb, blocks, 0, count);
+}
+
+void tfs_free_block_range(struct super_block *sb, sector_t start, u32 count)
+{
+  tfs_clear_block_bits(sb, NULL, start, count);
+}
+
+/* zero the on-disk inode and clear its bit */
+void tfs_free_inode(struct super_block *sb, unsigned int ino)
+{
+  struct tfs_sb_info *si = sb->s_fs_info;
+  struct tfs_super_block *tsb = si->super_block;
+  struct buffer_head *bh;
+  unsigned int offset;
+  sector_t block;
+
+  if (ino <= TFS_TMP_DIR_INODE || ino >= tsb->inode_table_entries)
+    {
+      printk("TFS: freeing invalid inode: %u\n", ino);
+      return;
+    }
+
+  block = tfs_inode_block(sb, ino, &offset);
+  if ((bh = tfs_bread_itable(sb, block)))
+    {
+      memset(bh->b_data + offset, 0, TFS_INODE_SIZE);
+      mark_buffer_dirty(bh);
+      brelse(bh);
+    }
+  else
+    printk("TFS: error reading inode table block: %u\n", (unsigned) block);
+
+  mutex_lock(&si->inode_bitmap_mutex);
+  tfs_put_inode_bit(sb, ino);
+  mutex_unlock(&si->inode_bitmap_mutex);
+}
@@ -5,10 +5,11 @@
 
 struct tfs_alloc_inode_info
 {
-  struct buffer_head *inode_bitmap_bh, *inode_table_bh, *data_bitmap_bh;
-  unsigned long *inode_bitmap_data, *datablock_bitmap_data;
-  unsigned int inode_index, datablock_index;
+  struct buffer_head *inode_table_bh, *data_bitmap_bh;
+  unsigned long *datablock_bitmap_data;
+  unsigned int datablock_index;
   unsigned int ino, data_block;
+  struct tfs_sb_info *si;
   int slot_page, slot_idx;
   int err;
 };
@@ -17,8 +18,16 @@ struct tfs_alloc_inode_info
 void tfs_release_inode_info_blocks(struct tfs_alloc_inode_info *tainfo);
 void tfs_error_inode_info(struct tfs_alloc_inode_info *tainfo);
 struct inode *tfs_new_inode(struct inode *dir, struct tfs_alloc_inode_info *tainfo, int mode);
-int alloc_inode_bitmap(struct super_block *sb, struct tfs_alloc_inode_info *tainfo);
-int alloc_datablock_bitmap(struct super_block *sb, struct tfs_alloc_inode_info *tainfo);
+int alloc_inode_bitmap(struct super_block *sb, struct tfs_alloc_inode_info *tainfo, unsigned int group, int batch);
+int alloc_datablock_bitmap(struct super_block *sb, struct tfs_alloc_inode_info *tainfo, sector_t goal);
+int tfs_alloc_mapped_block(struct super_block *sb, struct tfs_alloc_inode_info *tainfo,
+			   const u32 *e, u32 n, u32 index, sector_t goal);
+sector_t tfs_find_goal(struct inode *inode, sector_t prev);
+int tfs_data_block_valid(struct tfs_sb_info *si, sector_t block);
+int tfs_alloc_block_run(struct super_block *sb, sector_t goal, u32 count, sector_t *start);
+void tfs_free_blocks(struct super_block *sb, sector_t *blocks, int count);
+void tfs_free_block_range(struct super_block *sb, sector_t start, u32 count);
+void tfs_free_inode(struct super_block *sb, unsigned int ino);
 
 #endif
 
@@ -0,0 +1,180 @@
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/highmem.h>
+#include <linux/pagemap.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+
+#include "tfs_module.h"
+
+struct tfs_compact_work
+{
+  struct work_struct work;
+  struct inode *dir;
+};
+
+/* slot 'n' of a directory; its page is kept mapped in *pagep across calls */
+static struct tfs_dentry *tfs_dir_slot(struct inode *dir, unsigned long n, struct page **pagep)
+{
+  unsigned long per_page = PAGE_CACHE_SIZE / sizeof(struct tfs_dentry);
+  struct page *page = *pagep;
+
+  if (!page || page->index != n / per_page)
+    {
+      if (page)
+	{
+	  kunmap(page);
+	  page_cache_release(page);
+	  *pagep = NULL;
+	}
+
+      page = read_mapping_page(dir->i_mapping, n / per_page, NULL);
+      if (IS_ERR(page))
+	return ERR_CAST(page);
+      kmap(page);
+      *pagep = page;
+    }
+
+  return (struct tfs_dentry *) page_address(page) + n % per_page;
+}
+
+/*
+ * Move the live entries of a directory down over the free slots and cut
+ * it to the blocks they fill. Called with i_mutex held and the directory
+ * not open anywhere, so no readdir position is left pointing at an entry
+ * that moved. Every entry is cleared from its old slot as it is copied,
+ * so an error part way leaves no duplicate behind.
+ */
+static int tfs_compact_dir(struct inode *dir)
+{
+  unsigned long blocksize = dir->i_sb->s_blocksize;
+  unsigned long per_block = blocksize / sizeof(struct tfs_dentry);
+  unsigned long nslots = dir->i_size / sizeof(struct tfs_dentry);
+  unsigned long r, w, live = 0;
+  struct page *rpage = NULL, *wpage = NULL;
+  struct tfs_dentry *rtd, *wtd;
+  loff_t size;
+  int err = 0;
+
+  for (r = 0; r < nslots; ++r)
+    {
+      rtd = tfs_dir_slot(dir, r, &rpage);
+      if (IS_ERR(rtd))
+	{
+	  err = PTR_ERR(rtd);
+	  goto out;
+	}
+      if (rtd->inode)
+	++live;
+    }
+
+  size = (loff_t) ((live + per_block - 1) / per_block) * blocksize;
+  if (size < blocksize)
+    size = blocksize;
+  if (size >= dir->i_size)
+    goto out;
+
+  for (r = w = 0; r < nslots; ++r)
+    {
+      rtd = tfs_dir_slot(dir, r, &rpage);
+      if (IS_ERR(rtd))
+	{
+	  err = PTR_ERR(rtd);
+	  goto out;
+	}
+      if (!rtd->inode)
+	continue;
+
+      if (r != w)
+	{
+	  wtd = tfs_dir_slot(dir, w, &wpage);
+	  if (IS_ERR(wtd))
+	    {
+	      err = PTR_ERR(wtd);
+	      goto out;
+	    }
+
+	  lock_page(wpage);
+	  memcpy(wtd, rtd, sizeof(*wtd));
+	  set_page_dirty(wpage);
+	  if (rpage != wpage)
+	    {
+	      unlock_page(wpage);
+	      lock_page(rpage);
+	    }
+	  memset(rtd, 0, sizeof(*rtd));
+	  set_page_dirty(rpage);
+	  unlock_page(rpage);
+	}
+      ++w;
+    }
+
+  printk("TFS: compacted directory %u from %u to %u blocks\n", (unsigned) dir->i_ino,
+	 (unsigned) (dir->i_size / blocksize), (unsigned) (size / blocksize));
+  tfs_dir_set_size(dir, size);
+
+ out:
+  if (rpage)
+    {
+      kunmap(rpage);
+      page_cache_release(rpage);
+    }
+  if (wpage)
+    {
+      kunmap(wpage);
+      page_cache_release(wpage);
+    }
+  return err;
+}
+
+static void tfs_compact_work_fn(struct work_struct *work)
+{
+  struct tfs_compact_work *cw = container_of(work, struct tfs_compact_work, work);
+  struct inode *dir = cw->dir;
+  struct tfs_inode_info *ti = TFS_INODE(dir);
+
+  mutex_lock(&dir->i_mutex);
+  clear_bit(TFS_DIR_COMPACT_QUEUED, &ti->state);
+  if (atomic_read(&ti->dir_opens))
+    set_bit(TFS_DIR_COMPACT_WANTED, &ti->state);
+  else if (dir->i_nlink)
+    tfs_compact_dir(dir);
+  mutex_unlock(&dir->i_mutex);
+
+  iput(dir);
+  kfree(cw);
+}
+
+/*
+ * Called after entries were removed. While the directory is open the
+ * compaction is only noted, and queued when the last handle goes.
+ */
+void tfs_queue_compact(struct inode *dir)
+{
+  struct tfs_sb_info *si = dir->i_sb->s_fs_info;
+  struct tfs_inode_info *ti = TFS_INODE(dir);
+  struct tfs_compact_work *cw;
+
+  if (dir->i_size <= dir->i_sb->s_blocksize)
+    return;
+
+  if (atomic_read(&ti->dir_opens))
+    {
+      set_bit(TFS_DIR_COMPACT_WANTED, &ti->state);
+      return;
+    }
+
+  if (test_and_set_bit(TFS_DIR_COMPACT_QUEUED, &ti->state))
+    return;
+
+  if (!(cw = kmalloc(sizeof(*cw), GFP_NOFS)) || !(cw->dir = igrab(dir)))
+    {
+      kfree(cw);
+      clear_bit(TFS_DIR_COMPACT_QUEUED, &ti->state);
+      return;
+    }
+
+  clear_bit(TFS_DIR_COMPACT_WANTED, &ti->state);
+  INIT_WORK(&cw->work, tfs_compact_work_fn);
+  queue_work(si->free_wq, &cw->work);
+}
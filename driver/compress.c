@@ -0,0 +1,570 @@
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/highmem.h>
+#include <linux/pagemap.h>
+#include <linux/buffer_head.h>
+#include <linux/lzo.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+
+#include "tfs_module.h"
+#include "alloc.h"
+
+struct tfs_compress_work
+{
+  struct work_struct work;
+  struct inode *inode;
+};
+
+/* the last cluster decompressed by a readpages call, and room to read one */
+struct tfs_cluster_buf
+{
+  sector_t first;
+  u8 *data;
+  u8 *in;
+};
+
+static inline sector_t tfs_cluster_start(struct tfs_sb_info *si, sector_t lblock)
+{
+  return lblock - (lblock - TFS_DATA_BLOCKS_PER_INODE) % si->cluster_blocks;
+}
+
+/*
+ * Find the block map entries of the cluster holding 'lblock', which is
+ * past the direct blocks. *bhp is set to the indirect block holding
+ * them and *e to the first, or *bhp to NULL if the cluster has no
+ * indirect block. Returns tfs_cluster_compressed_blocks() of it.
+ */
+static int tfs_cluster_entries(struct inode *inode, sector_t lblock, struct buffer_head **bhp, u32 **e)
+{
+  struct tfs_inode_info *ti = TFS_INODE(inode);
+  struct tfs_sb_info *si = inode->i_sb->s_fs_info;
+  sector_t rel = tfs_cluster_start(si, lblock) - TFS_DATA_BLOCKS_PER_INODE;
+  struct buffer_head *bh;
+  u32 indirect_block;
+
+  *bhp = NULL;
+  if (!ti->root_indirect_data_block || rel / si->addr_per_block >= si->addr_per_block)
+    return 0;
+
+  if (!(bh = sb_bread(inode->i_sb, ti->root_indirect_data_block)))
+    return -EIO;
+  indirect_block = *((u32 *) bh->b_data + rel / si->addr_per_block);
+  brelse(bh);
+
+  if (!indirect_block)
+    return 0;
+  if (!(bh = sb_bread(inode->i_sb, indirect_block)))
+    return -EIO;
+
+  *bhp = bh;
+  *e = (u32 *) bh->b_data + rel % si->addr_per_block;
+
+  return tfs_cluster_compressed_blocks(*e, si->cluster_blocks);
+}
+
+/* decompress the cluster stored in blocks[0 .. m - 1] into 'out' */
+static int tfs_decompress_cluster(struct super_block *sb, const u32 *blocks, u32 m, u8 *in, u8 *out)
+{
+  struct tfs_sb_info *si = sb->s_fs_info;
+  size_t len = si->cluster_blocks << sb->s_blocksize_bits;
+  struct buffer_head *bh;
+  u32 i, clen;
+
+  for (i = 0; i < m; ++i)
+    {
+      if (!tfs_data_block_valid(si, blocks[i]) || !(bh = tfs_read_data_block(sb, blocks[i])))
+	return -EIO;
+      memcpy(in + (i << sb->s_blocksize_bits), bh->b_data, sb->s_blocksize);
+      tfs_forget_data_block(bh);
+    }
+
+  clen = *(u32 *) in;
+  if (clen > (m << sb->s_blocksize_bits) - sizeof(u32) ||
+      lzo1x_decompress_safe(in + sizeof(u32), clen, out, &len) != LZO_E_OK ||
+      len != si->cluster_blocks << sb->s_blocksize_bits)
+    {
+      printk("TFS: corrupt compressed cluster at block %u\n", blocks[0]);
+      return -EIO;
+    }
+
+  return 0;
+}
+
+/* write 'count' blocks from 'data' to 'blocks' and wait for them */
+static int tfs_write_cluster_blocks(struct super_block *sb, const sector_t *blocks, u32 count, const u8 *data)
+{
+  struct buffer_head *bhs[TFS_MAX_CLUSTER_BLOCKS];
+  u32 i, n;
+  int err = 0;
+
+  for (n = 0; n < count; ++n)
+    {
+      if (!(bhs[n] = sb_getblk(sb, blocks[n])))
+	{
+	  err = -EIO;
+	  break;
+	}
+      lock_buffer(bhs[n]);
+      memcpy(bhs[n]->b_data, data + (n << sb->s_blocksize_bits), sb->s_blocksize);
+      set_buffer_uptodate(bhs[n]);
+      unlock_buffer(bhs[n]);
+      mark_buffer_dirty(bhs[n]);
+    }
+
+  if (n)
+    ll_rw_block(SWRITE, n, bhs);
+
+  for (i = 0; i < n; ++i)
+    {
+      wait_on_buffer(bhs[i]);
+      if (!buffer_uptodate(bhs[i]))
+	err = -EIO;
+      tfs_forget_data_block(bhs[i]);
+    }
+
+  return err;
+}
+
+/*
+ * Store the compressed cluster whose first entry is 'e' raw again,
+ * before part of it is rewritten: decompress it into new blocks, which
+ * are on disk before the block map points at them, and free the blocks
+ * of the compressed data. Called with the map lock of the indirect
+ * block held.
+ */
+int tfs_expand_cluster(struct inode *inode, struct buffer_head *id_bh, u32 *e)
+{
+  struct super_block *sb = inode->i_sb;
+  struct tfs_sb_info *si = sb->s_fs_info;
+  u32 cb = si->cluster_blocks, m, i;
+  sector_t old[TFS_MAX_CLUSTER_BLOCKS], blocks[TFS_MAX_CLUSTER_BLOCKS], goal;
+  u8 *in, *out;
+  int err;
+
+  if (!(m = tfs_cluster_compressed_blocks(e, cb)))
+    return 0;
+
+  in = kmalloc(cb << sb->s_blocksize_bits, GFP_NOFS);
+  out = kmalloc(cb << sb->s_blocksize_bits, GFP_NOFS);
+  err = -ENOMEM;
+  if (!in || !out)
+    goto out;
+
+  if ((err = tfs_decompress_cluster(sb, e, m, in, out)))
+    goto out;
+
+  goal = tfs_find_goal(inode, e[0]);
+  for (i = 0; i < cb; ++i)
+    {
+      if ((err = tfs_alloc_block_run(sb, goal, 1, &blocks[i])))
+	break;
+      goal = blocks[i] + 1;
+    }
+  if (!err)
+    err = tfs_write_cluster_blocks(sb, blocks, cb, out);
+  if (err)
+    {
+      tfs_free_blocks(sb, blocks, i);
+      goto out;
+    }
+
+  for (i = 0; i < cb; ++i)
+    {
+      if (i < m)
+	old[i] = e[i];
+      e[i] = blocks[i];
+    }
+  mark_buffer_dirty(id_bh);
+  tfs_free_blocks(sb, old, m);
+
+  spin_lock(&inode->i_lock);
+  inode->i_blocks += cb - m;
+  spin_unlock(&inode->i_lock);
+  tfs_drop_cached_blocks(TFS_INODE(inode));
+  mark_inode_dirty(inode);
+
+ out:
+  kfree(in);
+  kfree(out);
+  return err;
+}
+
+/* expand the cluster holding 'lblock' if it is compressed; for truncate */
+int tfs_expand_cluster_at(struct inode *inode, sector_t lblock)
+{
+  struct tfs_sb_info *si = inode->i_sb->s_fs_info;
+  struct buffer_head *bh;
+  struct mutex *map_lock;
+  u32 *e;
+  int err;
+
+  if (lblock < TFS_DATA_BLOCKS_PER_INODE || !tfs_inode_compressed(inode))
+    return 0;
+
+  map_lock = tfs_map_lock(inode, (lblock - TFS_DATA_BLOCKS_PER_INODE) / si->addr_per_block + 1);
+  mutex_lock(map_lock);
+  err = tfs_cluster_entries(inode, lblock, &bh, &e);
+  if (err > 0)
+    err = tfs_expand_cluster(inode, bh, e);
+  if (bh)
+    brelse(bh);
+  mutex_unlock(map_lock);
+
+  return err;
+}
+
+/*
+ * Fill one page of a file with compressed clusters. A page lies within
+ * one cluster; pages of raw clusters and of the direct blocks are read
+ * as usual.
+ */
+static int tfs_fill_page(struct inode *inode, struct page *page, struct tfs_cluster_buf *cbuf)
+{
+  struct super_block *sb = inode->i_sb;
+  struct tfs_sb_info *si = sb->s_fs_info;
+  sector_t lblock = (sector_t) page->index << (PAGE_CACHE_SHIFT - inode->i_blkbits);
+  u32 blocks[TFS_MAX_CLUSTER_BLOCKS];
+  struct buffer_head *bh;
+  char *kaddr;
+  u32 *e;
+  int m;
+
+  if (lblock < TFS_DATA_BLOCKS_PER_INODE || lblock >= (i_size_read(inode) >> inode->i_blkbits))
+    return mpage_readpage(page, tfs_getblocks);
+
+  if (cbuf->first != tfs_cluster_start(si, lblock))
+    {
+      m = tfs_cluster_entries(inode, lblock, &bh, &e);
+      if (m > 0)
+	memcpy(blocks, e, m * sizeof(u32));
+      if (bh)
+	brelse(bh);
+
+      if (m < 0)
+	{
+	  unlock_page(page);
+	  return m;
+	}
+      if (!m)
+	return mpage_readpage(page, tfs_getblocks);
+
+      cbuf->first = 0;
+      if ((m = tfs_decompress_cluster(sb, blocks, m, cbuf->in, cbuf->data)))
+	{
+	  unlock_page(page);
+	  return m;
+	}
+      cbuf->first = tfs_cluster_start(si, lblock);
+    }
+
+  kaddr = kmap(page);
+  memcpy(kaddr, cbuf->data + ((lblock - cbuf->first) << inode->i_blkbits), PAGE_CACHE_SIZE);
+  kunmap(page);
+  flush_dcache_page(page);
+  SetPageUptodate(page);
+  unlock_page(page);
+
+  return 0;
+}
+
+static int tfs_cluster_buf_init(struct super_block *sb, struct tfs_cluster_buf *cbuf)
+{
+  struct tfs_sb_info *si = sb->s_fs_info;
+
+  cbuf->first = 0;
+  cbuf->data = kmalloc(si->cluster_blocks << sb->s_blocksize_bits, GFP_NOFS);
+  cbuf->in = kmalloc(si->cluster_blocks << sb->s_blocksize_bits, GFP_NOFS);
+  if (!cbuf->data || !cbuf->in)
+    {
+      kfree(cbuf->data);
+      kfree(cbuf->in);
+      return -ENOMEM;
+    }
+
+  return 0;
+}
+
+static void tfs_cluster_buf_free(struct tfs_cluster_buf *cbuf)
+{
+  kfree(cbuf->data);
+  kfree(cbuf->in);
+}
+
+int tfs_compressed_readpage(struct file *file, struct page *page)
+{
+  struct inode *inode = page->mapping->host;
+  struct tfs_cluster_buf cbuf;
+  int err;
+
+  if ((err = tfs_cluster_buf_init(inode->i_sb, &cbuf)))
+    {
+      unlock_page(page);
+      return err;
+    }
+
+  err = tfs_fill_page(inode, page, &cbuf);
+  tfs_cluster_buf_free(&cbuf);
+
+  return err;
+}
+
+static int tfs_fill_page_cb(void *data, struct page *page)
+{
+  return tfs_fill_page(page->mapping->host, page, data);
+}
+
+/* readahead decompresses each cluster once for all of its pages */
+int tfs_compressed_readpages(struct file *file, struct address_space *mapping, struct list_head *pages, unsigned nr_pages)
+{
+  struct tfs_cluster_buf cbuf;
+  int err;
+
+  if ((err = tfs_cluster_buf_init(mapping->host->i_sb, &cbuf)))
+    return err;
+
+  err = read_cache_pages(mapping, pages, tfs_fill_page_cb, &cbuf);
+  tfs_cluster_buf_free(&cbuf);
+
+  return err;
+}
+
+static void tfs_unlock_cluster_pages(struct page **pages, int n)
+{
+  while (n-- > 0)
+    {
+      unlock_page(pages[n]);
+      page_cache_release(pages[n]);
+    }
+}
+
+/*
+ * Read in and lock the pages of the cluster starting at 'first', and
+ * drop their buffers, which map the raw blocks. Returns the number of
+ * pages locked, or 0 if a page is dirty or its buffers are busy, in
+ * which case the cluster is left raw.
+ */
+static int tfs_lock_cluster_pages(struct inode *inode, sector_t first, struct page **pages)
+{
+  struct tfs_sb_info *si = inode->i_sb->s_fs_info;
+  pgoff_t index = (first << inode->i_blkbits) >> PAGE_CACHE_SHIFT;
+  int i, n = (si->cluster_blocks << inode->i_blkbits) >> PAGE_CACHE_SHIFT;
+  struct page *page;
+
+  for (i = 0; i < n; ++i)
+    {
+      page = read_mapping_page(inode->i_mapping, index + i, NULL);
+      if (IS_ERR(page))
+	{
+	  tfs_unlock_cluster_pages(pages, i);
+	  return PTR_ERR(page);
+	}
+
+      lock_page(page);
+      pages[i] = page;
+      if (page->mapping != inode->i_mapping || !PageUptodate(page) || PageDirty(page) || PageWriteback(page) ||
+	  (page_has_buffers(page) && !try_to_release_page(page, 0)))
+	{
+	  tfs_unlock_cluster_pages(pages, i + 1);
+	  return 0;
+	}
+    }
+
+  return n;
+}
+
+/*
+ * Compress the cluster starting at 'first' if that saves at least a
+ * block. Clusters already compressed, or with holes, are left alone.
+ * The cluster's pages stay locked, without buffers, until the block
+ * map points at the compressed blocks, so nothing reads or writes the
+ * raw blocks once they are freed. Returns the number of blocks saved.
+ */
+static int tfs_compress_cluster(struct inode *inode, sector_t first, u8 *data, u8 *out, void *wrkmem)
+{
+  struct super_block *sb = inode->i_sb;
+  struct tfs_sb_info *si = sb->s_fs_info;
+  struct tfs_inode_info *ti = TFS_INODE(inode);
+  u32 cb = si->cluster_blocks, m, i;
+  size_t len = cb << sb->s_blocksize_bits, clen;
+  sector_t old[TFS_MAX_CLUSTER_BLOCKS], start, blocks[TFS_MAX_CLUSTER_BLOCKS];
+  struct page *pages[TFS_MAX_CLUSTER_BLOCKS];
+  struct buffer_head *bh;
+  struct mutex *map_lock;
+  char *kaddr;
+  u32 *e;
+  int err, npages;
+
+  /* a cheap look first, so that a second pass over the file reads nothing */
+  err = tfs_cluster_entries(inode, first, &bh, &e);
+  for (i = 0; !err && bh && i < cb && e[i]; ++i)
+    ;
+  if (bh)
+    brelse(bh);
+  if (err || i < cb)
+    return err < 0 ? err : 0;
+
+  if ((npages = tfs_lock_cluster_pages(inode, first, pages)) <= 0)
+    return npages;
+
+  for (i = 0; i < npages; ++i)
+    {
+      kaddr = kmap(pages[i]);
+      memcpy(data + (i << PAGE_CACHE_SHIFT), kaddr, PAGE_CACHE_SIZE);
+      kunmap(pages[i]);
+    }
+
+  if (lzo1x_1_compress(data, len, out + sizeof(u32), &clen, wrkmem) != LZO_E_OK)
+    {
+      err = -EIO;
+      goto unlock;
+    }
+  *(u32 *) out = clen;
+  m = (clen + sizeof(u32) + sb->s_blocksize - 1) >> sb->s_blocksize_bits;
+  if (m >= cb)
+    {
+      err = 0;
+      goto unlock;
+    }
+  memset(out + sizeof(u32) + clen, 0, (m << sb->s_blocksize_bits) - sizeof(u32) - clen);
+
+  map_lock = tfs_map_lock(inode, (first - TFS_DATA_BLOCKS_PER_INODE) / si->addr_per_block + 1);
+  mutex_lock(map_lock);
+
+  err = tfs_cluster_entries(inode, first, &bh, &e);
+  for (i = 0; !err && bh && i < cb && e[i]; ++i)
+    ;
+  if (err || i < cb)
+    {
+      err = err < 0 ? err : 0;
+      goto out;
+    }
+
+  if ((err = tfs_alloc_block_run(sb, tfs_find_goal(inode, e[0]), m, &start)))
+    goto out;
+  for (i = 0; i < m; ++i)
+    blocks[i] = start + i;
+  if ((err = tfs_write_cluster_blocks(sb, blocks, m, out)))
+    {
+      tfs_free_block_range(sb, start, m);
+      goto out;
+    }
+
+  for (i = 0; i < cb; ++i)
+    {
+      old[i] = e[i];
+      e[i] = i < m ? start + i : TFS_COMPRESSED_BLOCK;
+    }
+  mark_buffer_dirty(bh);
+  tfs_free_blocks(sb, old, cb);
+
+  spin_lock(&inode->i_lock);
+  inode->i_blocks -= cb - m;
+  spin_unlock(&inode->i_lock);
+  ti->flags |= TFS_INODE_COMPRESSED;
+  tfs_drop_cached_blocks(ti);
+  mark_inode_dirty(inode);
+  err = cb - m;
+
+ out:
+  if (bh)
+    brelse(bh);
+  mutex_unlock(map_lock);
+ unlock:
+  tfs_unlock_cluster_pages(pages, npages);
+
+  return err;
+}
+
+/*
+ * Compress every whole cluster below i_size. Called with i_mutex and
+ * truncate_sem held, so that no write() changes the file meanwhile; the
+ * partial cluster at the end stays raw for appends to fill.
+ */
+static void tfs_compress_file(struct inode *inode)
+{
+  struct super_block *sb = inode->i_sb;
+  struct tfs_sb_info *si = sb->s_fs_info;
+  sector_t first, nblocks = i_size_read(inode) >> inode->i_blkbits;
+  size_t len = si->cluster_blocks << sb->s_blocksize_bits;
+  unsigned long saved = 0;
+  u8 *data, *out;
+  void *wrkmem;
+  int ret;
+
+  if (filemap_write_and_wait(inode->i_mapping))
+    return;
+
+  data = kmalloc(len, GFP_NOFS);
+  out = kmalloc(lzo1x_worst_compress(len) + sizeof(u32), GFP_NOFS);
+  wrkmem = vmalloc(LZO1X_MEM_COMPRESS);
+  if (!data || !out || !wrkmem)
+    goto out;
+
+  for (first = TFS_DATA_BLOCKS_PER_INODE; first + si->cluster_blocks <= nblocks; first += si->cluster_blocks)
+    {
+      if ((ret = tfs_compress_cluster(inode, first, data, out, wrkmem)) < 0)
+	{
+	  printk("TFS: compressing inode %u stopped at block %u: %d\n",
+		 (unsigned) inode->i_ino, (unsigned) first, ret);
+	  break;
+	}
+      saved += ret;
+      cond_resched();
+    }
+
+  printk("TFS: compressed inode %u, %lu blocks saved\n", (unsigned) inode->i_ino, saved);
+
+ out:
+  kfree(data);
+  kfree(out);
+  vfree(wrkmem);
+}
+
+static void tfs_compress_work_fn(struct work_struct *work)
+{
+  struct tfs_compress_work *cw = container_of(work, struct tfs_compress_work, work);
+  struct inode *inode = cw->inode;
+  struct tfs_inode_info *ti = TFS_INODE(inode);
+
+  mutex_lock(&inode->i_mutex);
+  clear_bit(TFS_COMPRESS_QUEUED, &ti->state);
+  if (inode->i_nlink && (ti->flags & TFS_INODE_COMPRESS))
+    {
+      down_write(&ti->truncate_sem);
+      tfs_compress_file(inode);
+      up_write(&ti->truncate_sem);
+    }
+  mutex_unlock(&inode->i_mutex);
+
+  iput(inode);
+  kfree(cw);
+}
+
+/* called when the last writer closes a file to be compressed */
+void tfs_queue_compress(struct inode *inode)
+{
+  struct tfs_sb_info *si = inode->i_sb->s_fs_info;
+  struct tfs_inode_info *ti = TFS_INODE(inode);
+  struct tfs_compress_work *cw;
+
+  if (!si->cluster_blocks || (inode->i_sb->s_flags & MS_RDONLY))
+    return;
+  if (i_size_read(inode) < ((loff_t) (TFS_DATA_BLOCKS_PER_INODE + si->cluster_blocks) << inode->i_blkbits))
+    return;
+
+  if (test_and_set_bit(TFS_COMPRESS_QUEUED, &ti->state))
+    return;
+
+  if (!(cw = kmalloc(sizeof(*cw), GFP_NOFS)) || !(cw->inode = igrab(inode)))
+    {
+      kfree(cw);
+      clear_bit(TFS_COMPRESS_QUEUED, &ti->state);
+      return;
+    }
+
+  INIT_WORK(&cw->work, tfs_compress_work_fn);
+  queue_work(si->free_wq, &cw->work);
+}
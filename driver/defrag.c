@@ -0,0 +1,328 @@
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/highmem.h>
+#include <linux/pagemap.h>
+#include <linux/buffer_head.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+
+#include "tfs_module.h"
+#include "alloc.h"
+
+/*
+ * Where the pointers of logical blocks lblock .. lblock + count - 1 live:
+ * the inode's direct blocks or one indirect block, returned in *bhp.
+ */
+static int tfs_defrag_slots(struct inode *inode, sector_t lblock, u32 count, sector_t *old,
+			    struct buffer_head **bhp)
+{
+  struct tfs_inode_info *ti = TFS_INODE(inode);
+  struct tfs_sb_info *si = inode->i_sb->s_fs_info;
+  struct buffer_head *rid_bh;
+  sector_t rel;
+  u32 indirect_block, *id, i;
+
+  *bhp = NULL;
+
+  if (lblock < TFS_DATA_BLOCKS_PER_INODE)
+    {
+      for (i = 0; i < count; ++i)
+	old[i] = ti->data_blocks[lblock + i];
+      return 0;
+    }
+
+  if (!ti->root_indirect_data_block)
+    return -EINVAL;
+
+  rel = lblock - TFS_DATA_BLOCKS_PER_INODE;
+  if (!(rid_bh = sb_bread(inode->i_sb, ti->root_indirect_data_block)))
+    return -EIO;
+  indirect_block = *((u32 *) rid_bh->b_data + rel / si->addr_per_block);
+  brelse(rid_bh);
+
+  if (!indirect_block)
+    return -EINVAL;
+  if (!(*bhp = sb_bread(inode->i_sb, indirect_block)))
+    return -EIO;
+
+  id = (u32 *) (*bhp)->b_data + rel % si->addr_per_block;
+  for (i = 0; i < count; ++i)
+    old[i] = id[i];
+
+  return 0;
+}
+
+static void tfs_defrag_unlock_pages(struct page **pages, int n)
+{
+  while (n-- > 0)
+    {
+      unlock_page(pages[n]);
+      page_cache_release(pages[n]);
+    }
+}
+
+/*
+ * Lock the pages holding blocks lblock .. lblock + count - 1, in index
+ * order, reading them in first. While they are locked no readpage or
+ * writepage can use the chunk's mapping, so it can be switched over.
+ */
+static int tfs_defrag_lock_pages(struct inode *inode, sector_t lblock, u32 count, struct page **pages)
+{
+  unsigned int shift = PAGE_CACHE_SHIFT - inode->i_blkbits;
+  pgoff_t index, last = (lblock + count - 1) >> shift;
+  int n = 0;
+
+  for (index = lblock >> shift; index <= last; ++index)
+    {
+      struct page *page = read_mapping_page(inode->i_mapping, index, NULL);
+
+      if (IS_ERR(page))
+	{
+	  tfs_defrag_unlock_pages(pages, n);
+	  return PTR_ERR(page);
+	}
+
+      lock_page(page);
+      if (!PageUptodate(page))
+	{
+	  unlock_page(page);
+	  page_cache_release(page);
+	  tfs_defrag_unlock_pages(pages, n);
+	  return -EIO;
+	}
+      pages[n++] = page;
+    }
+
+  return n;
+}
+
+/* copy the blocks from the locked pages to the donor run and wait for them */
+static int tfs_defrag_copy(struct inode *inode, sector_t lblock, u32 count, sector_t donor,
+			   struct buffer_head **bhs, struct page **pages)
+{
+  struct super_block *sb = inode->i_sb;
+  unsigned int per_page = PAGE_CACHE_SIZE >> inode->i_blkbits;
+  sector_t first = lblock / per_page;
+  char *kaddr;
+  u32 i, n = 0;
+  int err = 0;
+
+  for (i = 0; i < count; ++i)
+    {
+      sector_t b = lblock + i;
+      struct page *page = pages[b / per_page - first];
+
+      if (!(bhs[n] = sb_getblk(sb, donor + i)))
+	{
+	  err = -EIO;
+	  break;
+	}
+
+      kaddr = kmap(page);
+      lock_buffer(bhs[n]);
+      memcpy(bhs[n]->b_data, kaddr + ((b % per_page) << inode->i_blkbits), sb->s_blocksize);
+      set_buffer_uptodate(bhs[n]);
+      unlock_buffer(bhs[n]);
+      mark_buffer_dirty(bhs[n]);
+      kunmap(page);
+      ++n;
+    }
+
+  if (n)
+    ll_rw_block(SWRITE, n, bhs);
+
+  for (i = 0; i < n; ++i)
+    {
+      wait_on_buffer(bhs[i]);
+      if (!buffer_uptodate(bhs[i]))
+	err = -EIO;
+      brelse(bhs[i]);
+    }
+
+  return err;
+}
+
+/*
+ * Point the buffers of the locked pages that map the chunk at the donor
+ * run, so a page dirtied through mmap is written back to the new blocks.
+ */
+static void tfs_defrag_remap_pages(struct inode *inode, sector_t lblock, u32 count, sector_t donor,
+				   struct page **pages, int npages)
+{
+  unsigned int per_page = PAGE_CACHE_SIZE >> inode->i_blkbits;
+  struct buffer_head *bh, *head;
+  sector_t b;
+  int i;
+
+  for (i = 0; i < npages; ++i)
+    {
+      if (!page_has_buffers(pages[i]))
+	continue;
+
+      b = (sector_t) pages[i]->index * per_page;
+      bh = head = page_buffers(pages[i]);
+      do
+	{
+	  if (b >= lblock && b < lblock + count && buffer_mapped(bh))
+	    bh->b_blocknr = donor + (b - lblock);
+	  ++b;
+	  bh = bh->b_this_page;
+	}
+      while (bh != head);
+    }
+}
+
+/*
+ * Move one chunk of a file into a contiguous donor run, preferably right
+ * after the previous chunk. A chunk never spans more than one indirect
+ * block. Chunks that are already contiguous, or have unmapped blocks,
+ * are left alone. Returns the number of blocks moved.
+ */
+static int tfs_defrag_chunk(struct inode *inode, sector_t lblock, u32 count, sector_t *goal,
+			    sector_t *old, struct buffer_head **bhs, struct page **pages)
+{
+  struct tfs_inode_info *ti = TFS_INODE(inode);
+  struct super_block *sb = inode->i_sb;
+  struct buffer_head *id_bh;
+  sector_t donor;
+  u32 *id, i;
+  int err, npages = 0, fragmented = 0;
+
+  if ((err = tfs_defrag_slots(inode, lblock, count, old, &id_bh)))
+    return err == -EINVAL ? 0 : err;
+
+  for (i = 0; i < count; ++i)
+    {
+      if (!old[i])
+	goto out;
+      if (i && old[i] != old[i - 1] + 1)
+	fragmented = 1;
+    }
+
+  if (!fragmented)
+    {
+      *goal = old[count - 1] + 1;
+      goto out;
+    }
+
+  if ((err = npages = tfs_defrag_lock_pages(inode, lblock, count, pages)) < 0)
+    {
+      npages = 0;
+      goto out;
+    }
+
+  if ((err = tfs_alloc_block_run(sb, *goal ? *goal : tfs_find_goal(inode, 0), count, &donor)))
+    goto out;
+
+  if ((err = tfs_defrag_copy(inode, lblock, count, donor, bhs, pages)))
+    {
+      tfs_free_block_range(sb, donor, count);
+      goto out;
+    }
+
+  /* the donor now holds the data; switch the pointers over to it */
+  if (id_bh)
+    {
+      id = (u32 *) id_bh->b_data + (lblock - TFS_DATA_BLOCKS_PER_INODE) % (sb->s_blocksize / sizeof(u32));
+      for (i = 0; i < count; ++i)
+	id[i] = donor + i;
+      mark_buffer_dirty(id_bh);
+    }
+  else
+    {
+      for (i = 0; i < count; ++i)
+	ti->data_blocks[lblock + i] = donor + i;
+    }
+  tfs_drop_cached_blocks(ti);
+  tfs_defrag_remap_pages(inode, lblock, count, donor, pages, npages);
+  mark_inode_dirty(inode);
+
+  tfs_free_blocks(sb, old, count);
+  *goal = donor + count;
+  err = count;
+
+ out:
+  tfs_defrag_unlock_pages(pages, npages);
+  if (id_bh)
+    brelse(id_bh);
+  return err;
+}
+
+/*
+ * TFS_IOC_DEFRAG: called with i_mutex held, so no write() can change
+ * the mapping. Dirty pages are written back first; each chunk is then
+ * copied from, and switched over under, its locked pages.
+ */
+int tfs_defrag(struct inode *inode, struct tfs_defrag_range *range)
+{
+  struct tfs_sb_info *si = inode->i_sb->s_fs_info;
+  sector_t nblocks, lblock, end, goal = 0, *old;
+  struct buffer_head **bhs;
+  struct page **pages;
+  u32 count;
+  int err = 0, moved;
+
+  range->moved = 0;
+
+  /*
+   * the blocks of a compressed cluster are not the file's blocks, and
+   * with bigalloc a moved block would drag its cluster along
+   */
+  if (tfs_inode_compressed(inode) || si->alloc_bits)
+    return -EOPNOTSUPP;
+
+  nblocks = (i_size_read(inode) + inode->i_sb->s_blocksize - 1) >> inode->i_blkbits;
+  if (range->start >= nblocks)
+    return 0;
+  end = range->len < nblocks - range->start ? range->start + range->len : nblocks;
+
+  if ((err = filemap_write_and_wait(inode->i_mapping)))
+    return err;
+
+  old = kmalloc(TFS_DEFRAG_CHUNK * sizeof(*old), GFP_KERNEL);
+  bhs = kmalloc(TFS_DEFRAG_CHUNK * sizeof(*bhs), GFP_KERNEL);
+  /* a chunk that does not start on a page boundary touches one more page */
+  pages = kmalloc((TFS_DEFRAG_CHUNK + 1) * sizeof(*pages), GFP_KERNEL);
+  if (!old || !bhs || !pages)
+    {
+      err = -ENOMEM;
+      goto out;
+    }
+
+  for (lblock = range->start; lblock < end; lblock += count)
+    {
+      if (lblock < TFS_DATA_BLOCKS_PER_INODE)
+	count = TFS_DATA_BLOCKS_PER_INODE - lblock;
+      else
+	count = si->addr_per_block - (lblock - TFS_DATA_BLOCKS_PER_INODE) % si->addr_per_block;
+      if (count > TFS_DEFRAG_CHUNK)
+	count = TFS_DEFRAG_CHUNK;
+      if (count > end - lblock)
+	count = end - lblock;
+
+      moved = tfs_defrag_chunk(inode, lblock, count, &goal, old, bhs, pages);
+      if (moved < 0)
+	{
+	  err = moved;
+	  break;
+	}
+
+      range->moved += moved;
+
+      if (fatal_signal_pending(current))
+	{
+	  err = -EINTR;
+	  break;
+	}
+      cond_resched();
+    }
+
+  printk("TFS: defrag of inode %u moved %u blocks\n", (unsigned) inode->i_ino, (unsigned) range->moved);
+
+ out:
+  kfree(old);
+  kfree(bhs);
+  kfree(pages);
+
+  return range->moved ? 0 : err;
+}
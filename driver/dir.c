@@ -60,13 +60,35 @@ static struct dentry *tfs_lookup(struct inode *dir, struct dentry *dentry, struc
 }
 
 
+static void tfs_readdir_prefetch(struct inode *dir, struct tfs_dentry *td, char *end)
+{
+  unsigned int inos[TFS_PREFETCH_BATCH];
+  int count = 0;
+
+  for ( ; (char *) (td + 1) <= end; ++td)
+    {
+      if (!td->inode || td->inode == dir->i_ino || td->type == DT_UNKNOWN)
+	continue;
+
+      inos[count++] = td->inode;
+      if (count == TFS_PREFETCH_BATCH)
+	{
+	  tfs_prefetch_inodes(dir->i_sb, inos, count);
+	  count = 0;
+	}
+    }
+
+  if (count)
+    tfs_prefetch_inodes(dir->i_sb, inos, count);
+}
+
 static int tfs_readdir(struct file *file, void *dirent, filldir_t filldir)
 {
   struct inode *inode = file->f_path.dentry->d_inode;
   int npages = (inode->i_size - 1 + PAGE_CACHE_SIZE) >> PAGE_CACHE_SHIFT;
   int cpage = file->f_pos >> PAGE_CACHE_SHIFT;
   int offset = file->f_pos & ~PAGE_CACHE_MASK;
-  int j, ret;
+  int ret;
   struct tfs_dentry *td;
   char *addr;
 
@@ -82,13 +104,17 @@ static int tfs_readdir(struct file *file, void *dirent, filldir_t filldir)
 	  return -EIO;
 
       kmap(page);
-      addr = (char *)page_address(page) + offset;
-      for (j = 0, td = (struct tfs_dentry *) addr; j <= (PAGE_CACHE_SIZE / sizeof(struct tfs_dentry)) - sizeof(struct tfs_dentry) && file->f_pos < inode->i_size; ++j, ++td)
+      addr = (char *)page_address(page);
+      tfs_readdir_prefetch(inode, (struct tfs_dentry *) (addr + offset),
+			   addr + min_t(loff_t, PAGE_CACHE_SIZE, inode->i_size - ((loff_t) cpage << PAGE_CACHE_SHIFT)));
+      for (td = (struct tfs_dentry *) (addr + offset); (char *) (td + 1) <= addr + PAGE_CACHE_SIZE && file->f_pos < inode->i_size; ++td)
 	{
-	  file->f_pos += sizeof(struct tfs_dentry);
 	  if (td->type == DT_UNKNOWN)
-	    continue;
-	  offset = (char *) td  - addr;
+	    {
+	      file->f_pos += sizeof(struct tfs_dentry);
+	      continue;
+	    }
+	  offset = (char *) td - addr;
 	  ret = filldir(dirent, td->name, td->len, (cpage << PAGE_CACHE_SHIFT) | offset, td->inode, td->type);
 	  if (ret)
 	    {
@@ -97,6 +123,7 @@ static int tfs_readdir(struct file *file, void *dirent, filldir_t filldir)
 
 	      return 0;
 	    }
+	  file->f_pos += sizeof(struct tfs_dentry);
 	}
 
       kunmap(page);
@@ -185,10 +212,7 @@ int tfs_find_dentry(struct inode *dir, struct dentry *dentry, struct tfs_alloc_i
 	continue;
 
       kmap(page);
-      if (i != (npages - 1) || dir->i_size == PAGE_CACHE_SIZE)
-	lastbyte_in_page = PAGE_CACHE_SIZE;
-      else
-	lastbyte_in_page = dir->i_size % PAGE_CACHE_SIZE;
+      lastbyte_in_page = min_t(loff_t, PAGE_CACHE_SIZE, dir->i_size - ((loff_t) i << PAGE_CACHE_SHIFT));
 
       addr = page_address(page);
       for (td = (struct tfs_dentry *) addr; (char *) td < (addr + lastbyte_in_page); ++td)
@@ -221,7 +245,8 @@ int tfs_find_dentry(struct inode *dir, struct dentry *dentry, struct tfs_alloc_i
 
   if (tai->slot_page == -1)
     {
-      return -ENOSPC;
+      tai->slot_page = dir->i_size >> PAGE_CACHE_SHIFT;
+      tai->slot_idx = dir->i_size & ~PAGE_CACHE_MASK;
     }
 
   return 0;
@@ -387,6 +412,230 @@ err_dec_link:
   goto err;
 }
 
+/*
+ * Targets that fit in the inode are stored there; longer ones, up to a
+ * block, go in the first data block through page_symlink().
+ */
+int tfs_symlink(struct inode *dir, struct dentry *dentry, const char *symname)
+{
+  struct tfs_alloc_inode_info tai;
+  struct inode *inode_new = NULL;
+  unsigned int l = strlen(symname) + 1;
+  int err;
+
+  printk("TFS: tfs_symlink: %u\n", (unsigned int) dir->i_ino);
+
+  if (l > dir->i_sb->s_blocksize)
+    return -ENAMETOOLONG;
+
+  tfs_init_alloc_inode_info(tai);
+
+  err = tfs_find_dentry(dir, dentry, &tai);
+  if (err)
+    {
+      printk("TFS: error in tfs_find_dentry: %d\n", err);
+      return err;
+    }
+
+  inode_new = tfs_new_inode(dir, &tai, S_IFLNK | S_IRWXUGO);
+  if (!inode_new)
+    {
+      printk("TFS: error tfs_new_inode: %d\n", tai.err);
+      return tai.err;
+    }
+
+  if (l > TFS_FAST_SYMLINK_LEN)
+    {
+      inode_new->i_op = &page_symlink_inode_operations;
+      err = page_symlink(inode_new, symname, l);
+      if (err)
+	goto err;
+    }
+  else
+    {
+      memcpy(TFS_INODE(inode_new)->fast_symlink, symname, l);
+      inode_new->i_size = l - 1;
+    }
+  mark_inode_dirty(inode_new);
+
+  err = tfs_set_link(dir, inode_new, dentry, tai.slot_page, tai.slot_idx);
+  if (err)
+    {
+      printk("TFS: error in tfs_set_link: %d\n", err);
+      goto err;
+    }
+
+  d_instantiate(dentry, inode_new);
+  tfs_release_inode_info_blocks(&tai);
+
+  return 0;
+
+ err:
+  /* dropping the last link frees the inode and any block it got */
+  inode_dec_link_count(inode_new);
+  iput(inode_new);
+  tfs_release_inode_info_blocks(&tai);
+  return err;
+}
+
+static int tfs_delete_entry(struct inode *dir, int slot_page, int slot_idx)
+{
+  loff_t pos = ((loff_t) slot_page << PAGE_CACHE_SHIFT) | slot_idx;
+  struct page *page;
+  int err;
+
+  err = tfs_write_begin(NULL, dir->i_mapping, pos, sizeof(struct tfs_dentry), 0, &page, NULL);
+  if (err)
+    return err;
+
+  kmap(page);
+  memset(page_address(page) + slot_idx, 0, sizeof(struct tfs_dentry));
+  kunmap(page);
+
+  err = tfs_commit_write(page, pos, sizeof(struct tfs_dentry));
+  page_cache_release(page);
+
+  if (!err)
+    {
+      dir->i_ctime = dir->i_mtime = CURRENT_TIME_SEC;
+      mark_inode_dirty(dir);
+    }
+
+  return err;
+}
+
+/* shrink a directory to 'size' bytes and free its blocks past that */
+void tfs_dir_set_size(struct inode *dir, loff_t size)
+{
+  i_size_write(dir, size);
+  truncate_inode_pages(dir->i_mapping, size);
+  tfs_truncate_blocks(dir);
+}
+
+/*
+ * Drop the blocks at the end of a directory that hold no entries. Only
+ * empty slots go, so the readdir position of every live entry stays.
+ * i_size grows a dentry at a time, so the last block may be partial;
+ * a block never straddles a page.
+ */
+static void tfs_dir_trim(struct inode *dir)
+{
+  unsigned long blocksize = dir->i_sb->s_blocksize;
+  loff_t size = dir->i_size, start;
+  struct tfs_dentry *td, *end;
+  struct page *page;
+  char *addr;
+
+  while (size > blocksize)
+    {
+      start = (size - 1) & ~((loff_t) blocksize - 1);
+      page = read_mapping_page(dir->i_mapping, start >> PAGE_CACHE_SHIFT, NULL);
+      if (IS_ERR(page))
+	break;
+
+      addr = kmap(page);
+      td = (struct tfs_dentry *) (addr + (start & ~PAGE_CACHE_MASK));
+      end = (struct tfs_dentry *) ((char *) td + (size - start));
+      while (td < end && !td->inode)
+	++td;
+      kunmap(page);
+      page_cache_release(page);
+
+      if (td < end)
+	break;
+      size = start;
+    }
+
+  if (size < dir->i_size)
+    tfs_dir_set_size(dir, size);
+}
+
+static int tfs_dir_empty(struct inode *dir)
+{
+  int npages = (dir->i_size + PAGE_CACHE_SIZE - 1) >> PAGE_CACHE_SHIFT;
+  struct tfs_dentry *td, *end;
+  struct page *page;
+  char *addr;
+  int i;
+
+  for (i = 0; i < npages; ++i)
+    {
+      page = read_mapping_page(dir->i_mapping, i, NULL);
+      if (IS_ERR(page))
+	return 0;
+
+      addr = kmap(page);
+      end = (struct tfs_dentry *) (addr + min_t(loff_t, PAGE_CACHE_SIZE, dir->i_size - ((loff_t) i << PAGE_CACHE_SHIFT)));
+      for (td = (struct tfs_dentry *) addr; td < end; ++td)
+	{
+	  if (!td->inode)
+	    continue;
+	  if (td->name[0] == '.' && (td->len == 1 || (td->len == 2 && td->name[1] == '.')))
+	    continue;
+
+	  kunmap(page);
+	  page_cache_release(page);
+	  return 0;
+	}
+
+      kunmap(page);
+      page_cache_release(page);
+    }
+
+  return 1;
+}
+
+int tfs_unlink(struct inode *dir, struct dentry *dentry)
+{
+  struct inode *inode = dentry->d_inode;
+  struct tfs_alloc_inode_info tai;
+  int err;
+
+  printk("TFS: tfs_unlink: %u\n", (unsigned int) inode->i_ino);
+
+  tfs_init_alloc_inode_info(tai);
+
+  err = tfs_find_dentry(dir, dentry, &tai);
+  if (err != -EEXIST)
+    return err ? err : -ENOENT;
+
+  err = tfs_delete_entry(dir, tai.slot_page, tai.slot_idx);
+  if (err)
+    {
+      printk("TFS: error in tfs_delete_entry: %d\n", err);
+      return err;
+    }
+
+  inode->i_ctime = dir->i_ctime;
+  inode_dec_link_count(inode);
+
+  tfs_dir_trim(dir);
+  tfs_queue_compact(dir);
+
+  return 0;
+}
+
+int tfs_rmdir(struct inode *dir, struct dentry *dentry)
+{
+  struct inode *inode = dentry->d_inode;
+  int err;
+
+  printk("TFS: tfs_rmdir: %u\n", (unsigned int) inode->i_ino);
+
+  if (!tfs_dir_empty(inode))
+    return -ENOTEMPTY;
+
+  err = tfs_unlink(dir, dentry);
+  if (err)
+    return err;
+
+  inode->i_size = 0;
+  inode_dec_link_count(inode);
+  inode_dec_link_count(dir);
+
+  return 0;
+}
+
 int tfs_link(struct dentry *source_dentry, struct inode *dir, struct dentry *dentry)
 {
   struct tfs_alloc_inode_info tai;
@@ -430,15 +679,37 @@ int tfs_link(struct dentry *source_dentry, struct inode *dir, struct dentry *den
 struct inode_operations tfs_dir_inode_operations =
   {
     .create = tfs_create,
+    .symlink = tfs_symlink,
     .mkdir = tfs_mkdir,
     .lookup = tfs_lookup,
-    .link = tfs_link
+    .link = tfs_link,
+    .unlink = tfs_unlink,
+    .rmdir = tfs_rmdir
   };
 
+static int tfs_dir_open(struct inode *inode, struct file *file)
+{
+  atomic_inc(&TFS_INODE(inode)->dir_opens);
+  return 0;
+}
+
+static int tfs_dir_release(struct inode *inode, struct file *file)
+{
+  struct tfs_inode_info *ti = TFS_INODE(inode);
+
+  if (atomic_dec_and_test(&ti->dir_opens) &&
+      test_bit(TFS_DIR_COMPACT_WANTED, &ti->state))
+    tfs_queue_compact(inode);
+  return 0;
+}
+
 struct file_operations tfs_dir_operations =
   {
+    .open = tfs_dir_open,
+    .release = tfs_dir_release,
     .llseek = tfs_llseek,
     .read = generic_read_dir,
     .readdir = tfs_readdir,
-    .fsync = tfs_fsync
+    .fsync = tfs_fsync,
+    .unlocked_ioctl = tfs_ioctl
   };
@@ -0,0 +1,241 @@
+#include <linux/fs.h>
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+
+#include "tfs_module.h"
+#include "alloc.h"
+
+struct tfs_discard_extent
+{
+  struct list_head list;
+  sector_t start;
+  u32 count;
+};
+
+static int tfs_issue_discard(struct super_block *sb, sector_t block, u32 count)
+{
+  unsigned int shift = sb->s_blocksize_bits - 9;
+
+  return blkdev_issue_discard(sb->s_bdev, block << shift, count << shift, GFP_NOFS);
+}
+
+/*
+ * Queue freed blocks for the discard worker, merging adjacent blocks
+ * into extents of at most one bitmap block's worth. With bigalloc a
+ * block stands for its whole cluster. Either every block is queued or,
+ * if memory runs out, none is.
+ */
+int tfs_queue_discard(struct super_block *sb, sector_t *blocks, int count)
+{
+  struct tfs_sb_info *si = sb->s_fs_info;
+  struct tfs_discard_extent *ex = NULL, *tmp, *last;
+  LIST_HEAD(list);
+  sector_t start;
+  int i;
+
+  for (i = 0; i < count; ++i)
+    {
+      if (!tfs_data_block_valid(si, blocks[i]))
+	{
+	  printk("TFS: freeing invalid block: %u\n", (unsigned) blocks[i]);
+	  continue;
+	}
+
+      start = blocks[i] & ~(sector_t) (si->alloc_blocks - 1);
+      if (ex && ex->start + ex->count == start && ex->count < si->bits_per_block)
+	{
+	  ex->count += si->alloc_blocks;
+	  continue;
+	}
+
+      if (!(ex = kmalloc(sizeof(*ex), GFP_NOFS)))
+	{
+	  list_for_each_entry_safe(ex, tmp, &list, list)
+	    kfree(ex);
+	  return -ENOMEM;
+	}
+
+      ex->start = start;
+      ex->count = si->alloc_blocks;
+      list_add_tail(&ex->list, &list);
+    }
+
+  if (list_empty(&list))
+    return 0;
+
+  spin_lock(&si->discard_lock);
+  if (!list_empty(&si->discard_list))
+    {
+      last = list_entry(si->discard_list.prev, struct tfs_discard_extent, list);
+      ex = list_entry(list.next, struct tfs_discard_extent, list);
+      if (last->start + last->count == ex->start && last->count + ex->count <= si->bits_per_block)
+	{
+	  last->count += ex->count;
+	  list_del(&ex->list);
+	  kfree(ex);
+	}
+    }
+  list_splice_init(&list, si->discard_list.prev);
+  spin_unlock(&si->discard_lock);
+
+  queue_delayed_work(si->free_wq, &si->discard_work, TFS_DISCARD_DELAY);
+
+  return 0;
+}
+
+/* discard the queued extents, then return them to the bitmap */
+static void tfs_run_discards(struct tfs_sb_info *si)
+{
+  struct super_block *sb = si->sb;
+  struct tfs_discard_extent *ex, *tmp;
+  LIST_HEAD(list);
+  int err;
+
+  spin_lock(&si->discard_lock);
+  list_splice_init(&si->discard_list, &list);
+  spin_unlock(&si->discard_lock);
+
+  list_for_each_entry_safe(ex, tmp, &list, list)
+    {
+      if (si->mount_opts & TFS_MOUNT_DISCARD)
+	{
+	  err = tfs_issue_discard(sb, ex->start, ex->count);
+	  if (err == -EOPNOTSUPP)
+	    {
+	      printk("TFS: %s does not support discard, disabling it\n", sb->s_id);
+	      si->mount_opts &= ~TFS_MOUNT_DISCARD;
+	    }
+	  else if (err)
+	    printk("TFS: discard of %u blocks at %u failed: %d\n", ex->count, (unsigned) ex->start, err);
+	}
+
+      tfs_free_block_range(sb, ex->start, ex->count);
+      list_del(&ex->list);
+      kfree(ex);
+      cond_resched();
+    }
+}
+
+static void tfs_discard_work_fn(struct work_struct *work)
+{
+  struct tfs_sb_info *si = container_of(work, struct tfs_sb_info, discard_work.work);
+
+  tfs_run_discards(si);
+}
+
+void tfs_init_discard(struct super_block *sb)
+{
+  struct tfs_sb_info *si = sb->s_fs_info;
+
+  spin_lock_init(&si->discard_lock);
+  INIT_LIST_HEAD(&si->discard_list);
+  INIT_DELAYED_WORK(&si->discard_work, tfs_discard_work_fn);
+}
+
+/* called at unmount once no more blocks can be freed */
+void tfs_stop_discard(struct super_block *sb)
+{
+  struct tfs_sb_info *si = sb->s_fs_info;
+
+  cancel_delayed_work_sync(&si->discard_work);
+  tfs_run_discards(si);
+}
+
+/*
+ * FITRIM: discard every free run of at least minlen bytes in the range.
+ * The bits of a run are set while its discard is in flight so that the
+ * allocator cannot hand the blocks out; runs do not cross bitmap blocks.
+ * The bitmap buffer stays locked meanwhile, so writeback cannot put the
+ * borrowed bits on disk. With bigalloc only the clusters wholly inside
+ * the range are trimmed.
+ */
+int tfs_trim_fs(struct super_block *sb, struct fstrim_range *range)
+{
+  struct tfs_sb_info *si = sb->s_fs_info;
+  struct tfs_super_block *tsb = si->super_block;
+  unsigned int bits = sb->s_blocksize_bits;
+  struct buffer_head *bh;
+  unsigned long *map;
+  sector_t start, end, base, trimmed = 0;
+  u32 minlen, lo, hi, run, len, i;
+  int err = 0;
+
+  start = range->start >> bits;
+  end = range->len >> bits;
+  if (start >= si->blocks_count || !end)
+    {
+      range->len = 0;
+      return start >= si->blocks_count ? -EINVAL : 0;
+    }
+  end = end > si->blocks_count - start ? si->blocks_count : start + end;
+  if (start < tsb->inode_table_block_start)
+    start = tsb->inode_table_block_start;
+  minlen = range->minlen >> bits;
+  if (!minlen)
+    minlen = 1;
+
+  /* from here on, in data bitmap bits */
+  start = (start + si->alloc_blocks - 1) >> si->alloc_bits;
+  end >>= si->alloc_bits;
+  minlen = (minlen + si->alloc_blocks - 1) >> si->alloc_bits;
+
+  for (base = start - start % si->bits_per_block; base < end && !err; base += si->bits_per_block)
+    {
+      lo = base < start ? start - base : 0;
+      hi = end - base < si->bits_per_block ? end - base : si->bits_per_block;
+
+      mutex_lock(&si->data_bitmap_mutex);
+      if (!(bh = sb_bread(sb, tsb->data_bitmap_block_start + base / si->bits_per_block)))
+	{
+	  mutex_unlock(&si->data_bitmap_mutex);
+	  err = -EIO;
+	  break;
+	}
+      map = (unsigned long *) bh->b_data;
+
+      while (lo < hi)
+	{
+	  run = find_next_zero_bit(map, hi, lo);
+	  if (run >= hi)
+	    break;
+	  lo = find_next_bit(map, hi, run);
+	  len = lo - run;
+	  if (len < minlen)
+	    continue;
+
+	  lock_buffer(bh);
+	  for (i = run; i < lo; ++i)
+	    __set_bit(i, map);
+	  mutex_unlock(&si->data_bitmap_mutex);
+
+	  err = tfs_issue_discard(sb, (base + run) << si->alloc_bits, len << si->alloc_bits);
+
+	  mutex_lock(&si->data_bitmap_mutex);
+	  for (i = run; i < lo; ++i)
+	    __clear_bit(i, map);
+	  unlock_buffer(bh);
+
+	  if (err)
+	    break;
+	  trimmed += (sector_t) len << si->alloc_bits;
+
+	  if (fatal_signal_pending(current))
+	    {
+	      err = -ERESTARTSYS;
+	      break;
+	    }
+	}
+
+      mutex_unlock(&si->data_bitmap_mutex);
+      brelse(bh);
+      cond_resched();
+    }
+
+  range->len = (u64) trimmed << bits;
+  printk("TFS: trimmed %u blocks\n", (unsigned) trimmed);
+
+  return trimmed ? 0 : err;
+}
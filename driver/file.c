@@ -2,9 +2,23 @@
 
 void tfs_truncate(struct inode *inode)
 {
+  struct tfs_sb_info *si = inode->i_sb->s_fs_info;
+  int err;
+
   printk("TFS: tfs_truncate: %u\n", (unsigned int) inode->i_ino);
 
-  block_truncate_page(inode->i_mapping, inode->i_size, tfs_getblocks);
+  /* a compressed cluster the new end of file cuts in two is stored raw first */
+  if (tfs_inode_compressed(inode) &&
+      ((inode->i_size & (inode->i_sb->s_blocksize - 1)) ||
+       ((inode->i_size >> inode->i_blkbits) - TFS_DATA_BLOCKS_PER_INODE) % si->cluster_blocks) &&
+      (err = tfs_expand_cluster_at(inode, inode->i_size >> inode->i_blkbits)))
+    printk("TFS: error expanding the last cluster of inode %u: %d\n", (unsigned int) inode->i_ino, err);
+
+  if (si->mount_opts & TFS_MOUNT_NOBH)
+    nobh_truncate_page(inode->i_mapping, inode->i_size, tfs_getblocks);
+  else
+    block_truncate_page(inode->i_mapping, inode->i_size, tfs_getblocks);
+  tfs_truncate_blocks(inode);
   inode->i_mtime = CURRENT_TIME_SEC;
   mark_inode_dirty(inode);
   if (inode_needs_sync(inode))
@@ -13,17 +27,81 @@ void tfs_truncate(struct inode *inode)
     }
 }
 
+/*
+ * A write that stays inside i_size cannot change the size, so it skips
+ * i_mutex and only excludes truncate and defrag through truncate_sem.
+ * Threads writing disjoint ranges of a file then run in parallel, the
+ * block map being guarded by the hashed locks of tfs_getblocks().
+ * Appends, extending writes and writes that must drop suid bits still
+ * go through generic_file_aio_write().
+ */
+static ssize_t tfs_file_aio_write(struct kiocb *iocb, const struct iovec *iov,
+				  unsigned long nr_segs, loff_t pos)
+{
+  struct file *file = iocb->ki_filp;
+  struct inode *inode = file->f_mapping->host;
+  struct tfs_inode_info *ti = TFS_INODE(inode);
+  ssize_t ret;
+
+  if (!(file->f_flags & O_APPEND) && !(inode->i_mode & (S_ISUID | S_ISGID)))
+    {
+      down_read(&ti->truncate_sem);
+      if (pos + iov_length(iov, nr_segs) <= i_size_read(inode))
+	{
+	  ret = generic_file_aio_write_nolock(iocb, iov, nr_segs, pos);
+	  up_read(&ti->truncate_sem);
+	  return ret;
+	}
+      up_read(&ti->truncate_sem);
+    }
+
+  return generic_file_aio_write(iocb, iov, nr_segs, pos);
+}
+
+static int tfs_setattr(struct dentry *dentry, struct iattr *attr)
+{
+  struct inode *inode = dentry->d_inode;
+  struct tfs_inode_info *ti = TFS_INODE(inode);
+  int err;
+
+  if ((err = inode_change_ok(inode, attr)))
+    return err;
+
+  if (!(attr->ia_valid & ATTR_SIZE))
+    return inode_setattr(inode, attr);
+
+  down_write(&ti->truncate_sem);
+  err = inode_setattr(inode, attr);
+  up_write(&ti->truncate_sem);
+
+  return err;
+}
+
+/* compress a file marked for it once its last writer is gone */
+static int tfs_file_release(struct inode *inode, struct file *file)
+{
+  if ((file->f_mode & FMODE_WRITE) && atomic_read(&inode->i_writecount) == 1 &&
+      (TFS_INODE(inode)->flags & TFS_INODE_COMPRESS))
+    tfs_queue_compress(inode);
+
+  return 0;
+}
+
 struct file_operations tfs_file_operations =
   {
     .read = do_sync_read,
     .write = do_sync_write,
     .aio_read = generic_file_aio_read,
-    .aio_write = generic_file_aio_write,
+    .aio_write = tfs_file_aio_write,
     .llseek = tfs_llseek,
-    .fsync = tfs_fsync
+    .fsync = tfs_fsync,
+    .release = tfs_file_release,
+    .unlocked_ioctl = tfs_ioctl
   };
 
 struct inode_operations tfs_file_inode_operations =
   {
-    .truncate = tfs_truncate
+    .truncate = tfs_truncate,
+    .setattr = tfs_setattr,
+    .fiemap = tfs_fiemap
   };
@@ -1,4 +1,5 @@
 #include <linux/mm.h>
+#include <linux/slab.h>
 #include <linux/highmem.h>
 #include <linux/fs.h>
 #include <linux/buffer_head.h>
@@ -8,25 +9,37 @@
 #include <linux/namei.h>
 #include <linux/dcache.h>
 #include <linux/mpage.h>
+#include <linux/hash.h>
 #include <linux/time.h>
 
 #include "tfs_module.h"
 #include "alloc.h"
 
 static const struct address_space_operations tfs_aops;
+static const struct address_space_operations tfs_nobh_aops;
 extern struct file_operations tfs_file_operations;
 extern struct file_operations tfs_dir_operations;
 extern struct inode_operations tfs_file_inode_operations;
 extern struct inode_operations tfs_dir_inode_operations;
 
+sector_t tfs_inode_block(struct super_block *sb, unsigned int ino, unsigned int *offset)
+{
+  struct tfs_sb_info *si = sb->s_fs_info;
+
+  *offset = (ino % si->inodes_per_block) << TFS_INODE_SIZE_BITS;
+
+  return tfs_itable_map_block(si->super_block, si->itable_map, ino / si->inodes_per_block);
+}
+
 struct inode *tfs_inode_get(struct super_block *sb, int ino)
 {
+  struct tfs_sb_info *si = sb->s_fs_info;
   struct inode *inode = NULL;
   struct tfs_inode_info *ti;
   struct tfs_inode *tfs_inode;
   struct buffer_head *bh = NULL;
-  struct tfs_sb_info *si = sb->s_fs_info;
-  unsigned int block, offset, shift;
+  unsigned int offset;
+  sector_t block;
   int ret, i;
 
   printk("TFS: tfs_inode_get: %u\n", ino);
@@ -46,13 +59,11 @@ struct inode *tfs_inode_get(struct super_block *sb, int ino)
 
   ti = TFS_INODE(inode);
 
-  shift = ino << TFS_INODE_SIZE_BITS;
-  block = si->super_block->inode_table_block_start + (shift >> TFS_BLOCK_SIZE_BITS);
-  offset = shift % TFS_BLOCK_SIZE;
+  block = tfs_inode_block(sb, ino, &offset);
 
-  printk("TFS: block and offset: %u, %u\n", block, offset);
+  printk("TFS: block and offset: %u, %u\n", (unsigned) block, offset);
 
-  bh = sb_bread(sb, block);
+  bh = tfs_bread_itable(sb, block);
   if (!bh)
     {
       ret = -EIO;
@@ -67,19 +78,32 @@ struct inode *tfs_inode_get(struct super_block *sb, int ino)
   inode->i_uid = tfs_inode->uid;
   inode->i_gid = tfs_inode->gid;
   inode->i_nlink = tfs_inode->hard_link_count;
-  inode->i_size = tfs_inode->size;
+  inode->i_size = TFS_FILE_SIZE(tfs_inode);
   inode->i_atime.tv_sec = tfs_inode->atime;
   inode->i_ctime.tv_sec = tfs_inode->ctime;
   inode->i_mtime.tv_sec = tfs_inode->mtime;
   inode->i_blocks = tfs_inode->blocks;
 
-  for (i = 0; i < TFS_DATA_BLOCKS_PER_INODE; ++i)
-    ti->data_blocks[i] = tfs_inode->data_blocks[i];
+  if (TFS_IS_FAST_SYMLINK(tfs_inode->mode, tfs_inode->size))
+    {
+      memset(ti->data_blocks, 0, sizeof(ti->data_blocks));
+      ti->root_indirect_data_block = 0;
+      memcpy(ti->fast_symlink, tfs_inode->data_blocks, TFS_FAST_SYMLINK_LEN);
+    }
+  else
+    {
+      for (i = 0; i < TFS_DATA_BLOCKS_PER_INODE; ++i)
+	ti->data_blocks[i] = tfs_inode->data_blocks[i];
+      ti->root_indirect_data_block = tfs_inode->root_indirect_data_block;
+    }
+  ti->flags = S_ISREG(inode->i_mode) ? tfs_inode->flags : 0;
 
-  ti->root_indirect_data_block = tfs_inode->root_indirect_data_block;
-  ti->cached_next_slot = 0;
-  memset(ti->cached_first_logical_blocks, 0, sizeof(ti->cached_first_logical_blocks));
-  memset(ti->cached_data_blocks, 0, sizeof(ti->cached_data_blocks));
+  if ((ti->flags & TFS_INODE_COMPRESSED) && !si->cluster_blocks)
+    {
+      printk("TFS: inode %d has compressed clusters this page size cannot read\n", ino);
+      ret = -EOPNOTSUPP;
+      goto err;
+    }
 
   //TODO: implement setattr
   if (S_ISREG(inode->i_mode))
@@ -94,8 +118,18 @@ struct inode *tfs_inode_get(struct super_block *sb, int ino)
       inode->i_op = &tfs_dir_inode_operations;
       inode->i_fop = &tfs_dir_operations;
     }
+  else if (S_ISLNK(inode->i_mode))
+    {
+      if (TFS_IS_FAST_SYMLINK(inode->i_mode, inode->i_size))
+	inode->i_op = &tfs_fast_symlink_inode_operations;
+      else
+	inode->i_op = &page_symlink_inode_operations;
+    }
 
-  inode->i_mapping->a_ops = &tfs_aops;
+  if (S_ISREG(inode->i_mode) && (si->mount_opts & TFS_MOUNT_NOBH))
+    inode->i_mapping->a_ops = &tfs_nobh_aops;
+  else
+    inode->i_mapping->a_ops = &tfs_aops;
 
   brelse(bh);
   unlock_new_inode(inode);
@@ -114,6 +148,59 @@ struct inode *tfs_inode_get(struct super_block *sb, int ino)
   return ERR_PTR(ret);
 }
 
+/*
+ * Start reads for the inode table blocks holding the given inodes, so
+ * that the stat() calls which usually follow a readdir() find them in
+ * the buffer cache. Blocks are deduplicated and submitted in ascending
+ * order as one READA batch; blocks already cached are skipped.
+ */
+void tfs_prefetch_inodes(struct super_block *sb, unsigned int *inos, int count)
+{
+  struct buffer_head *bhs[TFS_PREFETCH_BATCH];
+  sector_t blocks[TFS_PREFETCH_BATCH];
+  unsigned int offset;
+  int i, j, nr = 0;
+
+  for (i = 0; i < count && nr < TFS_PREFETCH_BATCH; ++i)
+    {
+      sector_t block = tfs_inode_block(sb, inos[i], &offset);
+
+      if (!block || !tfs_itable_block_initialized(sb, block))
+	continue;
+
+      for (j = nr; j > 0 && blocks[j - 1] > block; --j)
+	;
+      if (j > 0 && blocks[j - 1] == block)
+	continue;
+
+      memmove(&blocks[j + 1], &blocks[j], (nr - j) * sizeof(blocks[0]));
+      blocks[j] = block;
+      ++nr;
+    }
+
+  for (i = 0, j = 0; i < nr; ++i)
+    {
+      struct buffer_head *bh = sb_getblk(sb, blocks[i]);
+
+      if (!bh)
+	continue;
+      if (buffer_uptodate(bh))
+	{
+	  brelse(bh);
+	  continue;
+	}
+      bhs[j++] = bh;
+    }
+
+  if (!j)
+    return;
+
+  ll_rw_block(READA, j, bhs);
+
+  for (i = 0; i < j; ++i)
+    brelse(bhs[i]);
+}
+
 int tfs_sync_inode(struct inode *inode)
 {
   struct writeback_control wbc = 
@@ -121,15 +208,99 @@ int tfs_sync_inode(struct inode *inode)
     .sync_mode = WB_SYNC_ALL,
     .nr_to_write = 0
   };
+  int err, err2;
 
   printk("TFS: tfs_sync_inode: %u\n", (unsigned int) inode->i_ino);
 
-  return sync_inode(inode, &wbc);
+  /* deferred timestamps leave the inode clean; dirty it again to write them */
+  if (test_bit(TFS_INODE_LAZY_TIMES, &TFS_INODE(inode)->state))
+    mark_inode_dirty_sync(inode);
+
+  err = sync_inode(inode, &wbc);
+  err2 = tfs_flush_inode_table(inode->i_sb);
+
+  return err ? err : err2;
 }
 
 #define TFS_BLOCK_FOUND 1
 #define TFS_BLOCK_NOT_FOUND 2
 
+/*
+ * Allocating writers serialize on a mutex hashed from the inode and the
+ * part of the block map they change: slot 0 for the direct blocks and
+ * the root indirect block, slot n + 1 for indirect block n. Writers
+ * filling disjoint ranges of a large file mostly take different locks.
+ * With bigalloc the indirect blocks of one allocation cluster share a
+ * slot, since allocating them fills in the same cluster.
+ */
+struct mutex *tfs_map_lock(struct inode *inode, u32 slot)
+{
+  struct tfs_sb_info *si = inode->i_sb->s_fs_info;
+
+  if (slot)
+    slot -= (slot - 1) % si->alloc_blocks;
+
+  return &si->map_locks[hash_long(inode->i_ino * 31 + slot, TFS_MAP_LOCK_BITS)];
+}
+
+/*
+ * If *block is shared, point it at a private copy. Called with the map
+ * lock of the slot holding *block.
+ */
+static int tfs_unshare_block(struct inode *inode, sector_t *block)
+{
+  sector_t copy;
+  int err;
+
+  if ((err = tfs_block_shared(inode->i_sb, *block)) <= 0)
+    return err;
+
+  if ((err = tfs_cow_block(inode, *block, &copy)))
+    return err;
+
+  *block = copy;
+  tfs_drop_cached_blocks(TFS_INODE(inode));
+  mark_inode_dirty(inode);
+
+  return 0;
+}
+
+/* the inode's block map cache, allocated on first use; NULL if that fails */
+static struct tfs_block_cache *tfs_get_block_cache(struct tfs_inode_info *ti)
+{
+  struct tfs_block_cache *bc;
+  int i;
+
+  if (ti->block_cache)
+    return ti->block_cache;
+
+  if (!(bc = kzalloc(sizeof(*bc), GFP_NOFS)))
+    return NULL;
+  for (i = 0; i < TFS_BLK_GRP; ++i)
+    seqlock_init(&bc->seqlocks[i]);
+  mutex_init(&bc->mutex);
+
+  /* lookups read ti->block_cache without a lock */
+  smp_wmb();
+  spin_lock(&ti->inode.i_lock);
+  if (!ti->block_cache)
+    {
+      ti->block_cache = bc;
+      bc = NULL;
+    }
+  spin_unlock(&ti->inode.i_lock);
+  kfree(bc);
+
+  return ti->block_cache;
+}
+
+static void tfs_inode_add_block(struct inode *inode)
+{
+  spin_lock(&inode->i_lock);
+  inode->i_blocks++;
+  spin_unlock(&inode->i_lock);
+}
+
 int tfs_getblocks(struct inode *inode, sector_t iblock, struct buffer_head *bh_result, int create)
 {
   int i;
@@ -141,21 +312,16 @@ int tfs_getblocks(struct inode *inode, sector_t iblock, struct buffer_head *bh_r
   int status;
   int err = 0;
   struct tfs_alloc_inode_info tainfo;
+  struct tfs_sb_info *si = inode->i_sb->s_fs_info;
+  struct mutex *map_lock = NULL;
+  u32 direct[TFS_DATA_BLOCKS_PER_INODE];
   unsigned blkbits = inode->i_blkbits;
-  sector_t last_block_in_file = (i_size_read(inode) + TFS_BLOCK_SIZE - 1) >> blkbits;
+  sector_t last_block_in_file = (i_size_read(inode) + inode->i_sb->s_blocksize - 1) >> blkbits;
 
   printk("TFS: tfs_getblocks - block=%u, req size=%u, lblock=%u\n", (unsigned)iblock, bh_result->b_size, (unsigned)last_block_in_file);
 
   if (iblock < TFS_DATA_BLOCKS_PER_INODE)
     {
-      if (iblock >= last_block_in_file)
-	{
-	  if (!create)
-	    return -EINVAL;
-	  else 
-	    goto alloc_directblock;
-	}
-
       count = 0;
       blocknum = iblock;
       while (blocknum < TFS_DATA_BLOCKS_PER_INODE &&
@@ -167,33 +333,58 @@ int tfs_getblocks(struct inode *inode, sector_t iblock, struct buffer_head *bh_r
 	  ++count;
 	}
 
+      /* a hole reads as zeroes: leave bh_result unmapped */
       if (!count)
 	{
 	  if (!create)
-	      return -EINVAL;
+	    return 0;
 	  else
 	    goto alloc_directblock;
 	}
 
+      /* a write to a shared block goes to a copy of it */
+      if (create && tfs_has_shared_blocks(si))
+	{
+	  map_lock = tfs_map_lock(inode, 0);
+	  mutex_lock(map_lock);
+	  if ((err = tfs_unshare_block(inode, &ti->data_blocks[iblock])))
+	    goto out;
+	  count = 1;
+	}
+
       map_bh(bh_result, inode->i_sb, ti->data_blocks[iblock]);
       bh_result->b_size = count << inode->i_blkbits;
 
       printk("TFS: mapped: data block=%u, size=%u\n", (unsigned) ti->data_blocks[iblock], bh_result->b_size);
 
-      return 0;
+      goto out;
 
 alloc_directblock:
+      map_lock = tfs_map_lock(inode, 0);
+      mutex_lock(map_lock);
+      if (ti->data_blocks[iblock])
+	{
+	  /* another writer mapped it while we waited */
+	  map_bh(bh_result, inode->i_sb, ti->data_blocks[iblock]);
+	  bh_result->b_size = 1 << inode->i_blkbits;
+	  goto out;
+	}
+
       tfs_init_alloc_inode_info(tainfo);
 
-      err = alloc_datablock_bitmap(inode->i_sb, &tainfo);
+      for (i = 0; i < TFS_DATA_BLOCKS_PER_INODE; ++i)
+	direct[i] = ti->data_blocks[i];
+      err = tfs_alloc_mapped_block(inode->i_sb, &tainfo, direct, TFS_DATA_BLOCKS_PER_INODE, iblock,
+				   tfs_find_goal(inode, iblock ? ti->data_blocks[iblock - 1] : 0));
       if (err)
 	goto error_alloc;
       
       ti->data_blocks[iblock] = tainfo.data_block;
-      inode->i_blocks++;
+      tfs_inode_add_block(inode);
       mark_inode_dirty(inode);
 
       map_bh(bh_result, inode->i_sb, tainfo.data_block);
+      set_buffer_new(bh_result);
       bh_result->b_size = 1 << inode->i_blkbits;
 
       printk("TFS: mapped data block=%u, size=%u\n", (unsigned) tainfo.data_block, bh_result->b_size);
@@ -208,25 +399,32 @@ alloc_directblock:
       sector_t rid_block, indirect_block, block;
       u32 indirect_block_index, block_index;
       struct buffer_head *rid_bh = NULL, *id_bh = NULL;
+      struct tfs_block_cache *bc;
 
       printk("TFS: first rounded block=%u, relative block=%u, blocknum=%u\n", (unsigned) first_rounded_logical_block, (unsigned) first_rounded_relative_block, (unsigned) (iblock - TFS_DATA_BLOCKS_PER_INODE));
 
       if (iblock >= last_block_in_file)
 	{
 	  if (!create)
-	    return -EINVAL;
+	    return 0;
 	  else 
 	    goto alloc_indirectblock;
 	}
 
-      for (i = 0; i < TFS_BLK_GRP; ++i)
+      /* the cache cannot tell whether a block is shared, or compressed */
+      if ((create && tfs_has_shared_blocks(si)) || tfs_inode_compressed(inode))
+	goto alloc_indirectblock;
+
+      bc = ti->block_cache;
+      smp_read_barrier_depends();
+      for (i = 0; bc && i < TFS_BLK_GRP; ++i)
 	{
-	  sector_t *pblock = &ti->cached_data_blocks[i][0];
+	  sector_t *pblock = &bc->data_blocks[i][0];
 	  count = 0;
 	  blocknum = iblock - TFS_DATA_BLOCKS_PER_INODE;
-	  printk("TFS: cached_first_logical_block[%d]=%u, first block=%u\n", i, (unsigned) ti->cached_first_logical_blocks[i], (unsigned) pblock[blocknum - first_rounded_relative_block]);
-	  seq = read_seqbegin(&ti->cached_block_seqlocks[i]);
-	  if (first_rounded_logical_block == ti->cached_first_logical_blocks[i] && pblock[blocknum - first_rounded_relative_block])
+	  printk("TFS: cached_first_logical_block[%d]=%u, first block=%u\n", i, (unsigned) bc->first_logical_blocks[i], (unsigned) pblock[blocknum - first_rounded_relative_block]);
+	  seq = read_seqbegin(&bc->seqlocks[i]);
+	  if (first_rounded_logical_block == bc->first_logical_blocks[i] && pblock[blocknum - first_rounded_relative_block])
 	    {
 	      status = TFS_BLOCK_FOUND;
 	      while (count < (bh_result->b_size >> inode->i_blkbits) &&
@@ -238,13 +436,18 @@ alloc_directblock:
 		  ++count;
 		}
 	      bsize = count << inode->i_blkbits;
+
+	      /* the run may go on past the cached group: map it from the indirect block */
+	      if (blocknum - first_rounded_relative_block == TFS_BLK_PER_GRP &&
+		  count < (bh_result->b_size >> inode->i_blkbits))
+		status = TFS_BLOCK_NOT_FOUND;
 	    }
 	  else
 	    {
 	      status = TFS_BLOCK_NOT_FOUND;
 	    }
 
-	  if (read_seqretry(&ti->cached_block_seqlocks[i], seq) && status == TFS_BLOCK_FOUND)
+	  if (read_seqretry(&bc->seqlocks[i], seq) && status == TFS_BLOCK_FOUND)
 	    break;
 
 	  if (status == TFS_BLOCK_FOUND)
@@ -261,8 +464,14 @@ alloc_indirectblock:
       
       if (create && !ti->root_indirect_data_block)
 	{
+	  map_lock = tfs_map_lock(inode, 0);
+	  mutex_lock(map_lock);
+	  if (ti->root_indirect_data_block)
+	    goto rid_allocated;
+
 	  tfs_init_alloc_inode_info(tainfo);
-	  err = alloc_datablock_bitmap(inode->i_sb, &tainfo);
+	  err = alloc_datablock_bitmap(inode->i_sb, &tainfo,
+				       tfs_find_goal(inode, ti->data_blocks[TFS_DATA_BLOCKS_PER_INODE - 1]));
 	  if (err)
 	    {
 	      printk("TFS: error allocating root indirect data block: %d\n", err);
@@ -271,17 +480,17 @@ alloc_indirectblock:
 
 	  printk("TFS: allocated root indirect data block: %u\n", tainfo.data_block);
 	  ti->root_indirect_data_block = tainfo.data_block;
-	  inode->i_blocks++;
+	  tfs_inode_add_block(inode);
 	  mark_inode_dirty(inode);
 	  tfs_release_inode_info_blocks(&tainfo);
+	rid_allocated:
+	  mutex_unlock(map_lock);
+	  map_lock = NULL;
 	}
       rid_block = ti->root_indirect_data_block;
 
       if (!rid_block)
-	{
-	  printk("TFS: root indirect data block cannot be 0");
-	  return -EINVAL;
-	}
+	return 0;
       printk("TFS: root indirect block: %u\n", (unsigned) rid_block);
 
       rid_bh = sb_bread(inode->i_sb, rid_block);
@@ -291,8 +500,8 @@ alloc_indirectblock:
 	  return -EIO;
 	}
 
-      indirect_block_index = (iblock - TFS_DATA_BLOCKS_PER_INODE) / (TFS_BLOCK_SIZE / sizeof(u32));
-      if (indirect_block_index >= TFS_BLOCK_SIZE / sizeof(u32))
+      indirect_block_index = (iblock - TFS_DATA_BLOCKS_PER_INODE) / si->addr_per_block;
+      if (indirect_block_index >= si->addr_per_block)
 	{
 	  printk("TFS: invalid indirect block index: %u\n", indirect_block_index);
 	  brelse(rid_bh);
@@ -301,11 +510,20 @@ alloc_indirectblock:
 
       printk("TFS: indirect_block_index: %u\n", indirect_block_index);
 
+      if (create)
+	{
+	  map_lock = tfs_map_lock(inode, indirect_block_index + 1);
+	  mutex_lock(map_lock);
+	}
+
       indirect_block = (sector_t) *((u32 *) rid_bh->b_data + indirect_block_index);
       if (create && !indirect_block)
 	{
 	  tfs_init_alloc_inode_info(tainfo);
-	  err = alloc_datablock_bitmap(inode->i_sb, &tainfo);
+	  err = tfs_alloc_mapped_block(inode->i_sb, &tainfo, (u32 *) rid_bh->b_data, si->addr_per_block,
+				       indirect_block_index,
+				       tfs_find_goal(inode, indirect_block_index ?
+						     *((u32 *) rid_bh->b_data + indirect_block_index - 1) : rid_block));
 	  if (err)
 	    {
 	      printk("TFS: error allocating indirect data block: %d\n", err);
@@ -316,16 +534,13 @@ alloc_indirectblock:
 	  printk("TFS: allocated indirect data block: %u\n", tainfo.data_block);
 	  *((u32 *) rid_bh->b_data + indirect_block_index) = indirect_block = tainfo.data_block;
 	  mark_buffer_dirty(rid_bh);
-	  inode->i_blocks++;
+	  tfs_inode_add_block(inode);
 	  mark_inode_dirty(inode);
 	  tfs_release_inode_info_blocks(&tainfo);
 	}
       brelse(rid_bh);
       if (!indirect_block)
-	{
-	  printk("TFS: indirect block cannot be 0\n");
-	  return -EINVAL;
-	}
+	goto out;
 
       printk("TFS: indirect block: %u\n", (unsigned) indirect_block);
 
@@ -333,23 +548,45 @@ alloc_indirectblock:
       if (!id_bh)
 	{
 	  printk("TFS: error reading indirect block: %u\n", (unsigned) indirect_block);
-	  return -EIO;
+	  err = -EIO;
+	  goto out;
 	}
-      block_index = (iblock - TFS_DATA_BLOCKS_PER_INODE) % (TFS_BLOCK_SIZE / sizeof(u32));
-      if (block_index >= (TFS_BLOCK_SIZE / sizeof(u32)))
+      block_index = (iblock - TFS_DATA_BLOCKS_PER_INODE) % si->addr_per_block;
+      if (block_index >= si->addr_per_block)
 	{
 	  printk("TFS: invalid block index: %u\n", block_index);
 	  brelse(id_bh);
-	  return -EINVAL;
+	  err = -EINVAL;
+	  goto out;
 	}
 
       printk("TFS: block_index: %u\n", block_index);
 
       block = (sector_t) *((u32 *) id_bh->b_data + block_index);
+      if (tfs_inode_compressed(inode) &&
+	  tfs_cluster_compressed_blocks((u32 *) id_bh->b_data + block_index - block_index % si->cluster_blocks,
+					si->cluster_blocks))
+	{
+	  /* compressed clusters are read by tfs_compressed_readpage; a write stores the cluster raw again */
+	  if (!create)
+	    {
+	      brelse(id_bh);
+	      goto out;
+	    }
+	  if ((err = tfs_expand_cluster(inode, id_bh, (u32 *) id_bh->b_data + block_index - block_index % si->cluster_blocks)))
+	    {
+	      brelse(id_bh);
+	      goto out;
+	    }
+	  block = (sector_t) *((u32 *) id_bh->b_data + block_index);
+	}
+      count = 1;
       if (create && !block)
 	{
 	  tfs_init_alloc_inode_info(tainfo);
-	  err = alloc_datablock_bitmap(inode->i_sb, &tainfo);
+	  err = tfs_alloc_mapped_block(inode->i_sb, &tainfo, (u32 *) id_bh->b_data, si->addr_per_block, block_index,
+				       tfs_find_goal(inode, block_index ?
+						     *((u32 *) id_bh->b_data + block_index - 1) : indirect_block));
 	  if (err)
 	    {
 	      printk("TFS: error allocating data block: %d\n", err);
@@ -360,80 +597,147 @@ alloc_indirectblock:
 	  printk("TFS: allocated data block: %u\n", tainfo.data_block);
 	  *((u32 *) id_bh->b_data + block_index) = block = tainfo.data_block;
 	  mark_buffer_dirty(id_bh);
-	  inode->i_blocks++;
+	  tfs_inode_add_block(inode);
 	  mark_inode_dirty(inode);
 	  tfs_release_inode_info_blocks(&tainfo);
+	  set_buffer_new(bh_result);
+	}
+      else if (block && create && tfs_has_shared_blocks(si))
+	{
+	  sector_t copy = block;
+
+	  if ((err = tfs_unshare_block(inode, &copy)))
+	    {
+	      brelse(id_bh);
+	      goto out;
+	    }
+	  if (copy != block)
+	    {
+	      *((u32 *) id_bh->b_data + block_index) = block = copy;
+	      mark_buffer_dirty(id_bh);
+	    }
+	}
+      else if (block)
+	{
+	  /* map as much of the contiguous run in this indirect block, or cluster, as was asked for */
+	  u32 end = tfs_inode_compressed(inode) ?
+	    block_index - block_index % si->cluster_blocks + si->cluster_blocks : si->addr_per_block;
+
+	  while (block_index + count < end &&
+		 count < (bh_result->b_size >> inode->i_blkbits) &&
+		 *((u32 *) id_bh->b_data + block_index + count) == block + count)
+	    ++count;
 	}
       
       if (!block)
 	{
-	  printk("TFS: block cannot be 0\n");
 	  brelse(id_bh);
-	  return -EINVAL;
+	  goto out;
 	}
 
       printk("TFS: data block: %u\n", (unsigned) block);
 
       map_bh(bh_result, inode->i_sb, block);
-      bh_result->b_size = 1 << inode->i_blkbits;
+      bh_result->b_size = count << inode->i_blkbits;
       printk("TFS: mapped data block=%u, size=%u\n", (unsigned) block, bh_result->b_size);
 
-      mutex_lock(&ti->cached_block_mutex);
+      if (tfs_inode_compressed(inode) || !(bc = tfs_get_block_cache(ti)))
+	{
+	  brelse(id_bh);
+	  goto out;
+	}
+
+      mutex_lock(&bc->mutex);
 
       for (i = 0; i < TFS_BLK_GRP; ++i)
 	{
-	  if (first_rounded_logical_block == ti->cached_first_logical_blocks[i])
+	  if (first_rounded_logical_block == bc->first_logical_blocks[i])
 	    {
-	      ti->cached_next_slot = i;
+	      bc->next_slot = i;
 	      break;
 	    }
 	}
 
-      if (ti->cached_next_slot == TFS_BLK_GRP)
-	ti->cached_next_slot = 0;
+      if (bc->next_slot == TFS_BLK_GRP)
+	bc->next_slot = 0;
 
-      rounded_block_index = first_rounded_relative_block % (TFS_BLOCK_SIZE / sizeof(u32));
-      printk("TFS: rounded block index: %u, next slot: %u\n", rounded_block_index, ti->cached_next_slot);
+      rounded_block_index = first_rounded_relative_block % si->addr_per_block;
+      printk("TFS: rounded block index: %u, next slot: %u\n", rounded_block_index, bc->next_slot);
 
-      write_seqlock(&ti->cached_block_seqlocks[ti->cached_next_slot]);
-      ti->cached_first_logical_blocks[ti->cached_next_slot] = first_rounded_logical_block;
+      write_seqlock(&bc->seqlocks[bc->next_slot]);
+      bc->first_logical_blocks[bc->next_slot] = first_rounded_logical_block;
 
       for (i = 0; i < TFS_BLK_PER_GRP; ++i)
 	{
-	  ti->cached_data_blocks[ti->cached_next_slot][i] = (sector_t) *(((u32 *) id_bh->b_data) + rounded_block_index + i);
-	  printk("TFS: cached data blocks[%d]=%u\n", i, (unsigned) ti->cached_data_blocks[ti->cached_next_slot][i]);
+	  bc->data_blocks[bc->next_slot][i] = (sector_t) *(((u32 *) id_bh->b_data) + rounded_block_index + i);
+	  printk("TFS: cached data blocks[%d]=%u\n", i, (unsigned) bc->data_blocks[bc->next_slot][i]);
 	}
 
-      write_sequnlock(&ti->cached_block_seqlocks[ti->cached_next_slot]);
-      ti->cached_next_slot++;
+      write_sequnlock(&bc->seqlocks[bc->next_slot]);
+      bc->next_slot++;
 
-      mutex_unlock(&ti->cached_block_mutex);
+      mutex_unlock(&bc->mutex);
 
       brelse(id_bh);
     }
 
-  return 0;
+ out:
+  if (map_lock)
+    mutex_unlock(map_lock);
+  return err;
 error_alloc:
   tfs_error_inode_info(&tainfo);
-  return err;
+  goto out;
 }
 
 
 static int tfs_readpages(struct file *file, struct address_space *mapping, struct list_head *pages, unsigned nr_pages)
 {
   printk("TFS: tfs_readpages: %u\n", (unsigned int) mapping->host->i_ino);
+  if (tfs_inode_compressed(mapping->host))
+    return tfs_compressed_readpages(file, mapping, pages, nr_pages);
   return mpage_readpages(mapping, pages, nr_pages, tfs_getblocks);
 }
 
+/*
+ * Buffers of a page may still point at blocks that have been shared
+ * since they were mapped. Unmap those, so that writing the page asks
+ * tfs_getblocks again and gets a copy of the block instead.
+ */
+static void tfs_unmap_shared_buffers(struct page *page)
+{
+  struct super_block *sb = page->mapping->host->i_sb;
+  struct buffer_head *head, *bh;
+
+  if (!page_has_buffers(page))
+    return;
+
+  bh = head = page_buffers(page);
+  do
+    {
+      if (buffer_mapped(bh) && tfs_block_shared(sb, bh->b_blocknr) > 0)
+	clear_buffer_mapped(bh);
+      bh = bh->b_this_page;
+    }
+  while (bh != head);
+}
+
 static int tfs_writepages(struct address_space *mapping, struct writeback_control *wbc)
 {
   printk("TFS: tfs_writepages: %u, %u\n", (unsigned int) mapping->host->i_ino, (unsigned) wbc->nr_to_write);
+
+  /* mpage_writepages would write mapped buffers without asking */
+  if (tfs_has_shared_blocks(mapping->host->i_sb->s_fs_info))
+    return generic_writepages(mapping, wbc);
+
   return mpage_writepages(mapping, wbc, tfs_getblocks);
 }
 
 static int tfs_readpage(struct file *file, struct page *page)
 {
   printk("TFS: tfs_readpage: %u\n", (unsigned int) page->mapping->host->i_ino);
+  if (tfs_inode_compressed(page->mapping->host))
+    return tfs_compressed_readpage(file, page);
   return mpage_readpage(page, tfs_getblocks);
 }
 
@@ -441,6 +745,12 @@ static int tfs_writepage(struct page *page, struct writeback_control *wbc)
 {
   printk("TFS: tfs_writepage: %u\n", (unsigned int) page->mapping->host->i_ino);
 
+  if (tfs_has_shared_blocks(page->mapping->host->i_sb->s_fs_info))
+    {
+      tfs_unmap_shared_buffers(page);
+      return block_write_full_page(page, tfs_getblocks, wbc);
+    }
+
   return mpage_writepage(page, tfs_getblocks, wbc);
 }
 
@@ -480,6 +790,33 @@ int tfs_write_end(struct file *file, struct address_space *mapping,
   return generic_write_end(file, mapping, pos, len, copied, page, fsdata);
 }
 
+/*
+ * With 'nobh' regular files keep no buffer_heads attached to their
+ * pages: writes map the blocks of a page, do the I/O and drop the
+ * buffers again, and writeback goes through mpage_writepages.
+ */
+static int tfs_nobh_writepage(struct page *page, struct writeback_control *wbc)
+{
+  printk("TFS: tfs_nobh_writepage: %u\n", (unsigned int) page->mapping->host->i_ino);
+
+  if (tfs_has_shared_blocks(page->mapping->host->i_sb->s_fs_info))
+    {
+      tfs_unmap_shared_buffers(page);
+      return block_write_full_page(page, tfs_getblocks, wbc);
+    }
+
+  return nobh_writepage(page, tfs_getblocks, wbc);
+}
+
+static int tfs_nobh_write_begin(struct file *file, struct address_space *mapping,
+				loff_t pos, unsigned len, unsigned flags,
+				struct page **pagep, void **fsdata)
+{
+  printk("TFS: tfs_nobh_write_begin: %u\n", (unsigned int) mapping->host->i_ino);
+
+  return nobh_write_begin(file, mapping, pos, len, flags, pagep, fsdata, tfs_getblocks);
+}
+
 
 int tfs_commit_write(struct page *page, loff_t pos, unsigned len)
 {
@@ -506,6 +843,124 @@ int tfs_commit_write(struct page *page, loff_t pos, unsigned len)
   return err;
 }
 
+/*
+ * Describe the run of blocks from 'lblock' up to at most 'end': either
+ * physically contiguous mapped blocks, with *pblock set to the first,
+ * or a hole, with *pblock 0. A missing indirect block is skipped as one
+ * piece of hole. The rest of a compressed cluster is one run of its own,
+ * starting at its first block, with *encoded set.
+ */
+static int tfs_map_run(struct inode *inode, sector_t lblock, sector_t end, sector_t *pblock, sector_t *len,
+		       int *encoded)
+{
+  struct tfs_inode_info *ti = TFS_INODE(inode);
+  struct tfs_sb_info *si = inode->i_sb->s_fs_info;
+  struct buffer_head *rid_bh = NULL, *id_bh = NULL;
+  u32 apb = si->addr_per_block, index = 0, indirect_block, cb = si->cluster_blocks, *e;
+  sector_t first = 0, n = 0, l, rel, b;
+  int err = 0;
+
+  *encoded = 0;
+  while (lblock + n < end)
+    {
+      l = lblock + n;
+      if (l < TFS_DATA_BLOCKS_PER_INODE)
+	b = ti->data_blocks[l];
+      else
+	{
+	  rel = l - TFS_DATA_BLOCKS_PER_INODE;
+	  if (!ti->root_indirect_data_block || rel / apb >= apb)
+	    {
+	      if (!n || !first)
+		n = end - lblock;
+	      break;
+	    }
+
+	  if (!rid_bh && !(rid_bh = sb_bread(inode->i_sb, ti->root_indirect_data_block)))
+	    {
+	      err = -EIO;
+	      break;
+	    }
+
+	  if (!id_bh || rel / apb != index)
+	    {
+	      if (id_bh)
+		brelse(id_bh);
+	      id_bh = NULL;
+	      index = rel / apb;
+	      indirect_block = *((u32 *) rid_bh->b_data + index);
+	      if (indirect_block && !(id_bh = sb_bread(inode->i_sb, indirect_block)))
+		{
+		  err = -EIO;
+		  break;
+		}
+	    }
+
+	  if (!id_bh)
+	    {
+	      if (n && first)
+		break;
+	      n += min_t(sector_t, apb - rel % apb, end - l);
+	      continue;
+	    }
+
+	  e = (u32 *) id_bh->b_data + rel % apb;
+	  if (tfs_inode_compressed(inode) && tfs_cluster_compressed_blocks(e - rel % cb, cb))
+	    {
+	      if (!n)
+		{
+		  first = *(e - rel % cb);
+		  n = min_t(sector_t, cb - rel % cb, end - l);
+		  *encoded = 1;
+		}
+	      break;
+	    }
+	  b = *e;
+	}
+
+      if (!n)
+	first = b;
+      else if (first ? b != first + n : b != 0)
+	break;
+      ++n;
+    }
+
+  if (id_bh)
+    brelse(id_bh);
+  if (rid_bh)
+    brelse(rid_bh);
+
+  *pblock = first;
+  *len = n;
+
+  return err;
+}
+
+/* first offset at or after 'offset' holding data (or a hole) */
+static loff_t tfs_seek_data(struct inode *inode, loff_t offset, int data)
+{
+  unsigned blkbits = inode->i_blkbits;
+  loff_t size = i_size_read(inode);
+  sector_t lblock, nblocks, pblock, len;
+  int err, encoded;
+
+  if (offset >= size)
+    return -ENXIO;
+
+  nblocks = (size + inode->i_sb->s_blocksize - 1) >> blkbits;
+  for (lblock = offset >> blkbits; lblock < nblocks; lblock += len)
+    {
+      if ((err = tfs_map_run(inode, lblock, nblocks, &pblock, &len, &encoded)))
+	return err;
+
+      if (!pblock == !data)
+	return max_t(loff_t, offset, (loff_t) lblock << blkbits);
+    }
+
+  /* there is always an implicit hole at the end of the file */
+  return data ? -ENXIO : size;
+}
+
 loff_t tfs_llseek(struct file *file, loff_t offset, int origin)
 {
   loff_t ret;
@@ -513,32 +968,29 @@ loff_t tfs_llseek(struct file *file, loff_t offset, int origin)
 
   printk("TFS: tfs_llseek: %u\n", (unsigned int) inode->i_ino);
 
-  mutex_lock(&file->f_dentry->d_inode->i_mutex);
+  mutex_lock(&inode->i_mutex);
 
-  switch(origin)
+  switch (origin)
     {
-    case SEEK_SET: 
-      if (offset > inode->i_size)
-	{
-	  ret = -EINVAL;
-	  goto unlock_llseek_mutex;
-	}
-      break;
     case SEEK_END:
-      if ((offset + inode->i_size) > inode->i_size)
+      offset += i_size_read(inode);
+      break;
+    case SEEK_CUR:
+      offset += file->f_pos;
+      break;
+    case SEEK_DATA:
+    case SEEK_HOLE:
+      if (!S_ISREG(inode->i_mode))
 	{
 	  ret = -EINVAL;
 	  goto unlock_llseek_mutex;
 	}
-      offset += inode->i_size;
-      break;
-    case SEEK_CUR:
-      if ((offset + file->f_pos) > inode->i_size)
+      offset = tfs_seek_data(inode, offset, origin == SEEK_DATA);
+      if (offset < 0)
 	{
-	  ret = -EINVAL;
+	  ret = offset;
 	  goto unlock_llseek_mutex;
 	}
-      offset += file->f_pos;
       break;
     }
 
@@ -553,27 +1005,88 @@ loff_t tfs_llseek(struct file *file, loff_t offset, int origin)
       file->f_pos = offset;
       file->f_version = 0;
     }
+  ret = offset;
 
 unlock_llseek_mutex:
-  mutex_unlock(&file->f_dentry->d_inode->i_mutex);
+  mutex_unlock(&inode->i_mutex);
 
   return ret;
 }
 
+/*
+ * Report the mapped runs of the file, merged across block and indirect
+ * block boundaries. An extent is held back until the next one is found
+ * so that the last one can be flagged.
+ */
+int tfs_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo, u64 start, u64 len)
+{
+  unsigned blkbits = inode->i_blkbits;
+  sector_t lblock, end, nblocks, pblock, n;
+  sector_t prev_lblock = 0, prev_pblock = 0, prev_len = 0;
+  int err, encoded, prev_flags = 0;
+
+  if ((err = fiemap_check_flags(fieinfo, FIEMAP_FLAG_SYNC)))
+    return err;
+
+  mutex_lock(&inode->i_mutex);
+
+  nblocks = (i_size_read(inode) + inode->i_sb->s_blocksize - 1) >> blkbits;
+  lblock = start >> blkbits;
+  end = len >= ((u64) nblocks << blkbits) ? nblocks :
+    min_t(sector_t, nblocks, (start + len + inode->i_sb->s_blocksize - 1) >> blkbits);
+
+  for ( ; lblock < nblocks; lblock += n)
+    {
+      if ((err = tfs_map_run(inode, lblock, nblocks, &pblock, &n, &encoded)))
+	break;
+      if (!pblock)
+	continue;
+
+      if (prev_len)
+	{
+	  err = fiemap_fill_next_extent(fieinfo, (u64) prev_lblock << blkbits, (u64) prev_pblock << blkbits,
+					(u64) prev_len << blkbits, prev_flags);
+	  prev_len = 0;
+	  if (err)
+	    break;
+	}
+
+      if (lblock >= end)
+	break;
+
+      prev_lblock = lblock;
+      prev_pblock = pblock;
+      prev_len = n;
+      prev_flags = encoded ? FIEMAP_EXTENT_ENCODED : 0;
+    }
+
+  if (!err && prev_len)
+    err = fiemap_fill_next_extent(fieinfo, (u64) prev_lblock << blkbits, (u64) prev_pblock << blkbits,
+				  (u64) prev_len << blkbits, prev_flags | (lblock >= nblocks ? FIEMAP_EXTENT_LAST : 0));
+
+  mutex_unlock(&inode->i_mutex);
+
+  /* 1 means the caller's extent array is full */
+  return err == 1 ? 0 : err;
+}
+
 int tfs_fsync(struct file *file, struct dentry *dentry, int datasync)
 {
   struct inode *inode = dentry->d_inode;
 
   printk("TFS: tfs_fsync: %u\n", (unsigned int) inode->i_ino);
 
+  /* deferred lazytime timestamps leave the inode clean but must go out */
+  if (!datasync && test_bit(TFS_INODE_LAZY_TIMES, &TFS_INODE(inode)->state))
+    return tfs_sync_inode(inode);
+
   if (!(inode->i_state & I_DIRTY))
     return 0;
 
   if (datasync && !(inode->i_state & I_DIRTY_DATASYNC))
     return 0;
 
-  tfs_sync_inode(dentry->d_inode);
-  return 0;
+  return tfs_sync_inode(dentry->d_inode);
 }
 
 static const struct address_space_operations tfs_aops =
@@ -587,3 +1100,15 @@ static const struct address_space_operations tfs_aops =
     .write_begin = tfs_write_begin,
     .write_end = tfs_write_end
   };
+
+static const struct address_space_operations tfs_nobh_aops =
+  {
+    .readpage = tfs_readpage,
+    .writepage = tfs_nobh_writepage,
+    .readpages = tfs_readpages,
+    .writepages = tfs_writepages,
+    .bmap = tfs_bmap,
+    .sync_page = block_sync_page,
+    .write_begin = tfs_nobh_write_begin,
+    .write_end = nobh_write_end
+  };
@@ -0,0 +1,125 @@
+#include <linux/fs.h>
+#include <linux/file.h>
+#include <linux/capability.h>
+#include <linux/uaccess.h>
+
+#include "tfs_module.h"
+
+long tfs_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+  struct inode *inode = filp->f_path.dentry->d_inode;
+  struct super_block *sb = inode->i_sb;
+
+  printk("TFS: tfs_ioctl: %u, %x\n", (unsigned int) inode->i_ino, cmd);
+
+  switch (cmd)
+    {
+    case FITRIM:
+      {
+	struct fstrim_range range;
+	int err;
+
+	if (!capable(CAP_SYS_ADMIN))
+	  return -EPERM;
+	if (sb->s_flags & MS_RDONLY)
+	  return -EROFS;
+	if (copy_from_user(&range, (struct fstrim_range __user *) arg, sizeof(range)))
+	  return -EFAULT;
+
+	err = tfs_trim_fs(sb, &range);
+	if (err)
+	  return err;
+
+	if (copy_to_user((struct fstrim_range __user *) arg, &range, sizeof(range)))
+	  return -EFAULT;
+	return 0;
+      }
+    case FS_IOC_GETFLAGS:
+      {
+	int flags = TFS_INODE(inode)->flags & TFS_INODE_COMPRESS ? FS_COMPR_FL : 0;
+
+	return put_user(flags, (int __user *) arg);
+      }
+    case FS_IOC_SETFLAGS:
+      {
+	struct tfs_inode_info *ti = TFS_INODE(inode);
+	struct tfs_sb_info *si = sb->s_fs_info;
+	int flags;
+
+	if (!is_owner_or_cap(inode))
+	  return -EACCES;
+	if (sb->s_flags & MS_RDONLY)
+	  return -EROFS;
+	if (get_user(flags, (int __user *) arg))
+	  return -EFAULT;
+	/* compression is the only flag there is */
+	if (flags & ~FS_COMPR_FL)
+	  return -EOPNOTSUPP;
+	if ((flags & FS_COMPR_FL) && (!S_ISREG(inode->i_mode) || !si->cluster_blocks))
+	  return -EOPNOTSUPP;
+
+	mutex_lock(&inode->i_mutex);
+	if (flags & FS_COMPR_FL)
+	  ti->flags |= TFS_INODE_COMPRESS;
+	else
+	  ti->flags &= ~TFS_INODE_COMPRESS;
+	inode->i_ctime = CURRENT_TIME_SEC;
+	mark_inode_dirty(inode);
+	mutex_unlock(&inode->i_mutex);
+
+	/* a file nobody writes is compressed now, the others on their last close */
+	if ((flags & FS_COMPR_FL) && !atomic_read(&inode->i_writecount))
+	  tfs_queue_compress(inode);
+	return 0;
+      }
+    case TFS_IOC_DEFRAG:
+      {
+	struct tfs_defrag_range range;
+	int err;
+
+	if (!S_ISREG(inode->i_mode))
+	  return -EINVAL;
+	if (!(filp->f_mode & FMODE_WRITE))
+	  return -EBADF;
+	if (!is_owner_or_cap(inode))
+	  return -EACCES;
+	if (copy_from_user(&range, (struct tfs_defrag_range __user *) arg, sizeof(range)))
+	  return -EFAULT;
+
+	mutex_lock(&inode->i_mutex);
+	down_write(&TFS_INODE(inode)->truncate_sem);
+	err = tfs_defrag(inode, &range);
+	up_write(&TFS_INODE(inode)->truncate_sem);
+	mutex_unlock(&inode->i_mutex);
+	if (err)
+	  return err;
+
+	if (copy_to_user((struct tfs_defrag_range __user *) arg, &range, sizeof(range)))
+	  return -EFAULT;
+	return 0;
+      }
+    case FICLONE:
+    case FICLONERANGE:
+      {
+	struct file_clone_range range;
+	struct file *src_file;
+	int err;
+
+	if (cmd == FICLONE)
+	  {
+	    memset(&range, 0, sizeof(range));
+	    range.src_fd = (int) arg;
+	  }
+	else if (copy_from_user(&range, (struct file_clone_range __user *) arg, sizeof(range)))
+	  return -EFAULT;
+
+	if (!(src_file = fget(range.src_fd)))
+	  return -EBADF;
+	err = tfs_clone_range(filp, src_file, range.src_offset, range.src_length, range.dest_offset);
+	fput(src_file);
+	return err;
+      }
+    default:
+      return -ENOTTY;
+    }
+}
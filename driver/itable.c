@@ -0,0 +1,127 @@
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+
+#include "tfs_module.h"
+#include "alloc.h"
+
+/*
+ * Dynamic inode tables: the chunk map block stays in memory for the
+ * life of the mount, so translating an inode number costs no I/O.
+ */
+int tfs_init_itable_map(struct super_block *sb)
+{
+  struct tfs_sb_info *si = sb->s_fs_info;
+  struct tfs_super_block *tsb = si->super_block;
+
+  if (!(tsb->flags & TFS_SB_ITABLE_DYNAMIC))
+    return 0;
+
+  if (tsb->blocks_per_group || (tsb->flags & TFS_SB_ITABLE_UNINIT) || tsb->alloc_bits ||
+      !tsb->itable_chunk_blocks || tsb->itable_chunk_blocks > si->bits_per_block ||
+      tsb->inode_table_blocks % tsb->itable_chunk_blocks ||
+      tsb->inode_table_blocks / tsb->itable_chunk_blocks > si->addr_per_block ||
+      !tsb->itable_map_block || tsb->itable_map_block >= tsb->inode_table_block_start)
+    {
+      printk("TFS: invalid dynamic inode table\n");
+      return -EINVAL;
+    }
+
+  if (!(si->itable_map_bh = sb_bread(sb, tsb->itable_map_block)))
+    {
+      printk("TFS: unable to read inode table map: %u\n", tsb->itable_map_block);
+      return -EIO;
+    }
+  si->itable_map = (u32 *) si->itable_map_bh->b_data;
+
+  if (si->itable_map[0] != tsb->inode_table_block_start)
+    {
+      printk("TFS: inode table map does not start at the inode table\n");
+      tfs_release_itable_map(sb);
+      return -EINVAL;
+    }
+
+  return 0;
+}
+
+void tfs_release_itable_map(struct super_block *sb)
+{
+  struct tfs_sb_info *si = sb->s_fs_info;
+
+  if (si->itable_map_bh)
+    brelse(si->itable_map_bh);
+  si->itable_map_bh = NULL;
+  si->itable_map = NULL;
+}
+
+/*
+ * Make sure the chunk holding inode 'ino' exists. A new chunk is a
+ * contiguous run after the last chunk, zeroed on disk before the map
+ * names it. Called with inode_bitmap_mutex held, which serializes
+ * changes to the map.
+ */
+int tfs_grow_inode_table(struct super_block *sb, u32 ino)
+{
+  struct tfs_sb_info *si = sb->s_fs_info;
+  struct tfs_super_block *tsb = si->super_block;
+  struct buffer_head *bhs[TFS_ITABLE_SYNC_BATCH];
+  u32 n = tsb->itable_chunk_blocks;
+  u32 chunk = ino / si->inodes_per_block / n;
+  sector_t goal, start;
+  int i, j, count, err;
+
+  if (!(tsb->flags & TFS_SB_ITABLE_DYNAMIC) || si->itable_map[chunk])
+    return 0;
+
+  goal = tfs_group_data_start(si, 0);
+  for (i = chunk; i-- > 0; )
+    if (si->itable_map[i])
+      {
+	goal = si->itable_map[i] + n;
+	break;
+      }
+
+  if ((err = tfs_alloc_block_run(sb, goal, n, &start)))
+    return err;
+
+  for (i = 0; i < n && !err; i += count)
+    {
+      for (count = 0; count < TFS_ITABLE_SYNC_BATCH && i + count < n; ++count)
+	{
+	  if (!(bhs[count] = sb_getblk(sb, start + i + count)))
+	    {
+	      err = -EIO;
+	      break;
+	    }
+
+	  lock_buffer(bhs[count]);
+	  memset(bhs[count]->b_data, 0, sb->s_blocksize);
+	  set_buffer_uptodate(bhs[count]);
+	  unlock_buffer(bhs[count]);
+	  mark_buffer_dirty(bhs[count]);
+	}
+
+      ll_rw_block(SWRITE, count, bhs);
+      for (j = 0; j < count; ++j)
+	{
+	  wait_on_buffer(bhs[j]);
+	  if (buffer_req(bhs[j]) && !buffer_uptodate(bhs[j]))
+	    err = -EIO;
+	  brelse(bhs[j]);
+	}
+    }
+
+  if (err)
+    {
+      printk("TFS: error zeroing inode table chunk %u at %u\n", chunk, (unsigned) start);
+      tfs_free_block_range(sb, start, n);
+      return err;
+    }
+
+  si->itable_map[chunk] = start;
+  mark_buffer_dirty(si->itable_map_bh);
+  sync_dirty_buffer(si->itable_map_bh);
+
+  printk("TFS: inode table chunk %u at %u\n", chunk, (unsigned) start);
+
+  return 0;
+}
@@ -0,0 +1,279 @@
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/vmalloc.h>
+
+#include "tfs_module.h"
+
+/*
+ * Table blocks past the on-disk high-water mark are zeroed one at a
+ * time, when one of their inodes is first allocated, before its bit is
+ * set; the background thread zeroes the rest in order and moves the
+ * mark. So a block past the mark has been zeroed exactly when the inode
+ * bitmap has a bit set for one of its inodes, which is how
+ * itable_init_map is rebuilt at mount.
+ */
+int tfs_init_lazy_itable(struct super_block *sb)
+{
+  struct tfs_sb_info *si = sb->s_fs_info;
+  struct tfs_super_block *tsb = si->super_block;
+  u32 first = tsb->inode_table_init_blocks * si->inodes_per_block;
+  u32 b, bit, nbits, index = 0;
+  struct buffer_head *bh;
+
+  if (!(tsb->flags & TFS_SB_ITABLE_UNINIT))
+    return 0;
+
+  si->itable_init_map = vmalloc(BITS_TO_LONGS(tsb->inode_table_blocks) * sizeof(unsigned long));
+  if (!si->itable_init_map)
+    return -ENOMEM;
+  memset(si->itable_init_map, 0, BITS_TO_LONGS(tsb->inode_table_blocks) * sizeof(unsigned long));
+
+  for (b = first / si->bits_per_block; (u64) b * si->bits_per_block < tsb->inode_table_entries; ++b)
+    {
+      if (!(bh = sb_bread(sb, tsb->inode_bitmap_block_start + b)))
+	{
+	  printk("TFS: error reading inode bitmap block: %u\n", tsb->inode_bitmap_block_start + b);
+	  vfree(si->itable_init_map);
+	  si->itable_init_map = NULL;
+	  return -EIO;
+	}
+
+      nbits = min_t(u64, si->bits_per_block, tsb->inode_table_entries - (u64) b * si->bits_per_block);
+      bit = b == first / si->bits_per_block ? first % si->bits_per_block : 0;
+      for (bit = find_next_bit((unsigned long *) bh->b_data, nbits, bit); bit < nbits;
+	   bit = find_next_bit((unsigned long *) bh->b_data, nbits, (index + 1) * si->inodes_per_block -
+			       b * si->bits_per_block))
+	{
+	  index = (b * si->bits_per_block + bit) / si->inodes_per_block;
+	  __set_bit(index, si->itable_init_map);
+	}
+      brelse(bh);
+    }
+
+  return 0;
+}
+
+void tfs_release_lazy_itable(struct super_block *sb)
+{
+  struct tfs_sb_info *si = sb->s_fs_info;
+
+  vfree(si->itable_init_map);
+  si->itable_init_map = NULL;
+}
+
+static int tfs_itable_index_initialized(struct tfs_sb_info *si, u32 index)
+{
+  struct tfs_super_block *tsb = si->super_block;
+
+  return !(tsb->flags & TFS_SB_ITABLE_UNINIT) || index < tsb->inode_table_init_blocks ||
+    index >= tsb->inode_table_blocks || test_bit(index, si->itable_init_map);
+}
+
+int tfs_itable_block_initialized(struct super_block *sb, sector_t block)
+{
+  struct tfs_sb_info *si = sb->s_fs_info;
+
+  return tfs_itable_index_initialized(si, tfs_itable_index(si->super_block, block));
+}
+
+/* zero the given inode table blocks and wait for them to reach the disk */
+static int tfs_zero_itable_blocks(struct super_block *sb, const u32 *indices, int count)
+{
+  struct tfs_sb_info *si = sb->s_fs_info;
+  struct buffer_head *bhs[TFS_LAZY_INIT_BATCH];
+  int i, n = 0, err = 0;
+
+  for (i = 0; i < count; ++i)
+    {
+      struct buffer_head *bh = sb_getblk(sb, tfs_itable_block(si->super_block, indices[i]));
+      if (!bh)
+	{
+	  err = -EIO;
+	  break;
+	}
+
+      lock_buffer(bh);
+      memset(bh->b_data, 0, sb->s_blocksize);
+      set_buffer_uptodate(bh);
+      unlock_buffer(bh);
+      mark_buffer_dirty(bh);
+      bhs[n++] = bh;
+    }
+
+  ll_rw_block(SWRITE, n, bhs);
+  for (i = 0; i < n; ++i)
+    {
+      wait_on_buffer(bhs[i]);
+      if (buffer_req(bhs[i]) && !buffer_uptodate(bhs[i]))
+	err = -EIO;
+      brelse(bhs[i]);
+    }
+
+  return err;
+}
+
+/*
+ * Make sure table block 'index' is zeroed on disk. Called before an
+ * inode bit in it is set, and before a write to it.
+ */
+int tfs_init_itable_block(struct super_block *sb, u32 index)
+{
+  struct tfs_sb_info *si = sb->s_fs_info;
+  int err = 0;
+
+  if (tfs_itable_index_initialized(si, index))
+    return 0;
+
+  mutex_lock(&si->lazy_init_mutex);
+  if (!tfs_itable_index_initialized(si, index) && !(err = tfs_zero_itable_blocks(sb, &index, 1)))
+    set_bit(index, si->itable_init_map);
+  mutex_unlock(&si->lazy_init_mutex);
+
+  if (err)
+    printk("TFS: error initializing inode table block %u\n", index);
+
+  return err;
+}
+
+/*
+ * Zero the blocks from the high-water mark up to (not including) table
+ * block 'upto' that are not zeroed yet, then advance the mark; the
+ * super block records it only once they are on disk. Called with
+ * lazy_init_mutex held.
+ */
+static int tfs_advance_itable_mark(struct super_block *sb, u32 upto)
+{
+  struct tfs_sb_info *si = sb->s_fs_info;
+  struct tfs_super_block *tsb = si->super_block;
+  u32 indices[TFS_LAZY_INIT_BATCH];
+  u32 i;
+  int count = 0, err;
+
+  for (i = tsb->inode_table_init_blocks; i < upto; ++i)
+    if (!test_bit(i, si->itable_init_map))
+      indices[count++] = i;
+
+  if ((err = tfs_zero_itable_blocks(sb, indices, count)))
+    return err;
+
+  tsb->inode_table_init_blocks = upto;
+  if (upto >= tsb->inode_table_blocks)
+    {
+      tsb->flags &= ~TFS_SB_ITABLE_UNINIT;
+      printk("TFS: inode table initialized\n");
+    }
+
+  mark_buffer_dirty(si->bh);
+  sb->s_dirt = 1;
+
+  return 0;
+}
+
+/*
+ * Read an inode table block. A block never zeroed is zeroed on disk
+ * first, by itself; on a read-only mount it is only zeroed in memory.
+ */
+struct buffer_head *tfs_bread_itable(struct super_block *sb, sector_t block)
+{
+  struct tfs_sb_info *si = sb->s_fs_info;
+  struct tfs_super_block *tsb = si->super_block;
+  struct buffer_head *bh;
+
+  /* an inode in a chunk of a dynamic table that was never allocated */
+  if (!block)
+    {
+      printk("TFS: inode table block not allocated\n");
+      return NULL;
+    }
+
+  if (tfs_itable_block_initialized(sb, block))
+    return sb_bread(sb, block);
+
+  if (sb->s_flags & MS_RDONLY)
+    {
+      if (!(bh = sb_getblk(sb, block)))
+	return NULL;
+
+      lock_buffer(bh);
+      if (!buffer_uptodate(bh))
+	{
+	  memset(bh->b_data, 0, sb->s_blocksize);
+	  set_buffer_uptodate(bh);
+	}
+      unlock_buffer(bh);
+
+      return bh;
+    }
+
+  if (tfs_init_itable_block(sb, tfs_itable_index(tsb, block)))
+    return NULL;
+
+  return sb_bread(sb, block);
+}
+
+static int tfs_lazy_init_thread(void *data)
+{
+  struct super_block *sb = data;
+  struct tfs_sb_info *si = sb->s_fs_info;
+  struct tfs_super_block *tsb = si->super_block;
+  u32 upto;
+  int err = 0;
+
+  printk("TFS: lazy inode table init started at block %u of %u\n",
+	 tsb->inode_table_init_blocks, tsb->inode_table_blocks);
+
+  while (!kthread_should_stop() && !err)
+    {
+      mutex_lock(&si->lazy_init_mutex);
+      if (!(tsb->flags & TFS_SB_ITABLE_UNINIT))
+	{
+	  mutex_unlock(&si->lazy_init_mutex);
+	  break;
+	}
+
+      upto = min_t(u32, tsb->inode_table_init_blocks + TFS_LAZY_INIT_BATCH, tsb->inode_table_blocks);
+      err = tfs_advance_itable_mark(sb, upto);
+      mutex_unlock(&si->lazy_init_mutex);
+
+      if (err)
+	printk("TFS: lazy inode table init failed: %d\n", err);
+
+      schedule_timeout_interruptible(TFS_LAZY_INIT_DELAY);
+    }
+
+  while (!kthread_should_stop())
+    schedule_timeout_interruptible(HZ);
+
+  return 0;
+}
+
+void tfs_start_lazy_init(struct super_block *sb)
+{
+  struct tfs_sb_info *si = sb->s_fs_info;
+  struct task_struct *task;
+
+  if (!(si->super_block->flags & TFS_SB_ITABLE_UNINIT) || (sb->s_flags & MS_RDONLY))
+    return;
+
+  task = kthread_run(tfs_lazy_init_thread, sb, "tfs_lazyinit");
+  if (IS_ERR(task))
+    {
+      printk("TFS: unable to start lazy init thread: %ld\n", PTR_ERR(task));
+      return;
+    }
+
+  si->lazy_init_task = task;
+}
+
+void tfs_stop_lazy_init(struct super_block *sb)
+{
+  struct tfs_sb_info *si = sb->s_fs_info;
+
+  if (si->lazy_init_task)
+    {
+      kthread_stop(si->lazy_init_task);
+      si->lazy_init_task = NULL;
+    }
+}
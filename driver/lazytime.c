@@ -0,0 +1,113 @@
+#include <linux/fs.h>
+#include <linux/list.h>
+#include <linux/rwsem.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+
+#include "tfs_module.h"
+
+/*
+ * With the lazytime mount option an inode write that would change only
+ * the on-disk timestamps leaves the inode table block alone and puts
+ * the inode on si->lazy_list instead. The times reach the disk with the
+ * next write of the inode for any other reason, when the inode is
+ * evicted, on sync, or from the expiry work below.
+ */
+void tfs_defer_times(struct inode *inode)
+{
+  struct tfs_sb_info *si = inode->i_sb->s_fs_info;
+  struct tfs_inode_info *ti = TFS_INODE(inode);
+
+  spin_lock(&si->lazy_lock);
+  if (!test_and_set_bit(TFS_INODE_LAZY_TIMES, &ti->state))
+    list_add_tail(&ti->lazy_list, &si->lazy_list);
+  spin_unlock(&si->lazy_lock);
+}
+
+void tfs_forget_times(struct inode *inode)
+{
+  struct tfs_sb_info *si = inode->i_sb->s_fs_info;
+  struct tfs_inode_info *ti = TFS_INODE(inode);
+
+  if (!test_bit(TFS_INODE_LAZY_TIMES, &ti->state))
+    return;
+
+  spin_lock(&si->lazy_lock);
+  if (test_and_clear_bit(TFS_INODE_LAZY_TIMES, &ti->state))
+    list_del_init(&ti->lazy_list);
+  spin_unlock(&si->lazy_lock);
+}
+
+/*
+ * Write out every inode with deferred timestamps. Inodes on their way
+ * out are left on the list; tfs_clear_inode() writes those.
+ */
+int tfs_flush_lazy_times(struct super_block *sb, int wait)
+{
+  struct tfs_sb_info *si = sb->s_fs_info;
+  struct tfs_inode_info *ti;
+  struct inode *inode;
+  LIST_HEAD(list);
+  int ret, err = 0;
+
+  spin_lock(&si->lazy_lock);
+  list_splice_init(&si->lazy_list, &list);
+  while (!list_empty(&list))
+    {
+      ti = list_first_entry(&list, struct tfs_inode_info, lazy_list);
+      if (!(inode = igrab(&ti->inode)))
+	{
+	  list_move_tail(&ti->lazy_list, &si->lazy_list);
+	  continue;
+	}
+
+      list_del_init(&ti->lazy_list);
+      clear_bit(TFS_INODE_LAZY_TIMES, &ti->state);
+      spin_unlock(&si->lazy_lock);
+
+      if ((ret = tfs_update_inode(inode, wait, 0)))
+	{
+	  printk("TFS: error writing timestamps of inode: %u\n", (unsigned int) inode->i_ino);
+	  err = ret;
+	}
+      iput(inode);
+
+      spin_lock(&si->lazy_lock);
+    }
+  spin_unlock(&si->lazy_lock);
+
+  return err;
+}
+
+static void tfs_lazytime_work(struct work_struct *work)
+{
+  struct tfs_sb_info *si = container_of(work, struct tfs_sb_info, lazytime_work.work);
+  struct super_block *sb = si->sb;
+
+  /* an unmount in progress writes the times itself */
+  if (down_read_trylock(&sb->s_umount))
+    {
+      if (sb->s_root)
+	tfs_flush_lazy_times(sb, 0);
+      up_read(&sb->s_umount);
+    }
+
+  queue_delayed_work(si->free_wq, &si->lazytime_work, TFS_LAZYTIME_EXPIRE);
+}
+
+void tfs_start_lazytime(struct super_block *sb)
+{
+  struct tfs_sb_info *si = sb->s_fs_info;
+
+  INIT_DELAYED_WORK(&si->lazytime_work, tfs_lazytime_work);
+
+  if (si->mount_opts & TFS_MOUNT_LAZYTIME)
+    queue_delayed_work(si->free_wq, &si->lazytime_work, TFS_LAZYTIME_EXPIRE);
+}
+
+void tfs_stop_lazytime(struct super_block *sb)
+{
+  struct tfs_sb_info *si = sb->s_fs_info;
+
+  cancel_delayed_work_sync(&si->lazytime_work);
+}
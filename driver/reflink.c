@@ -0,0 +1,509 @@
+#include <linux/fs.h>
+#include <linux/pagemap.h>
+#include <linux/buffer_head.h>
+#include <linux/sched.h>
+
+#include "tfs_module.h"
+#include "alloc.h"
+
+/* the refcount table buffer covering 'block', with *p at its byte */
+static struct buffer_head *tfs_refcount_bh(struct super_block *sb, sector_t block, u8 **p)
+{
+  struct tfs_sb_info *si = sb->s_fs_info;
+  struct buffer_head *bh;
+
+  bh = sb_bread(sb, si->super_block->refcount_block_start + (block >> sb->s_blocksize_bits));
+  if (!bh)
+    {
+      printk("TFS: error reading reference count of block: %u\n", (unsigned) block);
+      return NULL;
+    }
+
+  *p = (u8 *) bh->b_data + (block & (sb->s_blocksize - 1));
+  return bh;
+}
+
+static void tfs_shared_blocks_add(struct super_block *sb, int delta)
+{
+  struct tfs_sb_info *si = sb->s_fs_info;
+
+  si->super_block->shared_blocks += delta;
+  sb->s_dirt = 1;
+}
+
+int tfs_block_shared(struct super_block *sb, sector_t block)
+{
+  struct tfs_sb_info *si = sb->s_fs_info;
+  struct buffer_head *bh;
+  int shared;
+  u8 *p;
+
+  if (!tfs_has_shared_blocks(si) || !tfs_data_block_valid(si, block))
+    return 0;
+
+  if (!(bh = tfs_refcount_bh(sb, block, &p)))
+    return -EIO;
+  shared = *p != 0;
+  brelse(bh);
+
+  return shared;
+}
+
+/*
+ * Drop one reference on 'block' if it has more than one owner. Returns
+ * 1 if it did, 0 if the caller held the last reference. Called with
+ * refcount_mutex held.
+ */
+static int tfs_unref_block(struct super_block *sb, sector_t block)
+{
+  struct buffer_head *bh;
+  u8 *p;
+
+  if (!(bh = tfs_refcount_bh(sb, block, &p)))
+    return -EIO;
+
+  if (!*p)
+    {
+      brelse(bh);
+      return 0;
+    }
+
+  if (!--*p)
+    tfs_shared_blocks_add(sb, -1);
+  mark_buffer_dirty(bh);
+  brelse(bh);
+
+  return 1;
+}
+
+/*
+ * Drop a reference on each of the 'count' blocks. Shared blocks are
+ * removed from the array, which is left holding the blocks whose last
+ * reference went; their number is returned. A block whose count cannot
+ * be read is leaked rather than freed under another owner.
+ */
+int tfs_unref_blocks(struct super_block *sb, sector_t *blocks, int count)
+{
+  struct tfs_sb_info *si = sb->s_fs_info;
+  int i, n = 0;
+
+  if (!tfs_has_shared_blocks(si))
+    return count;
+
+  mutex_lock(&si->refcount_mutex);
+  for (i = 0; i < count; ++i)
+    {
+      if (!tfs_data_block_valid(si, blocks[i]) || !tfs_unref_block(sb, blocks[i]))
+	blocks[n++] = blocks[i];
+    }
+  mutex_unlock(&si->refcount_mutex);
+
+  return n;
+}
+
+/* add a reference to the blocks start .. start + count - 1, all or none */
+static int tfs_ref_blocks(struct super_block *sb, sector_t start, u32 count)
+{
+  struct tfs_sb_info *si = sb->s_fs_info;
+  struct buffer_head *bh;
+  int err = 0;
+  u32 i;
+  u8 *p;
+
+  mutex_lock(&si->refcount_mutex);
+  for (i = 0; i < count; ++i)
+    {
+      if (!tfs_data_block_valid(si, start + i))
+	{
+	  err = -EIO;
+	  break;
+	}
+      if (!(bh = tfs_refcount_bh(sb, start + i, &p)))
+	{
+	  err = -EIO;
+	  break;
+	}
+      if (*p == TFS_REFCOUNT_MAX)
+	{
+	  brelse(bh);
+	  err = -EMLINK;
+	  break;
+	}
+
+      if (!(*p)++)
+	tfs_shared_blocks_add(sb, 1);
+      mark_buffer_dirty(bh);
+      brelse(bh);
+    }
+
+  if (err)
+    while (i--)
+      tfs_unref_block(sb, start + i);
+  mutex_unlock(&si->refcount_mutex);
+
+  return err;
+}
+
+/*
+ * File data is written through the page cache of the file, so a buffer
+ * the block device caches for a data block may be stale. Read such
+ * blocks from disk, and drop what was read once done with it.
+ */
+struct buffer_head *tfs_read_data_block(struct super_block *sb, sector_t block)
+{
+  struct buffer_head *bh;
+
+  if (!(bh = sb_getblk(sb, block)))
+    return NULL;
+
+  lock_buffer(bh);
+  clear_buffer_uptodate(bh);
+  unlock_buffer(bh);
+
+  ll_rw_block(READ, 1, &bh);
+  wait_on_buffer(bh);
+  if (!buffer_uptodate(bh))
+    {
+      brelse(bh);
+      return NULL;
+    }
+
+  return bh;
+}
+
+void tfs_forget_data_block(struct buffer_head *bh)
+{
+  lock_buffer(bh);
+  clear_buffer_uptodate(bh);
+  unlock_buffer(bh);
+  brelse(bh);
+}
+
+/*
+ * Copy the shared block 'old' to a new block for 'inode', returned in
+ * *new, and drop the inode's reference to 'old'. The copy reaches the
+ * disk before the caller maps it, since a partial write of the block
+ * reads the rest back from there. Called with the map lock of the slot
+ * pointing at 'old' held.
+ */
+int tfs_cow_block(struct inode *inode, sector_t old, sector_t *new)
+{
+  struct super_block *sb = inode->i_sb;
+  struct buffer_head *obh, *nbh;
+  int err;
+
+  if ((err = tfs_alloc_block_run(sb, tfs_find_goal(inode, old), 1, new)))
+    return err;
+
+  err = -EIO;
+  if (!(obh = tfs_read_data_block(sb, old)))
+    goto err_free;
+  if (!(nbh = sb_getblk(sb, *new)))
+    {
+      tfs_forget_data_block(obh);
+      goto err_free;
+    }
+
+  lock_buffer(nbh);
+  memcpy(nbh->b_data, obh->b_data, sb->s_blocksize);
+  set_buffer_uptodate(nbh);
+  unlock_buffer(nbh);
+  mark_buffer_dirty(nbh);
+  err = sync_dirty_buffer(nbh);
+
+  tfs_forget_data_block(obh);
+  tfs_forget_data_block(nbh);
+  if (err)
+    goto err_free;
+
+  printk("TFS: copied shared block %u of inode %u to %u\n", (unsigned) old, (unsigned) inode->i_ino, (unsigned) *new);
+
+  tfs_free_blocks(sb, &old, 1);
+  return 0;
+
+ err_free:
+  tfs_free_block_range(sb, *new, 1);
+  return err;
+}
+
+/* a zeroed block for the block map of 'inode', near 'prev' */
+static int tfs_alloc_map_block(struct inode *inode, sector_t prev, u32 *block)
+{
+  struct super_block *sb = inode->i_sb;
+  struct buffer_head *bh;
+  sector_t b;
+  int err;
+
+  if ((err = tfs_alloc_block_run(sb, tfs_find_goal(inode, prev), 1, &b)))
+    return err;
+
+  if (!(bh = sb_getblk(sb, b)))
+    {
+      tfs_free_block_range(sb, b, 1);
+      return -EIO;
+    }
+
+  lock_buffer(bh);
+  memset(bh->b_data, 0, sb->s_blocksize);
+  set_buffer_uptodate(bh);
+  unlock_buffer(bh);
+  mark_buffer_dirty(bh);
+  brelse(bh);
+
+  spin_lock(&inode->i_lock);
+  inode->i_blocks++;
+  spin_unlock(&inode->i_lock);
+
+  *block = b;
+  return 0;
+}
+
+/*
+ * Point logical block 'lblock' of 'inode' at 'block', 0 making it a
+ * hole, and return what it pointed at in *old. Indirect blocks are
+ * allocated as needed, under the same map locks as tfs_getblocks.
+ */
+static int tfs_clone_set(struct inode *inode, sector_t lblock, sector_t block, sector_t *old)
+{
+  struct tfs_inode_info *ti = TFS_INODE(inode);
+  struct tfs_sb_info *si = inode->i_sb->s_fs_info;
+  struct buffer_head *bh;
+  struct mutex *map_lock;
+  sector_t rel;
+  u32 index, b, *id;
+  int err = 0;
+
+  *old = 0;
+  map_lock = tfs_map_lock(inode, 0);
+
+  if (lblock < TFS_DATA_BLOCKS_PER_INODE)
+    {
+      mutex_lock(map_lock);
+      *old = ti->data_blocks[lblock];
+      ti->data_blocks[lblock] = block;
+      mutex_unlock(map_lock);
+      return 0;
+    }
+
+  rel = lblock - TFS_DATA_BLOCKS_PER_INODE;
+  index = rel / si->addr_per_block;
+  if (index >= si->addr_per_block)
+    return -EFBIG;
+
+  mutex_lock(map_lock);
+  if (!ti->root_indirect_data_block && block)
+    {
+      if ((err = tfs_alloc_map_block(inode, ti->data_blocks[TFS_DATA_BLOCKS_PER_INODE - 1], &b)))
+	{
+	  mutex_unlock(map_lock);
+	  return err;
+	}
+      ti->root_indirect_data_block = b;
+    }
+  mutex_unlock(map_lock);
+
+  if (!ti->root_indirect_data_block)
+    return 0;
+
+  map_lock = tfs_map_lock(inode, index + 1);
+  mutex_lock(map_lock);
+
+  if (!(bh = sb_bread(inode->i_sb, ti->root_indirect_data_block)))
+    {
+      err = -EIO;
+      goto out;
+    }
+  id = (u32 *) bh->b_data + index;
+  if (!*id && block)
+    {
+      if ((err = tfs_alloc_map_block(inode, ti->root_indirect_data_block, &b)))
+	{
+	  brelse(bh);
+	  goto out;
+	}
+      *id = b;
+      mark_buffer_dirty(bh);
+    }
+  b = *id;
+  brelse(bh);
+  if (!b)
+    goto out;
+
+  if (!(bh = sb_bread(inode->i_sb, b)))
+    {
+      err = -EIO;
+      goto out;
+    }
+  id = (u32 *) bh->b_data + rel % si->addr_per_block;
+  *old = *id;
+  *id = block;
+  mark_buffer_dirty(bh);
+  brelse(bh);
+
+ out:
+  mutex_unlock(map_lock);
+  return err;
+}
+
+static void tfs_lock_two(struct inode *a, struct inode *b)
+{
+  if (b->i_ino < a->i_ino)
+    {
+      struct inode *tmp = a;
+
+      a = b;
+      b = tmp;
+    }
+
+  mutex_lock(&a->i_mutex);
+  if (b != a)
+    mutex_lock_nested(&b->i_mutex, I_MUTEX_CHILD);
+  down_write(&TFS_INODE(a)->truncate_sem);
+  if (b != a)
+    down_write_nested(&TFS_INODE(b)->truncate_sem, SINGLE_DEPTH_NESTING);
+}
+
+static void tfs_unlock_two(struct inode *a, struct inode *b)
+{
+  up_write(&TFS_INODE(a)->truncate_sem);
+  if (b != a)
+    up_write(&TFS_INODE(b)->truncate_sem);
+  mutex_unlock(&a->i_mutex);
+  if (b != a)
+    mutex_unlock(&b->i_mutex);
+}
+
+/*
+ * FICLONE and FICLONERANGE: make 'len' bytes of dst_file from 'destoff'
+ * share the blocks of src_file from 'off', a len of 0 meaning up to the
+ * end of src_file. Offsets must be block aligned, and so must len unless
+ * the range ends at the end of src_file. Both files are written back
+ * first, so that the blocks hold what their pages do; the pages of
+ * src_file keep pointing at blocks that are now shared, which writeback
+ * copies before writing to.
+ */
+int tfs_clone_range(struct file *dst_file, struct file *src_file, u64 off, u64 len, u64 destoff)
+{
+  struct inode *dst = dst_file->f_path.dentry->d_inode;
+  struct inode *src = src_file->f_path.dentry->d_inode;
+  struct super_block *sb = dst->i_sb;
+  struct tfs_sb_info *si = sb->s_fs_info;
+  unsigned int bits = sb->s_blocksize_bits;
+  u64 bmask = sb->s_blocksize - 1, size, end;
+  sector_t nblocks, done = 0, old;
+  struct buffer_head map;
+  long delta = 0;
+  u32 n, j;
+  int err = 0;
+
+  if (src->i_sb != sb)
+    return -EXDEV;
+  if (!S_ISREG(src->i_mode) || !S_ISREG(dst->i_mode))
+    return -EINVAL;
+  if (!(dst_file->f_mode & FMODE_WRITE) || !(src_file->f_mode & FMODE_READ))
+    return -EBADF;
+  if (IS_APPEND(dst) || IS_IMMUTABLE(dst))
+    return -EPERM;
+  if (sb->s_flags & MS_RDONLY)
+    return -EROFS;
+  if (!si->super_block->refcount_blocks)
+    return -EOPNOTSUPP;
+  if ((off | destoff) & bmask)
+    return -EINVAL;
+
+  tfs_lock_two(src, dst);
+
+  size = i_size_read(src);
+  if (off > size)
+    {
+      err = -EINVAL;
+      goto out;
+    }
+  if (!len || len > size - off)
+    len = size - off;
+  end = off + len;
+  nblocks = (len + bmask) >> bits;
+
+  /* a partial last block would bring the tail of src_file's block along */
+  if ((len & bmask) && (end != size || destoff + len < i_size_read(dst)))
+    err = -EINVAL;
+  else if (tfs_inode_compressed(src) || tfs_inode_compressed(dst))
+    err = -EOPNOTSUPP;
+  else if (destoff + len > sb->s_maxbytes)
+    err = -EFBIG;
+  else if (src == dst && off < destoff + len && destoff < end)
+    err = -EINVAL;
+  if (err || !nblocks)
+    goto out;
+
+  if ((err = filemap_write_and_wait(src->i_mapping)) ||
+      (err = filemap_write_and_wait(dst->i_mapping)))
+    goto out;
+
+  while (done < nblocks)
+    {
+      memset(&map, 0, sizeof(map));
+      map.b_size = min_t(sector_t, nblocks - done, si->addr_per_block) << bits;
+      if ((err = tfs_getblocks(src, (off >> bits) + done, &map, 0)))
+	break;
+
+      n = buffer_mapped(&map) ? map.b_size >> bits : 1;
+      if (buffer_mapped(&map) && (err = tfs_ref_blocks(sb, map.b_blocknr, n)))
+	break;
+
+      for (j = 0; j < n; ++j)
+	{
+	  err = tfs_clone_set(dst, (destoff >> bits) + done, buffer_mapped(&map) ? map.b_blocknr + j : 0, &old);
+	  if (err)
+	    {
+	      /* the blocks not pointed at after all lose their new reference */
+	      if (buffer_mapped(&map))
+		{
+		  mutex_lock(&si->refcount_mutex);
+		  for (; j < n; ++j)
+		    tfs_unref_block(sb, map.b_blocknr + j);
+		  mutex_unlock(&si->refcount_mutex);
+		}
+	      break;
+	    }
+
+	  delta += buffer_mapped(&map) ? 1 : 0;
+	  if (old)
+	    {
+	      --delta;
+	      tfs_free_blocks(sb, &old, 1);
+	    }
+	  ++done;
+	}
+      if (err)
+	break;
+
+      if (fatal_signal_pending(current))
+	{
+	  err = -EINTR;
+	  break;
+	}
+      cond_resched();
+    }
+
+  tfs_drop_cached_blocks(TFS_INODE(dst));
+
+  spin_lock(&dst->i_lock);
+  dst->i_blocks += delta;
+  spin_unlock(&dst->i_lock);
+
+  end = min_t(u64, destoff + ((u64) done << bits), destoff + len);
+  if (done && end > i_size_read(dst))
+    i_size_write(dst, end);
+  dst->i_mtime = dst->i_ctime = CURRENT_TIME_SEC;
+  mark_inode_dirty(dst);
+
+  invalidate_inode_pages2_range(dst->i_mapping, destoff >> PAGE_CACHE_SHIFT,
+				(destoff + (nblocks << bits) - 1) >> PAGE_CACHE_SHIFT);
+
+  printk("TFS: cloned %u blocks of inode %u to inode %u\n", (unsigned) done, (unsigned) src->i_ino, (unsigned) dst->i_ino);
+
+ out:
+  tfs_unlock_two(src, dst);
+  return err;
+}
@@ -4,6 +4,9 @@
 #include <linux/buffer_head.h>
 #include <linux/mount.h>
 #include <linux/seq_file.h>
+#include <linux/parser.h>
+#include <linux/percpu.h>
+#include <linux/vmalloc.h>
 
 #include "tfs_module.h"
 
@@ -14,6 +17,88 @@ MODULE_LICENSE("GPL");
 static struct super_operations tfs_sops;
 static struct kmem_cache *tfs_inode_cachep;
 
+enum
+  {
+    Opt_discard, Opt_nodiscard, Opt_nobh, Opt_bh, Opt_compress, Opt_nocompress,
+    Opt_lazytime, Opt_nolazytime, Opt_err
+  };
+
+static const match_table_t tfs_tokens =
+  {
+    {Opt_discard, "discard"},
+    {Opt_nodiscard, "nodiscard"},
+    {Opt_nobh, "nobh"},
+    {Opt_bh, "bh"},
+    {Opt_compress, "compress"},
+    {Opt_nocompress, "nocompress"},
+    {Opt_lazytime, "lazytime"},
+    {Opt_nolazytime, "nolazytime"},
+    {Opt_err, NULL}
+  };
+
+static int tfs_parse_options(char *options, struct tfs_sb_info *si)
+{
+  substring_t args[MAX_OPT_ARGS];
+  char *p;
+
+  if (!options)
+    return 0;
+
+  while ((p = strsep(&options, ",")) != NULL)
+    {
+      if (!*p)
+	continue;
+
+      switch (match_token(p, tfs_tokens, args))
+	{
+	case Opt_discard:
+	  si->mount_opts |= TFS_MOUNT_DISCARD;
+	  break;
+	case Opt_nodiscard:
+	  si->mount_opts &= ~TFS_MOUNT_DISCARD;
+	  break;
+	case Opt_nobh:
+	  si->mount_opts |= TFS_MOUNT_NOBH;
+	  break;
+	case Opt_bh:
+	  si->mount_opts &= ~TFS_MOUNT_NOBH;
+	  break;
+	case Opt_compress:
+	  si->mount_opts |= TFS_MOUNT_COMPRESS;
+	  break;
+	case Opt_nocompress:
+	  si->mount_opts &= ~TFS_MOUNT_COMPRESS;
+	  break;
+	case Opt_lazytime:
+	  si->mount_opts |= TFS_MOUNT_LAZYTIME;
+	  break;
+	case Opt_nolazytime:
+	  si->mount_opts &= ~TFS_MOUNT_LAZYTIME;
+	  break;
+	default:
+	  printk("TFS: unrecognized mount option \"%s\"\n", p);
+	  return -EINVAL;
+	}
+    }
+
+  return 0;
+}
+
+static struct buffer_head *tfs_read_super_block(struct super_block *sb, struct tfs_super_block **tfs_sb)
+{
+  struct buffer_head *bh;
+
+  if (!(bh = sb_bread(sb, TFS_SUPER_OFFSET / sb->s_blocksize)))
+    {
+      printk("TFS: unable to read super block\n");
+      return NULL;
+    }
+
+  *tfs_sb = (struct tfs_super_block *) (bh->b_data + (TFS_SUPER_OFFSET % sb->s_blocksize));
+
+  return bh;
+}
+
 static int tfs_fill_super(struct super_block *sb, void *data, int silent)
 {
   struct tfs_super_block *tfs_sb;
@@ -21,23 +106,19 @@ static int tfs_fill_super(struct super_block *sb, void *data, int silent)
   struct buffer_head *bh = NULL;
   struct inode *root_inode = NULL;
   int blocksize;
-  int ret;
+  int ret, i;
 
   printk("TSF: tfs_fill_super\n");
 
-  blocksize = sb_min_blocksize(sb, TFS_BLOCK_SIZE);
-
-  if (blocksize != TFS_BLOCK_SIZE)
+  blocksize = sb_min_blocksize(sb, TFS_MIN_BLOCK_SIZE);
+  if (!blocksize)
     {
-      printk("TFS: unable set block size to %d\n", TFS_BLOCK_SIZE);
-      return -1;
+      printk("TFS: unable set block size to %d\n", TFS_MIN_BLOCK_SIZE);
+      return -EINVAL;
     }
 
-  if (!(bh = sb_bread(sb, TFS_SUPER_BLOCK)))
-    {
-      printk("TFS: unable to read super block\n");
-      return -1;
-    }
+  if (!(bh = tfs_read_super_block(sb, &tfs_sb)))
+    return -EIO;
 
   si = kzalloc(sizeof(struct tfs_sb_info), GFP_KERNEL);
   if (!si)
@@ -47,8 +128,20 @@ static int tfs_fill_super(struct super_block *sb, void *data, int silent)
       goto err_sb;
     }
 
-  tfs_sb = (struct tfs_super_block *) ((char *) bh->b_data);
-  
+  mutex_init(&si->inode_bitmap_mutex);
+  mutex_init(&si->data_bitmap_mutex);
+  spin_lock_init(&si->itable_lock);
+  mutex_init(&si->itable_flush_mutex);
+  mutex_init(&si->lazy_init_mutex);
+  mutex_init(&si->refcount_mutex);
+  spin_lock_init(&si->lazy_lock);
+  INIT_LIST_HEAD(&si->lazy_list);
+  for (i = 0; i < (1 << TFS_MAP_LOCK_BITS); ++i)
+    mutex_init(&si->map_locks[i]);
+
+  if ((ret = tfs_parse_options(data, si)))
+    goto err_sb;
+
   if (tfs_sb->magic != TFS_MAGIC)
     {
       printk("TFS: Magic does not match - not a TFS file system\n");
@@ -56,10 +149,65 @@ static int tfs_fill_super(struct super_block *sb, void *data, int silent)
       goto err_sb;
     }
 
-  printk("TFS: magic number: %x\n", tfs_sb->magic);
+  blocksize = tfs_sb->block_size ? tfs_sb->block_size : TFS_BLOCK_SIZE;
+  if (blocksize < TFS_MIN_BLOCK_SIZE || blocksize > TFS_MAX_BLOCK_SIZE ||
+      (blocksize & (blocksize - 1)))
+    {
+      printk("TFS: invalid block size: %d\n", blocksize);
+      ret = -EINVAL;
+      goto err_sb;
+    }
+
+  if (blocksize != sb->s_blocksize)
+    {
+      brelse(bh);
+      bh = NULL;
+
+      if (!sb_set_blocksize(sb, blocksize))
+	{
+	  printk("TFS: block size %d not supported by device or page size\n", blocksize);
+	  ret = -EINVAL;
+	  goto err_sb;
+	}
 
+      if (!(bh = tfs_read_super_block(sb, &tfs_sb)))
+	{
+	  ret = -EIO;
+	  goto err_sb;
+	}
+
+      if (tfs_sb->magic != TFS_MAGIC)
+	{
+	  printk("TFS: Magic does not match after switching block size\n");
+	  ret = -EINVAL;
+	  goto err_sb;
+	}
+    }
+
+  printk("TFS: magic number: %x, block size: %d\n", tfs_sb->magic, blocksize);
+
+  si->sb = sb;
   si->super_block = tfs_sb;
   si->bh = bh;
+  si->addr_per_block = sb->s_blocksize / sizeof(u32);
+  si->inodes_per_block = TFS_INODE_PER_BLOCK(sb->s_blocksize);
+  si->bits_per_block = sb->s_blocksize << 3;
+  if (tfs_sb->alloc_bits > TFS_MAX_ALLOC_BITS || (tfs_sb->alloc_bits && tfs_sb->refcount_blocks))
+    {
+      printk("TFS: invalid allocation cluster: %u\n", tfs_sb->alloc_bits);
+      ret = -EINVAL;
+      goto err_sb;
+    }
+  si->alloc_bits = tfs_sb->alloc_bits;
+  si->alloc_blocks = 1 << si->alloc_bits;
+  /*
+   * clusters must start on page boundaries for the page cache to read
+   * them; compressed clusters do not fit in allocation clusters
+   */
+  si->cluster_blocks = TFS_CLUSTER_SIZE >> sb->s_blocksize_bits;
+  if (si->cluster_blocks < 2 || TFS_CLUSTER_SIZE % PAGE_CACHE_SIZE ||
+      (TFS_DATA_BLOCKS_PER_INODE << sb->s_blocksize_bits) % PAGE_CACHE_SIZE || si->alloc_bits)
+    si->cluster_blocks = 0;
 
   tfs_sb->mnt_count++;
 
@@ -67,10 +215,48 @@ static int tfs_fill_super(struct super_block *sb, void *data, int silent)
   sync_dirty_buffer(bh);
 
   sb->s_magic = tfs_sb->magic;
-  sb->s_maxbytes = tfs_sb->size;
+  /* as far as the block map reaches, and the on-disk size can record */
+  sb->s_maxbytes = min_t(u64, (u64) (TFS_DATA_BLOCKS_PER_INODE + si->addr_per_block * si->addr_per_block)
+			 << sb->s_blocksize_bits,
+			 tfs_sb->flags & TFS_SB_64BIT ? MAX_LFS_FILESIZE : 0xffffffffULL);
   sb->s_fs_info = si;
   sb->s_op = &tfs_sops;
 
+  ret = tfs_init_groups(sb);
+  if (ret)
+    goto err_sb;
+
+  ret = tfs_init_itable_map(sb);
+  if (ret)
+    goto err_sb;
+
+  ret = tfs_init_lazy_itable(sb);
+  if (ret)
+    goto err_sb;
+
+  ret = tfs_init_inode_batches(sb);
+  if (ret)
+    goto err_sb;
+
+  if (tfs_sb->refcount_blocks &&
+      (((sector_t) tfs_sb->refcount_blocks << sb->s_blocksize_bits) < si->blocks_count ||
+       tfs_sb->refcount_block_start + tfs_sb->refcount_blocks > tfs_sb->inode_table_block_start))
+    {
+      printk("TFS: invalid block reference count table: %u+%u\n",
+	     tfs_sb->refcount_block_start, tfs_sb->refcount_blocks);
+      ret = -EINVAL;
+      goto err_sb;
+    }
+
+  si->free_wq = create_singlethread_workqueue("tfs_free");
+  if (!si->free_wq)
+    {
+      printk("TFS: unable to create free workqueue\n");
+      ret = -ENOMEM;
+      goto err_sb;
+    }
+  tfs_init_discard(sb);
+
   root_inode = tfs_inode_get(sb, TFS_ROOT_DIR_INODE);
   if (IS_ERR(root_inode))
     {
@@ -88,8 +274,8 @@ static int tfs_fill_super(struct super_block *sb, void *data, int silent)
       goto err_sb;
     }
 
-  mutex_init(&si->inode_bitmap_mutex);
-  mutex_init(&si->data_bitmap_mutex);
+  tfs_start_lazytime(sb);
+  tfs_start_lazy_init(sb);
 
   printk("TFS: tfs_fill_super successful\n");
 
@@ -97,7 +283,17 @@ static int tfs_fill_super(struct super_block *sb, void *data, int silent)
 
 err_sb:
   if (si)
-    kfree(si);
+    {
+      if (si->free_wq)
+	destroy_workqueue(si->free_wq);
+      if (si->inode_batches)
+	free_percpu(si->inode_batches);
+      if (si->itable_map_bh)
+	brelse(si->itable_map_bh);
+      vfree(si->itable_init_map);
+      kfree(si->groups);
+      kfree(si);
+    }
   if (bh)
     brelse(bh);
     
@@ -112,11 +308,11 @@ static int tfs_get_sb(struct file_system_type *fs_type, int flags, const char *d
 static void init_once(void *foo)
 {
   struct tfs_inode_info *ti = (struct tfs_inode_info *) foo;
-  int i;
 
-  mutex_init(&ti->cached_block_mutex);
-  for (i = 0; i < TFS_BLK_GRP; ++i)
-    seqlock_init(&ti->cached_block_seqlocks[i]);
+  init_rwsem(&ti->truncate_sem);
+  atomic_set(&ti->dir_opens, 0);
+  ti->state = 0;
+  INIT_LIST_HEAD(&ti->lazy_list);
 
   inode_init_once(&ti->inode);
 }
@@ -137,6 +333,7 @@ static struct inode *tfs_alloc_inode(struct super_block *sb)
 
   if (!ti)
     return NULL;
+  ti->block_cache = NULL;
 
   return &ti->inode;
 }
@@ -148,63 +345,211 @@ void tfs_destroy_inode(struct inode *inode)
   printk("TFS: tfs_destroy_inode: %u\n", (unsigned int) inode->i_ino);
 
   ti = TFS_INODE(inode);
+  kfree(ti->block_cache);
   kmem_cache_free(tfs_inode_cachep, ti);
 }
 
-static int tfs_write_inode(struct inode *inode, int wait)
+/*
+ * Synchronous inode writes only queue their inode table block here; the
+ * queue is written as one batch, and waited on as one batch, by
+ * tfs_flush_inode_table(). A block already queued is not queued twice,
+ * so a table block shared by many dirty inodes is written once; the
+ * caller's flush writes it, or waits for the flush that took it.
+ */
+static int tfs_queue_inode_table_sync(struct super_block *sb, struct buffer_head *bh)
+{
+  struct tfs_sb_info *si = sb->s_fs_info;
+  int full, ret, err = 0;
+
+  if (test_set_buffer_tfs_queued(bh))
+    {
+      /* an earlier write of the block may still be in flight, or have failed */
+      wait_on_buffer(bh);
+      if (!buffer_uptodate(bh))
+	err = -EIO;
+      brelse(bh);
+      return err;
+    }
+
+  /* another writer may have filled the queue and not flushed it yet */
+  for (;;)
+    {
+      spin_lock(&si->itable_lock);
+      if (si->itable_sync_count < TFS_ITABLE_SYNC_BATCH)
+	break;
+      spin_unlock(&si->itable_lock);
+
+      if ((ret = tfs_flush_inode_table(sb)))
+	err = ret;
+    }
+
+  si->itable_sync_bhs[si->itable_sync_count++] = bh;
+  full = (si->itable_sync_count == TFS_ITABLE_SYNC_BATCH);
+  spin_unlock(&si->itable_lock);
+
+  if (full && (ret = tfs_flush_inode_table(sb)))
+    err = ret;
+
+  return err;
+}
+
+/*
+ * Write and wait on the queued inode table blocks. Flushes are
+ * serialized, so a flush that finds the queue empty because another
+ * task took the batch returns only once that batch is on disk.
+ */
+int tfs_flush_inode_table(struct super_block *sb)
+{
+  struct tfs_sb_info *si = sb->s_fs_info;
+  struct buffer_head *bhs[TFS_ITABLE_SYNC_BATCH];
+  int i, count, err = 0;
+
+  mutex_lock(&si->itable_flush_mutex);
+
+  spin_lock(&si->itable_lock);
+  count = si->itable_sync_count;
+  memcpy(bhs, si->itable_sync_bhs, count * sizeof(bhs[0]));
+  si->itable_sync_count = 0;
+  for (i = 0; i < count; ++i)
+    clear_buffer_tfs_queued(bhs[i]);
+  spin_unlock(&si->itable_lock);
+
+  if (!count)
+    {
+      mutex_unlock(&si->itable_flush_mutex);
+      return 0;
+    }
+
+  printk("TFS: tfs_flush_inode_table: %d blocks\n", count);
+
+  ll_rw_block(SWRITE, count, bhs);
+
+  for (i = 0; i < count; ++i)
+    {
+      wait_on_buffer(bhs[i]);
+      if (buffer_req(bhs[i]) && !buffer_uptodate(bhs[i]))
+	{
+	  printk("TFS: error syncing inode table block: %u\n", (unsigned) bhs[i]->b_blocknr);
+	  err = -EIO;
+	}
+      brelse(bhs[i]);
+    }
+
+  mutex_unlock(&si->itable_flush_mutex);
+
+  return err;
+}
+
+static int tfs_sync_fs(struct super_block *sb, int wait)
+{
+  int err, err2;
+
+  printk("TFS: tfs_sync_fs: %d\n", wait);
+
+  if (!wait)
+    return 0;
+
+  tfs_return_inode_batches(sb);
+  err = tfs_flush_lazy_times(sb, 1);
+  err2 = tfs_flush_inode_table(sb);
+
+  return err ? err : err2;
+}
+
+/* whether a and b differ in nothing but their timestamps */
+static int tfs_only_times_differ(const struct tfs_inode *a, const struct tfs_inode *b)
+{
+  struct tfs_inode tmp = *a;
+
+  tmp.ctime = b->ctime;
+  tmp.mtime = b->mtime;
+  tmp.atime = b->atime;
+
+  return !memcmp(&tmp, b, sizeof(tmp));
+}
+
+/*
+ * Build the on-disk inode and store it in its inode table block, unless
+ * the block already holds it. With lazy set, a change to the timestamps
+ * alone is deferred to tfs_flush_lazy_times() instead.
+ */
+int tfs_update_inode(struct inode *inode, int wait, int lazy)
 {
   struct tfs_inode_info *tinfo = TFS_INODE(inode);
-  int ino = inode->i_ino;
-  unsigned int block, offset, shift;
+  unsigned int offset;
+  sector_t block;
   struct super_block *sb = inode->i_sb;
-  struct tfs_sb_info *si = sb->s_fs_info;
-  struct tfs_inode *ti;
+  struct tfs_inode *ti, raw;
   struct buffer_head *bh;
   int i;
 
-  printk("TFS: tfs_write_inode: %u, %d\n", (unsigned int) inode->i_ino, wait);
-
-  shift = (ino << TFS_INODE_SIZE_BITS);
-  block = si->super_block->inode_table_block_start + (shift >> TFS_BLOCK_SIZE_BITS);
-  offset = shift % TFS_BLOCK_SIZE;
-  if (!(bh = sb_bread(sb, block)))
+  block = tfs_inode_block(sb, inode->i_ino, &offset);
+  if (!(bh = tfs_bread_itable(sb, block)))
     {
       return -EIO;
     }
 
   ti = (struct tfs_inode *) (bh->b_data + offset);
+  raw = *ti;
+
+  raw.mode = inode->i_mode;
+  raw.uid = inode->i_uid;
+  raw.gid = inode->i_gid;
+  raw.ctime = inode->i_ctime.tv_sec;
+  raw.mtime = inode->i_mtime.tv_sec;
+  raw.atime = inode->i_atime.tv_sec;
+  raw.hard_link_count = inode->i_nlink;
+  raw.blocks = inode->i_blocks;
+  if (tfs_inode_is_fast_symlink(inode))
+    {
+      raw.size = inode->i_size;
+      memcpy(raw.data_blocks, tinfo->fast_symlink, TFS_FAST_SYMLINK_LEN);
+    }
+  else
+    {
+      raw.flags = tinfo->flags;
+      raw.size_hi = 0;
+      TFS_SET_FILE_SIZE(&raw, inode->i_size);
+      for (i = 0; i < TFS_DATA_BLOCKS_PER_INODE; ++i)
+	raw.data_blocks[i] = tinfo->data_blocks[i];
+      raw.root_indirect_data_block = tinfo->root_indirect_data_block;
+    }
 
-  ti->mode = inode->i_mode;
-  ti->uid = inode->i_uid;
-  ti->gid = inode->i_gid;
-  ti->ctime = inode->i_ctime.tv_sec;
-  ti->mtime = inode->i_mtime.tv_sec;
-  ti->atime = inode->i_atime.tv_sec;
-  ti->hard_link_count = inode->i_nlink;
-  ti->size = inode->i_size;
-  ti->blocks = inode->i_blocks;
-  memset(ti->pad, 0, sizeof(ti->pad));
-  for (i = 0; i < TFS_DATA_BLOCKS_PER_INODE; ++i)
-    ti->data_blocks[i] = tinfo->data_blocks[i];
-  ti->root_indirect_data_block = tinfo->root_indirect_data_block;
+  if (!wait && !memcmp(&raw, ti, sizeof(raw)))
+    {
+      tfs_forget_times(inode);
+      brelse(bh);
+      return 0;
+    }
 
-  mark_buffer_dirty(bh);
-  if (wait)
+  if (lazy && !wait && tfs_only_times_differ(&raw, ti))
     {
-      sync_dirty_buffer(bh);
-      if (buffer_req(bh) && !buffer_uptodate(bh))
-	{
-	  printk("TFS: error syncing buffer\n");
-	  brelse(bh);
-	  return -EIO;
-	}
+      tfs_defer_times(inode);
+      brelse(bh);
+      return 0;
     }
 
+  tfs_forget_times(inode);
+  *ti = raw;
+
+  mark_buffer_dirty(bh);
+  if (wait)
+    return tfs_queue_inode_table_sync(sb, bh);
+
   brelse(bh);
 
   return 0;
 }
 
+static int tfs_write_inode(struct inode *inode, int wait)
+{
+  struct tfs_sb_info *si = inode->i_sb->s_fs_info;
+
+  printk("TFS: tfs_write_inode: %u, %d\n", (unsigned int) inode->i_ino, wait);
+
+  return tfs_update_inode(inode, wait, si->mount_opts & TFS_MOUNT_LAZYTIME);
+}
+
 static void tfs_put_super(struct super_block *sb)
 {
   struct tfs_sb_info *si;
@@ -212,6 +557,18 @@ static void tfs_put_super(struct super_block *sb)
   printk("TFS: tfs_put_super\n");
 
   si = sb->s_fs_info;
+
+  tfs_stop_lazy_init(sb);
+  tfs_stop_lazytime(sb);
+  /* let queued frees and discards finish before the bitmaps go away */
+  flush_workqueue(si->free_wq);
+  tfs_stop_discard(sb);
+  destroy_workqueue(si->free_wq);
+  tfs_return_inode_batches(sb);
+  free_percpu(si->inode_batches);
+  tfs_flush_inode_table(sb);
+  tfs_release_itable_map(sb);
+  tfs_release_lazy_itable(sb);
   sb->s_fs_info = NULL;
 
   mark_buffer_dirty(si->bh);
@@ -220,6 +577,8 @@ static void tfs_put_super(struct super_block *sb)
   brelse(si->bh);
   mutex_destroy(&si->inode_bitmap_mutex);
   mutex_destroy(&si->data_bitmap_mutex);
+  mutex_destroy(&si->lazy_init_mutex);
+  kfree(si->groups);
   kfree(si);
 }
 
@@ -232,17 +591,41 @@ static void tfs_write_super(struct super_block *sb)
 
 static void tfs_delete_inode(struct inode *inode)
 {
-  printk("TFS: tfs_delete_inode\n");
+  printk("TFS: tfs_delete_inode: %u\n", (unsigned int) inode->i_ino);
+
+  truncate_inode_pages(&inode->i_data, 0);
+  if (!is_bad_inode(inode))
+    tfs_free_inode_blocks(inode);
+
+  clear_inode(inode);
 }
 
 static void tfs_clear_inode(struct inode *inode)
 {
   printk("TFS: tfs_clear_inode\n");
+
+  /* deferred timestamps of an inode still linked must not be lost */
+  if (test_bit(TFS_INODE_LAZY_TIMES, &TFS_INODE(inode)->state) &&
+      inode->i_nlink && !is_bad_inode(inode))
+    tfs_update_inode(inode, 0, 0);
+  tfs_forget_times(inode);
 }
 
 static int tfs_statfs(struct dentry *dentry, struct kstatfs *statfs)
 {
+  struct super_block *sb = dentry->d_sb;
+  struct tfs_sb_info *si = sb->s_fs_info;
+
   printk("TFS: tfs_statfs\n");
+
+  statfs->f_type = TFS_MAGIC;
+  statfs->f_bsize = sb->s_blocksize;
+  statfs->f_blocks = si->blocks_count;
+  statfs->f_bfree = statfs->f_bavail = si->free_blocks;
+  statfs->f_files = si->super_block->inode_table_entries;
+  statfs->f_ffree = si->free_inodes;
+  statfs->f_namelen = TFS_DENTRY_NAME_LEN;
+
   return 0;
 }
 
@@ -252,6 +635,14 @@ static int tfs_show_options(struct seq_file *seqfile, struct vfsmount *mnt)
   struct tfs_sb_info *si = sb->s_fs_info;
   struct tfs_super_block *tsb = si->super_block;
 
+  if (si->mount_opts & TFS_MOUNT_DISCARD)
+    seq_puts(seqfile, ",discard");
+  if (si->mount_opts & TFS_MOUNT_NOBH)
+    seq_puts(seqfile, ",nobh");
+  if (si->mount_opts & TFS_MOUNT_COMPRESS)
+    seq_puts(seqfile, ",compress");
+  if (si->mount_opts & TFS_MOUNT_LAZYTIME)
+    seq_puts(seqfile, ",lazytime");
   seq_printf(seqfile, "TFS: inode bitmap blocks=%u\n", (unsigned int) tsb->inode_bitmap_blocks);
 
   return 0;
@@ -266,6 +657,7 @@ static struct super_operations tfs_sops =
     .delete_inode = tfs_delete_inode,
     .put_super = tfs_put_super,
     .write_super = tfs_write_super,
+    .sync_fs = tfs_sync_fs,
     .statfs = tfs_statfs,
     .clear_inode = tfs_clear_inode,
     .show_options = tfs_show_options
@@ -2,6 +2,7 @@
 #define _TFS_H
 
 #include <linux/types.h>
+#include <linux/ioctl.h>
 
 #define TFS_MAGIC 0x1234
 #define TFS_MAX_MNT_COUNT 100
@@ -9,16 +10,30 @@
 #define TFS_SUPER_BLOCK 1
 #define TFS_BLOCK_SIZE 1024
 #define TFS_BLOCK_SIZE_BITS 10
+#define TFS_MIN_BLOCK_SIZE TFS_BLOCK_SIZE
+#define TFS_MAX_BLOCK_SIZE 65536
 #define TFS_INODE_SIZE 64
 #define TFS_INODE_SIZE_BITS 6
-#define TFS_INODE_PER_BLOCK (TFS_BLOCK_SIZE / TFS_INODE_SIZE)
+#define TFS_INODE_PER_BLOCK(bs) ((bs) / TFS_INODE_SIZE)
+
+/*
+ * The super block always lives at byte offset 1024, whatever block size
+ * the image was made with. TFS_BLOCK_SIZE is only the default (and the
+ * size used by images made before block_size was recorded).
+ */
+#define TFS_SUPER_OFFSET (TFS_SUPER_BLOCK * TFS_BLOCK_SIZE)
 #define TFS_DATA_BLOCKS_PER_INODE 4
 
+#define TFS_SB_ITABLE_UNINIT 0x0001
+#define TFS_SB_64BIT 0x0002		/* 64-bit file and volume sizes */
+#define TFS_SB_ITABLE_DYNAMIC 0x0004	/* inode table grown in chunks on demand */
+
 #define TFS_ROOT_DIR_INODE 1
 #define TFS_TMP_DIR_INODE 2
 
 #ifndef __KERNEL__
 #define u32 __u32
+#define u64 __u64
 #endif
 
 
@@ -43,6 +58,61 @@ struct tfs_super_block
   u32 tmp_dir_data_block_start;
   u32 reserve_data_block_start;
   u32 data_block_start;
+
+  u32 block_size;
+
+  /*
+   * With TFS_SB_ITABLE_UNINIT set, only the first inode_table_init_blocks
+   * blocks of the inode table have surely been written. A later block
+   * has been zeroed if the inode bitmap has a bit set for one of its
+   * inodes, and reads as zero otherwise.
+   */
+  u32 flags;
+  u32 inode_table_init_blocks;
+
+  /*
+   * With blocks_per_group set, the blocks from inode_table_block_start on
+   * are split into groups of blocks_per_group blocks, each starting with
+   * the inode table blocks of its inodes_per_group inodes. The bitmaps
+   * stay at the front. Zero means one flat inode table.
+   */
+  u32 blocks_per_group;
+  u32 inodes_per_group;
+
+  /*
+   * One byte per block of the volume, after the data bitmap, counting
+   * the references to the block beyond the first: zero for a block with
+   * one owner. shared_blocks is how many bytes are non-zero. Images
+   * without the table (refcount_blocks zero) cannot share blocks.
+   */
+  u32 refcount_block_start;
+  u32 refcount_blocks;
+  u32 shared_blocks;
+
+  /* with TFS_SB_64BIT, the high half of size */
+  u32 size_hi;
+
+  /*
+   * With alloc_bits set, each bit of the data bitmap covers an aligned
+   * cluster of 1 << alloc_bits blocks, and the aligned runs of that many
+   * entries in each block map of a file (the direct blocks, the root
+   * indirect block, an indirect block) map into a single cluster, at
+   * the same offsets. Such images have no reference count table.
+   */
+  u32 alloc_bits;
+
+  /*
+   * With TFS_SB_ITABLE_DYNAMIC the inode table is split into chunks of
+   * itable_chunk_blocks blocks, and the block at itable_map_block holds
+   * the first block of each chunk, zero for a chunk not allocated yet.
+   * The first chunk sits at inode_table_block_start; the others are
+   * taken from the data area along with their first inode.
+   * inode_table_blocks and inode_table_entries cover the chunks of a
+   * full map. Such images have one flat table (no groups), no
+   * uninitialized table blocks and no allocation clusters.
+   */
+  u32 itable_chunk_blocks;
+  u32 itable_map_block;
 };
 
 struct tfs_inode
@@ -58,9 +128,48 @@ struct tfs_inode
   u32 blocks;
   u32 data_blocks[TFS_DATA_BLOCKS_PER_INODE];
   u32 root_indirect_data_block;
-  char pad[8];
+  u32 flags;
+  u32 size_hi;
 };
 
+/* tfs_inode.flags, for regular files */
+#define TFS_INODE_COMPRESS 0x0001	/* compress the file once written */
+#define TFS_INODE_COMPRESSED 0x0002	/* some of its clusters are compressed */
+
+/*
+ * Past the direct blocks a file is split into clusters of
+ * TFS_CLUSTER_SIZE bytes, which never straddle an indirect block. A
+ * compressed cluster of n blocks keeps its LZO stream, preceded by the
+ * stream's length as a u32, in the blocks of its first m < n block map
+ * entries; the other n - m entries hold TFS_COMPRESSED_BLOCK.
+ */
+#define TFS_CLUSTER_SIZE 16384
+#define TFS_MAX_CLUSTER_BLOCKS (TFS_CLUSTER_SIZE / TFS_MIN_BLOCK_SIZE)
+#define TFS_COMPRESSED_BLOCK ((u32) -1)
+
+/*
+ * Regular files keep the high half of their size in size_hi; it stays
+ * zero unless the image has TFS_SB_64BIT. Use these rather than size.
+ */
+#define TFS_FILE_SIZE(ti) \
+  (S_ISREG((ti)->mode) ? (u64) (ti)->size_hi << 32 | (ti)->size : (u64) (ti)->size)
+#define TFS_SET_FILE_SIZE(ti, sz)		\
+  do						\
+    {						\
+      (ti)->size = (u32) (sz);			\
+      if (S_ISREG((ti)->mode))			\
+	(ti)->size_hi = (u32) ((u64) (sz) >> 32);	\
+    }						\
+  while (0)
+
+/*
+ * A symlink whose target, with its NUL, fits in the bytes from
+ * data_blocks to the end of the inode (flags and size_hi included)
+ * keeps it there and owns no blocks.
+ */
+#define TFS_FAST_SYMLINK_LEN (TFS_DATA_BLOCKS_PER_INODE * 4 + 4 + 8)
+#define TFS_IS_FAST_SYMLINK(mode, size) (S_ISLNK(mode) && (size) < TFS_FAST_SYMLINK_LEN)
+
 #define TFS_DENTRY_NAME_LEN 20
 
 struct tfs_dentry
@@ -71,4 +180,84 @@ struct tfs_dentry
   char name[TFS_DENTRY_NAME_LEN];
 };
 
+/*
+ * TFS_IOC_DEFRAG moves the blocks start .. start + len - 1 of a file
+ * into contiguous runs and returns how many blocks it moved.
+ */
+struct tfs_defrag_range
+{
+  u64 start;
+  u64 len;
+  u64 moved;
+};
+
+#define TFS_IOC_DEFRAG _IOWR('t', 1, struct tfs_defrag_range)
+
+#define TFS_REFCOUNT_MAX 255
+#define TFS_MAX_ALLOC_BITS 8
+
+#define TFS_SB_BLOCK_SIZE(tsb) ((tsb)->block_size ? (tsb)->block_size : TFS_BLOCK_SIZE)
+#define TFS_NOT_ITABLE ((u32) -1)
+
+/* inode table blocks at the start of each group, or of the data area */
+static inline u32 tfs_itable_blocks_per_group(const struct tfs_super_block *tsb)
+{
+  if (tsb->flags & TFS_SB_ITABLE_DYNAMIC)
+    return tsb->itable_chunk_blocks;
+  if (!tsb->blocks_per_group)
+    return tsb->inode_table_blocks;
+
+  return tsb->inodes_per_group / TFS_INODE_PER_BLOCK(TFS_SB_BLOCK_SIZE(tsb));
+}
+
+/* physical block of inode table block 'index'; only the first chunk of a dynamic table */
+static inline u32 tfs_itable_block(const struct tfs_super_block *tsb, u32 index)
+{
+  u32 per_group = tfs_itable_blocks_per_group(tsb);
+
+  if (!tsb->blocks_per_group)
+    return tsb->inode_table_block_start + index;
+
+  return tsb->inode_table_block_start + index / per_group * tsb->blocks_per_group + index % per_group;
+}
+
+/* inode table index of a physical block, TFS_NOT_ITABLE if it holds data */
+static inline u32 tfs_itable_index(const struct tfs_super_block *tsb, u32 block)
+{
+  u32 per_group = tfs_itable_blocks_per_group(tsb);
+  u32 rel, group;
+
+  if (block < tsb->inode_table_block_start)
+    return TFS_NOT_ITABLE;
+
+  rel = block - tsb->inode_table_block_start;
+  if (tsb->flags & TFS_SB_ITABLE_DYNAMIC)
+    return rel < tsb->itable_chunk_blocks ? rel : TFS_NOT_ITABLE;
+  if (!tsb->blocks_per_group)
+    return rel < tsb->inode_table_blocks ? rel : TFS_NOT_ITABLE;
+
+  group = rel / tsb->blocks_per_group;
+  rel %= tsb->blocks_per_group;
+  if (rel >= per_group || group * per_group >= tsb->inode_table_blocks)
+    return TFS_NOT_ITABLE;
+
+  return group * per_group + rel;
+}
+
+/*
+ * Physical block of inode table block 'index' through the chunk map of
+ * a dynamic table, or 0 if its chunk is not allocated; map is ignored
+ * for fixed tables.
+ */
+static inline u32 tfs_itable_map_block(const struct tfs_super_block *tsb, const u32 *map, u32 index)
+{
+  u32 chunk;
+
+  if (!(tsb->flags & TFS_SB_ITABLE_DYNAMIC))
+    return tfs_itable_block(tsb, index);
+
+  chunk = map[index / tsb->itable_chunk_blocks];
+  return chunk ? chunk + index % tsb->itable_chunk_blocks : 0;
+}
+
 #endif
@@ -7,34 +7,205 @@
 #include <linux/fs.h>
 #include <linux/buffer_head.h>
 #include <linux/mutex.h>
+#include <linux/rwsem.h>
 #include <linux/seqlock.h>
+#include <linux/workqueue.h>
 
 #define TFS_BLK_GRP 2
 #define TFS_BLK_PER_GRP 4
 
+#define TFS_PREFETCH_BATCH 16
+#define TFS_ITABLE_SYNC_BATCH 32
+#define TFS_LAZY_INIT_BATCH 64
+#define TFS_LAZY_INIT_DELAY (HZ / 50)
+#define TFS_FREE_BATCH 64
+#define TFS_FREE_SYNC_BLOCKS 256
+#define TFS_DISCARD_DELAY HZ
+#define TFS_DEFRAG_CHUNK 256
+#define TFS_MAP_LOCK_BITS 6
+#define TFS_LAZYTIME_EXPIRE (12 * 60 * 60 * HZ)
+#define TFS_INODE_BATCH 16
+
+/* tfs_inode_info.state bits */
+#define TFS_DIR_COMPACT_QUEUED 0
+#define TFS_DIR_COMPACT_WANTED 1
+#define TFS_COMPRESS_QUEUED 2
+#define TFS_INODE_LAZY_TIMES 3	/* timestamps newer in memory than on disk */
+
+#define TFS_MOUNT_DISCARD 0x0001
+#define TFS_MOUNT_NOBH 0x0002
+#define TFS_MOUNT_COMPRESS 0x0004
+#define TFS_MOUNT_LAZYTIME 0x0008
+
+/* neither are SEEK_DATA and SEEK_HOLE */
+#ifndef SEEK_DATA
+#define SEEK_DATA 3
+#define SEEK_HOLE 4
+#endif
+
+/* FITRIM is not in this kernel's headers yet; same number as later kernels */
+#ifndef FITRIM
+struct fstrim_range
+{
+  u64 start;
+  u64 len;
+  u64 minlen;
+};
+#define FITRIM _IOWR('X', 121, struct fstrim_range)
+#endif
+
+/* nor are the clone ioctls */
+#ifndef FICLONE
+struct file_clone_range
+{
+  s64 src_fd;
+  u64 src_offset;
+  u64 src_length;
+  u64 dest_offset;
+};
+#define FICLONE _IOW(0x94, 9, int)
+#define FICLONERANGE _IOW(0x94, 13, struct file_clone_range)
+#endif
+
+enum tfs_bh_state_bits
+  {
+    BH_TfsQueued = BH_PrivateStart
+  };
+
+BUFFER_FNS(TfsQueued, tfs_queued)
+TAS_BUFFER_FNS(TfsQueued, tfs_queued)
+
+struct tfs_group_info
+{
+  u32 free_inodes;
+  u32 free_blocks;
+};
+
+/* inode numbers set aside in the inode bitmap for one CPU's creates */
+struct tfs_inode_batch
+{
+  struct mutex mutex;
+  unsigned int group;
+  unsigned int next, count;
+  u32 inos[TFS_INODE_BATCH];
+};
+
 struct tfs_sb_info
 {
+  struct super_block *sb;
   struct tfs_super_block *super_block;
   struct buffer_head *bh;
+  unsigned int addr_per_block;
+  unsigned int inodes_per_block;
+  unsigned int bits_per_block;
+  sector_t blocks_count;
+  unsigned int groups_count;
+  unsigned int blocks_per_group;
+  unsigned int inodes_per_group;
+  unsigned int itable_blocks_per_group;
+  unsigned int cluster_blocks;
+  unsigned int alloc_bits;	/* blocks per data bitmap bit, as a shift */
+  unsigned int alloc_blocks;
+  struct tfs_group_info *groups;
+  u32 free_inodes;
+  u32 free_blocks;
   struct mutex inode_bitmap_mutex;
+  struct tfs_inode_batch *inode_batches;	/* per CPU */
   struct mutex data_bitmap_mutex;
+  spinlock_t itable_lock;
+  struct buffer_head *itable_sync_bhs[TFS_ITABLE_SYNC_BATCH];
+  int itable_sync_count;
+  struct mutex itable_flush_mutex;	/* held while a batch is written */
+  struct mutex lazy_init_mutex;
+  struct task_struct *lazy_init_task;
+  unsigned long *itable_init_map;	/* table blocks past the mark already zeroed */
+  struct workqueue_struct *free_wq;
+  unsigned long mount_opts;
+  spinlock_t discard_lock;
+  struct list_head discard_list;
+  struct delayed_work discard_work;
+  struct mutex map_locks[1 << TFS_MAP_LOCK_BITS];
+  struct mutex refcount_mutex;
+  spinlock_t lazy_lock;
+  struct list_head lazy_list;
+  struct delayed_work lazytime_work;
+  struct buffer_head *itable_map_bh;
+  u32 *itable_map;		/* first block of each chunk of a dynamic inode table */
+};
+
+/*
+ * Recently used runs of a file's indirect block map. Only files that
+ * reach their indirect blocks get one, on the first lookup there.
+ */
+struct tfs_block_cache
+{
+  sector_t first_logical_blocks[TFS_BLK_GRP];
+  sector_t data_blocks[TFS_BLK_GRP][TFS_BLK_PER_GRP];
+  seqlock_t seqlocks[TFS_BLK_GRP];
+  struct mutex mutex;
+  int next_slot;
 };
 
 struct tfs_inode_info
 {
-  sector_t data_blocks[TFS_DATA_BLOCKS_PER_INODE];
-  sector_t cached_first_logical_blocks[TFS_BLK_GRP];
-  sector_t cached_data_blocks[TFS_BLK_GRP][TFS_BLK_PER_GRP];
-  seqlock_t cached_block_seqlocks[TFS_BLK_GRP];
-  sector_t root_indirect_data_block;
-  int cached_next_slot;
-  struct mutex cached_block_mutex;
+  union
+  {
+    struct
+    {
+      sector_t data_blocks[TFS_DATA_BLOCKS_PER_INODE];
+      sector_t root_indirect_data_block;
+    };
+    /* fast symlinks keep their target instead of a block map */
+    char fast_symlink[TFS_FAST_SYMLINK_LEN];
+  };
+  struct tfs_block_cache *block_cache;
+  u32 flags;
+  atomic_t dir_opens;
+  unsigned long state;
+  struct list_head lazy_list;
+  struct rw_semaphore truncate_sem;
   struct inode inode;
 };
 
 #define TFS_INODE(vfs_inode) container_of(vfs_inode, struct tfs_inode_info, inode)
 
+extern struct inode_operations tfs_fast_symlink_inode_operations;
+
+static inline int tfs_inode_is_fast_symlink(struct inode *inode)
+{
+  return inode->i_op == &tfs_fast_symlink_inode_operations;
+}
+
+/* cheap test for the write paths: only then look blocks up in the refcount table */
+static inline int tfs_has_shared_blocks(struct tfs_sb_info *si)
+{
+  return si->super_block->shared_blocks != 0;
+}
+
+/* whether reads and writes must look for compressed clusters */
+static inline int tfs_inode_compressed(struct inode *inode)
+{
+  struct tfs_sb_info *si = inode->i_sb->s_fs_info;
+
+  return (TFS_INODE(inode)->flags & TFS_INODE_COMPRESSED) && si->cluster_blocks;
+}
+
+/* blocks holding a cluster's compressed data, 0 if it is stored raw; 'e' is its first entry */
+static inline u32 tfs_cluster_compressed_blocks(const u32 *e, u32 cluster_blocks)
+{
+  u32 m;
+
+  if (e[cluster_blocks - 1] != TFS_COMPRESSED_BLOCK)
+    return 0;
+  for (m = 0; m < cluster_blocks && e[m] != TFS_COMPRESSED_BLOCK; ++m)
+    ;
+
+  return m;
+}
+
 struct inode *tfs_inode_get(struct super_block *sb, int ino);
+sector_t tfs_inode_block(struct super_block *sb, unsigned int ino, unsigned int *offset);
+void tfs_prefetch_inodes(struct super_block *sb, unsigned int *inos, int count);
 void tfs_destroy_inode(struct inode *inode);
 int tfs_write_begin(struct file *file, struct address_space *mapping,
 		    loff_t pos, unsigned len, unsigned flags, 
@@ -44,8 +215,55 @@ int __tfs_write_begin(struct file *file, struct address_space *mapping,
 		      struct page **pagep, void **fsdata);
 int tfs_commit_write(struct page *page, loff_t pos, unsigned len);
 loff_t tfs_llseek(struct file *file, loff_t offset, int origin);
+int tfs_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo, u64 start, u64 len);
 int tfs_fsync(struct file *file, struct dentry *dentry, int datasync);
 int tfs_getblocks(struct inode *inode, sector_t iblock, struct buffer_head *bh_result, int create);
 int tfs_sync_inode(struct inode *inode);
+int tfs_flush_inode_table(struct super_block *sb);
+int tfs_itable_block_initialized(struct super_block *sb, sector_t block);
+int tfs_init_lazy_itable(struct super_block *sb);
+void tfs_release_lazy_itable(struct super_block *sb);
+int tfs_init_itable_block(struct super_block *sb, u32 index);
+struct buffer_head *tfs_bread_itable(struct super_block *sb, sector_t block);
+void tfs_start_lazy_init(struct super_block *sb);
+int tfs_init_groups(struct super_block *sb);
+int tfs_init_inode_batches(struct super_block *sb);
+void tfs_return_inode_batches(struct super_block *sb);
+unsigned int tfs_group_of_inode(struct tfs_sb_info *si, unsigned int ino);
+unsigned int tfs_group_of_block(struct tfs_sb_info *si, sector_t block);
+sector_t tfs_group_data_start(struct tfs_sb_info *si, unsigned int group);
+void tfs_stop_lazy_init(struct super_block *sb);
+void tfs_truncate_blocks(struct inode *inode);
+void tfs_drop_cached_blocks(struct tfs_inode_info *ti);
+void tfs_free_inode_blocks(struct inode *inode);
+void tfs_init_discard(struct super_block *sb);
+void tfs_stop_discard(struct super_block *sb);
+int tfs_queue_discard(struct super_block *sb, sector_t *blocks, int count);
+int tfs_trim_fs(struct super_block *sb, struct fstrim_range *range);
+long tfs_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+int tfs_defrag(struct inode *inode, struct tfs_defrag_range *range);
+void tfs_dir_set_size(struct inode *dir, loff_t size);
+void tfs_queue_compact(struct inode *dir);
+struct mutex *tfs_map_lock(struct inode *inode, u32 slot);
+int tfs_block_shared(struct super_block *sb, sector_t block);
+int tfs_unref_blocks(struct super_block *sb, sector_t *blocks, int count);
+int tfs_cow_block(struct inode *inode, sector_t old, sector_t *new);
+int tfs_clone_range(struct file *dst_file, struct file *src_file, u64 off, u64 len, u64 destoff);
+struct buffer_head *tfs_read_data_block(struct super_block *sb, sector_t block);
+void tfs_forget_data_block(struct buffer_head *bh);
+int tfs_expand_cluster(struct inode *inode, struct buffer_head *id_bh, u32 *e);
+int tfs_expand_cluster_at(struct inode *inode, sector_t lblock);
+int tfs_compressed_readpage(struct file *file, struct page *page);
+int tfs_compressed_readpages(struct file *file, struct address_space *mapping, struct list_head *pages, unsigned nr_pages);
+void tfs_queue_compress(struct inode *inode);
+int tfs_update_inode(struct inode *inode, int wait, int lazy);
+int tfs_init_itable_map(struct super_block *sb);
+void tfs_release_itable_map(struct super_block *sb);
+int tfs_grow_inode_table(struct super_block *sb, u32 ino);
+void tfs_defer_times(struct inode *inode);
+void tfs_forget_times(struct inode *inode);
+int tfs_flush_lazy_times(struct super_block *sb, int wait);
+void tfs_start_lazytime(struct super_block *sb);
+void tfs_stop_lazytime(struct super_block *sb);
 
 #endif
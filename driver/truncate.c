@@ -0,0 +1,266 @@
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+
+#include "tfs_module.h"
+#include "alloc.h"
+
+struct tfs_free_batch
+{
+  struct super_block *sb;
+  sector_t blocks[TFS_FREE_BATCH];
+  int count;
+  unsigned long freed;
+};
+
+struct tfs_free_work
+{
+  struct work_struct work;
+  struct super_block *sb;
+  unsigned int ino;
+  sector_t data_blocks[TFS_DATA_BLOCKS_PER_INODE];
+  sector_t root_indirect_data_block;
+};
+
+static void tfs_free_batch_add(struct tfs_free_batch *fb, sector_t block)
+{
+  if (fb->count == TFS_FREE_BATCH)
+    {
+      tfs_free_blocks(fb->sb, fb->blocks, fb->count);
+      fb->count = 0;
+    }
+
+  fb->blocks[fb->count++] = block;
+  fb->freed++;
+}
+
+/*
+ * Free entry i of the block map 'e', whose entries from 'from' on are
+ * all being dropped in ascending order. With bigalloc the entries of an
+ * aligned run share a cluster, which goes with the first of them unless
+ * an entry before 'from' still maps into it; *last is the cluster freed
+ * last from this map, ~0 to start with.
+ */
+static void tfs_free_entry(struct tfs_free_batch *fb, const u32 *e, u32 i, u32 from, sector_t *last)
+{
+  struct tfs_sb_info *si = fb->sb->s_fs_info;
+  u32 j;
+
+  if (si->alloc_bits)
+    {
+      if (e[i] >> si->alloc_bits == *last)
+	{
+	  fb->freed++;
+	  return;
+	}
+      *last = e[i] >> si->alloc_bits;
+
+      for (j = i - i % si->alloc_blocks; j < from; ++j)
+	{
+	  if (e[j])
+	    {
+	      fb->freed++;
+	      return;
+	    }
+	}
+    }
+
+  tfs_free_batch_add(fb, e[i]);
+}
+
+/*
+ * Free every block mapped at logical block 'from' or later, and the
+ * indirect blocks left empty, clearing the pointers to them. Returns
+ * the number of blocks freed. On a read error the unreadable branch is
+ * leaked rather than freed.
+ */
+static unsigned long tfs_free_branches(struct super_block *sb, sector_t *data_blocks,
+				       sector_t *root_indirect_data_block, sector_t from)
+{
+  struct tfs_sb_info *si = sb->s_fs_info;
+  struct tfs_free_batch fb;
+  struct buffer_head *rid_bh, *id_bh;
+  u32 *rid, *id;
+  u32 direct[TFS_DATA_BLOCKS_PER_INODE];
+  u32 i, j, first_index, first_block, rid_from;
+  sector_t rel, last = ~(sector_t) 0, rid_last = ~(sector_t) 0;
+  int err = 0;
+
+  fb.sb = sb;
+  fb.count = 0;
+  fb.freed = 0;
+
+  for (i = 0; i < TFS_DATA_BLOCKS_PER_INODE; ++i)
+    direct[i] = data_blocks[i];
+  for (i = from; i < TFS_DATA_BLOCKS_PER_INODE; ++i)
+    {
+      if (data_blocks[i])
+	{
+	  tfs_free_entry(&fb, direct, i, from, &last);
+	  data_blocks[i] = 0;
+	}
+    }
+
+  if (!*root_indirect_data_block)
+    goto out;
+
+  rel = from > TFS_DATA_BLOCKS_PER_INODE ? from - TFS_DATA_BLOCKS_PER_INODE : 0;
+  if (rel >= (sector_t) si->addr_per_block * si->addr_per_block)
+    goto out;
+  first_index = rel / si->addr_per_block;
+  first_block = rel % si->addr_per_block;
+  rid_from = first_index + !!first_block;
+
+  if (!(rid_bh = sb_bread(sb, *root_indirect_data_block)))
+    {
+      printk("TFS: error reading root indirect data block: %u\n", (unsigned) *root_indirect_data_block);
+      goto out;
+    }
+  rid = (u32 *) rid_bh->b_data;
+
+  for (i = first_index; i < si->addr_per_block; ++i, first_block = 0)
+    {
+      if (!rid[i])
+	continue;
+
+      if (!(id_bh = sb_bread(sb, rid[i])))
+	{
+	  printk("TFS: error reading indirect block: %u\n", rid[i]);
+	  err = -EIO;
+	  continue;
+	}
+      id = (u32 *) id_bh->b_data;
+      last = ~(sector_t) 0;
+
+      for (j = first_block; j < si->addr_per_block; ++j)
+	{
+	  if (id[j])
+	    {
+	      /* the tail of a compressed cluster owns no block */
+	      if (id[j] != TFS_COMPRESSED_BLOCK)
+		tfs_free_entry(&fb, id, j, first_block, &last);
+	      id[j] = 0;
+	    }
+	}
+
+      if (first_block)
+	{
+	  mark_buffer_dirty(id_bh);
+	  brelse(id_bh);
+	}
+      else
+	{
+	  bforget(id_bh);
+	  tfs_free_entry(&fb, rid, i, rid_from, &rid_last);
+	  rid[i] = 0;
+	}
+
+      cond_resched();
+    }
+
+  if (from <= TFS_DATA_BLOCKS_PER_INODE && !err)
+    {
+      bforget(rid_bh);
+      tfs_free_batch_add(&fb, *root_indirect_data_block);
+      *root_indirect_data_block = 0;
+    }
+  else
+    {
+      mark_buffer_dirty(rid_bh);
+      brelse(rid_bh);
+    }
+
+ out:
+  if (fb.count)
+    tfs_free_blocks(sb, fb.blocks, fb.count);
+
+  return fb.freed;
+}
+
+void tfs_drop_cached_blocks(struct tfs_inode_info *ti)
+{
+  struct tfs_block_cache *bc = ti->block_cache;
+  int i;
+
+  if (!bc)
+    return;
+
+  mutex_lock(&bc->mutex);
+  for (i = 0; i < TFS_BLK_GRP; ++i)
+    {
+      write_seqlock(&bc->seqlocks[i]);
+      bc->first_logical_blocks[i] = 0;
+      memset(bc->data_blocks[i], 0, sizeof(bc->data_blocks[i]));
+      write_sequnlock(&bc->seqlocks[i]);
+    }
+  bc->next_slot = 0;
+  mutex_unlock(&bc->mutex);
+}
+
+/* release the blocks past i_size; called with i_mutex held */
+void tfs_truncate_blocks(struct inode *inode)
+{
+  struct tfs_inode_info *ti = TFS_INODE(inode);
+  sector_t from = (i_size_read(inode) + inode->i_sb->s_blocksize - 1) >> inode->i_blkbits;
+  unsigned long freed;
+
+  freed = tfs_free_branches(inode->i_sb, ti->data_blocks, &ti->root_indirect_data_block, from);
+  tfs_drop_cached_blocks(ti);
+
+  inode->i_blocks = inode->i_blocks > freed ? inode->i_blocks - freed : 0;
+  mark_inode_dirty(inode);
+}
+
+static void tfs_free_work_fn(struct work_struct *work)
+{
+  struct tfs_free_work *fw = container_of(work, struct tfs_free_work, work);
+  unsigned long freed;
+
+  freed = tfs_free_branches(fw->sb, fw->data_blocks, &fw->root_indirect_data_block, 0);
+  tfs_free_inode(fw->sb, fw->ino);
+
+  printk("TFS: reclaimed %lu blocks of inode %u\n", freed, fw->ino);
+  kfree(fw);
+}
+
+/*
+ * Release the blocks and the inode of an unlinked inode. Files larger
+ * than TFS_FREE_SYNC_BLOCKS are handed to the free workqueue so that
+ * the final iput() does not wait for their indirect blocks to be read;
+ * the inode bit is cleared after the blocks, so the number is not
+ * reused before then.
+ */
+void tfs_free_inode_blocks(struct inode *inode)
+{
+  struct super_block *sb = inode->i_sb;
+  struct tfs_sb_info *si = sb->s_fs_info;
+  struct tfs_inode_info *ti = TFS_INODE(inode);
+  struct tfs_free_work *fw;
+  int i;
+
+  /* the target of a fast symlink overlays its block pointers */
+  if (tfs_inode_is_fast_symlink(inode))
+    {
+      tfs_free_inode(sb, inode->i_ino);
+      return;
+    }
+
+  if (inode->i_blocks > TFS_FREE_SYNC_BLOCKS &&
+      (fw = kmalloc(sizeof(*fw), GFP_NOFS)))
+    {
+      fw->sb = sb;
+      fw->ino = inode->i_ino;
+      for (i = 0; i < TFS_DATA_BLOCKS_PER_INODE; ++i)
+	fw->data_blocks[i] = ti->data_blocks[i];
+      fw->root_indirect_data_block = ti->root_indirect_data_block;
+
+      INIT_WORK(&fw->work, tfs_free_work_fn);
+      queue_work(si->free_wq, &fw->work);
+      return;
+    }
+
+  tfs_free_branches(sb, ti->data_blocks, &ti->root_indirect_data_block, 0);
+  tfs_free_inode(sb, inode->i_ino);
+}
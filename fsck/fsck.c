@@ -0,0 +1,827 @@
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+#include <linux/fs.h>
+
+#include "../driver/tfs.h"
+
+#define FSCK_OK 0
+#define FSCK_CORRECTED 1
+#define FSCK_UNCORRECTED 4
+#define FSCK_ERROR 8
+
+#define MAX_THREADS 64
+#define MAX_REPORTS 20
+
+struct fsck
+{
+  const char *device;
+  int repair;
+  int verbose;
+  int threads;
+
+  unsigned char *image;
+  unsigned long long image_size;
+  struct tfs_super_block *sb;
+  unsigned int bs;
+  unsigned int addr_per_block;
+  unsigned int alloc_bits;	/* data bitmap bits cover 1 << alloc_bits blocks */
+  unsigned long long blocks;
+  unsigned long long first_data_block;
+  unsigned int inodes;
+  unsigned long long itable_blocks;	/* inode table blocks on disk */
+  u32 *itable_map;		/* dynamic tables: the chunk map, bad entries cleared */
+  unsigned char *itable_bitmap;	/* dynamic tables: blocks of the chunks */
+
+  unsigned char *inode_bitmap;	/* expected, rebuilt from the inode table */
+  unsigned char *data_bitmap;	/* expected per block, rebuilt from the block maps */
+  unsigned char *cluster_bitmap;	/* with bigalloc, the same per cluster */
+  unsigned int *links;		/* directory entries naming each inode */
+  unsigned char *refcounts;	/* on disk, NULL on images without the table */
+  unsigned short *claims;	/* block map entries naming each block */
+
+  /* updated with atomics by the worker threads */
+  unsigned long long inodes_scanned;
+  unsigned long long inodes_used;
+  unsigned long long blocks_used;
+  unsigned long long shared_blocks;
+  unsigned long long bytes_read;
+  unsigned long long errors;
+  unsigned long long fixed;
+  unsigned long long reports;
+  unsigned long long reservations;	/* inode bits a crash left in per-CPU batches */
+};
+
+struct worker
+{
+  struct fsck *fs;
+  int pass;
+  unsigned int first_ino, last_ino;
+  unsigned long long first_block, last_block;
+};
+
+static double now(void)
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void problem(struct fsck *fs, int fixed, const char *fmt, ...)
+  __attribute__ ((format (printf, 3, 4)));
+
+static void problem(struct fsck *fs, int fixed, const char *fmt, ...)
+{
+  va_list ap;
+
+  __atomic_add_fetch(fixed ? &fs->fixed : &fs->errors, 1, __ATOMIC_RELAXED);
+  if (!fs->verbose && __atomic_add_fetch(&fs->reports, 1, __ATOMIC_RELAXED) > MAX_REPORTS)
+    return;
+
+  va_start(ap, fmt);
+  flockfile(stdout);
+  vprintf(fmt, ap);
+  printf(fixed ? " (fixed)\n" : "\n");
+  funlockfile(stdout);
+  va_end(ap);
+}
+
+static int test_bit(const unsigned char *bitmap, unsigned long long bit)
+{
+  return bitmap[bit >> 3] & (1 << (bit & 7));
+}
+
+static int set_bit_atomic(unsigned char *bitmap, unsigned long long bit)
+{
+  unsigned char mask = 1 << (bit & 7);
+
+  return __atomic_fetch_or(&bitmap[bit >> 3], mask, __ATOMIC_RELAXED) & mask;
+}
+
+static unsigned char *block_ptr(struct fsck *fs, unsigned long long block)
+{
+  return fs->image + block * fs->bs;
+}
+
+/* past the mark, a table block was zeroed if any of its inodes has its bit set on disk */
+static int inode_table_initialized(struct fsck *fs, unsigned long long table_block)
+{
+  unsigned char *bitmap = block_ptr(fs, fs->sb->inode_bitmap_block_start);
+  unsigned int bytes = TFS_INODE_PER_BLOCK(fs->bs) / 8, i;
+
+  if (!(fs->sb->flags & TFS_SB_ITABLE_UNINIT) || table_block < fs->sb->inode_table_init_blocks)
+    return 1;
+
+  for (i = 0; i < bytes; ++i)
+    if (bitmap[table_block * bytes + i])
+      return 1;
+  return 0;
+}
+
+static struct tfs_inode *inode_ptr(struct fsck *fs, unsigned int ino)
+{
+  static struct tfs_inode zero_inode;
+  unsigned int per_block = TFS_INODE_PER_BLOCK(fs->bs);
+  unsigned long long table_block = ino / per_block;
+  unsigned long long block;
+
+  if (!inode_table_initialized(fs, table_block))
+    return &zero_inode;
+
+  /* a chunk of a dynamic table not allocated yet holds only free inodes */
+  if (!(block = tfs_itable_map_block(fs->sb, fs->itable_map, table_block)))
+    return &zero_inode;
+
+  return (struct tfs_inode *) block_ptr(fs, block) + (ino % per_block);
+}
+
+static int block_valid(struct fsck *fs, unsigned long long block)
+{
+  return block >= fs->first_data_block && block < fs->blocks &&
+    tfs_itable_index(fs->sb, block) == TFS_NOT_ITABLE &&
+    !(fs->itable_bitmap && test_bit(fs->itable_bitmap, block));
+}
+
+/*
+ * Physical block of logical block 'lblock' of an inode, 0 for a hole or
+ * anything that points outside the volume.
+ */
+static unsigned long long map_block(struct fsck *fs, struct tfs_inode *ti, unsigned long long lblock)
+{
+  unsigned long long rel, ind;
+  u32 *table;
+
+  if (lblock < TFS_DATA_BLOCKS_PER_INODE)
+    return block_valid(fs, ti->data_blocks[lblock]) ? ti->data_blocks[lblock] : 0;
+
+  rel = lblock - TFS_DATA_BLOCKS_PER_INODE;
+  if (rel / fs->addr_per_block >= fs->addr_per_block || !block_valid(fs, ti->root_indirect_data_block))
+    return 0;
+
+  table = (u32 *) block_ptr(fs, ti->root_indirect_data_block);
+  ind = table[rel / fs->addr_per_block];
+  if (!block_valid(fs, ind))
+    return 0;
+
+  table = (u32 *) block_ptr(fs, ind);
+  return block_valid(fs, table[rel % fs->addr_per_block]) ? table[rel % fs->addr_per_block] : 0;
+}
+
+static void claim_block(struct fsck *fs, unsigned int ino, unsigned long long block, unsigned long long *count)
+{
+  if (!block_valid(fs, block))
+    {
+      problem(fs, 0, "inode %u: block %llu outside the data area", ino, block);
+      return;
+    }
+
+  /* shared blocks are checked against their reference count in pass 3 */
+  if (fs->claims)
+    __atomic_add_fetch(&fs->claims[block], 1, __ATOMIC_RELAXED);
+  if (set_bit_atomic(fs->data_bitmap, block) && !(fs->refcounts && fs->refcounts[block]))
+    problem(fs, 0, "inode %u: block %llu is claimed more than once", ino, block);
+
+  ++*count;
+}
+
+/*
+ * With bigalloc, the entries of each aligned run of a block map must
+ * sit at their own offsets in one cluster: the driver frees the cluster
+ * with the first of them.
+ */
+static void check_cluster_runs(struct fsck *fs, unsigned int ino, const u32 *e, unsigned int n)
+{
+  unsigned int run = 1U << fs->alloc_bits, i, first = 0;
+
+  for (i = 0; fs->alloc_bits && i < n; ++i)
+    {
+      if (!(i % run))
+	first = 0;
+      if (!e[i] || e[i] == TFS_COMPRESSED_BLOCK)
+	continue;
+
+      if ((e[i] & (run - 1)) != i % run)
+	problem(fs, 0, "inode %u: block %u is not at its offset in its cluster", ino, e[i]);
+      else if (!first)
+	first = e[i];
+      else if (e[i] >> fs->alloc_bits != first >> fs->alloc_bits)
+	problem(fs, 0, "inode %u: blocks %u and %u of one run are in different clusters", ino, first, e[i]);
+    }
+}
+
+/* Mark every block an inode owns, including its indirect blocks. */
+static unsigned long long claim_inode_blocks(struct fsck *fs, unsigned int ino, struct tfs_inode *ti)
+{
+  unsigned long long count = 0;
+  unsigned int i, j;
+  u32 *root, *ind;
+
+  /* the target is stored where the block pointers would be */
+  if (TFS_IS_FAST_SYMLINK(ti->mode, ti->size))
+    return 0;
+
+  for (i = 0; i < TFS_DATA_BLOCKS_PER_INODE; ++i)
+    if (ti->data_blocks[i])
+      claim_block(fs, ino, ti->data_blocks[i], &count);
+  check_cluster_runs(fs, ino, ti->data_blocks, TFS_DATA_BLOCKS_PER_INODE);
+
+  if (!ti->root_indirect_data_block)
+    return count;
+
+  claim_block(fs, ino, ti->root_indirect_data_block, &count);
+  if (!block_valid(fs, ti->root_indirect_data_block))
+    return count;
+
+  root = (u32 *) block_ptr(fs, ti->root_indirect_data_block);
+  __atomic_add_fetch(&fs->bytes_read, fs->bs, __ATOMIC_RELAXED);
+  check_cluster_runs(fs, ino, root, fs->addr_per_block);
+  for (i = 0; i < fs->addr_per_block; ++i)
+    {
+      if (!root[i])
+	continue;
+
+      claim_block(fs, ino, root[i], &count);
+      if (!block_valid(fs, root[i]))
+	continue;
+
+      ind = (u32 *) block_ptr(fs, root[i]);
+      __atomic_add_fetch(&fs->bytes_read, fs->bs, __ATOMIC_RELAXED);
+      /* the tail entries of a compressed cluster own no block */
+      for (j = 0; j < fs->addr_per_block; ++j)
+	if (ind[j] && ind[j] != TFS_COMPRESSED_BLOCK)
+	  claim_block(fs, ino, ind[j], &count);
+      check_cluster_runs(fs, ino, ind, fs->addr_per_block);
+    }
+
+  return count;
+}
+
+/* Pass 1: directories. Count links and drop entries naming free inodes. */
+static void check_directory(struct fsck *fs, unsigned int ino, struct tfs_inode *ti)
+{
+  unsigned long long nblocks = (ti->size + fs->bs - 1) / fs->bs;
+  unsigned long long lblock, block;
+  unsigned int per_block = fs->bs / sizeof(struct tfs_dentry);
+  unsigned int i, nent;
+  struct tfs_dentry *td;
+
+  for (lblock = 0; lblock < nblocks; ++lblock)
+    {
+      block = map_block(fs, ti, lblock);
+      if (!block)
+	continue;
+
+      td = (struct tfs_dentry *) block_ptr(fs, block);
+      __atomic_add_fetch(&fs->bytes_read, fs->bs, __ATOMIC_RELAXED);
+
+      nent = per_block;
+      if ((lblock + 1) * fs->bs > ti->size)
+	nent = (ti->size - lblock * fs->bs) / sizeof(struct tfs_dentry);
+
+      for (i = 0; i < nent; ++i, ++td)
+	{
+	  if (!td->inode)
+	    continue;
+
+	  if (td->inode >= fs->inodes || !inode_ptr(fs, td->inode)->mode || td->len > TFS_DENTRY_NAME_LEN)
+	    {
+	      if (fs->repair)
+		{
+		  problem(fs, 1, "directory %u: bad entry for inode %u", ino, td->inode);
+		  memset(td, 0, sizeof(*td));
+		}
+	      else
+		problem(fs, 0, "directory %u: entry '%.*s' names free or invalid inode %u",
+			ino, (int) (td->len > TFS_DENTRY_NAME_LEN ? TFS_DENTRY_NAME_LEN : td->len), td->name, td->inode);
+	      continue;
+	    }
+
+	  __atomic_add_fetch(&fs->links[td->inode], 1, __ATOMIC_RELAXED);
+	}
+    }
+}
+
+/* Pass 2: every inode. Rebuild the bitmaps and check the counts. */
+static void check_inode(struct fsck *fs, unsigned int ino, struct tfs_inode *ti)
+{
+  unsigned long long count;
+  unsigned int links = fs->links[ino];
+
+  if (!links && ino != TFS_ROOT_DIR_INODE)
+    {
+      if (fs->repair)
+	{
+	  memset(ti, 0, sizeof(*ti));
+	  problem(fs, 1, "inode %u: not in any directory, cleared", ino);
+	  return;
+	}
+      problem(fs, 0, "inode %u: not in any directory", ino);
+    }
+
+  set_bit_atomic(fs->inode_bitmap, ino);
+  __atomic_add_fetch(&fs->inodes_used, 1, __ATOMIC_RELAXED);
+
+  count = claim_inode_blocks(fs, ino, ti);
+  __atomic_add_fetch(&fs->blocks_used, count, __ATOMIC_RELAXED);
+
+  if (count != ti->blocks)
+    {
+      if (fs->repair)
+	ti->blocks = count;
+      problem(fs, fs->repair, "inode %u: block count %u, should be %llu", ino, ti->blocks, count);
+    }
+
+  if (S_ISREG(ti->mode) && ti->size_hi && !(fs->sb->flags & TFS_SB_64BIT))
+    {
+      if (fs->repair)
+	ti->size_hi = 0;
+      problem(fs, fs->repair, "inode %u: size of %llu bytes needs the 64bit feature", ino,
+	      (unsigned long long) TFS_FILE_SIZE(ti));
+    }
+
+  if (links && links != ti->hard_link_count)
+    {
+      if (fs->repair)
+	ti->hard_link_count = links;
+      problem(fs, fs->repair, "inode %u: link count %u, should be %u", ino, ti->hard_link_count, links);
+    }
+}
+
+static void *worker_inodes(void *arg)
+{
+  struct worker *w = arg;
+  struct fsck *fs = w->fs;
+  unsigned int per_block = TFS_INODE_PER_BLOCK(fs->bs);
+  unsigned int ino;
+  unsigned long long first, last;
+
+  /* the inode table is walked in order; tell the kernel to read it ahead */
+  if (!(fs->sb->flags & TFS_SB_ITABLE_DYNAMIC))
+    {
+      first = tfs_itable_block(fs->sb, w->first_ino / per_block);
+      last = tfs_itable_block(fs->sb, (w->last_ino - 1) / per_block);
+      madvise(block_ptr(fs, first), (last - first + 1) * fs->bs, MADV_SEQUENTIAL);
+    }
+
+  for (ino = w->first_ino; ino < w->last_ino; ++ino)
+    {
+      struct tfs_inode *ti;
+
+      if (!ino)
+	continue;
+
+      ti = inode_ptr(fs, ino);
+      if (!ti->mode)
+	continue;
+
+      if (w->pass == 1)
+	{
+	  if (S_ISDIR(ti->mode))
+	    check_directory(fs, ino, ti);
+	}
+      else
+	check_inode(fs, ino, ti);
+    }
+
+  if (w->pass == 2)
+    {
+      __atomic_add_fetch(&fs->inodes_scanned, w->last_ino - w->first_ino, __ATOMIC_RELAXED);
+      __atomic_add_fetch(&fs->bytes_read, (unsigned long long) (w->last_ino - w->first_ino) * TFS_INODE_SIZE, __ATOMIC_RELAXED);
+    }
+
+  return NULL;
+}
+
+/*
+ * Pass 3: compare the rebuilt bitmaps with the ones on disk. With
+ * 'reserved', a bit set on disk for a free entry is not a problem: the
+ * driver sets the bits of the inode numbers it hands each CPU ahead of
+ * the creates, and a crash leaves the unused ones set. Repairing gives
+ * them back.
+ */
+static void compare_bitmap(struct fsck *fs, const char *what, unsigned char *disk, unsigned char *expected,
+			   unsigned long long first, unsigned long long last, int reserved)
+{
+  unsigned long long bit;
+
+  for (bit = first; bit < last; ++bit)
+    {
+      int on_disk = test_bit(disk, bit) != 0;
+      int wanted = test_bit(expected, bit) != 0;
+
+      if (on_disk == wanted)
+	{
+	  /* skip whole bytes that agree */
+	  if (!(bit & 7) && bit + 8 <= last && disk[bit >> 3] == expected[bit >> 3])
+	    bit += 7;
+	  continue;
+	}
+
+      if (fs->repair)
+	disk[bit >> 3] ^= 1 << (bit & 7);
+
+      if (!wanted && reserved)
+	{
+	  if (fs->repair)
+	    __atomic_add_fetch(&fs->reservations, 1, __ATOMIC_RELAXED);
+	  continue;
+	}
+
+      if (wanted)
+	problem(fs, fs->repair, "%s %llu in use but marked free", what, bit);
+      else
+	problem(fs, fs->repair, "%s %llu free but marked in use", what, bit);
+    }
+}
+
+/* a block named n times should have n - 1 extra references on record */
+static void compare_refcounts(struct fsck *fs, unsigned long long first, unsigned long long last)
+{
+  unsigned long long block, shared = 0;
+  unsigned int wanted;
+
+  for (block = first; block < last; ++block)
+    {
+      wanted = fs->claims[block] > 1 ? fs->claims[block] - 1 : 0;
+      if (wanted > TFS_REFCOUNT_MAX)
+	{
+	  problem(fs, 0, "block %llu is claimed %u times, more than can be counted", block, fs->claims[block]);
+	  wanted = TFS_REFCOUNT_MAX;
+	}
+
+      if (fs->refcounts[block] != wanted)
+	{
+	  problem(fs, fs->repair, "block %llu has reference count %u, %u expected",
+		  block, fs->refcounts[block] + 1, wanted + 1);
+	  if (fs->repair)
+	    fs->refcounts[block] = wanted;
+	}
+
+      if (fs->refcounts[block])
+	++shared;
+    }
+
+  __atomic_add_fetch(&fs->shared_blocks, shared, __ATOMIC_RELAXED);
+}
+
+static void *worker_bitmaps(void *arg)
+{
+  struct worker *w = arg;
+  struct fsck *fs = w->fs;
+  struct tfs_super_block *sb = fs->sb;
+
+  if (w->first_ino < w->last_ino)
+    compare_bitmap(fs, "inode", block_ptr(fs, sb->inode_bitmap_block_start), fs->inode_bitmap, w->first_ino, w->last_ino, 1);
+  if (fs->alloc_bits)
+    compare_bitmap(fs, "cluster", block_ptr(fs, sb->data_bitmap_block_start), fs->cluster_bitmap,
+		   w->first_block >> fs->alloc_bits, (w->last_block + (1U << fs->alloc_bits) - 1) >> fs->alloc_bits, 0);
+  else
+    compare_bitmap(fs, "block", block_ptr(fs, sb->data_bitmap_block_start), fs->data_bitmap, w->first_block, w->last_block, 0);
+  if (fs->refcounts)
+    compare_refcounts(fs, w->first_block, w->last_block);
+
+  return NULL;
+}
+
+static int run_workers(struct fsck *fs, int pass, void *(*fn)(void *))
+{
+  pthread_t tids[MAX_THREADS];
+  struct worker w[MAX_THREADS];
+  unsigned long long ipt, bpt;
+  int i;
+
+  /* split on 64-bit boundaries, of clusters with bigalloc, so no two threads share a bitmap byte range they both write */
+  ipt = ((fs->inodes + fs->threads - 1) / fs->threads + 63) & ~63ULL;
+  bpt = ((fs->blocks + fs->threads - 1) / fs->threads + (64ULL << fs->alloc_bits) - 1) & ~((64ULL << fs->alloc_bits) - 1);
+
+  for (i = 0; i < fs->threads; ++i)
+    {
+      w[i].fs = fs;
+      w[i].pass = pass;
+      w[i].first_ino = i * ipt < fs->inodes ? i * ipt : fs->inodes;
+      w[i].last_ino = (i + 1) * ipt < fs->inodes ? (i + 1) * ipt : fs->inodes;
+      w[i].first_block = i * bpt < fs->blocks ? i * bpt : fs->blocks;
+      w[i].last_block = (i + 1) * bpt < fs->blocks ? (i + 1) * bpt : fs->blocks;
+      if (pthread_create(&tids[i], NULL, fn, &w[i]))
+	{
+	  fprintf(stderr, "fsck.tfs: cannot create thread\n");
+	  return -1;
+	}
+    }
+
+  for (i = 0; i < fs->threads; ++i)
+    pthread_join(tids[i], NULL);
+
+  return 0;
+}
+
+static int open_image(struct fsck *fs)
+{
+  struct stat st;
+  int fd;
+
+  fd = open(fs->device, fs->repair ? O_RDWR : O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) < 0)
+    {
+      fprintf(stderr, "fsck.tfs: %s: %s\n", fs->device, strerror(errno));
+      return -1;
+    }
+
+  fs->image_size = st.st_size;
+  if (S_ISBLK(st.st_mode) && ioctl(fd, BLKGETSIZE64, &fs->image_size) < 0)
+    {
+      fprintf(stderr, "fsck.tfs: %s: cannot get size: %s\n", fs->device, strerror(errno));
+      return -1;
+    }
+
+  if (fs->image_size < TFS_SUPER_OFFSET + sizeof(struct tfs_super_block))
+    {
+      fprintf(stderr, "fsck.tfs: %s: too small\n", fs->device);
+      return -1;
+    }
+
+  fs->image = mmap(NULL, fs->image_size, PROT_READ | (fs->repair ? PROT_WRITE : 0), MAP_SHARED, fd, 0);
+  close(fd);
+  if (fs->image == MAP_FAILED)
+    {
+      fprintf(stderr, "fsck.tfs: %s: mmap: %s\n", fs->device, strerror(errno));
+      return -1;
+    }
+
+  fs->sb = (struct tfs_super_block *) (fs->image + TFS_SUPER_OFFSET);
+  if (fs->sb->magic != TFS_MAGIC)
+    {
+      fprintf(stderr, "fsck.tfs: %s: not a tfs file system\n", fs->device);
+      return -1;
+    }
+
+  fs->bs = fs->sb->block_size ? fs->sb->block_size : TFS_BLOCK_SIZE;
+  if (fs->bs < TFS_MIN_BLOCK_SIZE || fs->bs > TFS_MAX_BLOCK_SIZE || (fs->bs & (fs->bs - 1)))
+    {
+      fprintf(stderr, "fsck.tfs: %s: bad block size %u\n", fs->device, fs->bs);
+      return -1;
+    }
+
+  fs->addr_per_block = fs->bs / sizeof(u32);
+  fs->alloc_bits = fs->sb->alloc_bits;
+  if (fs->alloc_bits > TFS_MAX_ALLOC_BITS || (fs->alloc_bits && fs->sb->refcount_blocks))
+    {
+      fprintf(stderr, "fsck.tfs: %s: bad allocation cluster of %u bits\n", fs->device, fs->alloc_bits);
+      return -1;
+    }
+  fs->blocks = fs->image_size / fs->bs;
+  if (fs->blocks > (unsigned long long) fs->sb->data_bitmap_blocks * fs->bs * 8 << fs->alloc_bits)
+    fs->blocks = (unsigned long long) fs->sb->data_bitmap_blocks * fs->bs * 8 << fs->alloc_bits;
+  fs->first_data_block = fs->sb->inode_table_block_start;
+  fs->inodes = fs->sb->inode_table_entries;
+  fs->itable_blocks = (fs->sb->flags & TFS_SB_ITABLE_DYNAMIC) ? fs->sb->itable_chunk_blocks : fs->sb->inode_table_blocks;
+
+  if ((fs->sb->flags & TFS_SB_ITABLE_DYNAMIC) &&
+      (fs->sb->blocks_per_group || (fs->sb->flags & TFS_SB_ITABLE_UNINIT) || fs->alloc_bits ||
+       !fs->sb->itable_chunk_blocks || fs->sb->itable_chunk_blocks > fs->bs * 8 ||
+       fs->sb->inode_table_blocks % fs->sb->itable_chunk_blocks ||
+       fs->sb->inode_table_blocks / fs->sb->itable_chunk_blocks > fs->addr_per_block ||
+       !fs->sb->itable_map_block || fs->sb->itable_map_block >= fs->first_data_block))
+    {
+      fprintf(stderr, "fsck.tfs: %s: bad dynamic inode table\n", fs->device);
+      return -1;
+    }
+
+  if (!fs->sb->inode_table_blocks ||
+      (fs->sb->blocks_per_group &&
+       (!fs->sb->inodes_per_group || fs->sb->inodes_per_group % TFS_INODE_PER_BLOCK(fs->bs) ||
+	tfs_itable_blocks_per_group(fs->sb) >= fs->sb->blocks_per_group)) ||
+      (unsigned long long) tfs_itable_block(fs->sb, fs->itable_blocks - 1) >= fs->blocks ||
+      (unsigned long long) fs->sb->inode_bitmap_block_start + fs->sb->inode_bitmap_blocks > fs->blocks ||
+      (unsigned long long) fs->sb->data_bitmap_block_start + fs->sb->data_bitmap_blocks > fs->blocks ||
+      (fs->sb->refcount_blocks &&
+       ((unsigned long long) fs->sb->refcount_blocks * fs->bs < fs->blocks ||
+	(unsigned long long) fs->sb->refcount_block_start + fs->sb->refcount_blocks > fs->first_data_block)) ||
+      (unsigned long long) fs->sb->inode_bitmap_blocks * fs->bs * 8 < fs->inodes ||
+      (unsigned long long) fs->sb->inode_table_blocks * TFS_INODE_PER_BLOCK(fs->bs) < fs->inodes)
+    {
+      fprintf(stderr, "fsck.tfs: %s: super block geometry does not fit the device\n", fs->device);
+      return -1;
+    }
+
+  return 0;
+}
+
+/*
+ * Copy the chunk map of a dynamic inode table, marking the blocks of
+ * every chunk. A chunk off the device or overlapping metadata or another
+ * chunk cannot be trusted; its inodes are treated as free.
+ */
+static int load_itable_map(struct fsck *fs)
+{
+  u32 *map = (u32 *) block_ptr(fs, fs->sb->itable_map_block);
+  unsigned int n = fs->sb->itable_chunk_blocks;
+  unsigned int chunks = fs->sb->inode_table_blocks / n;
+  unsigned int chunk;
+  unsigned long long block;
+
+  if (!(fs->sb->flags & TFS_SB_ITABLE_DYNAMIC))
+    return 0;
+
+  fs->itable_map = calloc(fs->addr_per_block, sizeof(u32));
+  fs->itable_bitmap = calloc(1, (fs->blocks + 7) / 8);
+  if (!fs->itable_map || !fs->itable_bitmap)
+    return -1;
+
+  if (map[0] != fs->sb->inode_table_block_start)
+    {
+      problem(fs, fs->repair, "inode table map: first chunk at %u, should be %u",
+	      map[0], fs->sb->inode_table_block_start);
+      if (fs->repair)
+	map[0] = fs->sb->inode_table_block_start;
+    }
+  fs->itable_map[0] = fs->sb->inode_table_block_start;
+
+  for (chunk = 1; chunk < fs->addr_per_block; ++chunk)
+    {
+      if (!map[chunk])
+	continue;
+
+      if (chunk >= chunks || map[chunk] < fs->first_data_block + n ||
+	  (unsigned long long) map[chunk] + n > fs->blocks)
+	{
+	  problem(fs, 0, "inode table map: chunk %u at %u outside the data area", chunk, map[chunk]);
+	  continue;
+	}
+
+      for (block = map[chunk]; block < (unsigned long long) map[chunk] + n; ++block)
+	if (test_bit(fs->itable_bitmap, block))
+	  break;
+      if (block < (unsigned long long) map[chunk] + n)
+	{
+	  problem(fs, 0, "inode table map: chunk %u at %u overlaps another chunk", chunk, map[chunk]);
+	  continue;
+	}
+
+      for (block = map[chunk]; block < (unsigned long long) map[chunk] + n; ++block)
+	set_bit_atomic(fs->itable_bitmap, block);
+      fs->itable_map[chunk] = map[chunk];
+      fs->itable_blocks += n;
+    }
+
+  fs->bytes_read += fs->bs;
+  return 0;
+}
+
+static void usage(const char *prog)
+{
+  fprintf(stderr,
+	  "usage: %s [-n|-y] [-j threads] [-v] device\n"
+	  "  -n  check only, change nothing (default)\n"
+	  "  -y  repair everything found\n"
+	  "  -j  worker threads (default: online CPUs)\n"
+	  "  -v  report every problem, not only the first %d\n",
+	  prog, MAX_REPORTS);
+  exit(FSCK_ERROR);
+}
+
+int main(int argc, char **argv)
+{
+  struct fsck fs;
+  unsigned long long bit, block, bitmap_bytes;
+  double start, elapsed;
+  int c;
+
+  memset(&fs, 0, sizeof(fs));
+  fs.threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+  while ((c = getopt(argc, argv, "nyj:v")) != -1)
+    {
+      switch (c)
+	{
+	case 'n':
+	  fs.repair = 0;
+	  break;
+	case 'y':
+	  fs.repair = 1;
+	  break;
+	case 'j':
+	  fs.threads = atoi(optarg);
+	  break;
+	case 'v':
+	  fs.verbose = 1;
+	  break;
+	default:
+	  usage(argv[0]);
+	}
+    }
+
+  if (optind != argc - 1)
+    usage(argv[0]);
+  if (fs.threads < 1)
+    fs.threads = 1;
+  if (fs.threads > MAX_THREADS)
+    fs.threads = MAX_THREADS;
+
+  fs.device = argv[optind];
+  start = now();
+
+  if (open_image(&fs) < 0)
+    return FSCK_ERROR;
+  if (load_itable_map(&fs) < 0)
+    {
+      fprintf(stderr, "fsck.tfs: out of memory\n");
+      return FSCK_ERROR;
+    }
+
+  bitmap_bytes = (unsigned long long) (fs.sb->inode_bitmap_blocks > fs.sb->data_bitmap_blocks ?
+				       fs.sb->inode_bitmap_blocks : fs.sb->data_bitmap_blocks) * fs.bs;
+  fs.inode_bitmap = calloc(1, bitmap_bytes);
+  fs.data_bitmap = calloc(1, bitmap_bytes << fs.alloc_bits);
+  if (fs.alloc_bits)
+    fs.cluster_bitmap = calloc(1, bitmap_bytes);
+  fs.links = calloc(fs.inodes, sizeof(*fs.links));
+  if (fs.sb->refcount_blocks)
+    {
+      fs.refcounts = block_ptr(&fs, fs.sb->refcount_block_start);
+      fs.claims = calloc(fs.blocks, sizeof(*fs.claims));
+    }
+  if (!fs.inode_bitmap || !fs.data_bitmap || !fs.links || (fs.refcounts && !fs.claims) ||
+      (fs.alloc_bits && !fs.cluster_bitmap))
+    {
+      fprintf(stderr, "fsck.tfs: out of memory\n");
+      return FSCK_ERROR;
+    }
+
+  /* inode 0, the metadata in front of the groups and the inode table are always in use */
+  set_bit_atomic(fs.inode_bitmap, 0);
+  for (bit = 0; bit < fs.first_data_block; ++bit)
+    set_bit_atomic(fs.data_bitmap, bit);
+  for (bit = 0; bit < fs.sb->inode_table_blocks; ++bit)
+    if ((block = tfs_itable_map_block(fs.sb, fs.itable_map, bit)))
+      set_bit_atomic(fs.data_bitmap, block);
+
+  if (run_workers(&fs, 1, worker_inodes) < 0 ||
+      run_workers(&fs, 2, worker_inodes) < 0)
+    return FSCK_ERROR;
+
+  /* bits past the end of the table or the device stay set, as mkfs left them */
+  for (bit = fs.inodes; bit < (unsigned long long) fs.sb->inode_bitmap_blocks * fs.bs * 8; ++bit)
+    set_bit_atomic(fs.inode_bitmap, bit);
+  for (bit = fs.blocks; bit < (unsigned long long) fs.sb->data_bitmap_blocks * fs.bs * 8 << fs.alloc_bits; ++bit)
+    set_bit_atomic(fs.data_bitmap, bit);
+
+  /* a cluster is in use if any of its blocks is */
+  for (bit = 0; fs.alloc_bits && bit < (unsigned long long) fs.sb->data_bitmap_blocks * fs.bs * 8 << fs.alloc_bits; ++bit)
+    if (test_bit(fs.data_bitmap, bit))
+      set_bit_atomic(fs.cluster_bitmap, bit >> fs.alloc_bits);
+
+  if (run_workers(&fs, 3, worker_bitmaps) < 0)
+    return FSCK_ERROR;
+  fs.bytes_read += (unsigned long long) (fs.sb->inode_bitmap_blocks + fs.sb->data_bitmap_blocks +
+					 fs.sb->refcount_blocks) * fs.bs;
+
+  if (fs.refcounts && fs.sb->shared_blocks != fs.shared_blocks)
+    {
+      problem(&fs, fs.repair, "super block counts %u shared blocks, %llu found", fs.sb->shared_blocks, fs.shared_blocks);
+      if (fs.repair)
+	fs.sb->shared_blocks = fs.shared_blocks;
+    }
+
+  if (fs.repair && msync(fs.image, fs.image_size, MS_SYNC) < 0)
+    {
+      fprintf(stderr, "fsck.tfs: %s: msync: %s\n", fs.device, strerror(errno));
+      return FSCK_ERROR;
+    }
+
+  elapsed = now() - start;
+  if (elapsed <= 0)
+    elapsed = 1e-6;
+
+  if (!fs.verbose && fs.reports > MAX_REPORTS)
+    printf("... %llu more problems not shown\n", fs.reports - MAX_REPORTS);
+
+  printf("%s: %llu/%u inodes, %llu/%llu blocks in use\n",
+	 fs.device, fs.inodes_used, fs.inodes, fs.blocks_used + fs.first_data_block + fs.itable_blocks, fs.blocks);
+  if (fs.reservations)
+    printf("%s: %llu reserved inode numbers returned\n", fs.device, fs.reservations);
+  printf("%s: %llu problems fixed, %llu left\n", fs.device, fs.fixed, fs.errors);
+  printf("%s: %d threads, %.3f s, %.0f inodes/s, %.3f GB/s of metadata\n",
+	 fs.device, fs.threads, elapsed, fs.inodes_scanned / elapsed, fs.bytes_read / elapsed / 1e9);
+
+  munmap(fs.image, fs.image_size);
+
+  if (fs.errors)
+    return FSCK_UNCORRECTED;
+  if (fs.fixed)
+    return FSCK_CORRECTED;
+  return FSCK_OK;
+}
@@ -0,0 +1,2123 @@
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#include "libtfs.h"
+
+struct tfs_buf
+{
+  uint64_t block;
+  int refs;
+  int dirty;
+  struct tfs_buf *hash_next;
+  struct tfs_buf *lru_prev, *lru_next;
+  unsigned char *data;
+};
+
+struct tfs_cache
+{
+  pthread_mutex_t lock;
+  struct tfs_buf **hash;
+  size_t hash_size;
+  size_t count, max;
+  struct tfs_buf lru;		/* lru.lru_next is the most recently used */
+};
+
+struct tfs_fs
+{
+  int fd;
+  int rw;
+  pthread_rwlock_t lock;
+  struct tfs_super_block sb;
+  int sb_dirty;
+
+  unsigned int bs;
+  unsigned int addr_per_block;
+  unsigned int inodes_per_block;
+  uint64_t bits_per_block;
+  unsigned int alloc_bits;	/* data bitmap bits cover 1 << alloc_bits blocks */
+  uint64_t blocks;
+  uint64_t first_data_block;
+
+  uint64_t free_blocks, free_inodes;
+  uint64_t inode_hint, data_hint;
+
+  struct tfs_cache cache;
+};
+
+static uint32_t now(void)
+{
+  return time(NULL);
+}
+
+/*
+ * Block cache for metadata: bitmaps, inode table, indirect blocks and
+ * directories. Regular file data bypasses it and goes straight to the
+ * image with pread/pwrite.
+ */
+
+static int io_full(int fd, void *buf, size_t len, off_t off, int write)
+{
+  char *p = buf;
+
+  while (len)
+    {
+      ssize_t n = write ? pwrite(fd, p, len, off) : pread(fd, p, len, off);
+      if (n < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  return -errno;
+	}
+      if (!n)
+	{
+	  if (write)
+	    return -EIO;
+	  memset(p, 0, len);
+	  return 0;
+	}
+      p += n;
+      off += n;
+      len -= n;
+    }
+
+  return 0;
+}
+
+static void lru_unlink(struct tfs_buf *b)
+{
+  b->lru_prev->lru_next = b->lru_next;
+  b->lru_next->lru_prev = b->lru_prev;
+}
+
+static void lru_push(struct tfs_cache *c, struct tfs_buf *b)
+{
+  b->lru_next = c->lru.lru_next;
+  b->lru_prev = &c->lru;
+  c->lru.lru_next->lru_prev = b;
+  c->lru.lru_next = b;
+}
+
+static struct tfs_buf **hash_slot(struct tfs_cache *c, uint64_t block)
+{
+  return &c->hash[(block * 0x9e3779b97f4a7c15ULL >> 20) % c->hash_size];
+}
+
+static void hash_remove(struct tfs_cache *c, struct tfs_buf *b)
+{
+  struct tfs_buf **p;
+
+  for (p = hash_slot(c, b->block); *p; p = &(*p)->hash_next)
+    if (*p == b)
+      {
+	*p = b->hash_next;
+	return;
+      }
+}
+
+static int cache_init(struct tfs_cache *c, size_t max)
+{
+  pthread_mutex_init(&c->lock, NULL);
+  c->max = max ? max : TFS_DEFAULT_CACHE_BLOCKS;
+  c->hash_size = c->max * 2 + 1;
+  c->hash = calloc(c->hash_size, sizeof(*c->hash));
+  c->lru.lru_next = c->lru.lru_prev = &c->lru;
+  c->count = 0;
+
+  return c->hash ? 0 : -ENOMEM;
+}
+
+static int buf_write(struct tfs_fs *fs, struct tfs_buf *b)
+{
+  int err = io_full(fs->fd, b->data, fs->bs, (off_t) b->block * fs->bs, 1);
+
+  if (!err)
+    b->dirty = 0;
+  return err;
+}
+
+/* drop one unreferenced buffer from the cold end, writing it if dirty */
+static int cache_evict(struct tfs_fs *fs)
+{
+  struct tfs_cache *c = &fs->cache;
+  struct tfs_buf *b;
+  int err;
+
+  for (b = c->lru.lru_prev; b != &c->lru; b = b->lru_prev)
+    {
+      if (b->refs)
+	continue;
+
+      if (b->dirty && (err = buf_write(fs, b)) < 0)
+	return err;
+
+      lru_unlink(b);
+      hash_remove(c, b);
+      free(b->data);
+      free(b);
+      --c->count;
+      return 0;
+    }
+
+  return 0;
+}
+
+/*
+ * Get a referenced buffer for 'block'. With 'read' clear a block not in
+ * the cache is zeroed instead of read, for blocks about to be rewritten.
+ */
+static struct tfs_buf *bget(struct tfs_fs *fs, uint64_t block, int read, int *err)
+{
+  struct tfs_cache *c = &fs->cache;
+  struct tfs_buf *b;
+
+  pthread_mutex_lock(&c->lock);
+
+  for (b = *hash_slot(c, block); b; b = b->hash_next)
+    if (b->block == block)
+      {
+	++b->refs;
+	lru_unlink(b);
+	lru_push(c, b);
+	if (!read)
+	  memset(b->data, 0, fs->bs);
+	pthread_mutex_unlock(&c->lock);
+	return b;
+      }
+
+  if (c->count >= c->max && (*err = cache_evict(fs)) < 0)
+    goto out_unlock;
+
+  b = calloc(1, sizeof(*b));
+  if (!b || !(b->data = malloc(fs->bs)))
+    {
+      free(b);
+      *err = -ENOMEM;
+      goto out_unlock;
+    }
+
+  b->block = block;
+  b->refs = 1;
+  if (read)
+    {
+      if ((*err = io_full(fs->fd, b->data, fs->bs, (off_t) block * fs->bs, 0)) < 0)
+	{
+	  free(b->data);
+	  free(b);
+	  goto out_unlock;
+	}
+    }
+  else
+    memset(b->data, 0, fs->bs);
+
+  b->hash_next = *hash_slot(c, block);
+  *hash_slot(c, block) = b;
+  lru_push(c, b);
+  ++c->count;
+
+  pthread_mutex_unlock(&c->lock);
+  return b;
+
+out_unlock:
+  pthread_mutex_unlock(&c->lock);
+  return NULL;
+}
+
+static struct tfs_buf *bread(struct tfs_fs *fs, uint64_t block, int *err)
+{
+  return bget(fs, block, 1, err);
+}
+
+static struct tfs_buf *bnew(struct tfs_fs *fs, uint64_t block, int *err)
+{
+  return bget(fs, block, 0, err);
+}
+
+static void bdirty(struct tfs_fs *fs, struct tfs_buf *b)
+{
+  pthread_mutex_lock(&fs->cache.lock);
+  b->dirty = 1;
+  pthread_mutex_unlock(&fs->cache.lock);
+}
+
+static void brelse(struct tfs_fs *fs, struct tfs_buf *b)
+{
+  if (!b)
+    return;
+  pthread_mutex_lock(&fs->cache.lock);
+  --b->refs;
+  pthread_mutex_unlock(&fs->cache.lock);
+}
+
+/* a block being freed or handed to file data must not be written back later */
+static void bforget(struct tfs_fs *fs, uint64_t block)
+{
+  struct tfs_cache *c = &fs->cache;
+  struct tfs_buf *b;
+
+  pthread_mutex_lock(&c->lock);
+  for (b = *hash_slot(c, block); b; b = b->hash_next)
+    if (b->block == block)
+      {
+	if (!b->refs)
+	  {
+	    lru_unlink(b);
+	    hash_remove(c, b);
+	    free(b->data);
+	    free(b);
+	    --c->count;
+	  }
+	else
+	  b->dirty = 0;
+	break;
+      }
+  pthread_mutex_unlock(&c->lock);
+}
+
+static int cmp_buf(const void *a, const void *b)
+{
+  const struct tfs_buf *x = *(const struct tfs_buf **) a, *y = *(const struct tfs_buf **) b;
+
+  return x->block < y->block ? -1 : x->block > y->block;
+}
+
+/* write every dirty buffer in block order */
+static int cache_flush(struct tfs_fs *fs)
+{
+  struct tfs_cache *c = &fs->cache;
+  struct tfs_buf **list, *b;
+  size_t n = 0, i;
+  int err = 0;
+
+  pthread_mutex_lock(&c->lock);
+  list = malloc(c->count * sizeof(*list) + 1);
+  if (!list)
+    {
+      pthread_mutex_unlock(&c->lock);
+      return -ENOMEM;
+    }
+
+  for (b = c->lru.lru_next; b != &c->lru; b = b->lru_next)
+    if (b->dirty)
+      list[n++] = b;
+
+  qsort(list, n, sizeof(*list), cmp_buf);
+  for (i = 0; i < n && !err; ++i)
+    err = buf_write(fs, list[i]);
+
+  pthread_mutex_unlock(&c->lock);
+  free(list);
+
+  return err;
+}
+
+static void cache_destroy(struct tfs_cache *c)
+{
+  struct tfs_buf *b, *next;
+
+  for (b = c->lru.lru_next; b != &c->lru; b = next)
+    {
+      next = b->lru_next;
+      free(b->data);
+      free(b);
+    }
+  free(c->hash);
+  pthread_mutex_destroy(&c->lock);
+}
+
+/*
+ * Bitmaps. Bit n of a bitmap is bit (n % 8) of byte n / 8, the layout
+ * the driver's unsigned long scans see on a little-endian host.
+ */
+
+static int bitmap_change(struct tfs_fs *fs, uint32_t start, uint64_t bit, int set)
+{
+  int err = 0;
+  struct tfs_buf *b = bread(fs, start + bit / fs->bits_per_block, &err);
+  uint64_t off = bit % fs->bits_per_block;
+
+  if (!b)
+    return err;
+
+  if (set)
+    b->data[off >> 3] |= 1 << (off & 7);
+  else
+    b->data[off >> 3] &= ~(1 << (off & 7));
+  bdirty(fs, b);
+  brelse(fs, b);
+
+  return 0;
+}
+
+/* first fit from *hint, which is kept at or below the lowest free bit */
+static int bitmap_alloc(struct tfs_fs *fs, uint32_t start, uint64_t nbits, uint64_t *hint, uint64_t *result)
+{
+  uint64_t bit = *hint;
+  int err = 0;
+
+  while (bit < nbits)
+    {
+      struct tfs_buf *b = bread(fs, start + bit / fs->bits_per_block, &err);
+      uint64_t off = bit % fs->bits_per_block;
+      uint64_t end = fs->bits_per_block;
+
+      if (!b)
+	return err;
+
+      if (end > off + (nbits - bit))
+	end = off + (nbits - bit);
+
+      for ( ; off < end; ++off, ++bit)
+	{
+	  if (!(off & 7) && b->data[off >> 3] == 0xff && off + 8 <= end)
+	    {
+	      off += 7;
+	      bit += 7;
+	      continue;
+	    }
+	  if (!(b->data[off >> 3] & (1 << (off & 7))))
+	    {
+	      b->data[off >> 3] |= 1 << (off & 7);
+	      bdirty(fs, b);
+	      brelse(fs, b);
+	      *hint = bit + 1;
+	      *result = bit;
+	      return 0;
+	    }
+	}
+      brelse(fs, b);
+    }
+
+  *hint = nbits;
+  return -ENOSPC;
+}
+
+static uint64_t bitmap_count_free(struct tfs_fs *fs, uint32_t start, uint64_t nbits)
+{
+  uint64_t bit, free_bits = 0;
+  int err = 0;
+
+  for (bit = 0; bit < nbits; bit += fs->bits_per_block)
+    {
+      struct tfs_buf *b = bread(fs, start + bit / fs->bits_per_block, &err);
+      uint64_t off, end = nbits - bit < fs->bits_per_block ? nbits - bit : fs->bits_per_block;
+
+      if (!b)
+	return 0;
+      for (off = 0; off < end; ++off)
+	if (!(b->data[off >> 3] & (1 << (off & 7))))
+	  ++free_bits;
+      brelse(fs, b);
+    }
+
+  return free_bits;
+}
+
+/*
+ * First fit for 'n' free bits in a row at or after 'goal', wrapping
+ * around once; the run is marked in use.
+ */
+static int bitmap_alloc_run(struct tfs_fs *fs, uint32_t start, uint64_t nbits, uint64_t goal, uint64_t n, uint64_t *result)
+{
+  uint64_t bit, first = 0, len = 0, scanned;
+  struct tfs_buf *b = NULL;
+  int err = 0;
+
+  if (goal >= nbits)
+    goal = 0;
+
+  for (scanned = 0, bit = goal; scanned < nbits + n; ++scanned, ++bit)
+    {
+      uint64_t off;
+
+      if (bit == nbits)
+	{
+	  bit = 0;
+	  len = 0;
+	}
+      off = bit % fs->bits_per_block;
+      if (!b || !off)
+	{
+	  brelse(fs, b);
+	  if (!(b = bread(fs, start + bit / fs->bits_per_block, &err)))
+	    return err;
+	}
+
+      if (b->data[off >> 3] & (1 << (off & 7)))
+	{
+	  len = 0;
+	  continue;
+	}
+      if (!len++)
+	first = bit;
+      if (len == n)
+	break;
+    }
+  brelse(fs, b);
+
+  if (len < n)
+    return -ENOSPC;
+
+  for (bit = first; bit < first + n; ++bit)
+    if ((err = bitmap_change(fs, start, bit, 1)) < 0)
+      return err;
+
+  *result = first;
+  return 0;
+}
+
+/* with bigalloc, a whole cluster, of which *block is the first block */
+static int alloc_block(struct tfs_fs *fs, uint64_t *block)
+{
+  uint64_t bit, i;
+  int err = bitmap_alloc(fs, fs->sb.data_bitmap_block_start, fs->blocks >> fs->alloc_bits, &fs->data_hint, &bit);
+
+  if (!err)
+    {
+      *block = bit << fs->alloc_bits;
+      fs->free_blocks -= 1U << fs->alloc_bits;
+      for (i = 0; i < 1U << fs->alloc_bits; ++i)
+	bforget(fs, *block + i);
+    }
+  return err;
+}
+
+/*
+ * Allocate the block for entry 'index' of the block map 'e' of 'n'
+ * entries. With bigalloc, the aligned run of entries around it shares
+ * one cluster, each entry at its own offset in it.
+ */
+static int alloc_mapped_block(struct tfs_fs *fs, const uint32_t *e, unsigned int n, unsigned int index, uint64_t *block)
+{
+  unsigned int run = 1U << fs->alloc_bits, first = index - index % run, i;
+  int err;
+
+  for (i = first; e && fs->alloc_bits && i < first + run && i < n; ++i)
+    {
+      if (e[i] && (e[i] & (run - 1)) == i - first)
+	{
+	  *block = e[i] - (i - first) + (index - first);
+	  return 0;
+	}
+    }
+
+  if (!(err = alloc_block(fs, block)) && e)
+    *block += index - first;
+
+  return err;
+}
+
+/*
+ * Reference counts: byte n of the table counts the block map entries
+ * naming block n beyond the first.
+ */
+static int block_shared(struct tfs_fs *fs, uint64_t block)
+{
+  struct tfs_buf *b;
+  int err = 0, shared;
+
+  if (!fs->sb.shared_blocks)
+    return 0;
+  if (!(b = bread(fs, fs->sb.refcount_block_start + block / fs->bs, &err)))
+    return err;
+  shared = b->data[block % fs->bs] != 0;
+  brelse(fs, b);
+
+  return shared;
+}
+
+/* drop a reference to a shared block; returns 1 if it was shared */
+static int unref_block(struct tfs_fs *fs, uint64_t block)
+{
+  struct tfs_buf *b;
+  unsigned char *p;
+  int err = 0;
+
+  if (!fs->sb.shared_blocks)
+    return 0;
+  if (!(b = bread(fs, fs->sb.refcount_block_start + block / fs->bs, &err)))
+    return err;
+
+  p = &b->data[block % fs->bs];
+  if (!*p)
+    {
+      brelse(fs, b);
+      return 0;
+    }
+
+  if (!--*p)
+    {
+      --fs->sb.shared_blocks;
+      fs->sb_dirty = 1;
+    }
+  bdirty(fs, b);
+  brelse(fs, b);
+
+  return 1;
+}
+
+/* with bigalloc, frees the whole cluster holding 'block' */
+static void free_block(struct tfs_fs *fs, uint64_t block)
+{
+  uint64_t bit = block >> fs->alloc_bits;
+
+  if (block < fs->first_data_block || block >= fs->blocks ||
+      tfs_itable_index(&fs->sb, block) != TFS_NOT_ITABLE)
+    return;
+
+  /* still named elsewhere, or its count is unreadable: keep it */
+  if (unref_block(fs, block))
+    return;
+
+  bforget(fs, block);
+  if (!bitmap_change(fs, fs->sb.data_bitmap_block_start, bit, 0))
+    {
+      fs->free_blocks += 1U << fs->alloc_bits;
+      if (bit < fs->data_hint)
+	fs->data_hint = bit;
+    }
+}
+
+/*
+ * Drop entry i of the block map 'e', clearing it. With bigalloc its
+ * cluster is freed only with the first entry dropped from it, *last,
+ * and only if no earlier entry of its run still maps into it.
+ */
+static void free_entry(struct tfs_fs *fs, uint32_t *e, unsigned int i, uint64_t *last)
+{
+  unsigned int j;
+
+  if (fs->alloc_bits)
+    {
+      if (e[i] >> fs->alloc_bits == *last)
+	{
+	  e[i] = 0;
+	  return;
+	}
+      *last = e[i] >> fs->alloc_bits;
+      for (j = i - i % (1U << fs->alloc_bits); j < i; ++j)
+	if (e[j])
+	  {
+	    e[i] = 0;
+	    return;
+	  }
+    }
+
+  free_block(fs, e[i]);
+  e[i] = 0;
+}
+
+/* Inode table */
+
+/*
+ * Past the mark, a table block has been zeroed if the inode bitmap has
+ * a bit set for one of its inodes; bit 'skip' does not count.
+ */
+static int itable_initialized(struct tfs_fs *fs, uint64_t table_block, uint64_t skip, int *err)
+{
+  uint64_t first = table_block * fs->inodes_per_block, bit;
+  struct tfs_buf *b;
+  int used = 0;
+
+  if (!(fs->sb.flags & TFS_SB_ITABLE_UNINIT) || table_block < fs->sb.inode_table_init_blocks)
+    return 1;
+
+  if (!(b = bread(fs, fs->sb.inode_bitmap_block_start + first / fs->bits_per_block, err)))
+    return -1;
+  for (bit = first; bit < first + fs->inodes_per_block && !used; ++bit)
+    {
+      uint64_t off = bit % fs->bits_per_block;
+
+      if (bit != skip && (b->data[off >> 3] & (1 << (off & 7))))
+	used = 1;
+    }
+  brelse(fs, b);
+
+  return used;
+}
+
+/* a table block never zeroed reads as zero; alloc_inode() zeroes it for real */
+static struct tfs_buf *itable_bread(struct tfs_fs *fs, uint64_t table_block, int *err)
+{
+  struct tfs_buf *map;
+  uint64_t block;
+  int init;
+
+  /* dynamic tables go through the chunk map; a missing chunk has no inodes */
+  if (fs->sb.flags & TFS_SB_ITABLE_DYNAMIC)
+    {
+      if (!(map = bread(fs, fs->sb.itable_map_block, err)))
+	return NULL;
+      block = tfs_itable_map_block(&fs->sb, (const uint32_t *) map->data, table_block);
+      brelse(fs, map);
+      if (!block)
+	{
+	  *err = -ENOENT;
+	  return NULL;
+	}
+      return bread(fs, block, err);
+    }
+
+  if ((init = itable_initialized(fs, table_block, UINT64_MAX, err)) < 0)
+    return NULL;
+  if (init)
+    return bread(fs, tfs_itable_block(&fs->sb, table_block), err);
+
+  return bnew(fs, tfs_itable_block(&fs->sb, table_block), err);
+}
+
+/*
+ * Zero the table block of a newly allocated inode 'ino' if the driver
+ * has not, as it does before setting the inode's bit.
+ */
+static int itable_init(struct tfs_fs *fs, uint32_t ino)
+{
+  uint64_t table_block = ino / fs->inodes_per_block;
+  struct tfs_buf *b;
+  int init, err = 0;
+
+  if ((init = itable_initialized(fs, table_block, ino, &err)) < 0)
+    return err;
+  if (init)
+    return 0;
+
+  if (!(b = bnew(fs, tfs_itable_block(&fs->sb, table_block), &err)))
+    return err;
+  bdirty(fs, b);
+  brelse(fs, b);
+
+  return 0;
+}
+
+static int get_inode(struct tfs_fs *fs, uint32_t ino, struct tfs_inode *ti)
+{
+  struct tfs_buf *b;
+  int err = 0;
+
+  if (!ino || ino >= fs->sb.inode_table_entries)
+    return -ENOENT;
+
+  if (!(b = itable_bread(fs, ino / fs->inodes_per_block, &err)))
+    return err;
+
+  memcpy(ti, (struct tfs_inode *) b->data + ino % fs->inodes_per_block, sizeof(*ti));
+  brelse(fs, b);
+
+  return ti->mode ? 0 : -ENOENT;
+}
+
+static int put_inode(struct tfs_fs *fs, uint32_t ino, const struct tfs_inode *ti)
+{
+  struct tfs_buf *b;
+  int err = 0;
+
+  if (!(b = itable_bread(fs, ino / fs->inodes_per_block, &err)))
+    return err;
+
+  memcpy((struct tfs_inode *) b->data + ino % fs->inodes_per_block, ti, sizeof(*ti));
+  bdirty(fs, b);
+  brelse(fs, b);
+
+  return 0;
+}
+
+/*
+ * Allocate the chunk of a dynamic table holding inode 'ino' if it is
+ * missing: a zeroed run of blocks after the previous chunk, then its
+ * map entry.
+ */
+static int grow_itable(struct tfs_fs *fs, uint32_t ino)
+{
+  uint32_t n = fs->sb.itable_chunk_blocks;
+  uint32_t chunk = ino / fs->inodes_per_block / n;
+  uint64_t goal = fs->sb.data_block_start, start = 0, i;
+  struct tfs_buf *map, *b;
+  uint32_t *e;
+  int err = 0;
+
+  if (!(fs->sb.flags & TFS_SB_ITABLE_DYNAMIC))
+    return 0;
+
+  if (!(map = bread(fs, fs->sb.itable_map_block, &err)))
+    return err;
+  e = (uint32_t *) map->data;
+  if (e[chunk])
+    goto out;
+
+  for (i = chunk; i-- > 0; )
+    if (e[i])
+      {
+	goal = e[i] + n;
+	break;
+      }
+
+  if ((err = bitmap_alloc_run(fs, fs->sb.data_bitmap_block_start, fs->blocks, goal, n, &start)) < 0)
+    goto out;
+  fs->free_blocks -= n;
+
+  for (i = start; i < start + n; ++i)
+    {
+      if (!(b = bnew(fs, i, &err)))
+	goto out;
+      bdirty(fs, b);
+      brelse(fs, b);
+    }
+
+  e[chunk] = start;
+  bdirty(fs, map);
+out:
+  brelse(fs, map);
+  return err;
+}
+
+static void free_inode_bit(struct tfs_fs *fs, uint32_t ino)
+{
+  if (!bitmap_change(fs, fs->sb.inode_bitmap_block_start, ino, 0))
+    {
+      ++fs->free_inodes;
+      if (ino < fs->inode_hint)
+	fs->inode_hint = ino;
+    }
+}
+
+static int alloc_inode(struct tfs_fs *fs, uint32_t *ino)
+{
+  uint64_t bit;
+  int err = bitmap_alloc(fs, fs->sb.inode_bitmap_block_start, fs->sb.inode_table_entries, &fs->inode_hint, &bit);
+
+  if (err)
+    return err;
+
+  --fs->free_inodes;
+  if ((err = grow_itable(fs, bit)) < 0 || (err = itable_init(fs, bit)) < 0)
+    {
+      free_inode_bit(fs, bit);
+      return err;
+    }
+
+  *ino = bit;
+  return 0;
+}
+
+/* Block mapping: 4 direct blocks, then a root indirect block of indirect blocks */
+
+static uint64_t max_file_blocks(struct tfs_fs *fs)
+{
+  return TFS_DATA_BLOCKS_PER_INODE + (uint64_t) fs->addr_per_block * fs->addr_per_block;
+}
+
+/* how large a file may grow: the reach of its block map, and of its size field */
+static uint64_t max_file_size(struct tfs_fs *fs)
+{
+  uint64_t reach = max_file_blocks(fs) * fs->bs;
+
+  return (fs->sb.flags & TFS_SB_64BIT) || reach < 0xffffffffULL ? reach : 0xffffffffULL;
+}
+
+/* for entry 'index' of the block map 'e' of 'n' entries, NULL for the root indirect block */
+static int new_zeroed_block(struct tfs_fs *fs, struct tfs_inode *ti, const uint32_t *e, unsigned int n,
+			    unsigned int index, uint64_t *block)
+{
+  struct tfs_buf *b;
+  int err;
+
+  if ((err = alloc_mapped_block(fs, e, n, index, block)) < 0)
+    return err;
+
+  if (!(b = bnew(fs, *block, &err)))
+    return err;
+  bdirty(fs, b);
+  brelse(fs, b);
+  ++ti->blocks;
+
+  return 0;
+}
+
+/*
+ * Give a shared data block about to be written a private copy. File
+ * data goes straight to the image, so the copy is made there too.
+ */
+static int unshare_block(struct tfs_fs *fs, uint64_t *block)
+{
+  unsigned char *data;
+  uint64_t nb;
+  int err;
+
+  if ((err = block_shared(fs, *block)) <= 0)
+    return err;
+
+  if (!(data = malloc(fs->bs)))
+    return -ENOMEM;
+  if ((err = alloc_block(fs, &nb)) < 0)
+    goto out;
+
+  if ((err = io_full(fs->fd, data, fs->bs, (off_t) *block * fs->bs, 0)) < 0 ||
+      (err = io_full(fs->fd, data, fs->bs, (off_t) nb * fs->bs, 1)) < 0)
+    {
+      free_block(fs, nb);
+      goto out;
+    }
+
+  unref_block(fs, *block);
+  *block = nb;
+
+ out:
+  free(data);
+  return err;
+}
+
+/*
+ * Map one logical block. Returns 0 with *pblock 0 for a hole when not
+ * creating; with 'create' a missing block (and the indirect blocks on
+ * the way) is allocated and *is_new set, and a shared one is copied.
+ */
+static int bmap(struct tfs_fs *fs, struct tfs_inode *ti, uint64_t lblock, int create, uint64_t *pblock, int *is_new)
+{
+  struct tfs_buf *b;
+  uint64_t rel, block;
+  uint32_t *table, slot;
+  int err = 0, i;
+
+  *pblock = 0;
+  if (is_new)
+    *is_new = 0;
+
+  if (lblock >= max_file_blocks(fs))
+    return create ? -EFBIG : 0;
+  if (TFS_IS_FAST_SYMLINK(ti->mode, ti->size))
+    return create ? -EINVAL : 0;
+
+  if (lblock < TFS_DATA_BLOCKS_PER_INODE)
+    {
+      if (!ti->data_blocks[lblock] && create)
+	{
+	  if ((err = alloc_mapped_block(fs, ti->data_blocks, TFS_DATA_BLOCKS_PER_INODE, lblock, &block)) < 0)
+	    return err;
+	  ti->data_blocks[lblock] = block;
+	  ++ti->blocks;
+	  if (is_new)
+	    *is_new = 1;
+	}
+      else if (ti->data_blocks[lblock] && create)
+	{
+	  block = ti->data_blocks[lblock];
+	  if ((err = unshare_block(fs, &block)) < 0)
+	    return err;
+	  ti->data_blocks[lblock] = block;
+	}
+      *pblock = ti->data_blocks[lblock];
+      return 0;
+    }
+
+  rel = lblock - TFS_DATA_BLOCKS_PER_INODE;
+  if (!ti->root_indirect_data_block)
+    {
+      if (!create)
+	return 0;
+      if ((err = new_zeroed_block(fs, ti, NULL, 0, 0, &block)) < 0)
+	return err;
+      ti->root_indirect_data_block = block;
+    }
+
+  block = ti->root_indirect_data_block;
+  for (i = 0; i < 2; ++i)
+    {
+      slot = i ? rel % fs->addr_per_block : rel / fs->addr_per_block;
+      if (!(b = bread(fs, block, &err)))
+	return err;
+
+      table = (uint32_t *) b->data;
+      if (!table[slot] && create)
+	{
+	  uint64_t nb;
+
+	  if (i)
+	    {
+	      err = alloc_mapped_block(fs, table, fs->addr_per_block, slot, &nb);
+	      if (!err)
+		++ti->blocks;
+	    }
+	  else
+	    err = new_zeroed_block(fs, ti, table, fs->addr_per_block, slot, &nb);
+
+	  if (err < 0)
+	    {
+	      brelse(fs, b);
+	      return err;
+	    }
+	  table[slot] = nb;
+	  bdirty(fs, b);
+	  if (i && is_new)
+	    *is_new = 1;
+	}
+      else if (table[slot] && create && i)
+	{
+	  uint64_t nb = table[slot];
+
+	  if ((err = unshare_block(fs, &nb)) < 0)
+	    {
+	      brelse(fs, b);
+	      return err;
+	    }
+	  if (nb != table[slot])
+	    {
+	      table[slot] = nb;
+	      bdirty(fs, b);
+	    }
+	}
+
+      block = table[slot];
+      brelse(fs, b);
+      if (!block)
+	return 0;
+    }
+
+  *pblock = block;
+  return 0;
+}
+
+/* Release every block from logical block 'from' on, and the indirect blocks left empty. */
+static int free_blocks_from(struct tfs_fs *fs, struct tfs_inode *ti, uint64_t from)
+{
+  struct tfs_buf *rb, *ib;
+  uint32_t *root, *ind;
+  uint64_t i, j, first, last = ~0ULL, root_last = ~0ULL;
+  int err = 0, empty;
+
+  if (TFS_IS_FAST_SYMLINK(ti->mode, ti->size))
+    return 0;
+
+  for (i = from; i < TFS_DATA_BLOCKS_PER_INODE; ++i)
+    if (ti->data_blocks[i])
+      {
+	free_entry(fs, ti->data_blocks, i, &last);
+	--ti->blocks;
+      }
+
+  if (!ti->root_indirect_data_block)
+    return 0;
+
+  first = from > TFS_DATA_BLOCKS_PER_INODE ? from - TFS_DATA_BLOCKS_PER_INODE : 0;
+  if (!(rb = bread(fs, ti->root_indirect_data_block, &err)))
+    return err;
+  root = (uint32_t *) rb->data;
+
+  for (i = first / fs->addr_per_block; i < fs->addr_per_block; ++i)
+    {
+      if (!root[i])
+	continue;
+      if (!(ib = bread(fs, root[i], &err)))
+	break;
+      ind = (uint32_t *) ib->data;
+      last = ~0ULL;
+
+      empty = 1;
+      for (j = 0; j < fs->addr_per_block; ++j)
+	{
+	  if (!ind[j])
+	    continue;
+	  if (i * fs->addr_per_block + j >= first)
+	    {
+	      /* the tail entries of a compressed cluster own no block */
+	      if (ind[j] != TFS_COMPRESSED_BLOCK)
+		{
+		  free_entry(fs, ind, j, &last);
+		  --ti->blocks;
+		}
+	      ind[j] = 0;
+	    }
+	  else
+	    empty = 0;
+	}
+      bdirty(fs, ib);
+      brelse(fs, ib);
+
+      if (empty)
+	{
+	  free_entry(fs, root, i, &root_last);
+	  --ti->blocks;
+	}
+    }
+  bdirty(fs, rb);
+
+  empty = 1;
+  for (i = 0; i < fs->addr_per_block; ++i)
+    if (root[i])
+      empty = 0;
+  brelse(fs, rb);
+
+  if (empty)
+    {
+      free_block(fs, ti->root_indirect_data_block);
+      ti->root_indirect_data_block = 0;
+      --ti->blocks;
+    }
+
+  return err;
+}
+
+static int map_range(struct tfs_fs *fs, uint32_t ino, struct tfs_inode *ti, off_t off, size_t size, int create,
+		     struct tfs_extent *ext, int max_ext)
+{
+  uint64_t lblock, last, pblock;
+  int n = 0, err = 0, is_new, dirty = 0;
+
+  if (!size)
+    return 0;
+  /* compressed clusters are left to the kernel driver */
+  if (ti->flags & TFS_INODE_COMPRESSED)
+    return -EOPNOTSUPP;
+
+  lblock = off / fs->bs;
+  last = (off + size - 1) / fs->bs;
+
+  for ( ; lblock <= last; ++lblock)
+    {
+      uint64_t before = lblock < TFS_DATA_BLOCKS_PER_INODE ? ti->data_blocks[lblock] : 0;
+
+      if ((err = bmap(fs, ti, lblock, create, &pblock, &is_new)) < 0)
+	break;
+
+      /* a shared direct block was replaced by its copy */
+      if (before && before != pblock)
+	dirty = 1;
+
+      if (is_new)
+	{
+	  /* zero what the caller will not overwrite in a fresh block */
+	  uint64_t bstart = lblock * fs->bs, bend = bstart + fs->bs;
+	  static const char zero[TFS_MAX_BLOCK_SIZE];
+
+	  dirty = 1;
+	  if (bstart < (uint64_t) off)
+	    io_full(fs->fd, (void *) zero, off - bstart, (off_t) pblock * fs->bs, 1);
+	  if (bend > (uint64_t) off + size)
+	    io_full(fs->fd, (void *) zero, bend - (off + size), (off_t) pblock * fs->bs + (off + size - bstart), 1);
+	}
+
+      if (n && ((!pblock && !ext[n - 1].pblock) ||
+		(pblock && ext[n - 1].pblock && pblock == ext[n - 1].pblock + ext[n - 1].count)))
+	{
+	  ++ext[n - 1].count;
+	  continue;
+	}
+
+      if (n == max_ext)
+	break;
+      ext[n].lblock = lblock;
+      ext[n].pblock = pblock;
+      ext[n].count = 1;
+      ++n;
+    }
+
+  if (dirty && (err = put_inode(fs, ino, ti)) < 0)
+    return err;
+
+  return n ? n : err;
+}
+
+/* Directories */
+
+struct dir_pos
+{
+  uint64_t off;
+  uint64_t pblock;
+};
+
+/* call fn for each dentry slot; fn returns non-zero to stop */
+static int dir_iterate(struct tfs_fs *fs, struct tfs_inode *dir, uint64_t start,
+		       int (*fn)(struct tfs_fs *, struct tfs_buf *, struct tfs_dentry *, uint64_t, void *), void *arg)
+{
+  uint64_t off, pblock;
+  struct tfs_buf *b = NULL;
+  uint64_t cur = 0;
+  int err = 0, ret = 0;
+
+  for (off = start - start % sizeof(struct tfs_dentry); off + sizeof(struct tfs_dentry) <= dir->size && !ret;
+       off += sizeof(struct tfs_dentry))
+    {
+      if (!b || off / fs->bs != cur)
+	{
+	  brelse(fs, b);
+	  b = NULL;
+	  cur = off / fs->bs;
+	  if ((err = bmap(fs, dir, cur, 0, &pblock, NULL)) < 0)
+	    return err;
+	  if (!pblock)
+	    {
+	      off = (cur + 1) * fs->bs - sizeof(struct tfs_dentry);
+	      continue;
+	    }
+	  if (!(b = bread(fs, pblock, &err)))
+	    return err;
+	}
+
+      ret = fn(fs, b, (struct tfs_dentry *) (b->data + off % fs->bs), off, arg);
+    }
+
+  brelse(fs, b);
+  return ret < 0 ? ret : 0;
+}
+
+struct find_ctx
+{
+  const char *name;
+  size_t len;
+  uint32_t ino;
+  uint64_t off;
+  int found;
+  int want_free;
+  int free_found;
+  uint64_t free_off;
+  int remove;
+  int live;
+};
+
+static int find_fn(struct tfs_fs *fs, struct tfs_buf *b, struct tfs_dentry *td, uint64_t off, void *arg)
+{
+  struct find_ctx *fc = arg;
+
+  if (!td->inode)
+    {
+      if (fc->want_free && !fc->free_found)
+	{
+	  fc->free_found = 1;
+	  fc->free_off = off;
+	}
+      return 0;
+    }
+
+  if (td->len == fc->len && !memcmp(td->name, fc->name, fc->len))
+    {
+      fc->found = 1;
+      fc->ino = td->inode;
+      fc->off = off;
+      if (fc->remove)
+	{
+	  memset(td, 0, sizeof(*td));
+	  bdirty(fs, b);
+	}
+      return 1;
+    }
+
+  return 0;
+}
+
+static int dir_find(struct tfs_fs *fs, struct tfs_inode *dir, const char *name, struct find_ctx *fc)
+{
+  fc->name = name;
+  fc->len = strlen(name);
+  if (fc->len > TFS_DENTRY_NAME_LEN)
+    return -ENAMETOOLONG;
+  if (!S_ISDIR(dir->mode))
+    return -ENOTDIR;
+
+  return dir_iterate(fs, dir, 0, find_fn, fc);
+}
+
+static unsigned int mode_to_type(uint32_t mode)
+{
+  if (S_ISDIR(mode))
+    return DT_DIR;
+  if (S_ISREG(mode))
+    return DT_REG;
+  if (S_ISLNK(mode))
+    return DT_LNK;
+  if (S_ISFIFO(mode))
+    return DT_FIFO;
+  if (S_ISCHR(mode))
+    return DT_CHR;
+  if (S_ISBLK(mode))
+    return DT_BLK;
+  if (S_ISSOCK(mode))
+    return DT_SOCK;
+  return DT_UNKNOWN;
+}
+
+/* add an entry in the first free slot, or at the end of the directory */
+static int dir_add(struct tfs_fs *fs, uint32_t dir_ino, struct tfs_inode *dir, const char *name, uint32_t ino, uint32_t mode)
+{
+  struct find_ctx fc;
+  struct tfs_buf *b;
+  struct tfs_dentry *td;
+  uint64_t off, pblock;
+  int err, is_new;
+
+  memset(&fc, 0, sizeof(fc));
+  fc.want_free = 1;
+  if ((err = dir_find(fs, dir, name, &fc)) < 0)
+    return err;
+  if (fc.found)
+    return -EEXIST;
+
+  off = fc.free_found ? fc.free_off : dir->size;
+  if ((err = bmap(fs, dir, off / fs->bs, 1, &pblock, &is_new)) < 0)
+    return err;
+
+  b = is_new ? bnew(fs, pblock, &err) : bread(fs, pblock, &err);
+  if (!b)
+    return err;
+
+  td = (struct tfs_dentry *) (b->data + off % fs->bs);
+  memset(td, 0, sizeof(*td));
+  td->type = mode_to_type(mode);
+  td->inode = ino;
+  td->len = strlen(name);
+  memcpy(td->name, name, td->len);
+  bdirty(fs, b);
+  brelse(fs, b);
+
+  if (off + sizeof(struct tfs_dentry) > dir->size)
+    dir->size = off + sizeof(struct tfs_dentry);
+  dir->mtime = dir->ctime = now();
+
+  return put_inode(fs, dir_ino, dir);
+}
+
+static int empty_fn(struct tfs_fs *fs, struct tfs_buf *b, struct tfs_dentry *td, uint64_t off, void *arg)
+{
+  if (!td->inode)
+    return 0;
+  if ((td->len == 1 && td->name[0] == '.') || (td->len == 2 && !memcmp(td->name, "..", 2)))
+    return 0;
+
+  *(int *) arg = 0;
+  return 1;
+}
+
+static int dir_is_empty(struct tfs_fs *fs, struct tfs_inode *dir)
+{
+  int empty = 1;
+  int err = dir_iterate(fs, dir, 0, empty_fn, &empty);
+
+  return err < 0 ? err : empty;
+}
+
+static int dotdot_fn(struct tfs_fs *fs, struct tfs_buf *b, struct tfs_dentry *td, uint64_t off, void *arg)
+{
+  if (td->inode && td->len == 2 && !memcmp(td->name, "..", 2))
+    {
+      td->inode = *(uint32_t *) arg;
+      bdirty(fs, b);
+      return 1;
+    }
+  return 0;
+}
+
+/* Public API */
+
+void tfs_lock(struct tfs_fs *fs, int write)
+{
+  if (write)
+    pthread_rwlock_wrlock(&fs->lock);
+  else
+    pthread_rwlock_rdlock(&fs->lock);
+}
+
+void tfs_unlock(struct tfs_fs *fs)
+{
+  pthread_rwlock_unlock(&fs->lock);
+}
+
+struct tfs_fs *tfs_open(const char *path, int flags, size_t cache_blocks, int *err)
+{
+  struct tfs_fs *fs;
+  struct stat st;
+  uint64_t size;
+
+  fs = calloc(1, sizeof(*fs));
+  if (!fs)
+    {
+      *err = -ENOMEM;
+      return NULL;
+    }
+
+  fs->rw = flags & TFS_OPEN_RDWR;
+  fs->fd = open(path, fs->rw ? O_RDWR : O_RDONLY);
+  if (fs->fd < 0 || fstat(fs->fd, &st) < 0)
+    {
+      *err = -errno;
+      goto err_free;
+    }
+
+  size = st.st_size;
+  if (S_ISBLK(st.st_mode) && ioctl(fs->fd, BLKGETSIZE64, &size) < 0)
+    {
+      *err = -errno;
+      goto err_close;
+    }
+
+  if ((*err = io_full(fs->fd, &fs->sb, sizeof(fs->sb), TFS_SUPER_OFFSET, 0)) < 0)
+    goto err_close;
+
+  if (fs->sb.magic != TFS_MAGIC)
+    {
+      *err = -EINVAL;
+      goto err_close;
+    }
+
+  fs->bs = fs->sb.block_size ? fs->sb.block_size : TFS_BLOCK_SIZE;
+  if (fs->bs < TFS_MIN_BLOCK_SIZE || fs->bs > TFS_MAX_BLOCK_SIZE || (fs->bs & (fs->bs - 1)))
+    {
+      *err = -EINVAL;
+      goto err_close;
+    }
+
+  fs->addr_per_block = fs->bs / sizeof(uint32_t);
+  fs->inodes_per_block = TFS_INODE_PER_BLOCK(fs->bs);
+  fs->bits_per_block = (uint64_t) fs->bs * 8;
+  fs->alloc_bits = fs->sb.alloc_bits;
+  if (fs->alloc_bits > TFS_MAX_ALLOC_BITS || (fs->alloc_bits && fs->sb.refcount_blocks))
+    {
+      *err = -EINVAL;
+      goto err_close;
+    }
+  fs->blocks = size / fs->bs;
+  if (fs->blocks > fs->sb.data_bitmap_blocks * fs->bits_per_block << fs->alloc_bits)
+    fs->blocks = fs->sb.data_bitmap_blocks * fs->bits_per_block << fs->alloc_bits;
+  fs->first_data_block = fs->sb.inode_table_block_start;
+
+  if ((fs->sb.flags & TFS_SB_ITABLE_DYNAMIC) &&
+      (fs->sb.blocks_per_group || (fs->sb.flags & TFS_SB_ITABLE_UNINIT) || fs->alloc_bits ||
+       !fs->sb.itable_chunk_blocks || fs->sb.itable_chunk_blocks > fs->bits_per_block ||
+       fs->sb.inode_table_blocks % fs->sb.itable_chunk_blocks ||
+       fs->sb.inode_table_blocks / fs->sb.itable_chunk_blocks > fs->addr_per_block ||
+       !fs->sb.itable_map_block || fs->sb.itable_map_block >= fs->first_data_block))
+    {
+      *err = -EINVAL;
+      goto err_close;
+    }
+
+  if ((*err = cache_init(&fs->cache, cache_blocks)) < 0)
+    goto err_close;
+  pthread_rwlock_init(&fs->lock, NULL);
+
+  fs->free_blocks = bitmap_count_free(fs, fs->sb.data_bitmap_block_start, fs->blocks >> fs->alloc_bits) << fs->alloc_bits;
+  fs->free_inodes = bitmap_count_free(fs, fs->sb.inode_bitmap_block_start, fs->sb.inode_table_entries);
+
+  if (fs->rw)
+    {
+      ++fs->sb.mnt_count;
+      fs->sb_dirty = 1;
+    }
+
+  *err = 0;
+  return fs;
+
+err_close:
+  close(fs->fd);
+err_free:
+  free(fs);
+  return NULL;
+}
+
+static int sync_locked(struct tfs_fs *fs)
+{
+  int err;
+
+  if (!fs->rw)
+    return 0;
+
+  if ((err = cache_flush(fs)) < 0)
+    return err;
+
+  if (fs->sb_dirty)
+    {
+      if ((err = io_full(fs->fd, &fs->sb, sizeof(fs->sb), TFS_SUPER_OFFSET, 1)) < 0)
+	return err;
+      fs->sb_dirty = 0;
+    }
+
+  return fsync(fs->fd) < 0 ? -errno : 0;
+}
+
+int tfs_sync(struct tfs_fs *fs)
+{
+  int err;
+
+  tfs_lock(fs, 1);
+  err = sync_locked(fs);
+  tfs_unlock(fs);
+
+  return err;
+}
+
+int tfs_close(struct tfs_fs *fs)
+{
+  int err = tfs_sync(fs);
+
+  cache_destroy(&fs->cache);
+  pthread_rwlock_destroy(&fs->lock);
+  close(fs->fd);
+  free(fs);
+
+  return err;
+}
+
+int tfs_image_fd(struct tfs_fs *fs)
+{
+  return fs->fd;
+}
+
+unsigned int tfs_block_size(struct tfs_fs *fs)
+{
+  return fs->bs;
+}
+
+const struct tfs_super_block *tfs_super(struct tfs_fs *fs)
+{
+  return &fs->sb;
+}
+
+int tfs_statfs(struct tfs_fs *fs, struct tfs_fsstat *st)
+{
+  tfs_lock(fs, 0);
+  st->block_size = fs->bs;
+  st->blocks = fs->blocks;
+  st->free_blocks = fs->free_blocks;
+  st->inodes = fs->sb.inode_table_entries;
+  st->free_inodes = fs->free_inodes;
+  tfs_unlock(fs);
+
+  return 0;
+}
+
+int tfs_getattr_locked(struct tfs_fs *fs, uint32_t ino, struct tfs_inode *ti)
+{
+  return get_inode(fs, ino, ti);
+}
+
+int tfs_getattr(struct tfs_fs *fs, uint32_t ino, struct tfs_inode *ti)
+{
+  int err;
+
+  tfs_lock(fs, 0);
+  err = get_inode(fs, ino, ti);
+  tfs_unlock(fs);
+
+  return err;
+}
+
+static int truncate_locked(struct tfs_fs *fs, uint32_t ino, struct tfs_inode *ti, uint64_t size)
+{
+  uint64_t keep;
+  int err;
+
+  if (size > max_file_size(fs))
+    return -EFBIG;
+
+  if (size && size < TFS_FILE_SIZE(ti) && (ti->flags & TFS_INODE_COMPRESSED))
+    return -EOPNOTSUPP;
+
+  if (size < TFS_FILE_SIZE(ti))
+    {
+      uint64_t pblock;
+
+      keep = (size + fs->bs - 1) / fs->bs;
+      if ((err = free_blocks_from(fs, ti, keep)) < 0)
+	return err;
+
+      /* zero the tail of the last block so a later extension reads zeros */
+      if (size % fs->bs && !bmap(fs, ti, size / fs->bs, 0, &pblock, NULL) && pblock)
+	{
+	  static const char zero[TFS_MAX_BLOCK_SIZE];
+	  io_full(fs->fd, (void *) zero, fs->bs - size % fs->bs, (off_t) pblock * fs->bs + size % fs->bs, 1);
+	}
+    }
+
+  TFS_SET_FILE_SIZE(ti, size);
+  ti->mtime = ti->ctime = now();
+
+  return put_inode(fs, ino, ti);
+}
+
+int tfs_setattr(struct tfs_fs *fs, uint32_t ino, const struct tfs_attr *attr, int to_set)
+{
+  struct tfs_inode ti;
+  int err;
+
+  if (!fs->rw)
+    return -EROFS;
+
+  tfs_lock(fs, 1);
+  if ((err = get_inode(fs, ino, &ti)) < 0)
+    goto out;
+
+  if (to_set & TFS_SET_MODE)
+    ti.mode = (ti.mode & S_IFMT) | (attr->mode & ~S_IFMT);
+  if (to_set & TFS_SET_UID)
+    ti.uid = attr->uid;
+  if (to_set & TFS_SET_GID)
+    ti.gid = attr->gid;
+  if (to_set & TFS_SET_ATIME)
+    ti.atime = attr->atime;
+  if (to_set & TFS_SET_MTIME)
+    ti.mtime = attr->mtime;
+  ti.ctime = (to_set & TFS_SET_CTIME) ? attr->ctime : now();
+
+  if (to_set & TFS_SET_SIZE)
+    {
+      if (S_ISDIR(ti.mode))
+	{
+	  err = -EISDIR;
+	  goto out;
+	}
+      err = truncate_locked(fs, ino, &ti, attr->size);
+      if (!err && (to_set & TFS_SET_MTIME))
+	{
+	  ti.mtime = attr->mtime;
+	  err = put_inode(fs, ino, &ti);
+	}
+    }
+  else
+    err = put_inode(fs, ino, &ti);
+
+out:
+  tfs_unlock(fs);
+  return err;
+}
+
+int tfs_truncate(struct tfs_fs *fs, uint32_t ino, uint64_t size)
+{
+  struct tfs_attr attr;
+
+  attr.size = size;
+  return tfs_setattr(fs, ino, &attr, TFS_SET_SIZE);
+}
+
+int tfs_lookup(struct tfs_fs *fs, uint32_t dir, const char *name, uint32_t *ino)
+{
+  struct tfs_inode di;
+  struct find_ctx fc;
+  int err;
+
+  memset(&fc, 0, sizeof(fc));
+  tfs_lock(fs, 0);
+  if (!(err = get_inode(fs, dir, &di)) && !(err = dir_find(fs, &di, name, &fc)))
+    {
+      if (fc.found)
+	*ino = fc.ino;
+      else
+	err = -ENOENT;
+    }
+  tfs_unlock(fs);
+
+  return err;
+}
+
+struct readdir_ctx
+{
+  tfs_filldir_t filldir;
+  void *ctx;
+};
+
+static int readdir_fn(struct tfs_fs *fs, struct tfs_buf *b, struct tfs_dentry *td, uint64_t off, void *arg)
+{
+  struct readdir_ctx *rc = arg;
+  char name[TFS_DENTRY_NAME_LEN + 1];
+  unsigned int len = td->len > TFS_DENTRY_NAME_LEN ? TFS_DENTRY_NAME_LEN : td->len;
+
+  if (!td->inode || td->type == DT_UNKNOWN)
+    return 0;
+
+  memcpy(name, td->name, len);
+  name[len] = 0;
+
+  return rc->filldir(rc->ctx, name, len, td->inode, td->type, off + sizeof(struct tfs_dentry)) ? 1 : 0;
+}
+
+int tfs_readdir(struct tfs_fs *fs, uint32_t dir, off_t off, tfs_filldir_t filldir, void *ctx)
+{
+  struct tfs_inode di;
+  struct readdir_ctx rc = { filldir, ctx };
+  int err;
+
+  tfs_lock(fs, 0);
+  if (!(err = get_inode(fs, dir, &di)))
+    err = S_ISDIR(di.mode) ? dir_iterate(fs, &di, off, readdir_fn, &rc) : -ENOTDIR;
+  tfs_unlock(fs);
+
+  return err;
+}
+
+static int new_inode(struct tfs_fs *fs, uint32_t mode, uint32_t uid, uint32_t gid, uint32_t *ino, struct tfs_inode *ti)
+{
+  int err;
+
+  if ((err = alloc_inode(fs, ino)) < 0)
+    return err;
+
+  memset(ti, 0, sizeof(*ti));
+  ti->mode = mode;
+  ti->uid = uid;
+  ti->gid = gid;
+  ti->ctime = ti->mtime = ti->atime = now();
+  ti->hard_link_count = 1;
+
+  return 0;
+}
+
+int tfs_create(struct tfs_fs *fs, uint32_t dir, const char *name, uint32_t mode, uint32_t uid, uint32_t gid, uint32_t *ino)
+{
+  struct tfs_inode di, ti;
+  int err;
+
+  if (S_ISDIR(mode))
+    return tfs_mkdir(fs, dir, name, mode, uid, gid, ino);
+  if (!fs->rw)
+    return -EROFS;
+
+  tfs_lock(fs, 1);
+  if ((err = get_inode(fs, dir, &di)) < 0)
+    goto out;
+  if (!S_ISDIR(di.mode))
+    {
+      err = -ENOTDIR;
+      goto out;
+    }
+
+  if ((err = new_inode(fs, mode, uid, gid, ino, &ti)) < 0)
+    goto out;
+
+  if ((err = put_inode(fs, *ino, &ti)) < 0 ||
+      (err = dir_add(fs, dir, &di, name, *ino, mode)) < 0)
+    {
+      memset(&ti, 0, sizeof(ti));
+      put_inode(fs, *ino, &ti);
+      free_inode_bit(fs, *ino);
+    }
+
+out:
+  tfs_unlock(fs);
+  return err;
+}
+
+int tfs_mkdir(struct tfs_fs *fs, uint32_t dir, const char *name, uint32_t mode, uint32_t uid, uint32_t gid, uint32_t *ino)
+{
+  struct tfs_inode di, ti;
+  struct tfs_dentry *td;
+  struct tfs_buf *b;
+  uint64_t block;
+  int err;
+
+  if (!fs->rw)
+    return -EROFS;
+
+  tfs_lock(fs, 1);
+  if ((err = get_inode(fs, dir, &di)) < 0)
+    goto out;
+  if (!S_ISDIR(di.mode))
+    {
+      err = -ENOTDIR;
+      goto out;
+    }
+
+  if ((err = new_inode(fs, S_IFDIR | (mode & ~S_IFMT), uid, gid, ino, &ti)) < 0)
+    goto out;
+
+  if ((err = alloc_block(fs, &block)) < 0)
+    {
+      free_inode_bit(fs, *ino);
+      goto out;
+    }
+
+  if (!(b = bnew(fs, block, &err)))
+    {
+      free_block(fs, block);
+      free_inode_bit(fs, *ino);
+      goto out;
+    }
+  td = (struct tfs_dentry *) b->data;
+  td[0].type = DT_DIR;
+  td[0].inode = *ino;
+  td[0].len = 1;
+  td[0].name[0] = '.';
+  td[1].type = DT_DIR;
+  td[1].inode = dir;
+  td[1].len = 2;
+  memcpy(td[1].name, "..", 2);
+  bdirty(fs, b);
+  brelse(fs, b);
+
+  ti.hard_link_count = 2;
+  ti.size = fs->bs;
+  ti.blocks = 1;
+  ti.data_blocks[0] = block;
+
+  if ((err = put_inode(fs, *ino, &ti)) < 0 ||
+      (err = dir_add(fs, dir, &di, name, *ino, ti.mode)) < 0)
+    {
+      free_block(fs, block);
+      memset(&ti, 0, sizeof(ti));
+      put_inode(fs, *ino, &ti);
+      free_inode_bit(fs, *ino);
+      goto out;
+    }
+
+  ++di.hard_link_count;
+  err = put_inode(fs, dir, &di);
+
+out:
+  tfs_unlock(fs);
+  return err;
+}
+
+int tfs_link(struct tfs_fs *fs, uint32_t ino, uint32_t dir, const char *name)
+{
+  struct tfs_inode di, ti;
+  int err;
+
+  if (!fs->rw)
+    return -EROFS;
+
+  tfs_lock(fs, 1);
+  if (!(err = get_inode(fs, dir, &di)) && !(err = get_inode(fs, ino, &ti)))
+    {
+      if (S_ISDIR(ti.mode))
+	err = -EPERM;
+      else if (!(err = dir_add(fs, dir, &di, name, ino, ti.mode)))
+	{
+	  ++ti.hard_link_count;
+	  ti.ctime = now();
+	  err = put_inode(fs, ino, &ti);
+	}
+    }
+  tfs_unlock(fs);
+
+  return err;
+}
+
+/* remove a name; the inode itself is released by tfs_forget() once unused */
+static int remove_locked(struct tfs_fs *fs, uint32_t dir, const char *name, int want_dir, uint32_t *ino)
+{
+  struct tfs_inode di, ti;
+  struct find_ctx fc;
+  int err;
+
+  memset(&fc, 0, sizeof(fc));
+  if ((err = get_inode(fs, dir, &di)) < 0 || (err = dir_find(fs, &di, name, &fc)) < 0)
+    return err;
+  if (!fc.found)
+    return -ENOENT;
+  if ((err = get_inode(fs, fc.ino, &ti)) < 0)
+    return err;
+
+  if (want_dir && !S_ISDIR(ti.mode))
+    return -ENOTDIR;
+  if (!want_dir && S_ISDIR(ti.mode))
+    return -EISDIR;
+  if (want_dir)
+    {
+      if (!strcmp(name, ".") || !strcmp(name, ".."))
+	return -EINVAL;
+      if ((err = dir_is_empty(fs, &ti)) <= 0)
+	return err < 0 ? err : -ENOTEMPTY;
+    }
+
+  memset(&fc, 0, sizeof(fc));
+  fc.remove = 1;
+  if ((err = dir_find(fs, &di, name, &fc)) < 0)
+    return err;
+
+  if (want_dir)
+    {
+      ti.hard_link_count = 0;
+      --di.hard_link_count;
+    }
+  else if (ti.hard_link_count)
+    --ti.hard_link_count;
+
+  ti.ctime = di.ctime = di.mtime = now();
+  if ((err = put_inode(fs, fc.ino, &ti)) < 0)
+    return err;
+
+  *ino = fc.ino;
+  return put_inode(fs, dir, &di);
+}
+
+int tfs_unlink(struct tfs_fs *fs, uint32_t dir, const char *name, uint32_t *ino)
+{
+  int err;
+
+  if (!fs->rw)
+    return -EROFS;
+
+  tfs_lock(fs, 1);
+  err = remove_locked(fs, dir, name, 0, ino);
+  tfs_unlock(fs);
+
+  return err;
+}
+
+int tfs_rmdir(struct tfs_fs *fs, uint32_t dir, const char *name, uint32_t *ino)
+{
+  int err;
+
+  if (!fs->rw)
+    return -EROFS;
+
+  tfs_lock(fs, 1);
+  err = remove_locked(fs, dir, name, 1, ino);
+  tfs_unlock(fs);
+
+  return err;
+}
+
+int tfs_rename(struct tfs_fs *fs, uint32_t olddir, const char *oldname, uint32_t newdir, const char *newname, uint32_t *replaced)
+{
+  struct tfs_inode odi, ndi, ti, xi;
+  struct find_ctx fc;
+  uint32_t ino;
+  int err;
+
+  if (!fs->rw)
+    return -EROFS;
+
+  *replaced = 0;
+  tfs_lock(fs, 1);
+
+  memset(&fc, 0, sizeof(fc));
+  if ((err = get_inode(fs, olddir, &odi)) < 0 || (err = dir_find(fs, &odi, oldname, &fc)) < 0)
+    goto out;
+  if (!fc.found)
+    {
+      err = -ENOENT;
+      goto out;
+    }
+  ino = fc.ino;
+  if ((err = get_inode(fs, ino, &ti)) < 0 || (err = get_inode(fs, newdir, &ndi)) < 0)
+    goto out;
+
+  memset(&fc, 0, sizeof(fc));
+  if ((err = dir_find(fs, &ndi, newname, &fc)) < 0)
+    goto out;
+  if (fc.found)
+    {
+      if (fc.ino == ino)
+	goto out;
+      if ((err = get_inode(fs, fc.ino, &xi)) < 0)
+	goto out;
+      if (S_ISDIR(xi.mode) != S_ISDIR(ti.mode))
+	{
+	  err = S_ISDIR(xi.mode) ? -EISDIR : -ENOTDIR;
+	  goto out;
+	}
+      if ((err = remove_locked(fs, newdir, newname, S_ISDIR(xi.mode), replaced)) < 0)
+	goto out;
+      get_inode(fs, newdir, &ndi);
+    }
+
+  memset(&fc, 0, sizeof(fc));
+  fc.remove = 1;
+  if ((err = dir_find(fs, &odi, oldname, &fc)) < 0)
+    goto out;
+  odi.mtime = odi.ctime = now();
+  if ((err = put_inode(fs, olddir, &odi)) < 0)
+    goto out;
+
+  if (olddir == newdir)
+    ndi = odi;
+  if ((err = dir_add(fs, newdir, &ndi, newname, ino, ti.mode)) < 0)
+    goto out;
+
+  if (S_ISDIR(ti.mode) && olddir != newdir)
+    {
+      if ((err = dir_iterate(fs, &ti, 0, dotdot_fn, &newdir)) < 0)
+	goto out;
+      get_inode(fs, olddir, &odi);
+      --odi.hard_link_count;
+      put_inode(fs, olddir, &odi);
+      get_inode(fs, newdir, &ndi);
+      ++ndi.hard_link_count;
+      put_inode(fs, newdir, &ndi);
+    }
+
+  ti.ctime = now();
+  err = put_inode(fs, ino, &ti);
+
+out:
+  tfs_unlock(fs);
+  return err;
+}
+
+int tfs_forget(struct tfs_fs *fs, uint32_t ino)
+{
+  struct tfs_inode ti;
+  int err;
+
+  if (!fs->rw)
+    return 0;
+
+  tfs_lock(fs, 1);
+  if (!(err = get_inode(fs, ino, &ti)) && !ti.hard_link_count)
+    {
+      if (!(err = free_blocks_from(fs, &ti, 0)))
+	{
+	  memset(&ti, 0, sizeof(ti));
+	  if (!(err = put_inode(fs, ino, &ti)))
+	    free_inode_bit(fs, ino);
+	}
+    }
+  tfs_unlock(fs);
+
+  return err == -ENOENT ? 0 : err;
+}
+
+int tfs_map_locked(struct tfs_fs *fs, uint32_t ino, off_t off, size_t size, int create,
+		   struct tfs_extent *ext, int max_ext)
+{
+  struct tfs_inode ti;
+  int err;
+
+  if (create && !fs->rw)
+    return -EROFS;
+  if (create && (uint64_t) off + size > max_file_size(fs))
+    return -EFBIG;
+  if ((err = get_inode(fs, ino, &ti)) < 0)
+    return err;
+
+  return map_range(fs, ino, &ti, off, size, create, ext, max_ext);
+}
+
+int tfs_map(struct tfs_fs *fs, uint32_t ino, off_t off, size_t size, int create,
+	    struct tfs_extent *ext, int max_ext)
+{
+  int n;
+
+  tfs_lock(fs, create);
+  n = tfs_map_locked(fs, ino, off, size, create, ext, max_ext);
+  tfs_unlock(fs);
+
+  return n;
+}
+
+int tfs_extend_locked(struct tfs_fs *fs, uint32_t ino, uint64_t size)
+{
+  struct tfs_inode ti;
+  int err;
+
+  if ((err = get_inode(fs, ino, &ti)) < 0)
+    return err;
+
+  if (size > TFS_FILE_SIZE(&ti))
+    TFS_SET_FILE_SIZE(&ti, size);
+  ti.mtime = ti.ctime = now();
+
+  return put_inode(fs, ino, &ti);
+}
+
+#define MAX_EXTENTS 64
+
+ssize_t tfs_read(struct tfs_fs *fs, uint32_t ino, void *buf, size_t size, off_t off)
+{
+  struct tfs_extent ext[MAX_EXTENTS];
+  struct tfs_inode ti;
+  size_t done = 0;
+  int n, i, err;
+
+  tfs_lock(fs, 0);
+  if ((err = get_inode(fs, ino, &ti)) < 0)
+    goto out;
+  if (S_ISDIR(ti.mode))
+    {
+      err = -EISDIR;
+      goto out;
+    }
+
+  if ((uint64_t) off >= TFS_FILE_SIZE(&ti))
+    goto out;
+  if (off + size > TFS_FILE_SIZE(&ti))
+    size = TFS_FILE_SIZE(&ti) - off;
+
+  while (done < size)
+    {
+      n = map_range(fs, ino, &ti, off + done, size - done, 0, ext, MAX_EXTENTS);
+      if (n <= 0)
+	{
+	  err = n;
+	  break;
+	}
+
+      for (i = 0; i < n && !err; ++i)
+	{
+	  uint64_t start = ext[i].lblock * fs->bs;
+	  uint64_t from = start > (uint64_t) off + done ? start : off + done;
+	  uint64_t to = start + ext[i].count * fs->bs;
+	  char *dst = (char *) buf + (from - off);
+
+	  if (to > (uint64_t) off + size)
+	    to = off + size;
+
+	  if (ext[i].pblock)
+	    err = io_full(fs->fd, dst, to - from, (off_t) ext[i].pblock * fs->bs + (from - start), 0);
+	  else
+	    memset(dst, 0, to - from);
+	  done = to - off;
+	}
+      if (err)
+	break;
+    }
+
+out:
+  tfs_unlock(fs);
+  return err < 0 ? err : (ssize_t) done;
+}
+
+ssize_t tfs_write(struct tfs_fs *fs, uint32_t ino, const void *buf, size_t size, off_t off)
+{
+  struct tfs_extent ext[MAX_EXTENTS];
+  size_t done = 0;
+  int n, i, err = 0;
+
+  if (!fs->rw)
+    return -EROFS;
+  if (!size)
+    return 0;
+
+  tfs_lock(fs, 1);
+  while (done < size)
+    {
+      n = tfs_map_locked(fs, ino, off + done, size - done, 1, ext, MAX_EXTENTS);
+      if (n <= 0)
+	{
+	  err = n ? n : -EIO;
+	  break;
+	}
+
+      for (i = 0; i < n && !err; ++i)
+	{
+	  uint64_t start = ext[i].lblock * fs->bs;
+	  uint64_t from = start > (uint64_t) off + done ? start : off + done;
+	  uint64_t to = start + ext[i].count * fs->bs;
+
+	  if (to > (uint64_t) off + size)
+	    to = off + size;
+	  err = io_full(fs->fd, (char *) buf + (from - off), to - from, (off_t) ext[i].pblock * fs->bs + (from - start), 1);
+	  done = to - off;
+	}
+      if (err)
+	break;
+    }
+
+  if (done)
+    {
+      int err2 = tfs_extend_locked(fs, ino, off + done);
+      if (!err)
+	err = err2;
+    }
+  tfs_unlock(fs);
+
+  return done ? (ssize_t) done : err;
+}
@@ -0,0 +1,103 @@
+#ifndef _LIBTFS_H
+#define _LIBTFS_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "../driver/tfs.h"
+
+/*
+ * Userspace implementation of the on-disk format in driver/tfs.h. All
+ * functions return 0 (or a byte count) on success and a negative errno
+ * on failure. Every call takes the file system lock itself, so a
+ * struct tfs_fs can be shared between threads.
+ */
+
+#define TFS_OPEN_RDONLY 0
+#define TFS_OPEN_RDWR 1
+
+#define TFS_DEFAULT_CACHE_BLOCKS 4096
+
+#define TFS_SET_MODE 0x01
+#define TFS_SET_UID 0x02
+#define TFS_SET_GID 0x04
+#define TFS_SET_SIZE 0x08
+#define TFS_SET_ATIME 0x10
+#define TFS_SET_MTIME 0x20
+#define TFS_SET_CTIME 0x40
+
+struct tfs_fs;
+
+struct tfs_attr
+{
+  uint32_t mode;
+  uint32_t uid;
+  uint32_t gid;
+  uint64_t size;
+  uint32_t atime;
+  uint32_t mtime;
+  uint32_t ctime;
+};
+
+struct tfs_fsstat
+{
+  unsigned int block_size;
+  uint64_t blocks;
+  uint64_t free_blocks;
+  uint64_t inodes;
+  uint64_t free_inodes;
+};
+
+/* a run of logical blocks; pblock 0 is a hole */
+struct tfs_extent
+{
+  uint64_t lblock;
+  uint64_t pblock;
+  uint64_t count;
+};
+
+/* return non-zero to stop; next_off resumes after this entry */
+typedef int (*tfs_filldir_t)(void *ctx, const char *name, unsigned int len,
+			     uint32_t ino, unsigned int type, off_t next_off);
+
+struct tfs_fs *tfs_open(const char *path, int flags, size_t cache_blocks, int *err);
+int tfs_close(struct tfs_fs *fs);
+int tfs_sync(struct tfs_fs *fs);
+int tfs_image_fd(struct tfs_fs *fs);
+unsigned int tfs_block_size(struct tfs_fs *fs);
+int tfs_statfs(struct tfs_fs *fs, struct tfs_fsstat *st);
+const struct tfs_super_block *tfs_super(struct tfs_fs *fs);
+
+int tfs_getattr(struct tfs_fs *fs, uint32_t ino, struct tfs_inode *ti);
+int tfs_setattr(struct tfs_fs *fs, uint32_t ino, const struct tfs_attr *attr, int to_set);
+
+int tfs_lookup(struct tfs_fs *fs, uint32_t dir, const char *name, uint32_t *ino);
+int tfs_readdir(struct tfs_fs *fs, uint32_t dir, off_t off, tfs_filldir_t filldir, void *ctx);
+int tfs_create(struct tfs_fs *fs, uint32_t dir, const char *name, uint32_t mode, uint32_t uid, uint32_t gid, uint32_t *ino);
+int tfs_mkdir(struct tfs_fs *fs, uint32_t dir, const char *name, uint32_t mode, uint32_t uid, uint32_t gid, uint32_t *ino);
+int tfs_link(struct tfs_fs *fs, uint32_t ino, uint32_t dir, const char *name);
+int tfs_unlink(struct tfs_fs *fs, uint32_t dir, const char *name, uint32_t *ino);
+int tfs_rmdir(struct tfs_fs *fs, uint32_t dir, const char *name, uint32_t *ino);
+int tfs_rename(struct tfs_fs *fs, uint32_t olddir, const char *oldname, uint32_t newdir, const char *newname, uint32_t *replaced);
+int tfs_forget(struct tfs_fs *fs, uint32_t ino);
+
+ssize_t tfs_read(struct tfs_fs *fs, uint32_t ino, void *buf, size_t size, off_t off);
+ssize_t tfs_write(struct tfs_fs *fs, uint32_t ino, const void *buf, size_t size, off_t off);
+int tfs_truncate(struct tfs_fs *fs, uint32_t ino, uint64_t size);
+int tfs_map(struct tfs_fs *fs, uint32_t ino, off_t off, size_t size, int create,
+	    struct tfs_extent *ext, int max_ext);
+
+/*
+ * For callers that move file data themselves (splice): take the lock,
+ * map, copy to or from the image fd, and extend the file before
+ * unlocking. Blocks newly allocated by tfs_map_locked() are zeroed
+ * outside [off, off + size).
+ */
+void tfs_lock(struct tfs_fs *fs, int write);
+void tfs_unlock(struct tfs_fs *fs);
+int tfs_getattr_locked(struct tfs_fs *fs, uint32_t ino, struct tfs_inode *ti);
+int tfs_map_locked(struct tfs_fs *fs, uint32_t ino, off_t off, size_t size, int create,
+		   struct tfs_extent *ext, int max_ext);
+int tfs_extend_locked(struct tfs_fs *fs, uint32_t ino, uint64_t size);
+
+#endif
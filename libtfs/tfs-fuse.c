@@ -0,0 +1,708 @@
+/*
+ * tfs-fuse: mount a tfs image through FUSE with libtfs.
+ *
+ *   tfs-fuse [-o ro,cache_blocks=N,...] image mountpoint
+ *
+ * Inode numbers are passed through unchanged (the tfs root is inode 1,
+ * which is also FUSE_ROOT_ID). File data is spliced between the image
+ * and the FUSE device without a copy through the daemon.
+ */
+
+#define FUSE_USE_VERSION 34
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <fuse_lowlevel.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#include "libtfs.h"
+
+#define TFS_FUSE_TIMEOUT 1.0
+#define TFS_FUSE_ZERO_SIZE (128 * 1024)
+
+struct tfs_fuse_conf
+{
+  char *image;
+  int ro;
+  unsigned long cache_blocks;
+};
+
+static struct tfs_fs *fs;
+
+/*
+ * Kernel lookup count per inode. An unlinked inode is released only when
+ * its count drops to zero, so open files keep their blocks. calloc()
+ * leaves the untouched part of the array unbacked.
+ */
+static uint64_t *lookups;
+static uint32_t nr_inodes;
+static pthread_mutex_t lookups_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char zero_page[TFS_FUSE_ZERO_SIZE];
+
+static void lookup_get(uint32_t ino)
+{
+  pthread_mutex_lock(&lookups_lock);
+  ++lookups[ino];
+  pthread_mutex_unlock(&lookups_lock);
+}
+
+static void lookup_put(uint32_t ino, uint64_t n)
+{
+  uint64_t left;
+
+  pthread_mutex_lock(&lookups_lock);
+  lookups[ino] = lookups[ino] > n ? lookups[ino] - n : 0;
+  left = lookups[ino];
+  pthread_mutex_unlock(&lookups_lock);
+
+  if (!left)
+    tfs_forget(fs, ino);
+}
+
+/* release an inode that lost its last name if the kernel holds no reference */
+static void maybe_release(uint32_t ino)
+{
+  uint64_t n;
+
+  if (!ino)
+    return;
+
+  pthread_mutex_lock(&lookups_lock);
+  n = lookups[ino];
+  pthread_mutex_unlock(&lookups_lock);
+
+  if (!n)
+    tfs_forget(fs, ino);
+}
+
+static void fill_stat(struct stat *st, uint32_t ino, const struct tfs_inode *ti)
+{
+  memset(st, 0, sizeof(*st));
+  st->st_ino = ino;
+  st->st_mode = ti->mode;
+  st->st_nlink = ti->hard_link_count;
+  st->st_uid = ti->uid;
+  st->st_gid = ti->gid;
+  st->st_size = TFS_FILE_SIZE(ti);
+  st->st_blksize = tfs_block_size(fs);
+  st->st_blocks = (blkcnt_t) ti->blocks * (tfs_block_size(fs) / 512);
+  st->st_atime = ti->atime;
+  st->st_mtime = ti->mtime;
+  st->st_ctime = ti->ctime;
+}
+
+static int fill_entry(struct fuse_entry_param *e, uint32_t ino)
+{
+  struct tfs_inode ti;
+  int err;
+
+  if ((err = tfs_getattr(fs, ino, &ti)) < 0)
+    return err;
+
+  memset(e, 0, sizeof(*e));
+  e->ino = ino;
+  e->attr_timeout = TFS_FUSE_TIMEOUT;
+  e->entry_timeout = TFS_FUSE_TIMEOUT;
+  fill_stat(&e->attr, ino, &ti);
+  lookup_get(ino);
+
+  return 0;
+}
+
+static void reply_entry(fuse_req_t req, uint32_t ino, int err)
+{
+  struct fuse_entry_param e;
+
+  if (!err)
+    err = fill_entry(&e, ino);
+
+  if (err)
+    fuse_reply_err(req, -err);
+  else
+    fuse_reply_entry(req, &e);
+}
+
+static void tfs_ll_init(void *userdata, struct fuse_conn_info *conn)
+{
+  if (conn->capable & FUSE_CAP_SPLICE_READ)
+    conn->want |= FUSE_CAP_SPLICE_READ;
+  if (conn->capable & FUSE_CAP_SPLICE_WRITE)
+    conn->want |= FUSE_CAP_SPLICE_WRITE;
+  if (conn->capable & FUSE_CAP_SPLICE_MOVE)
+    conn->want |= FUSE_CAP_SPLICE_MOVE;
+}
+
+static void tfs_ll_destroy(void *userdata)
+{
+  tfs_sync(fs);
+}
+
+static void tfs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+  uint32_t ino = 0;
+  int err = tfs_lookup(fs, parent, name, &ino);
+
+  reply_entry(req, ino, err);
+}
+
+static void tfs_ll_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+{
+  lookup_put(ino, nlookup);
+  fuse_reply_none(req);
+}
+
+static void tfs_ll_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets)
+{
+  size_t i;
+
+  for (i = 0; i < count; ++i)
+    lookup_put(forgets[i].ino, forgets[i].nlookup);
+  fuse_reply_none(req);
+}
+
+static void tfs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  struct tfs_inode ti;
+  struct stat st;
+  int err;
+
+  if ((err = tfs_getattr(fs, ino, &ti)) < 0)
+    {
+      fuse_reply_err(req, -err);
+      return;
+    }
+
+  fill_stat(&st, ino, &ti);
+  fuse_reply_attr(req, &st, TFS_FUSE_TIMEOUT);
+}
+
+static void tfs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi)
+{
+  struct tfs_attr ta;
+  int set = 0, err;
+
+  memset(&ta, 0, sizeof(ta));
+  if (to_set & FUSE_SET_ATTR_MODE)
+    {
+      ta.mode = attr->st_mode;
+      set |= TFS_SET_MODE;
+    }
+  if (to_set & FUSE_SET_ATTR_UID)
+    {
+      ta.uid = attr->st_uid;
+      set |= TFS_SET_UID;
+    }
+  if (to_set & FUSE_SET_ATTR_GID)
+    {
+      ta.gid = attr->st_gid;
+      set |= TFS_SET_GID;
+    }
+  if (to_set & FUSE_SET_ATTR_SIZE)
+    {
+      ta.size = attr->st_size;
+      set |= TFS_SET_SIZE;
+    }
+  if (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_ATIME_NOW))
+    {
+      ta.atime = (to_set & FUSE_SET_ATTR_ATIME_NOW) ? time(NULL) : attr->st_atime;
+      set |= TFS_SET_ATIME;
+    }
+  if (to_set & (FUSE_SET_ATTR_MTIME | FUSE_SET_ATTR_MTIME_NOW))
+    {
+      ta.mtime = (to_set & FUSE_SET_ATTR_MTIME_NOW) ? time(NULL) : attr->st_mtime;
+      set |= TFS_SET_MTIME;
+    }
+
+  if ((err = tfs_setattr(fs, ino, &ta, set)) < 0)
+    fuse_reply_err(req, -err);
+  else
+    tfs_ll_getattr(req, ino, fi);
+}
+
+static void tfs_ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev)
+{
+  const struct fuse_ctx *ctx = fuse_req_ctx(req);
+  uint32_t ino = 0;
+  int err;
+
+  /* the inode has nowhere to keep a device number */
+  if (!S_ISREG(mode) && !S_ISFIFO(mode) && !S_ISSOCK(mode))
+    {
+      fuse_reply_err(req, EPERM);
+      return;
+    }
+
+  err = tfs_create(fs, parent, name, mode, ctx->uid, ctx->gid, &ino);
+  reply_entry(req, ino, err);
+}
+
+static void tfs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+  const struct fuse_ctx *ctx = fuse_req_ctx(req);
+  uint32_t ino = 0;
+  int err = tfs_mkdir(fs, parent, name, mode, ctx->uid, ctx->gid, &ino);
+
+  reply_entry(req, ino, err);
+}
+
+static void tfs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+  uint32_t ino = 0;
+  int err = tfs_unlink(fs, parent, name, &ino);
+
+  if (!err)
+    maybe_release(ino);
+  fuse_reply_err(req, -err);
+}
+
+static void tfs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+  uint32_t ino = 0;
+  int err = tfs_rmdir(fs, parent, name, &ino);
+
+  if (!err)
+    maybe_release(ino);
+  fuse_reply_err(req, -err);
+}
+
+static void tfs_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+			  fuse_ino_t newparent, const char *newname, unsigned int flags)
+{
+  uint32_t replaced = 0;
+  int err;
+
+  if (flags)
+    {
+      fuse_reply_err(req, EINVAL);
+      return;
+    }
+
+  err = tfs_rename(fs, parent, name, newparent, newname, &replaced);
+  if (!err)
+    maybe_release(replaced);
+  fuse_reply_err(req, -err);
+}
+
+static void tfs_ll_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char *newname)
+{
+  int err = tfs_link(fs, ino, newparent, newname);
+
+  reply_entry(req, ino, err);
+}
+
+static void tfs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  struct tfs_inode ti;
+  int err;
+
+  if ((err = tfs_getattr(fs, ino, &ti)) < 0)
+    {
+      fuse_reply_err(req, -err);
+      return;
+    }
+
+  if (S_ISDIR(ti.mode))
+    {
+      fuse_reply_err(req, EISDIR);
+      return;
+    }
+
+  if ((fi->flags & O_TRUNC) && (err = tfs_truncate(fs, ino, 0)) < 0)
+    {
+      fuse_reply_err(req, -err);
+      return;
+    }
+
+  fi->keep_cache = 1;
+  fuse_reply_open(req, fi);
+}
+
+static void tfs_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi)
+{
+  const struct fuse_ctx *ctx = fuse_req_ctx(req);
+  struct fuse_entry_param e;
+  uint32_t ino;
+  int err;
+
+  if ((err = tfs_create(fs, parent, name, S_IFREG | (mode & ~S_IFMT), ctx->uid, ctx->gid, &ino)) < 0 ||
+      (err = fill_entry(&e, ino)) < 0)
+    {
+      fuse_reply_err(req, -err);
+      return;
+    }
+
+  fi->keep_cache = 1;
+  fuse_reply_create(req, &e, fi);
+}
+
+/*
+ * Reply with buffers pointing into the image fd so the kernel can splice
+ * the data. The read lock is held until the reply is sent, so the blocks
+ * cannot be freed and reused underneath it.
+ */
+static void tfs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
+{
+  unsigned int bs = tfs_block_size(fs);
+  struct fuse_bufvec *bufv = NULL;
+  struct tfs_extent *ext = NULL;
+  struct tfs_inode ti;
+  int n, i, nbufs, err;
+
+  tfs_lock(fs, 0);
+  if ((err = tfs_getattr_locked(fs, ino, &ti)) < 0)
+    goto out;
+
+  if ((uint64_t) off >= TFS_FILE_SIZE(&ti))
+    size = 0;
+  else if (off + size > TFS_FILE_SIZE(&ti))
+    size = TFS_FILE_SIZE(&ti) - off;
+
+  n = size / bs + 2;
+  ext = malloc(n * sizeof(*ext));
+  if (!ext)
+    {
+      err = -ENOMEM;
+      goto out;
+    }
+
+  if ((n = tfs_map_locked(fs, ino, off, size, 0, ext, n)) < 0)
+    {
+      err = n;
+      goto out;
+    }
+
+  /* holes are served from zero_page in TFS_FUSE_ZERO_SIZE pieces */
+  nbufs = n + size / TFS_FUSE_ZERO_SIZE + 1;
+  bufv = calloc(1, sizeof(*bufv) + nbufs * sizeof(bufv->buf[0]));
+  if (!bufv)
+    {
+      err = -ENOMEM;
+      goto out;
+    }
+
+  for (i = 0; i < n; ++i)
+    {
+      uint64_t start = ext[i].lblock * bs;
+      uint64_t from = start > (uint64_t) off ? start : off;
+      uint64_t to = start + ext[i].count * bs;
+
+      if (to > off + size)
+	to = off + size;
+
+      while (from < to)
+	{
+	  struct fuse_buf *b = &bufv->buf[bufv->count++];
+
+	  b->size = to - from;
+	  if (ext[i].pblock)
+	    {
+	      b->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK | FUSE_BUF_FD_RETRY;
+	      b->fd = tfs_image_fd(fs);
+	      b->pos = ext[i].pblock * bs + (from - start);
+	    }
+	  else
+	    {
+	      if (b->size > TFS_FUSE_ZERO_SIZE)
+		b->size = TFS_FUSE_ZERO_SIZE;
+	      b->mem = (void *) zero_page;
+	    }
+	  from += b->size;
+	}
+    }
+
+  fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+  tfs_unlock(fs);
+  free(bufv);
+  free(ext);
+  return;
+
+out:
+  tfs_unlock(fs);
+  free(bufv);
+  free(ext);
+  fuse_reply_err(req, -err);
+}
+
+/* map (allocating) under the write lock and splice straight into the image */
+static void tfs_ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *in_buf, off_t off,
+			     struct fuse_file_info *fi)
+{
+  unsigned int bs = tfs_block_size(fs);
+  size_t size = fuse_buf_size(in_buf);
+  struct fuse_bufvec *bufv = NULL;
+  struct tfs_extent *ext = NULL;
+  ssize_t res = 0;
+  int n, i, err = 0;
+
+  if (!size)
+    {
+      fuse_reply_write(req, 0);
+      return;
+    }
+
+  n = size / bs + 2;
+  ext = malloc(n * sizeof(*ext));
+  bufv = calloc(1, sizeof(*bufv) + n * sizeof(bufv->buf[0]));
+  if (!ext || !bufv)
+    {
+      err = -ENOMEM;
+      goto out_free;
+    }
+
+  tfs_lock(fs, 1);
+  if ((n = tfs_map_locked(fs, ino, off, size, 1, ext, n)) <= 0)
+    {
+      err = n ? n : -EIO;
+      goto out;
+    }
+
+  for (i = 0; i < n; ++i)
+    {
+      uint64_t start = ext[i].lblock * bs;
+      uint64_t from = start > (uint64_t) off ? start : off;
+      uint64_t to = start + ext[i].count * bs;
+      struct fuse_buf *b = &bufv->buf[bufv->count++];
+
+      if (to > off + size)
+	to = off + size;
+
+      b->size = to - from;
+      b->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK | FUSE_BUF_FD_RETRY;
+      b->fd = tfs_image_fd(fs);
+      b->pos = ext[i].pblock * bs + (from - start);
+    }
+
+  res = fuse_buf_copy(bufv, in_buf, 0);
+  if (res < 0)
+    err = res;
+  else if (res > 0)
+    err = tfs_extend_locked(fs, ino, off + res);
+
+out:
+  tfs_unlock(fs);
+out_free:
+  free(bufv);
+  free(ext);
+
+  if (err < 0)
+    fuse_reply_err(req, -err);
+  else
+    fuse_reply_write(req, res);
+}
+
+struct tfs_fuse_dirbuf
+{
+  fuse_req_t req;
+  char *buf;
+  size_t size;
+  size_t pos;
+};
+
+static int tfs_fuse_filldir(void *ctx, const char *name, unsigned int len, uint32_t ino, unsigned int type, off_t next_off)
+{
+  struct tfs_fuse_dirbuf *db = ctx;
+  struct stat st;
+  size_t need;
+
+  memset(&st, 0, sizeof(st));
+  st.st_ino = ino;
+  st.st_mode = type << 12;
+
+  need = fuse_add_direntry(db->req, db->buf + db->pos, db->size - db->pos, name, &st, next_off);
+  if (need > db->size - db->pos)
+    return 1;
+
+  db->pos += need;
+  return 0;
+}
+
+static void tfs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
+{
+  struct tfs_fuse_dirbuf db;
+  int err;
+
+  db.req = req;
+  db.size = size;
+  db.pos = 0;
+  db.buf = malloc(size);
+  if (!db.buf)
+    {
+      fuse_reply_err(req, ENOMEM);
+      return;
+    }
+
+  if ((err = tfs_readdir(fs, ino, off, tfs_fuse_filldir, &db)) < 0)
+    fuse_reply_err(req, -err);
+  else
+    fuse_reply_buf(req, db.buf, db.pos);
+  free(db.buf);
+}
+
+static void tfs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi)
+{
+  fuse_reply_err(req, -tfs_sync(fs));
+}
+
+static void tfs_ll_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+  struct tfs_fsstat fst;
+  struct statvfs st;
+
+  tfs_statfs(fs, &fst);
+  memset(&st, 0, sizeof(st));
+  st.f_bsize = fst.block_size;
+  st.f_frsize = fst.block_size;
+  st.f_blocks = fst.blocks;
+  st.f_bfree = fst.free_blocks;
+  st.f_bavail = fst.free_blocks;
+  st.f_files = fst.inodes;
+  st.f_ffree = fst.free_inodes;
+  st.f_favail = fst.free_inodes;
+  st.f_namemax = TFS_DENTRY_NAME_LEN;
+
+  fuse_reply_statfs(req, &st);
+}
+
+static const struct fuse_lowlevel_ops tfs_ll_ops =
+  {
+    .init = tfs_ll_init,
+    .destroy = tfs_ll_destroy,
+    .lookup = tfs_ll_lookup,
+    .forget = tfs_ll_forget,
+    .forget_multi = tfs_ll_forget_multi,
+    .getattr = tfs_ll_getattr,
+    .setattr = tfs_ll_setattr,
+    .mknod = tfs_ll_mknod,
+    .mkdir = tfs_ll_mkdir,
+    .unlink = tfs_ll_unlink,
+    .rmdir = tfs_ll_rmdir,
+    .rename = tfs_ll_rename,
+    .link = tfs_ll_link,
+    .open = tfs_ll_open,
+    .create = tfs_ll_create,
+    .read = tfs_ll_read,
+    .write_buf = tfs_ll_write_buf,
+    .readdir = tfs_ll_readdir,
+    .fsync = tfs_ll_fsync,
+    .fsyncdir = tfs_ll_fsync,
+    .statfs = tfs_ll_statfs,
+  };
+
+static const struct fuse_opt tfs_fuse_opts[] =
+  {
+    { "cache_blocks=%lu", offsetof(struct tfs_fuse_conf, cache_blocks), 0 },
+    FUSE_OPT_END
+  };
+
+static int tfs_fuse_opt_proc(void *data, const char *arg, int key, struct fuse_args *outargs)
+{
+  struct tfs_fuse_conf *conf = data;
+
+  if (key == FUSE_OPT_KEY_NONOPT && !conf->image)
+    {
+      conf->image = strdup(arg);
+      return 0;
+    }
+
+  /* "ro" is also passed on so the kernel mounts read-only */
+  if (key == FUSE_OPT_KEY_OPT && !strcmp(arg, "ro"))
+    conf->ro = 1;
+
+  return 1;
+}
+
+static void usage(const char *prog)
+{
+  printf("usage: %s [options] image mountpoint\n\n"
+	 "    -o ro                  mount read-only\n"
+	 "    -o cache_blocks=N      metadata blocks to cache (default %d)\n\n",
+	 prog, TFS_DEFAULT_CACHE_BLOCKS);
+  fuse_cmdline_help();
+  fuse_lowlevel_help();
+}
+
+int main(int argc, char *argv[])
+{
+  struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+  struct tfs_fuse_conf conf;
+  struct fuse_cmdline_opts opts;
+  struct fuse_loop_config config;
+  struct fuse_session *se;
+  int err, ret = 1;
+
+  memset(&conf, 0, sizeof(conf));
+  if (fuse_opt_parse(&args, &conf, tfs_fuse_opts, tfs_fuse_opt_proc) == -1 ||
+      fuse_parse_cmdline(&args, &opts) != 0)
+    return 1;
+
+  if (opts.show_help || !conf.image || !opts.mountpoint)
+    {
+      usage(argv[0]);
+      ret = !opts.show_help;
+      goto out_args;
+    }
+
+  fs = tfs_open(conf.image, conf.ro ? TFS_OPEN_RDONLY : TFS_OPEN_RDWR, conf.cache_blocks, &err);
+  if (!fs)
+    {
+      fprintf(stderr, "%s: %s: %s\n", argv[0], conf.image, strerror(-err));
+      goto out_args;
+    }
+
+  nr_inodes = tfs_super(fs)->inode_table_entries;
+  lookups = calloc(nr_inodes, sizeof(*lookups));
+  if (!lookups)
+    goto out_fs;
+  /* the kernel never forgets the root */
+  lookups[TFS_ROOT_DIR_INODE] = 1;
+
+  fuse_opt_add_arg(&args, "-odefault_permissions");
+  se = fuse_session_new(&args, &tfs_ll_ops, sizeof(tfs_ll_ops), NULL);
+  if (!se)
+    goto out_fs;
+
+  if (fuse_set_signal_handlers(se) != 0)
+    goto out_session;
+  if (fuse_session_mount(se, opts.mountpoint) != 0)
+    goto out_signals;
+
+  fuse_daemonize(opts.foreground);
+
+  if (opts.singlethread)
+    ret = fuse_session_loop(se);
+  else
+    {
+      config.clone_fd = opts.clone_fd;
+      config.max_idle_threads = opts.max_idle_threads;
+      ret = fuse_session_loop_mt(se, &config);
+    }
+
+  fuse_session_unmount(se);
+out_signals:
+  fuse_remove_signal_handlers(se);
+out_session:
+  fuse_session_destroy(se);
+out_fs:
+  free(lookups);
+  if ((err = tfs_close(fs)) < 0)
+    {
+      fprintf(stderr, "%s: %s: %s\n", argv[0], conf.image, strerror(-err));
+      ret = 1;
+    }
+out_args:
+  free(opts.mountpoint);
+  free(conf.image);
+  fuse_opt_free_args(&args);
+
+  return ret ? 1 : 0;
+}
@@ -0,0 +1,605 @@
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+#include <linux/fs.h>
+
+#include "../driver/tfs.h"
+
+#define DEFAULT_BYTES_PER_INODE 8192
+
+struct mkfs_options
+{
+  const char *device;
+  unsigned int block_size;
+  unsigned long long blocks;
+  unsigned long long bytes_per_inode;
+  unsigned long long inodes;
+  long long blocks_per_group;
+  unsigned int cluster_size;
+  unsigned int alloc_bits;
+  int zero_inode_table;
+  int quiet;
+  int big;
+  int dynamic_itable;
+  int inodes_given;
+};
+
+static void usage(const char *prog)
+{
+  fprintf(stderr,
+	  "usage: %s [-b block-size] [-C cluster-size] [-g blocks-per-group] [-i bytes-per-inode] [-N inodes] [-O feature] [-z] [-q] device [blocks]\n"
+	  "  -b  block size in bytes, 1024 to 65536 (default %d)\n"
+	  "  -C  allocate data in clusters of this many bytes, up to %d blocks (default one block)\n"
+	  "  -g  blocks per block group, 0 for one flat inode table (default 8 * block size)\n"
+	  "  -i  bytes of volume per inode (default %d)\n"
+	  "  -N  number of inodes, overrides -i\n"
+	  "  -O  64bit: allow files of 4 GiB and more, as far as the block map reaches\n"
+	  "      dynamic_itable: allocate the inode table in chunks as inodes are used;\n"
+	  "      -i and -N then set the most inodes, one per block by default\n"
+	  "  -z  write the whole inode table now instead of leaving it to the driver\n"
+	  "  -q  quiet\n",
+	  prog, TFS_BLOCK_SIZE, 1 << TFS_MAX_ALLOC_BITS, DEFAULT_BYTES_PER_INODE);
+  exit(1);
+}
+
+static int is_power_of_2(unsigned long long n)
+{
+  return n && !(n & (n - 1));
+}
+
+static unsigned long long div_round_up(unsigned long long n, unsigned long long d)
+{
+  return (n + d - 1) / d;
+}
+
+static double now(void)
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static int write_blocks(int fd, const void *buf, unsigned long long block, unsigned long long count, unsigned int bs)
+{
+  const char *p = buf;
+  size_t left = count * bs;
+  off_t off = (off_t) block * bs;
+
+  while (left)
+    {
+      ssize_t n = pwrite(fd, p, left, off);
+      if (n < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  return -1;
+	}
+      p += n;
+      off += n;
+      left -= n;
+    }
+
+  return 0;
+}
+
+static void set_bit(unsigned char *bitmap, unsigned long long bit)
+{
+  bitmap[bit >> 3] |= 1 << (bit & 7);
+}
+
+/* mark the cluster holding 'block' used in the data bitmap */
+static void set_block_bit(unsigned char *bitmap, unsigned long long block, const struct mkfs_options *opt)
+{
+  set_bit(bitmap, block >> opt->alloc_bits);
+}
+
+/*
+ * Spread the inodes over block groups, each starting with its slice of
+ * the inode table. The inode bitmap sits in front of the groups and its
+ * size depends on how many inodes fit, so iterate until it stops growing.
+ * A tail too short for a table slice and a data block is left to the
+ * last group.
+ */
+static int layout_groups(struct tfs_super_block *tsb, struct mkfs_options *opt, unsigned long long first_block)
+{
+  unsigned long long bits_per_block = (unsigned long long) opt->block_size * 8;
+  unsigned long long inodes_per_block = TFS_INODE_PER_BLOCK(opt->block_size);
+  unsigned long long bpg = opt->blocks_per_group, ipg = 0, groups = 0, start, rest, max_ipg;
+
+  tsb->data_bitmap_blocks = div_round_up(div_round_up(opt->blocks, 1ULL << opt->alloc_bits), bits_per_block);
+  /* blocks of a cluster cannot be shared one by one */
+  tsb->refcount_blocks = opt->alloc_bits ? 0 : div_round_up(opt->blocks, opt->block_size);
+  tsb->inode_bitmap_blocks = 1;
+
+  for (;;)
+    {
+      start = first_block + tsb->inode_bitmap_blocks + tsb->data_bitmap_blocks + tsb->refcount_blocks;
+      if (start + 3 > opt->blocks)
+	return -1;
+
+      if (!bpg || bpg > opt->blocks - start)
+	{
+	  groups = 1;
+	  bpg = 0;
+	  max_ipg = (opt->blocks - start - 2) * inodes_per_block;
+	}
+      else
+	{
+	  groups = (opt->blocks - start) / bpg;
+	  max_ipg = (bpg - 2) * inodes_per_block;
+	}
+
+      ipg = div_round_up(div_round_up(opt->inodes, groups), inodes_per_block) * inodes_per_block;
+      if (ipg > max_ipg)
+	ipg = max_ipg;
+      if (ipg * groups > 0xffffffffULL)
+	ipg = 0xffffffffULL / groups / inodes_per_block * inodes_per_block;
+
+      if (bpg)
+	{
+	  rest = (opt->blocks - start) % bpg;
+	  if (rest > ipg / inodes_per_block && ipg * (groups + 1) <= 0xffffffffULL)
+	    ++groups;
+	}
+
+      if (div_round_up(ipg * groups, bits_per_block) <= tsb->inode_bitmap_blocks)
+	break;
+      tsb->inode_bitmap_blocks = div_round_up(ipg * groups, bits_per_block);
+    }
+
+  opt->inodes = ipg * groups;
+  opt->blocks_per_group = bpg;
+  tsb->blocks_per_group = bpg;
+  tsb->inodes_per_group = bpg ? ipg : 0;
+  tsb->inode_table_entries = opt->inodes;
+  tsb->inode_table_blocks = opt->inodes / inodes_per_block;
+
+  return 0;
+}
+
+/*
+ * A dynamic inode table: a chunk map block in front of the first chunk,
+ * and chunks large enough that one map block reaches the inode count
+ * asked for. The inode bitmap is sized for every chunk the map can
+ * name; all chunks but the first are left to the driver.
+ */
+static int layout_dynamic(struct tfs_super_block *tsb, struct mkfs_options *opt, unsigned long long first_block)
+{
+  unsigned long long bits_per_block = (unsigned long long) opt->block_size * 8;
+  unsigned long long inodes_per_block = TFS_INODE_PER_BLOCK(opt->block_size);
+  unsigned long long entries = opt->block_size / sizeof(u32);
+  unsigned long long target = opt->inodes, chunk, chunks, start;
+
+  if (!opt->inodes_given && target < opt->blocks)
+    target = opt->blocks;
+
+  chunk = div_round_up(target, entries * inodes_per_block);
+  if (chunk > bits_per_block)
+    chunk = bits_per_block;
+  chunks = div_round_up(target, chunk * inodes_per_block);
+  if (chunks > entries)
+    chunks = entries;
+  while (chunks > 1 && chunks * chunk * inodes_per_block > 0xffffffffULL)
+    --chunks;
+
+  opt->inodes = chunks * chunk * inodes_per_block;
+  opt->blocks_per_group = 0;
+  tsb->data_bitmap_blocks = div_round_up(opt->blocks, bits_per_block);
+  tsb->refcount_blocks = div_round_up(opt->blocks, opt->block_size);
+  tsb->inode_bitmap_blocks = div_round_up(opt->inodes, bits_per_block);
+
+  start = first_block + tsb->inode_bitmap_blocks + tsb->data_bitmap_blocks + tsb->refcount_blocks + 1;
+  if (start + chunk + 2 > opt->blocks)
+    return -1;
+
+  tsb->flags |= TFS_SB_ITABLE_DYNAMIC;
+  tsb->blocks_per_group = 0;
+  tsb->inodes_per_group = 0;
+  tsb->inode_table_entries = opt->inodes;
+  tsb->inode_table_blocks = chunks * chunk;
+  tsb->itable_chunk_blocks = chunk;
+
+  return 0;
+}
+
+static void add_dentry(struct tfs_dentry *td, unsigned int type, unsigned int ino, const char *name)
+{
+  memset(td, 0, sizeof(*td));
+  td->type = type;
+  td->inode = ino;
+  td->len = strlen(name);
+  memcpy(td->name, name, td->len);
+}
+
+int main(int argc, char **argv)
+{
+  struct mkfs_options opt;
+  struct tfs_super_block tsb;
+  struct tfs_inode *ti;
+  struct stat st;
+  unsigned long long size, bits_per_block, first_block, inodes_per_block;
+  unsigned long long i, itable_written, itable_blocks;
+  unsigned char *buf;
+  size_t buf_size;
+  double start;
+  int fd, c, sparse;
+  char *end;
+
+  memset(&opt, 0, sizeof(opt));
+  opt.block_size = TFS_BLOCK_SIZE;
+  opt.bytes_per_inode = DEFAULT_BYTES_PER_INODE;
+  opt.blocks_per_group = -1;
+
+  while ((c = getopt(argc, argv, "b:C:g:i:N:O:zq")) != -1)
+    {
+      switch (c)
+	{
+	case 'b':
+	  opt.block_size = strtoul(optarg, &end, 0);
+	  if (*end || !is_power_of_2(opt.block_size) ||
+	      opt.block_size < TFS_MIN_BLOCK_SIZE || opt.block_size > TFS_MAX_BLOCK_SIZE)
+	    {
+	      fprintf(stderr, "mkfs.tfs: invalid block size: %s\n", optarg);
+	      return 1;
+	    }
+	  break;
+	case 'C':
+	  opt.cluster_size = strtoul(optarg, &end, 0);
+	  if (*end || !is_power_of_2(opt.cluster_size))
+	    {
+	      fprintf(stderr, "mkfs.tfs: invalid cluster size: %s\n", optarg);
+	      return 1;
+	    }
+	  break;
+	case 'g':
+	  opt.blocks_per_group = strtoll(optarg, &end, 0);
+	  if (*end || opt.blocks_per_group < 0 || opt.blocks_per_group > 0xffffffffLL ||
+	      (opt.blocks_per_group && opt.blocks_per_group < 8))
+	    usage(argv[0]);
+	  break;
+	case 'i':
+	  opt.bytes_per_inode = strtoull(optarg, &end, 0);
+	  if (*end || opt.bytes_per_inode < TFS_INODE_SIZE)
+	    usage(argv[0]);
+	  break;
+	case 'N':
+	  opt.inodes = strtoull(optarg, &end, 0);
+	  if (*end || !opt.inodes)
+	    usage(argv[0]);
+	  opt.inodes_given = 1;
+	  break;
+	case 'O':
+	  if (!strcmp(optarg, "64bit"))
+	    opt.big = 1;
+	  else if (!strcmp(optarg, "dynamic_itable"))
+	    opt.dynamic_itable = 1;
+	  else
+	    {
+	      fprintf(stderr, "mkfs.tfs: unknown feature: %s\n", optarg);
+	      return 1;
+	    }
+	  break;
+	case 'z':
+	  opt.zero_inode_table = 1;
+	  break;
+	case 'q':
+	  opt.quiet = 1;
+	  break;
+	default:
+	  usage(argv[0]);
+	}
+    }
+
+  if (optind >= argc || argc - optind > 2)
+    usage(argv[0]);
+
+  if (opt.dynamic_itable && opt.cluster_size)
+    {
+      fprintf(stderr, "mkfs.tfs: dynamic_itable does not work with clusters\n");
+      return 1;
+    }
+
+  if (opt.cluster_size)
+    {
+      if (opt.cluster_size < opt.block_size ||
+	  opt.cluster_size / opt.block_size > 1U << TFS_MAX_ALLOC_BITS)
+	{
+	  fprintf(stderr, "mkfs.tfs: cluster size must be 1 to %d blocks\n", 1 << TFS_MAX_ALLOC_BITS);
+	  return 1;
+	}
+      while (opt.block_size << opt.alloc_bits < opt.cluster_size)
+	++opt.alloc_bits;
+    }
+
+  opt.device = argv[optind];
+  if (argc - optind == 2)
+    {
+      opt.blocks = strtoull(argv[optind + 1], &end, 0);
+      if (*end || !opt.blocks)
+	usage(argv[0]);
+    }
+
+  start = now();
+
+  fd = open(opt.device, O_RDWR | (opt.blocks ? O_CREAT : 0), 0644);
+  if (fd < 0 || fstat(fd, &st) < 0)
+    {
+      fprintf(stderr, "mkfs.tfs: %s: %s\n", opt.device, strerror(errno));
+      return 1;
+    }
+
+  if (S_ISBLK(st.st_mode))
+    {
+      if (ioctl(fd, BLKGETSIZE64, &size) < 0)
+	{
+	  fprintf(stderr, "mkfs.tfs: %s: cannot get size: %s\n", opt.device, strerror(errno));
+	  return 1;
+	}
+      sparse = 0;
+    }
+  else
+    {
+      size = opt.blocks ? opt.blocks * opt.block_size : (unsigned long long) st.st_size;
+      sparse = 1;
+    }
+
+  if (!opt.blocks)
+    opt.blocks = size / opt.block_size;
+  if (opt.blocks * opt.block_size > size && !sparse)
+    {
+      fprintf(stderr, "mkfs.tfs: %s is smaller than %llu blocks\n", opt.device, opt.blocks);
+      return 1;
+    }
+  if (opt.blocks > 0xffffffffULL)
+    {
+      fprintf(stderr, "mkfs.tfs: %llu blocks do not fit 32-bit block numbers\n", opt.blocks);
+      return 1;
+    }
+
+  bits_per_block = (unsigned long long) opt.block_size * 8;
+  inodes_per_block = TFS_INODE_PER_BLOCK(opt.block_size);
+  first_block = TFS_SUPER_OFFSET / opt.block_size + 1;
+  if (opt.blocks_per_group < 0)
+    opt.blocks_per_group = bits_per_block;
+
+  if (!opt.inodes)
+    opt.inodes = opt.blocks * opt.block_size / opt.bytes_per_inode;
+  if (opt.inodes < inodes_per_block)
+    opt.inodes = inodes_per_block;
+
+  memset(&tsb, 0, sizeof(tsb));
+  tsb.magic = TFS_MAGIC;
+  tsb.block_size = opt.block_size;
+  tsb.alloc_bits = opt.alloc_bits;
+  if ((opt.dynamic_itable ? layout_dynamic(&tsb, &opt, first_block) : layout_groups(&tsb, &opt, first_block)) < 0 ||
+      opt.inodes <= TFS_TMP_DIR_INODE)
+    {
+      fprintf(stderr, "mkfs.tfs: %llu blocks are too few for a file system\n", opt.blocks);
+      return 1;
+    }
+  tsb.data_blocks_per_inode = TFS_DATA_BLOCKS_PER_INODE;
+  if (opt.big)
+    {
+      tsb.flags |= TFS_SB_64BIT;
+      tsb.size = (u32) size;
+      tsb.size_hi = size >> 32;
+    }
+  else
+    tsb.size = size > 0xffffffffULL ? 0xffffffffU : size;
+  tsb.mnt_count = 0;
+  tsb.max_mnt_count = TFS_MAX_MNT_COUNT;
+
+  tsb.inode_bitmap_block_start = first_block;
+  tsb.data_bitmap_block_start = tsb.inode_bitmap_block_start + tsb.inode_bitmap_blocks;
+  tsb.refcount_block_start = tsb.data_bitmap_block_start + tsb.data_bitmap_blocks;
+  tsb.inode_table_block_start = tsb.refcount_block_start + tsb.refcount_blocks;
+  if (opt.dynamic_itable)
+    tsb.itable_map_block = tsb.inode_table_block_start++;
+  /* each directory block starts a cluster of its own */
+  tsb.root_dir_data_block_start = div_round_up(tsb.inode_table_block_start + tfs_itable_blocks_per_group(&tsb),
+					       1ULL << opt.alloc_bits) << opt.alloc_bits;
+  tsb.tmp_dir_data_block_start = tsb.root_dir_data_block_start + (1U << opt.alloc_bits);
+  tsb.reserve_data_block_start = tsb.tmp_dir_data_block_start + (1U << opt.alloc_bits);
+  tsb.data_block_start = tsb.reserve_data_block_start;
+  if (tsb.reserve_data_block_start > (tsb.blocks_per_group ? tsb.inode_table_block_start + tsb.blocks_per_group : opt.blocks))
+    {
+      fprintf(stderr, "mkfs.tfs: no room for the root directory in the first %s\n",
+	      tsb.blocks_per_group ? "block group" : "blocks");
+      return 1;
+    }
+
+  /* a dynamic table starts out with only its first chunk */
+  itable_blocks = opt.dynamic_itable ? tsb.itable_chunk_blocks : tsb.inode_table_blocks;
+
+  /*
+   * A regular file is truncated and re-extended so that everything not
+   * written below reads back as zero. On a block device the inode table
+   * is left to the driver, which zeroes it lazily.
+   */
+  if (sparse)
+    {
+      if (ftruncate(fd, 0) < 0 || ftruncate(fd, (off_t) opt.blocks * opt.block_size) < 0)
+	{
+	  fprintf(stderr, "mkfs.tfs: %s: %s\n", opt.device, strerror(errno));
+	  return 1;
+	}
+      itable_written = itable_blocks;
+    }
+  else if (opt.zero_inode_table || opt.dynamic_itable)
+    itable_written = itable_blocks;
+  else
+    itable_written = 1;
+
+  if (itable_written < itable_blocks)
+    {
+      tsb.flags |= TFS_SB_ITABLE_UNINIT;
+      tsb.inode_table_init_blocks = itable_written;
+    }
+  else
+    tsb.inode_table_init_blocks = tsb.inode_table_blocks;
+
+  buf_size = (size_t) (tsb.data_bitmap_blocks > tsb.inode_bitmap_blocks ? tsb.data_bitmap_blocks : tsb.inode_bitmap_blocks) * opt.block_size;
+  if (buf_size < (size_t) 1 << 20)
+    buf_size = (size_t) 1 << 20;
+  if (buf_size < (size_t) TFS_SUPER_OFFSET + opt.block_size)
+    buf_size = TFS_SUPER_OFFSET + opt.block_size;
+  buf = calloc(1, buf_size);
+  if (!buf)
+    {
+      fprintf(stderr, "mkfs.tfs: out of memory\n");
+      return 1;
+    }
+
+  /* super block, at byte offset TFS_SUPER_OFFSET whatever the block size */
+  memcpy(buf + TFS_SUPER_OFFSET, &tsb, sizeof(tsb));
+  if (write_blocks(fd, buf, 0, first_block, opt.block_size) < 0)
+    goto err_write;
+
+  /* inode bitmap: inode 0 is never used, plus root, tmp and the tail past the table */
+  memset(buf, 0, buf_size);
+  set_bit(buf, 0);
+  set_bit(buf, TFS_ROOT_DIR_INODE);
+  set_bit(buf, TFS_TMP_DIR_INODE);
+  for (i = opt.inodes; i < tsb.inode_bitmap_blocks * bits_per_block; ++i)
+    set_bit(buf, i);
+  if (write_blocks(fd, buf, tsb.inode_bitmap_block_start, tsb.inode_bitmap_blocks, opt.block_size) < 0)
+    goto err_write;
+
+  /*
+   * data bitmap: one bit per block, or cluster, of the volume; a cluster
+   * with any metadata in it, or running past the end, is in use
+   */
+  memset(buf, 0, buf_size);
+  for (i = 0; i < tsb.inode_table_block_start; ++i)
+    set_block_bit(buf, i, &opt);
+  for (i = 0; i < itable_blocks; ++i)
+    set_block_bit(buf, tfs_itable_block(&tsb, i), &opt);
+  set_block_bit(buf, tsb.root_dir_data_block_start, &opt);
+  set_block_bit(buf, tsb.tmp_dir_data_block_start, &opt);
+  for (i = opt.blocks >> opt.alloc_bits; i < tsb.data_bitmap_blocks * bits_per_block; ++i)
+    set_bit(buf, i);
+  if (write_blocks(fd, buf, tsb.data_bitmap_block_start, tsb.data_bitmap_blocks, opt.block_size) < 0)
+    goto err_write;
+
+  /* inode table: the first block holds the root and tmp directories */
+  memset(buf, 0, buf_size);
+  ti = (struct tfs_inode *) buf + TFS_ROOT_DIR_INODE;
+  ti->mode = S_IFDIR | 0755;
+  ti->ctime = ti->mtime = ti->atime = time(NULL);
+  ti->hard_link_count = 3;
+  ti->size = opt.block_size;
+  ti->blocks = 1;
+  ti->data_blocks[0] = tsb.root_dir_data_block_start;
+
+  ti = (struct tfs_inode *) buf + TFS_TMP_DIR_INODE;
+  ti->mode = S_IFDIR | 01777;
+  ti->ctime = ti->mtime = ti->atime = time(NULL);
+  ti->hard_link_count = 2;
+  ti->size = opt.block_size;
+  ti->blocks = 1;
+  ti->data_blocks[0] = tsb.tmp_dir_data_block_start;
+
+  if (write_blocks(fd, buf, tsb.inode_table_block_start, 1, opt.block_size) < 0)
+    goto err_write;
+
+  /* inode table map: only the first chunk exists */
+  if (opt.dynamic_itable)
+    {
+      memset(buf, 0, opt.block_size);
+      ((u32 *) buf)[0] = tsb.inode_table_block_start;
+      if (write_blocks(fd, buf, tsb.itable_map_block, 1, opt.block_size) < 0)
+	goto err_write;
+    }
+
+  /* block reference counts: no block is shared yet */
+  if (!sparse)
+    {
+      unsigned long long chunk = buf_size / opt.block_size;
+
+      memset(buf, 0, buf_size);
+      for (i = 0; i < tsb.refcount_blocks; i += chunk)
+	if (write_blocks(fd, buf, tsb.refcount_block_start + i,
+			 tsb.refcount_blocks - i < chunk ? tsb.refcount_blocks - i : chunk, opt.block_size) < 0)
+	  goto err_write;
+    }
+
+  if (!sparse && itable_written > 1)
+    {
+      unsigned long long chunk = buf_size / opt.block_size;
+      unsigned long long per_group = tfs_itable_blocks_per_group(&tsb);
+
+      memset(buf, 0, buf_size);
+      for (i = 1; i < itable_written; )
+	{
+	  unsigned long long n = itable_written - i < chunk ? itable_written - i : chunk;
+	  if (n > per_group - i % per_group)
+	    n = per_group - i % per_group;
+	  if (write_blocks(fd, buf, tfs_itable_block(&tsb, i), n, opt.block_size) < 0)
+	    goto err_write;
+	  i += n;
+	}
+    }
+
+  /* directory blocks */
+  memset(buf, 0, opt.block_size);
+  add_dentry((struct tfs_dentry *) buf, DT_DIR, TFS_ROOT_DIR_INODE, ".");
+  add_dentry((struct tfs_dentry *) buf + 1, DT_DIR, TFS_ROOT_DIR_INODE, "..");
+  add_dentry((struct tfs_dentry *) buf + 2, DT_DIR, TFS_TMP_DIR_INODE, "tmp");
+  if (write_blocks(fd, buf, tsb.root_dir_data_block_start, 1, opt.block_size) < 0)
+    goto err_write;
+
+  memset(buf, 0, opt.block_size);
+  add_dentry((struct tfs_dentry *) buf, DT_DIR, TFS_TMP_DIR_INODE, ".");
+  add_dentry((struct tfs_dentry *) buf + 1, DT_DIR, TFS_ROOT_DIR_INODE, "..");
+  if (write_blocks(fd, buf, tsb.tmp_dir_data_block_start, 1, opt.block_size) < 0)
+    goto err_write;
+
+  if (fsync(fd) < 0)
+    goto err_write;
+  close(fd);
+  free(buf);
+
+  if (!opt.quiet)
+    {
+      printf("%s: %llu blocks of %u bytes, %llu inodes\n", opt.device, opt.blocks, opt.block_size, opt.inodes);
+      printf("inode bitmap %u+%u, data bitmap %u+%u, refcounts %u+%u, inode table %u+%u, data from %u\n",
+	     tsb.inode_bitmap_block_start, tsb.inode_bitmap_blocks,
+	     tsb.data_bitmap_block_start, tsb.data_bitmap_blocks,
+	     tsb.refcount_block_start, tsb.refcount_blocks,
+	     tsb.inode_table_block_start, tsb.inode_table_blocks,
+	     tsb.data_block_start);
+      if (tsb.blocks_per_group)
+	printf("%llu block groups of %u blocks, %u inodes each\n",
+	       opt.inodes / tsb.inodes_per_group, tsb.blocks_per_group, tsb.inodes_per_group);
+      if (tsb.flags & TFS_SB_ITABLE_UNINIT)
+	printf("inode table: %u of %u blocks written, rest initialized by the driver\n",
+	       tsb.inode_table_init_blocks, tsb.inode_table_blocks);
+      if (tsb.flags & TFS_SB_ITABLE_DYNAMIC)
+	printf("dynamic inode table: map at %u, chunks of %u blocks, first chunk written\n",
+	       tsb.itable_map_block, tsb.itable_chunk_blocks);
+      if (tsb.alloc_bits)
+	printf("bigalloc: data allocated in clusters of %u bytes\n", opt.block_size << tsb.alloc_bits);
+      if (tsb.flags & TFS_SB_64BIT)
+	printf("64bit: files up to %llu bytes\n",
+	       (TFS_DATA_BLOCKS_PER_INODE + (unsigned long long) (opt.block_size / 4) * (opt.block_size / 4)) * opt.block_size);
+      printf("done in %.3f s\n", now() - start);
+    }
+
+  return 0;
+
+err_write:
+  fprintf(stderr, "mkfs.tfs: %s: write error: %s\n", opt.device, strerror(errno));
+  return 1;
+}
@@ -0,0 +1,721 @@
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#include "../driver/tfs.h"
+
+/* bucket b counts values in (2^(b-1), 2^b], bucket 0 the value 1 (and 0) */
+#define HIST_BUCKETS 48
+#define DEFAULT_TOP_DIRS 10
+
+struct histogram
+{
+  unsigned long long count[HIST_BUCKETS];
+  unsigned long long sum[HIST_BUCKETS];
+};
+
+struct dir_size
+{
+  unsigned int ino;
+  unsigned long long blocks;
+  unsigned long long entries;
+};
+
+struct region
+{
+  unsigned long long start;
+  unsigned long long blocks;
+  unsigned long long free;
+};
+
+struct tfs_stat
+{
+  const char *device;
+  int json;
+  int verbose;
+  int top;
+
+  unsigned char *image;
+  unsigned long long image_size;
+  struct tfs_super_block *sb;
+  unsigned int bs;
+  unsigned int addr_per_block;
+  unsigned int alloc_bits;
+  unsigned long long blocks;
+  unsigned long long first_data_block;
+  unsigned int inodes;
+  unsigned int inodes_used;
+  const u32 *itable_map;	/* chunk map of a dynamic inode table */
+
+  /* regular files */
+  unsigned long long files;
+  unsigned long long data_files;
+  unsigned long long file_blocks;
+  unsigned long long file_extents;
+  unsigned long long fragmented_files;
+  unsigned long long max_extents;
+  struct histogram extents;
+
+  /* free runs of the data bitmap, in blocks */
+  unsigned long long free_blocks;
+  unsigned long long free_runs;
+  unsigned long long largest_free_run;
+  struct histogram free_space;
+  struct region *regions;
+  unsigned long long nregions;
+
+  /* directories */
+  unsigned long long dirs;
+  struct histogram dir_entries;
+  struct histogram dir_blocks;
+  struct dir_size *largest_dirs;
+  int nlargest;
+
+  /* blocks between an inode's table block and its first data block */
+  unsigned long long *distances;
+  unsigned long long ndistances;
+  unsigned long long same_group;
+};
+
+/* extents of one file, counted as FIEMAP would report them */
+struct extent_walk
+{
+  unsigned long long prev_block;
+  unsigned long long prev_lblock;
+  unsigned long long first_block;
+  unsigned long long extents;
+  unsigned long long blocks;
+};
+
+static void usage(const char *prog)
+{
+  fprintf(stderr,
+	  "usage: %s [-j] [-v] [-d count] image\n"
+	  "  -j  print one JSON object instead of text\n"
+	  "  -v  list the free space of every region of the data bitmap\n"
+	  "  -d  largest directories to list (default %d)\n",
+	  prog, DEFAULT_TOP_DIRS);
+  exit(1);
+}
+
+static unsigned int bucket_of(unsigned long long v)
+{
+  unsigned int b = 0;
+
+  while (b < HIST_BUCKETS - 1 && v > (1ULL << b))
+    ++b;
+
+  return b;
+}
+
+static unsigned long long bucket_min(unsigned int b)
+{
+  return b ? (1ULL << (b - 1)) + 1 : 1;
+}
+
+static void hist_add(struct histogram *h, unsigned long long v)
+{
+  unsigned int b = bucket_of(v);
+
+  h->count[b]++;
+  h->sum[b] += v;
+}
+
+static int test_bit(const unsigned char *bitmap, unsigned long long bit)
+{
+  return bitmap[bit >> 3] & (1 << (bit & 7));
+}
+
+static unsigned char *block_ptr(struct tfs_stat *st, unsigned long long block)
+{
+  return st->image + block * st->bs;
+}
+
+static int block_valid(struct tfs_stat *st, unsigned long long block)
+{
+  return block >= st->first_data_block && block < st->blocks &&
+    tfs_itable_index(st->sb, block) == TFS_NOT_ITABLE;
+}
+
+/* past the mark, a table block was zeroed if any of its inodes has its bit set */
+static int inode_table_initialized(struct tfs_stat *st, unsigned long long table_block)
+{
+  unsigned char *bitmap = block_ptr(st, st->sb->inode_bitmap_block_start);
+  unsigned int bytes = TFS_INODE_PER_BLOCK(st->bs) / 8, i;
+
+  if (!(st->sb->flags & TFS_SB_ITABLE_UNINIT) || table_block < st->sb->inode_table_init_blocks)
+    return 1;
+
+  for (i = 0; i < bytes; ++i)
+    if (bitmap[table_block * bytes + i])
+      return 1;
+  return 0;
+}
+
+/* 0 for an inode in a chunk of a dynamic table not allocated yet */
+static unsigned long long inode_table_block(struct tfs_stat *st, unsigned int ino)
+{
+  return tfs_itable_map_block(st->sb, st->itable_map, ino / TFS_INODE_PER_BLOCK(st->bs));
+}
+
+static struct tfs_inode *inode_ptr(struct tfs_stat *st, unsigned int ino)
+{
+  static struct tfs_inode zero_inode;
+  unsigned int per_block = TFS_INODE_PER_BLOCK(st->bs);
+  unsigned long long block;
+
+  if (!inode_table_initialized(st, ino / per_block))
+    return &zero_inode;
+
+  block = inode_table_block(st, ino);
+  if (!block || block >= st->blocks)
+    return &zero_inode;
+
+  return (struct tfs_inode *) block_ptr(st, block) + (ino % per_block);
+}
+
+/* group of a block, or of the inode table block of an inode */
+static unsigned long long group_of_block(struct tfs_stat *st, unsigned long long block)
+{
+  if (!st->sb->blocks_per_group || block < st->sb->inode_table_block_start)
+    return 0;
+
+  return (block - st->sb->inode_table_block_start) / st->sb->blocks_per_group;
+}
+
+static void walk_block(struct tfs_stat *st, struct extent_walk *w, unsigned long long lblock, u32 block)
+{
+  /* holes, and the tail entries of compressed clusters, own nothing */
+  if (!block || block == TFS_COMPRESSED_BLOCK || !block_valid(st, block))
+    return;
+
+  if (!w->blocks)
+    w->first_block = block;
+  if (!w->blocks || block != w->prev_block + 1 || lblock != w->prev_lblock + 1)
+    w->extents++;
+
+  w->prev_block = block;
+  w->prev_lblock = lblock;
+  w->blocks++;
+}
+
+/* walk the data blocks of an inode in logical order; indirect blocks are not counted */
+static void walk_inode(struct tfs_stat *st, struct tfs_inode *ti, struct extent_walk *w)
+{
+  unsigned long long lblock;
+  unsigned int i, j;
+  u32 *root, *ind;
+
+  memset(w, 0, sizeof(*w));
+  if (TFS_IS_FAST_SYMLINK(ti->mode, ti->size))
+    return;
+
+  for (i = 0; i < TFS_DATA_BLOCKS_PER_INODE; ++i)
+    walk_block(st, w, i, ti->data_blocks[i]);
+
+  if (!block_valid(st, ti->root_indirect_data_block))
+    return;
+
+  root = (u32 *) block_ptr(st, ti->root_indirect_data_block);
+  for (i = 0; i < st->addr_per_block; ++i)
+    {
+      if (!block_valid(st, root[i]))
+	continue;
+
+      ind = (u32 *) block_ptr(st, root[i]);
+      lblock = TFS_DATA_BLOCKS_PER_INODE + (unsigned long long) i * st->addr_per_block;
+      for (j = 0; j < st->addr_per_block; ++j)
+	walk_block(st, w, lblock + j, ind[j]);
+    }
+}
+
+/* logical block of a directory to its block, 0 for a hole */
+static unsigned long long map_block(struct tfs_stat *st, struct tfs_inode *ti, unsigned long long lblock)
+{
+  unsigned long long rel;
+  u32 *table, ind;
+
+  if (lblock < TFS_DATA_BLOCKS_PER_INODE)
+    return block_valid(st, ti->data_blocks[lblock]) ? ti->data_blocks[lblock] : 0;
+
+  rel = lblock - TFS_DATA_BLOCKS_PER_INODE;
+  if (rel / st->addr_per_block >= st->addr_per_block || !block_valid(st, ti->root_indirect_data_block))
+    return 0;
+
+  table = (u32 *) block_ptr(st, ti->root_indirect_data_block);
+  ind = table[rel / st->addr_per_block];
+  if (!block_valid(st, ind))
+    return 0;
+
+  table = (u32 *) block_ptr(st, ind);
+  return block_valid(st, table[rel % st->addr_per_block]) ? table[rel % st->addr_per_block] : 0;
+}
+
+static unsigned long long count_entries(struct tfs_stat *st, struct tfs_inode *ti)
+{
+  unsigned long long nblocks = (ti->size + st->bs - 1) / st->bs;
+  unsigned long long lblock, block, entries = 0;
+  unsigned int per_block = st->bs / sizeof(struct tfs_dentry);
+  unsigned int i, nent;
+  struct tfs_dentry *td;
+
+  for (lblock = 0; lblock < nblocks; ++lblock)
+    {
+      if (!(block = map_block(st, ti, lblock)))
+	continue;
+
+      nent = per_block;
+      if ((lblock + 1) * st->bs > ti->size)
+	nent = (ti->size - lblock * st->bs) / sizeof(struct tfs_dentry);
+
+      td = (struct tfs_dentry *) block_ptr(st, block);
+      for (i = 0; i < nent; ++i)
+	if (td[i].inode)
+	  ++entries;
+    }
+
+  return entries;
+}
+
+/* keep the st->top directories with the most blocks, largest first */
+static void note_dir(struct tfs_stat *st, unsigned int ino, unsigned long long blocks, unsigned long long entries)
+{
+  int i;
+
+  if (st->nlargest == st->top && (!st->top || st->largest_dirs[st->top - 1].blocks >= blocks))
+    return;
+
+  if (st->nlargest < st->top)
+    st->nlargest++;
+  for (i = st->nlargest - 1; i > 0 && st->largest_dirs[i - 1].blocks < blocks; --i)
+    st->largest_dirs[i] = st->largest_dirs[i - 1];
+
+  st->largest_dirs[i].ino = ino;
+  st->largest_dirs[i].blocks = blocks;
+  st->largest_dirs[i].entries = entries;
+}
+
+static void scan_inodes(struct tfs_stat *st)
+{
+  struct extent_walk w;
+  struct tfs_inode *ti;
+  unsigned long long entries, table_block;
+  unsigned int ino;
+
+  for (ino = 1; ino < st->inodes; ++ino)
+    {
+      ti = inode_ptr(st, ino);
+      if (!ti->mode)
+	continue;
+
+      st->inodes_used++;
+      walk_inode(st, ti, &w);
+
+      if (S_ISREG(ti->mode))
+	{
+	  st->files++;
+	  st->file_blocks += w.blocks;
+	  if (w.blocks)
+	    {
+	      st->data_files++;
+	      st->file_extents += w.extents;
+	      hist_add(&st->extents, w.extents);
+	      if (w.extents > 1)
+		st->fragmented_files++;
+	      if (w.extents > st->max_extents)
+		st->max_extents = w.extents;
+	    }
+	}
+      else if (S_ISDIR(ti->mode))
+	{
+	  st->dirs++;
+	  entries = count_entries(st, ti);
+	  hist_add(&st->dir_entries, entries);
+	  hist_add(&st->dir_blocks, w.blocks);
+	  note_dir(st, ino, w.blocks, entries);
+	}
+      else
+	continue;
+
+      if (!w.blocks)
+	continue;
+
+      table_block = inode_table_block(st, ino);
+      st->distances[st->ndistances++] = w.first_block > table_block ?
+	w.first_block - table_block : table_block - w.first_block;
+      if (group_of_block(st, w.first_block) == group_of_block(st, table_block))
+	st->same_group++;
+    }
+}
+
+/*
+ * Free runs of the data bitmap, and how full each region of it is: a
+ * block group, or on images without groups the blocks one bitmap block
+ * covers.
+ */
+static int scan_free_space(struct tfs_stat *st)
+{
+  const unsigned char *bitmap = block_ptr(st, st->sb->data_bitmap_block_start);
+  unsigned long long nbits = st->blocks >> st->alloc_bits;
+  unsigned long long bit, block, run = 0, region_blocks, r;
+
+  if (st->sb->blocks_per_group)
+    {
+      region_blocks = st->sb->blocks_per_group;
+      st->nregions = (st->blocks - st->first_data_block + region_blocks - 1) / region_blocks;
+    }
+  else
+    {
+      region_blocks = (unsigned long long) st->bs * 8 << st->alloc_bits;
+      st->nregions = (st->blocks + region_blocks - 1) / region_blocks;
+    }
+
+  st->regions = calloc(st->nregions ? st->nregions : 1, sizeof(*st->regions));
+  if (!st->regions)
+    return -1;
+
+  for (r = 0; r < st->nregions; ++r)
+    {
+      st->regions[r].start = (st->sb->blocks_per_group ? st->first_data_block : 0) + r * region_blocks;
+      st->regions[r].blocks = st->blocks - st->regions[r].start < region_blocks ?
+	st->blocks - st->regions[r].start : region_blocks;
+    }
+
+  for (bit = 0; bit <= nbits; ++bit)
+    {
+      if (bit < nbits && !test_bit(bitmap, bit))
+	{
+	  block = bit << st->alloc_bits;
+	  run += 1ULL << st->alloc_bits;
+	  if (st->sb->blocks_per_group ? block >= st->first_data_block : 1)
+	    {
+	      r = (block - (st->sb->blocks_per_group ? st->first_data_block : 0)) / region_blocks;
+	      if (r < st->nregions)
+		st->regions[r].free += 1ULL << st->alloc_bits;
+	    }
+	  continue;
+	}
+
+      if (run)
+	{
+	  st->free_blocks += run;
+	  st->free_runs++;
+	  hist_add(&st->free_space, run);
+	  if (run > st->largest_free_run)
+	    st->largest_free_run = run;
+	}
+      run = 0;
+    }
+
+  return 0;
+}
+
+static int cmp_ull(const void *a, const void *b)
+{
+  unsigned long long x = *(const unsigned long long *) a, y = *(const unsigned long long *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+static unsigned long long percentile(struct tfs_stat *st, unsigned int pct)
+{
+  if (!st->ndistances)
+    return 0;
+
+  return st->distances[(st->ndistances - 1) * pct / 100];
+}
+
+static double mean_distance(struct tfs_stat *st)
+{
+  unsigned long long i;
+  double sum = 0;
+
+  for (i = 0; i < st->ndistances; ++i)
+    sum += st->distances[i];
+
+  return st->ndistances ? sum / st->ndistances : 0;
+}
+
+static void print_json_histogram(const char *name, const struct histogram *h, const char *count_name, int sums)
+{
+  int b, first = 1;
+
+  printf("\"%s\":[", name);
+  for (b = 0; b < HIST_BUCKETS; ++b)
+    {
+      if (!h->count[b])
+	continue;
+
+      printf("%s{\"min\":%llu,\"max\":%llu,\"%s\":%llu", first ? "" : ",",
+	     bucket_min(b), 1ULL << b, count_name, h->count[b]);
+      if (sums)
+	printf(",\"blocks\":%llu", h->sum[b]);
+      printf("}");
+      first = 0;
+    }
+  printf("]");
+}
+
+static void print_json(struct tfs_stat *st)
+{
+  unsigned long long r;
+  int i;
+
+  printf("{\"device\":\"");
+  for (i = 0; st->device[i]; ++i)
+    {
+      if (st->device[i] == '"' || st->device[i] == '\\')
+	putchar('\\');
+      if ((unsigned char) st->device[i] >= 0x20)
+	putchar(st->device[i]);
+    }
+  printf("\",\"block_size\":%u,\"cluster_blocks\":%u,\"blocks\":%llu,\"inodes\":%u,\"inodes_used\":%u,",
+	 st->bs, 1U << st->alloc_bits, st->blocks, st->inodes, st->inodes_used);
+
+  printf("\"files\":{\"count\":%llu,\"with_data\":%llu,\"blocks\":%llu,\"extents\":%llu,\"fragmented\":%llu,\"max_extents\":%llu,",
+	 st->files, st->data_files, st->file_blocks, st->file_extents, st->fragmented_files, st->max_extents);
+  print_json_histogram("extents_histogram", &st->extents, "files", 0);
+  printf("},");
+
+  printf("\"free_space\":{\"blocks\":%llu,\"runs\":%llu,\"largest_run\":%llu,",
+	 st->free_blocks, st->free_runs, st->largest_free_run);
+  print_json_histogram("runs_histogram", &st->free_space, "runs", 1);
+  printf(",\"regions\":[");
+  for (r = 0; r < st->nregions; ++r)
+    printf("%s{\"start\":%llu,\"blocks\":%llu,\"free\":%llu}", r ? "," : "",
+	   st->regions[r].start, st->regions[r].blocks, st->regions[r].free);
+  printf("]},");
+
+  printf("\"directories\":{\"count\":%llu,", st->dirs);
+  print_json_histogram("entries_histogram", &st->dir_entries, "directories", 0);
+  printf(",");
+  print_json_histogram("blocks_histogram", &st->dir_blocks, "directories", 0);
+  printf(",\"largest\":[");
+  for (i = 0; i < st->nlargest; ++i)
+    printf("%s{\"inode\":%u,\"blocks\":%llu,\"entries\":%llu}", i ? "," : "",
+	   st->largest_dirs[i].ino, st->largest_dirs[i].blocks, st->largest_dirs[i].entries);
+  printf("]},");
+
+  printf("\"inode_data_distance\":{\"inodes\":%llu,\"mean\":%.1f,\"median\":%llu,\"p90\":%llu,\"p99\":%llu,"
+	 "\"max\":%llu,\"same_group\":%llu}}\n",
+	 st->ndistances, mean_distance(st), percentile(st, 50), percentile(st, 90), percentile(st, 99),
+	 percentile(st, 100), st->same_group);
+}
+
+/* one line per non-empty bucket */
+static void print_histogram(const char *title, const struct histogram *h, int sums)
+{
+  int b;
+
+  printf("%s\n", title);
+  for (b = 0; b < HIST_BUCKETS; ++b)
+    {
+      if (!h->count[b])
+	continue;
+
+      if (bucket_min(b) == 1ULL << b)
+	printf("  %12llu          ", bucket_min(b));
+      else
+	printf("  %12llu-%-9llu", bucket_min(b), 1ULL << b);
+      printf(" %12llu", h->count[b]);
+      if (sums)
+	printf(" %14llu", h->sum[b]);
+      printf("\n");
+    }
+}
+
+static void print_text(struct tfs_stat *st)
+{
+  unsigned long long r, full_min = 100, full_max = 0, used;
+  int i;
+
+  printf("%s: %u byte blocks, %u blocks per cluster, %llu blocks, %u/%u inodes in use\n",
+	 st->device, st->bs, 1U << st->alloc_bits, st->blocks, st->inodes_used, st->inodes);
+
+  printf("\nfiles: %llu, %llu blocks, %llu extents (%.2f per file with data), %llu fragmented, at most %llu extents\n",
+	 st->files, st->file_blocks, st->file_extents,
+	 st->data_files ? (double) st->file_extents / st->data_files : 0.0,
+	 st->fragmented_files, st->max_extents);
+  print_histogram("  extents per file         files", &st->extents, 0);
+
+  printf("\nfree space: %llu blocks in %llu runs, largest %llu blocks\n",
+	 st->free_blocks, st->free_runs, st->largest_free_run);
+  print_histogram("  run length (blocks)       runs         blocks", &st->free_space, 1);
+
+  for (r = 0; r < st->nregions; ++r)
+    {
+      used = st->regions[r].blocks ? 100 - st->regions[r].free * 100 / st->regions[r].blocks : 100;
+      if (used < full_min)
+	full_min = used;
+      if (used > full_max)
+	full_max = used;
+      if (st->verbose)
+	printf("  %s %llu: blocks %llu-%llu, %llu free, %llu%% used\n", st->sb->blocks_per_group ? "group" : "region",
+	       r, st->regions[r].start, st->regions[r].start + st->regions[r].blocks - 1, st->regions[r].free, used);
+    }
+  if (st->nregions)
+    printf("  %llu %s, %llu%% to %llu%% used\n", st->nregions, st->sb->blocks_per_group ? "groups" : "regions",
+	   full_min, full_max);
+
+  printf("\ndirectories: %llu\n", st->dirs);
+  print_histogram("  entries            directories", &st->dir_entries, 0);
+  print_histogram("  blocks             directories", &st->dir_blocks, 0);
+  for (i = 0; i < st->nlargest; ++i)
+    printf("  inode %u: %llu blocks, %llu entries\n",
+	   st->largest_dirs[i].ino, st->largest_dirs[i].blocks, st->largest_dirs[i].entries);
+
+  printf("\ninode to first data block, in blocks: %llu inodes, mean %.1f, median %llu, p90 %llu, p99 %llu, max %llu",
+	 st->ndistances, mean_distance(st), percentile(st, 50), percentile(st, 90), percentile(st, 99),
+	 percentile(st, 100));
+  if (st->sb->blocks_per_group)
+    printf(", %llu in the inode's group", st->same_group);
+  printf("\n");
+}
+
+static int open_image(struct tfs_stat *st)
+{
+  struct stat sbuf;
+  int fd;
+
+  fd = open(st->device, O_RDONLY);
+  if (fd < 0 || fstat(fd, &sbuf) < 0)
+    {
+      fprintf(stderr, "tfs-stat: %s: %s\n", st->device, strerror(errno));
+      return -1;
+    }
+
+  st->image_size = sbuf.st_size;
+  if (S_ISBLK(sbuf.st_mode) && ioctl(fd, BLKGETSIZE64, &st->image_size) < 0)
+    {
+      fprintf(stderr, "tfs-stat: %s: cannot get size: %s\n", st->device, strerror(errno));
+      return -1;
+    }
+
+  if (st->image_size < TFS_SUPER_OFFSET + sizeof(struct tfs_super_block))
+    {
+      fprintf(stderr, "tfs-stat: %s: too small\n", st->device);
+      return -1;
+    }
+
+  st->image = mmap(NULL, st->image_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (st->image == MAP_FAILED)
+    {
+      fprintf(stderr, "tfs-stat: %s: mmap: %s\n", st->device, strerror(errno));
+      return -1;
+    }
+
+  st->sb = (struct tfs_super_block *) (st->image + TFS_SUPER_OFFSET);
+  if (st->sb->magic != TFS_MAGIC)
+    {
+      fprintf(stderr, "tfs-stat: %s: not a tfs file system\n", st->device);
+      return -1;
+    }
+
+  st->bs = TFS_SB_BLOCK_SIZE(st->sb);
+  if (st->bs < TFS_MIN_BLOCK_SIZE || st->bs > TFS_MAX_BLOCK_SIZE || (st->bs & (st->bs - 1)) ||
+      st->sb->alloc_bits > TFS_MAX_ALLOC_BITS)
+    {
+      fprintf(stderr, "tfs-stat: %s: bad block size %u or cluster of %u bits\n", st->device, st->bs, st->sb->alloc_bits);
+      return -1;
+    }
+
+  st->addr_per_block = st->bs / sizeof(u32);
+  st->alloc_bits = st->sb->alloc_bits;
+  st->blocks = st->image_size / st->bs;
+  if (st->blocks > (unsigned long long) st->sb->data_bitmap_blocks * st->bs * 8 << st->alloc_bits)
+    st->blocks = (unsigned long long) st->sb->data_bitmap_blocks * st->bs * 8 << st->alloc_bits;
+  st->first_data_block = st->sb->inode_table_block_start;
+  st->inodes = st->sb->inode_table_entries;
+
+  if (!st->sb->inode_table_blocks ||
+      (st->sb->blocks_per_group &&
+       (!st->sb->inodes_per_group || st->sb->inodes_per_group % TFS_INODE_PER_BLOCK(st->bs) ||
+	tfs_itable_blocks_per_group(st->sb) >= st->sb->blocks_per_group)) ||
+      (unsigned long long) tfs_itable_block(st->sb, ((st->sb->flags & TFS_SB_ITABLE_DYNAMIC) ?
+						       st->sb->itable_chunk_blocks : st->sb->inode_table_blocks) - 1) >= st->blocks ||
+      (unsigned long long) st->sb->data_bitmap_block_start + st->sb->data_bitmap_blocks > st->blocks ||
+      ((st->sb->flags & TFS_SB_ITABLE_DYNAMIC) &&
+       (!st->sb->itable_chunk_blocks || st->sb->inode_table_blocks / st->sb->itable_chunk_blocks > st->addr_per_block ||
+	st->sb->itable_map_block >= st->first_data_block)) ||
+      (unsigned long long) st->sb->inode_table_blocks * TFS_INODE_PER_BLOCK(st->bs) < st->inodes)
+    {
+      fprintf(stderr, "tfs-stat: %s: super block geometry does not fit the device\n", st->device);
+      return -1;
+    }
+  if (st->sb->flags & TFS_SB_ITABLE_DYNAMIC)
+    st->itable_map = (const u32 *) block_ptr(st, st->sb->itable_map_block);
+
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  struct tfs_stat st;
+  int c;
+
+  memset(&st, 0, sizeof(st));
+  st.top = DEFAULT_TOP_DIRS;
+
+  while ((c = getopt(argc, argv, "jvd:")) != -1)
+    {
+      switch (c)
+	{
+	case 'j':
+	  st.json = 1;
+	  break;
+	case 'v':
+	  st.verbose = 1;
+	  break;
+	case 'd':
+	  st.top = atoi(optarg);
+	  if (st.top < 0)
+	    usage(argv[0]);
+	  break;
+	default:
+	  usage(argv[0]);
+	}
+    }
+
+  if (optind != argc - 1)
+    usage(argv[0]);
+
+  st.device = argv[optind];
+  if (open_image(&st) < 0)
+    return 1;
+
+  st.distances = calloc(st.inodes ? st.inodes : 1, sizeof(*st.distances));
+  st.largest_dirs = calloc(st.top ? st.top : 1, sizeof(*st.largest_dirs));
+  if (!st.distances || !st.largest_dirs)
+    {
+      fprintf(stderr, "tfs-stat: out of memory\n");
+      return 1;
+    }
+
+  scan_inodes(&st);
+  if (scan_free_space(&st) < 0)
+    {
+      fprintf(stderr, "tfs-stat: out of memory\n");
+      return 1;
+    }
+  qsort(st.distances, st.ndistances, sizeof(*st.distances), cmp_ull);
+
+  if (st.json)
+    print_json(&st);
+  else
+    print_text(&st);
+
+  munmap(st.image, st.image_size);
+
+  return 0;
+}